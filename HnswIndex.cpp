@@ -0,0 +1,526 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/HnswIndex.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace NJLIC {
+
+    static const uint32_t INDEX_MAGIC = 0x31534e48; // "HNS1"
+    static const uint32_t INDEX_FORMAT_VERSION = 1;
+    // Levels above this are never drawn; with m = 2 it is reached once in 2^16 points.
+    static const int MAX_LEVEL = 16;
+
+    struct IndexHeader {
+        uint32_t magic;
+        uint32_t format_version;
+        int32_t source_dims;
+        int32_t dims;
+        int32_t m;
+        int32_t ef_construction;
+        int32_t ef_search;
+        int32_t max_level;
+        uint32_t entry;
+        uint32_t reserved;
+        uint64_t nodes;
+        uint64_t seed;
+    };
+
+    // Heap orders: candidates pop nearest first, results keep the farthest on top.
+    struct NearestFirst {
+        template<typename C>
+        bool operator()(const C &a, const C &b) const { return a.distance > b.distance || (a.distance == b.distance && a.node > b.node); }
+    };
+    struct FarthestFirst {
+        template<typename C>
+        bool operator()(const C &a, const C &b) const { return a.distance < b.distance || (a.distance == b.distance && a.node < b.node); }
+    };
+
+    // Four running sums break the add chain so the loop can vectorize
+    // without -ffast-math.
+    static float squaredDistance(const float* a, const float* b, size_t dims) {
+        float sums[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        size_t d = 0;
+        for (; d + 4 <= dims; d += 4) {
+            for (int lane = 0; lane < 4; ++lane) {
+                const float diff = a[d + lane] - b[d + lane];
+                sums[lane] += diff * diff;
+            }
+        }
+        for (; d < dims; ++d) {
+            const float diff = a[d] - b[d];
+            sums[0] += diff * diff;
+        }
+        return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    }
+
+    HnswIndex::HnswIndex()
+            : m_sourceDims(0), m_m(16), m_efConstruction(100), m_efSearch(64), m_seed(1), m_levelScale(0.0),
+              m_maxLevel(-1), m_entry(0) {
+    }
+
+    void HnswIndex::clear() {
+        m_sourceDims = 0;
+        m_dims.clear();
+        m_points.clear();
+        m_nodeIds.clear();
+        m_levels.clear();
+        m_tombstones.clear();
+        m_links0.clear();
+        m_upperLinks.clear();
+        m_maxLevel = -1;
+        m_entry = 0;
+        m_labels.clear();
+    }
+
+    void HnswIndex::reset(int source_dims, const Options &options) {
+        clear();
+        m_sourceDims = source_dims;
+        m_m = std::max(2, options.m);
+        m_efConstruction = std::max(m_m, options.ef_construction);
+        m_efSearch = std::max(1, options.ef_search);
+        m_seed = options.seed;
+        m_levelScale = 1.0 / std::log(static_cast<double>(m_m));
+        m_random.seed(m_seed);
+
+        if (options.dimensions.empty()) {
+            m_dims.resize(source_dims);
+            std::iota(m_dims.begin(), m_dims.end(), 0);
+        } else {
+            for (int d : options.dimensions) {
+                if (d >= 0 && d < source_dims) m_dims.push_back(d);
+            }
+        }
+    }
+
+    void HnswIndex::build(const float* vectors, size_t count, int source_dims, const int64_t* ids, const Options &options) {
+        reset(source_dims, options);
+        m_points.reserve(count * m_dims.size());
+        m_links0.reserve(count * (2 * m_m + 1));
+        for (size_t i = 0; i < count; ++i) insert(vectors + i * source_dims, ids[i]);
+    }
+
+    uint32_t* HnswIndex::getLinks(uint32_t node, int layer) {
+        if (0 == layer) return &m_links0[static_cast<size_t>(node) * (2 * m_m + 1)];
+        return &m_upperLinks[node][static_cast<size_t>(layer - 1) * (m_m + 1)];
+    }
+
+    const uint32_t* HnswIndex::getLinks(uint32_t node, int layer) const {
+        if (0 == layer) return &m_links0[static_cast<size_t>(node) * (2 * m_m + 1)];
+        return &m_upperLinks[node][static_cast<size_t>(layer - 1) * (m_m + 1)];
+    }
+
+    float HnswIndex::getDistance(const float* a, uint32_t node) const {
+        return squaredDistance(a, &m_points[static_cast<size_t>(node) * m_dims.size()], m_dims.size());
+    }
+
+    const float* HnswIndex::getPoint(int64_t id) const {
+        auto it = m_labels.find(id);
+        return it == m_labels.end() ? nullptr : &m_points[static_cast<size_t>(it->second) * m_dims.size()];
+    }
+
+    void HnswIndex::getIds(std::vector<int64_t> &ids) const {
+        ids.clear();
+        ids.reserve(m_labels.size());
+        for (size_t node = 0; node < m_nodeIds.size(); ++node) {
+            if (!m_tombstones[node]) ids.push_back(m_nodeIds[node]);
+        }
+    }
+
+    bool HnswIndex::remove(int64_t id) {
+        auto it = m_labels.find(id);
+        if (it == m_labels.end()) return false;
+        m_tombstones[it->second] = 1;
+        m_labels.erase(it);
+        return true;
+    }
+
+    uint32_t HnswIndex::greedySearch(const float* point, uint32_t entry, float &distance, int from_layer, int to_layer) const {
+        for (int layer = from_layer; layer > to_layer; --layer) {
+            bool moved = true;
+            while (moved) {
+                moved = false;
+                const uint32_t* links = getLinks(entry, layer);
+                for (uint32_t i = 1; i <= links[0]; ++i) {
+                    const float d = getDistance(point, links[i]);
+                    if (d < distance) {
+                        distance = d;
+                        entry = links[i];
+                        moved = true;
+                    }
+                }
+            }
+        }
+        return entry;
+    }
+
+    void HnswIndex::searchLayer(const float* point, uint32_t entry, float entry_distance, int ef, int layer, bool skip_tombstones, Search &search, std::vector<Candidate> &out) const {
+        if (search.visited.size() < m_nodeIds.size()) search.visited.resize(m_nodeIds.size(), 0);
+        if (0 == ++search.epoch) {
+            std::fill(search.visited.begin(), search.visited.end(), 0);
+            search.epoch = 1;
+        }
+        std::vector<Candidate> &candidates = search.candidates;
+        std::vector<Candidate> &results = search.results;
+        candidates.clear();
+        results.clear();
+
+        search.visited[entry] = search.epoch;
+        candidates.push_back(Candidate{entry_distance, entry});
+        if (!(skip_tombstones && m_tombstones[entry])) results.push_back(Candidate{entry_distance, entry});
+
+        while (!candidates.empty()) {
+            std::pop_heap(candidates.begin(), candidates.end(), NearestFirst());
+            const Candidate current = candidates.back();
+            candidates.pop_back();
+            if (static_cast<int>(results.size()) >= ef && current.distance > results.front().distance) break;
+
+            const uint32_t* links = getLinks(current.node, layer);
+            for (uint32_t i = 1; i <= links[0]; ++i) {
+                const uint32_t next = links[i];
+                if (search.epoch == search.visited[next]) continue;
+                search.visited[next] = search.epoch;
+
+                const float d = getDistance(point, next);
+                if (static_cast<int>(results.size()) < ef || d < results.front().distance) {
+                    candidates.push_back(Candidate{d, next});
+                    std::push_heap(candidates.begin(), candidates.end(), NearestFirst());
+                    if (skip_tombstones && m_tombstones[next]) continue;
+                    results.push_back(Candidate{d, next});
+                    std::push_heap(results.begin(), results.end(), FarthestFirst());
+                    if (static_cast<int>(results.size()) > ef) {
+                        std::pop_heap(results.begin(), results.end(), FarthestFirst());
+                        results.pop_back();
+                    }
+                }
+            }
+        }
+
+        out.assign(results.begin(), results.end());
+        std::sort(out.begin(), out.end(), [](const Candidate &a, const Candidate &b) {
+            return a.distance < b.distance || (a.distance == b.distance && a.node < b.node);
+        });
+    }
+
+    // Keeps a candidate only if it is nearer to the point than to every
+    // neighbour already kept, so the links spread out instead of bunching
+    // into one cluster. candidates must be nearest first.
+    void HnswIndex::selectNeighbors(std::vector<Candidate> &candidates, int max_links) const {
+        if (static_cast<int>(candidates.size()) <= max_links) return;
+        std::vector<Candidate> kept;
+        kept.reserve(max_links);
+        for (const Candidate &candidate : candidates) {
+            if (static_cast<int>(kept.size()) >= max_links) break;
+            const float* point = &m_points[static_cast<size_t>(candidate.node) * m_dims.size()];
+            bool diverse = true;
+            for (const Candidate &other : kept) {
+                if (getDistance(point, other.node) < candidate.distance) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) kept.push_back(candidate);
+        }
+        candidates.swap(kept);
+    }
+
+    void HnswIndex::link(uint32_t node, int layer, const std::vector<Candidate> &neighbors) {
+        const int max_links = getMaxLinks(layer);
+        uint32_t* links = getLinks(node, layer);
+        links[0] = static_cast<uint32_t>(neighbors.size());
+        for (size_t i = 0; i < neighbors.size(); ++i) links[i + 1] = neighbors[i].node;
+
+        const float* point = &m_points[static_cast<size_t>(node) * m_dims.size()];
+        for (const Candidate &neighbor : neighbors) {
+            uint32_t* back = getLinks(neighbor.node, layer);
+            if (static_cast<int>(back[0]) < max_links) {
+                back[++back[0]] = node;
+                continue;
+            }
+
+            // Full: re-pick the neighbour's links from its current ones plus this node.
+            const float* neighbor_point = &m_points[static_cast<size_t>(neighbor.node) * m_dims.size()];
+            std::vector<Candidate> pool;
+            pool.reserve(back[0] + 1);
+            pool.push_back(Candidate{squaredDistance(point, neighbor_point, m_dims.size()), node});
+            for (uint32_t i = 1; i <= back[0]; ++i) pool.push_back(Candidate{getDistance(neighbor_point, back[i]), back[i]});
+            std::sort(pool.begin(), pool.end(), [](const Candidate &a, const Candidate &b) {
+                return a.distance < b.distance || (a.distance == b.distance && a.node < b.node);
+            });
+            selectNeighbors(pool, max_links);
+            back[0] = static_cast<uint32_t>(pool.size());
+            for (size_t i = 0; i < pool.size(); ++i) back[i + 1] = pool[i].node;
+        }
+    }
+
+    void HnswIndex::insert(const float* vector, int64_t id) {
+        remove(id);
+
+        const uint32_t node = static_cast<uint32_t>(m_nodeIds.size());
+        const size_t dims = m_dims.size();
+        for (size_t d = 0; d < dims; ++d) m_points.push_back(vector[m_dims[d]]);
+        const float* point = &m_points[static_cast<size_t>(node) * dims];
+
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        const double draw = 1.0 - uniform(m_random); // (0, 1]
+        const int level = std::min(MAX_LEVEL, static_cast<int>(-std::log(draw) * m_levelScale));
+
+        m_nodeIds.push_back(id);
+        m_levels.push_back(level);
+        m_tombstones.push_back(0);
+        m_links0.resize(m_links0.size() + 2 * m_m + 1, 0);
+        m_upperLinks.emplace_back(static_cast<size_t>(level) * (m_m + 1), 0);
+        m_labels[id] = node;
+
+        if (m_maxLevel < 0) {
+            m_entry = node;
+            m_maxLevel = level;
+            return;
+        }
+
+        float distance = getDistance(point, m_entry);
+        uint32_t entry = greedySearch(point, m_entry, distance, m_maxLevel, level);
+
+        std::vector<Candidate> neighbors;
+        for (int layer = std::min(level, m_maxLevel); layer >= 0; --layer) {
+            searchLayer(point, entry, distance, m_efConstruction, layer, false, m_insertSearch, neighbors);
+            // The new node is not linked yet, so it cannot come back as its own neighbour.
+            entry = neighbors.front().node;
+            distance = neighbors.front().distance;
+            selectNeighbors(neighbors, m_m);
+            link(node, layer, neighbors);
+        }
+
+        if (level > m_maxLevel) {
+            m_entry = node;
+            m_maxLevel = level;
+        }
+    }
+
+    int HnswIndex::knn(const float* query, int k, int64_t* ids, float* distances) const {
+        Search search;
+        std::vector<Candidate> found;
+        return knn(query, k, search, found, ids, distances);
+    }
+
+    int HnswIndex::knn(const float* query, int k, Search &search, std::vector<Candidate> &found, int64_t* ids, float* distances) const {
+        const float infinity = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < k; ++i) {
+            ids[i] = -1;
+            distances[i] = infinity;
+        }
+        if (k <= 0 || m_labels.empty()) return 0;
+
+        std::vector<float> point(m_dims.size());
+        for (size_t d = 0; d < m_dims.size(); ++d) point[d] = query[m_dims[d]];
+
+        float distance = getDistance(point.data(), m_entry);
+        const uint32_t entry = greedySearch(point.data(), m_entry, distance, m_maxLevel, 0);
+        searchLayer(point.data(), entry, distance, std::max(k, m_efSearch), 0, true, search, found);
+
+        const int count = std::min(k, static_cast<int>(found.size()));
+        for (int i = 0; i < count; ++i) {
+            ids[i] = m_nodeIds[found[i].node];
+            distances[i] = found[i].distance;
+        }
+        return count;
+    }
+
+    void HnswIndex::knnBatch(const float* queries, size_t count, int k, int64_t* ids, float* distances, unsigned threads) const {
+        parallelFor(count, 256, [&](size_t begin, size_t end) {
+            Search search;
+            std::vector<Candidate> found;
+            for (size_t q = begin; q < end; ++q) {
+                knn(queries + q * m_sourceDims, k, search, found, ids + q * k, distances + q * k);
+            }
+        }, threads);
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd, ptr, size);
+            if (written < 0) {
+                if (EINTR == errno) continue;
+                return false;
+            }
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, void* data, size_t size) {
+        char* ptr = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t got = ::read(fd, ptr, size);
+            if (got < 0) {
+                if (EINTR == errno) continue;
+                return false;
+            }
+            if (0 == got) return false;
+            ptr += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    bool HnswIndex::save(const std::string &path, std::string &error_message) const {
+        IndexHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = INDEX_MAGIC;
+        header.format_version = INDEX_FORMAT_VERSION;
+        header.source_dims = m_sourceDims;
+        header.dims = static_cast<int32_t>(m_dims.size());
+        header.m = m_m;
+        header.ef_construction = m_efConstruction;
+        header.ef_search = m_efSearch;
+        header.max_level = m_maxLevel;
+        header.entry = m_entry;
+        header.nodes = m_nodeIds.size();
+        header.seed = m_seed;
+
+        // A unique file beside the target, so concurrent saves never write
+        // into each other's file and the rename stays on one filesystem.
+        std::vector<char> temp_name(path.begin(), path.end());
+        const char suffix[] = ".XXXXXX";
+        temp_name.insert(temp_name.end(), suffix, suffix + sizeof(suffix));
+        int fd = ::mkstemp(temp_name.data());
+        if (fd < 0) {
+            error_message = "Failed to create tile index " + path + ".XXXXXX: " + strerror(errno);
+            return false;
+        }
+        const std::string temp_path = temp_name.data();
+        if (0 != ::fchmod(fd, 0644)) {
+            error_message = "Failed to create tile index " + temp_path + ": " + strerror(errno);
+            ::close(fd);
+            ::unlink(temp_path.c_str());
+            return false;
+        }
+
+        bool ok = writeAll(fd, &header, sizeof(header)) &&
+                  writeAll(fd, m_dims.data(), m_dims.size() * sizeof(int)) &&
+                  writeAll(fd, m_nodeIds.data(), m_nodeIds.size() * sizeof(int64_t)) &&
+                  writeAll(fd, m_levels.data(), m_levels.size() * sizeof(int32_t)) &&
+                  writeAll(fd, m_tombstones.data(), m_tombstones.size()) &&
+                  writeAll(fd, m_points.data(), m_points.size() * sizeof(float)) &&
+                  writeAll(fd, m_links0.data(), m_links0.size() * sizeof(uint32_t));
+        for (size_t node = 0; ok && node < m_upperLinks.size(); ++node) {
+            ok = writeAll(fd, m_upperLinks[node].data(), m_upperLinks[node].size() * sizeof(uint32_t));
+        }
+        if (!ok) {
+            error_message = "Failed to write tile index " + temp_path + ": " + strerror(errno);
+            ::close(fd);
+            ::unlink(temp_path.c_str());
+            return false;
+        }
+        if (0 != ::fsync(fd) || 0 != ::close(fd) || 0 != ::rename(temp_path.c_str(), path.c_str())) {
+            error_message = "Failed to store tile index " + path + ": " + strerror(errno);
+            ::unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool HnswIndex::load(const std::string &path, std::string &error_message) {
+        clear();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error_message = "Failed to open tile index " + path + ": " + strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        IndexHeader header;
+        if (0 != fstat(fd, &st) || !readAll(fd, &header, sizeof(header)) || INDEX_MAGIC != header.magic) {
+            error_message = "Tile index " + path + " has an invalid header.";
+            ::close(fd);
+            return false;
+        }
+        if (INDEX_FORMAT_VERSION != header.format_version) {
+            error_message = "Tile index " + path + " was written by another version (format " + std::to_string(header.format_version) + ").";
+            ::close(fd);
+            return false;
+        }
+
+        // Check the sizes against the file before allocating anything.
+        const uint64_t nodes = header.nodes;
+        const uint64_t dims = static_cast<uint64_t>(std::max(0, header.dims));
+        const uint64_t per_node = sizeof(int64_t) + sizeof(int32_t) + 1 + dims * sizeof(float) + (2 * static_cast<uint64_t>(std::max(0, header.m)) + 1) * sizeof(uint32_t);
+        const uint64_t file_size = static_cast<uint64_t>(st.st_size);
+        if (header.source_dims <= 0 || header.dims <= 0 || header.m < 2 || header.max_level > MAX_LEVEL ||
+            nodes > std::numeric_limits<uint32_t>::max() || (nodes > 0 && header.entry >= nodes) ||
+            sizeof(header) + dims * sizeof(int) + nodes * per_node > file_size) {
+            error_message = "Tile index " + path + " is corrupt.";
+            ::close(fd);
+            return false;
+        }
+
+        Options options;
+        options.m = header.m;
+        options.ef_construction = header.ef_construction;
+        options.ef_search = header.ef_search;
+        options.seed = header.seed;
+        options.dimensions.resize(dims);
+        bool ok = readAll(fd, options.dimensions.data(), dims * sizeof(int));
+        reset(header.source_dims, options);
+        ok = ok && m_dims.size() == dims;
+
+        m_nodeIds.resize(nodes);
+        m_levels.resize(nodes);
+        m_tombstones.resize(nodes);
+        m_points.resize(nodes * dims);
+        m_links0.resize(nodes * (2 * m_m + 1));
+        ok = ok && readAll(fd, m_nodeIds.data(), nodes * sizeof(int64_t)) &&
+             readAll(fd, m_levels.data(), nodes * sizeof(int32_t)) &&
+             readAll(fd, m_tombstones.data(), nodes) &&
+             readAll(fd, m_points.data(), nodes * dims * sizeof(float)) &&
+             readAll(fd, m_links0.data(), m_links0.size() * sizeof(uint32_t));
+
+        m_upperLinks.resize(nodes);
+        for (size_t node = 0; ok && node < nodes; ++node) {
+            ok = m_levels[node] >= 0 && m_levels[node] <= header.max_level;
+            if (!ok) break;
+            m_upperLinks[node].resize(static_cast<size_t>(m_levels[node]) * (m_m + 1));
+            ok = readAll(fd, m_upperLinks[node].data(), m_upperLinks[node].size() * sizeof(uint32_t));
+        }
+        ::close(fd);
+
+        // Every link must name a node that exists on that layer.
+        for (size_t node = 0; ok && node < nodes; ++node) {
+            for (int layer = 0; ok && layer <= m_levels[node]; ++layer) {
+                const uint32_t* links = getLinks(static_cast<uint32_t>(node), layer);
+                ok = static_cast<int>(links[0]) <= getMaxLinks(layer);
+                for (uint32_t i = 1; ok && i <= links[0]; ++i) {
+                    ok = links[i] < nodes && m_levels[links[i]] >= layer;
+                }
+            }
+        }
+        if (!ok || (nodes > 0 && m_levels[header.entry] != header.max_level)) {
+            error_message = "Tile index " + path + " is corrupt.";
+            clear();
+            return false;
+        }
+
+        m_maxLevel = nodes > 0 ? header.max_level : -1;
+        m_entry = header.entry;
+        for (size_t node = 0; node < nodes; ++node) {
+            if (!m_tombstones[node]) m_labels[m_nodeIds[node]] = static_cast<uint32_t>(node);
+        }
+        // Continue the level draws where a fresh build of this many points would be.
+        m_random.seed(m_seed + nodes);
+        return true;
+    }
+}
@@ -0,0 +1,125 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/ImageCache.h"
+#include "MosaifyDatabase/LruCache.h"
+#include <mutex>
+
+namespace NJLIC {
+
+    static size_t entryBytes(const CachedImage &image) {
+        return sizeof(CachedImage) + image.filename.size() + image.data.size();
+    }
+
+    struct ImageCache::Shard {
+        struct Slot {
+            int project_id;
+            std::shared_ptr<const CachedImage> image;
+        };
+
+        std::mutex mutex;
+        LruCache<int, Slot> lru;
+        uint64_t generation = 0; // Bumped by every invalidation that reaches the shard.
+    };
+
+    ImageCache::ImageCache(size_t byte_budget, size_t num_shards)
+            : m_byteBudget(byte_budget), m_hits(0), m_misses(0), m_insertions(0), m_evictions(0), m_invalidations(0) {
+        if (0 == num_shards) num_shards = 1;
+
+        m_shards.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            m_shards.push_back(std::unique_ptr<Shard>(new Shard()));
+            m_shards.back()->lru.setByteBudget(byte_budget / num_shards);
+        }
+    }
+
+    ImageCache::~ImageCache() {
+    }
+
+    ImageCache::Shard& ImageCache::shardFor(int image_id) {
+        // An image id always lands in the same shard so invalidateImage only locks one.
+        uint32_t h = static_cast<uint32_t>(image_id) * 2654435761u;
+        return *m_shards[h % m_shards.size()];
+    }
+
+    std::shared_ptr<const CachedImage> ImageCache::find(int image_id, int project_id) {
+        Shard &shard = shardFor(image_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        std::shared_ptr<const Shard::Slot> slot = shard.lru.find(image_id);
+        if (!slot || slot->project_id != project_id) {
+            ++m_misses;
+            return nullptr;
+        }
+
+        ++m_hits;
+        return slot->image;
+    }
+
+    void ImageCache::insert(int image_id, int project_id, std::shared_ptr<const CachedImage> image) {
+        insert(image_id, project_id, std::move(image), getGeneration(image_id));
+    }
+
+    uint64_t ImageCache::getGeneration(int image_id) {
+        Shard &shard = shardFor(image_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.generation;
+    }
+
+    void ImageCache::insert(int image_id, int project_id, std::shared_ptr<const CachedImage> image, uint64_t generation) {
+        if (!image) return;
+
+        const size_t bytes = entryBytes(*image);
+        Shard &shard = shardFor(image_id);
+        if (bytes > shard.lru.getByteBudget()) return;
+
+        auto slot = std::make_shared<const Shard::Slot>(Shard::Slot{project_id, std::move(image)});
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.generation != generation) return;
+
+        m_evictions += shard.lru.insert(image_id, std::move(slot), bytes);
+        ++m_insertions;
+    }
+
+    void ImageCache::invalidateImage(int image_id) {
+        Shard &shard = shardFor(image_id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ++shard.generation;
+        if (shard.lru.erase(image_id)) ++m_invalidations;
+    }
+
+    void ImageCache::invalidateProject(int project_id) {
+        for (auto &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            ++shard->generation;
+            m_invalidations += shard->lru.eraseIf([project_id](int, const Shard::Slot &slot) { return slot.project_id == project_id; });
+        }
+    }
+
+    void ImageCache::clear() {
+        for (auto &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            ++shard->generation;
+            m_invalidations += shard->lru.size();
+            shard->lru.clear();
+        }
+    }
+
+    ImageCacheStats ImageCache::getStats() const {
+        ImageCacheStats stats;
+        stats.hits = m_hits;
+        stats.misses = m_misses;
+        stats.insertions = m_insertions;
+        stats.evictions = m_evictions;
+        stats.invalidations = m_invalidations;
+
+        for (const auto &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.entries += shard->lru.size();
+            stats.bytes += shard->lru.getBytes();
+        }
+        return stats;
+    }
+}
@@ -0,0 +1,281 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/ImageFeatures.h"
+#include "MosaifyDatabase/IntegralImage.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace NJLIC {
+
+    static const int MAX_COMPS = 4;
+
+    struct ChannelSums {
+        uint64_t sum[MAX_COMPS];
+        uint64_t squares[MAX_COMPS];
+        uint64_t pixels;
+    };
+
+    static void accumulateScalar(const unsigned char* data, size_t bytes, int comps, ChannelSums &sums) {
+        for (size_t i = 0; i < bytes; i += comps) {
+            for (int ch = 0; ch < comps; ++ch) {
+                const uint32_t value = data[i + ch];
+                sums.sum[ch] += value;
+                sums.squares[ch] += value * value;
+            }
+        }
+    }
+
+#if defined(__SSE2__)
+    // Interleaved channels repeat every lcm(16, comps) bytes, so for each of
+    // the 16-byte loads in one period a fixed byte mask selects each channel.
+    // Sums use psadbw; squares widen to 16 bits and use pmaddwd.
+    struct ChannelMasks {
+        int loads;
+        __m128i masks[3][MAX_COMPS];
+    };
+
+    static ChannelMasks makeChannelMasks(int comps) {
+        ChannelMasks masks;
+        masks.loads = (3 == comps) ? 3 : 1;
+        for (int k = 0; k < masks.loads; ++k) {
+            for (int ch = 0; ch < comps; ++ch) {
+                alignas(16) unsigned char bytes_mask[16];
+                for (int j = 0; j < 16; ++j) {
+                    bytes_mask[j] = ((k * 16 + j) % comps == ch) ? 0xff : 0x00;
+                }
+                masks.masks[k][ch] = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes_mask));
+            }
+        }
+        return masks;
+    }
+
+    // Built once: accumulate runs for every row of every grid cell.
+    static const ChannelMasks& channelMasks(int comps) {
+        static const ChannelMasks masks[MAX_COMPS] = { makeChannelMasks(1), makeChannelMasks(2), makeChannelMasks(3), makeChannelMasks(4) };
+        return masks[comps - 1];
+    }
+
+    static void accumulateSSE2(const unsigned char* data, size_t bytes, int comps, ChannelSums &sums) {
+        const ChannelMasks &channel_masks = channelMasks(comps);
+        const int loads = channel_masks.loads;
+        const size_t period = static_cast<size_t>(loads) * 16;
+        const auto &masks = channel_masks.masks;
+
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum[MAX_COMPS];
+        __m128i squares[MAX_COMPS];
+        for (int ch = 0; ch < comps; ++ch) {
+            sum[ch] = zero;
+            squares[ch] = zero;
+        }
+
+        // Each 32-bit square lane grows by at most 4 * 255^2 per period; flush well before it can wrap.
+        const size_t flush_interval = 4096;
+        size_t since_flush = 0;
+
+        auto flushSquares = [&]() {
+            for (int ch = 0; ch < comps; ++ch) {
+                alignas(16) uint32_t lanes[4];
+                _mm_store_si128(reinterpret_cast<__m128i*>(lanes), squares[ch]);
+                sums.squares[ch] += static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+                squares[ch] = zero;
+            }
+            since_flush = 0;
+        };
+
+        size_t i = 0;
+        for (; i + period <= bytes; i += period) {
+            for (int k = 0; k < loads; ++k) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + k * 16));
+                for (int ch = 0; ch < comps; ++ch) {
+                    const __m128i m = _mm_and_si128(v, masks[k][ch]);
+                    sum[ch] = _mm_add_epi64(sum[ch], _mm_sad_epu8(m, zero));
+
+                    const __m128i lo = _mm_unpacklo_epi8(m, zero);
+                    const __m128i hi = _mm_unpackhi_epi8(m, zero);
+                    squares[ch] = _mm_add_epi32(squares[ch], _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+                }
+            }
+            if (++since_flush == flush_interval) flushSquares();
+        }
+        flushSquares();
+
+        for (int ch = 0; ch < comps; ++ch) {
+            alignas(16) uint64_t lanes[2];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sum[ch]);
+            sums.sum[ch] += lanes[0] + lanes[1];
+        }
+
+        accumulateScalar(data + i, bytes - i, comps, sums);
+    }
+#endif
+
+    static void accumulate(const unsigned char* data, size_t bytes, int comps, ChannelSums &sums) {
+#if defined(__SSE2__)
+        accumulateSSE2(data, bytes, comps, sums);
+#else
+        accumulateScalar(data, bytes, comps, sums);
+#endif
+        sums.pixels += bytes / comps;
+    }
+
+    static float linearize(float c) {
+        return (c <= 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    static float labCurve(float t) {
+        return (t > 0.008856f) ? std::cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+    }
+
+    // sRGB in [0, 255] to CIE Lab under D65.
+    static void srgbToLab(float r, float g, float b, float* lab) {
+        r = linearize(r / 255.0f);
+        g = linearize(g / 255.0f);
+        b = linearize(b / 255.0f);
+
+        const float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f;
+        const float y = (0.2126729f * r + 0.7151522f * g + 0.0721750f * b);
+        const float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f;
+
+        const float fx = labCurve(x);
+        const float fy = labCurve(y);
+        const float fz = labCurve(z);
+
+        lab[0] = 116.0f * fy - 16.0f;
+        lab[1] = 500.0f * (fx - fy);
+        lab[2] = 200.0f * (fy - fz);
+    }
+
+    static void meanToLab(const ChannelSums &sums, int comps, float* lab) {
+        const double n = static_cast<double>(sums.pixels);
+        if (comps >= 3) {
+            srgbToLab(static_cast<float>(sums.sum[0] / n), static_cast<float>(sums.sum[1] / n), static_cast<float>(sums.sum[2] / n), lab);
+        } else {
+            const float gray = static_cast<float>(sums.sum[0] / n);
+            srgbToLab(gray, gray, gray, lab);
+        }
+    }
+
+    // Fills features from the sums of the GRID_SIZE x GRID_SIZE cells.
+    static void setFeatures(const ChannelSums* cells, int comps, ImageFeatures &features);
+
+    bool computeImageFeatures(const unsigned char* data, int rows, int cols, int comps, ImageFeatures &features) {
+        return computeImageFeatures(data, rows, cols, comps, static_cast<size_t>(cols) * comps, features);
+    }
+
+    bool computeImageFeatures(const unsigned char* data, int rows, int cols, int comps, size_t stride, ImageFeatures &features) {
+        if (nullptr == data || rows <= 0 || cols <= 0 || comps < 1 || comps > MAX_COMPS) return false;
+        if (stride < static_cast<size_t>(cols) * comps) return false;
+
+        const int grid = ImageFeatures::GRID_SIZE;
+        ChannelSums cells[grid * grid];
+        memset(cells, 0, sizeof(cells));
+
+        int col_bounds[grid + 1];
+        for (int gx = 0; gx <= grid; ++gx) col_bounds[gx] = static_cast<int>(static_cast<int64_t>(cols) * gx / grid);
+
+        for (int gy = 0; gy < grid; ++gy) {
+            const int row_begin = static_cast<int>(static_cast<int64_t>(rows) * gy / grid);
+            const int row_end = static_cast<int>(static_cast<int64_t>(rows) * (gy + 1) / grid);
+            for (int row = row_begin; row < row_end; ++row) {
+                const unsigned char* line = data + row * stride;
+                for (int gx = 0; gx < grid; ++gx) {
+                    const size_t begin = static_cast<size_t>(col_bounds[gx]) * comps;
+                    const size_t end = static_cast<size_t>(col_bounds[gx + 1]) * comps;
+                    accumulate(line + begin, end - begin, comps, cells[gy * grid + gx]);
+                }
+            }
+        }
+
+        setFeatures(cells, comps, features);
+        return true;
+    }
+
+    bool computeImageFeatures(const IntegralImage &integral, int x, int y, int width, int height, ImageFeatures &features) {
+        if (integral.empty() || width <= 0 || height <= 0 || x < 0 || y < 0) return false;
+        if (x + width > integral.getCols() || y + height > integral.getRows()) return false;
+
+        const int grid = ImageFeatures::GRID_SIZE;
+        const int channels = integral.getChannels();
+        ChannelSums cells[grid * grid];
+        memset(cells, 0, sizeof(cells));
+        for (int gy = 0; gy < grid; ++gy) {
+            const int row_begin = static_cast<int>(static_cast<int64_t>(height) * gy / grid);
+            const int row_end = static_cast<int>(static_cast<int64_t>(height) * (gy + 1) / grid);
+            for (int gx = 0; gx < grid; ++gx) {
+                const int col_begin = static_cast<int>(static_cast<int64_t>(width) * gx / grid);
+                const int col_end = static_cast<int>(static_cast<int64_t>(width) * (gx + 1) / grid);
+                if (row_end == row_begin || col_end == col_begin) continue;
+
+                ChannelSums &cell = cells[gy * grid + gx];
+                for (int ch = 0; ch < channels; ++ch) {
+                    cell.sum[ch] = integral.getSum(x + col_begin, y + row_begin, col_end - col_begin, row_end - row_begin, ch);
+                    cell.squares[ch] = integral.getSquareSum(x + col_begin, y + row_begin, col_end - col_begin, row_end - row_begin, ch);
+                }
+                cell.pixels = static_cast<uint64_t>(col_end - col_begin) * (row_end - row_begin);
+            }
+        }
+
+        // The tables keep 3 channels for color and 1 for gray, which
+        // setFeatures treats like 3 or 1 components.
+        setFeatures(cells, channels, features);
+        return true;
+    }
+
+    static void setFeatures(const ChannelSums* cells, int comps, ImageFeatures &features) {
+        const int grid = ImageFeatures::GRID_SIZE;
+        ChannelSums total;
+        memset(&total, 0, sizeof(total));
+        for (int c = 0; c < grid * grid; ++c) {
+            const ChannelSums &cell = cells[c];
+            for (int ch = 0; ch < comps; ++ch) {
+                total.sum[ch] += cell.sum[ch];
+                total.squares[ch] += cell.squares[ch];
+            }
+            total.pixels += cell.pixels;
+        }
+
+        meanToLab(total, comps, features.values + ImageFeatures::MEAN_OFFSET);
+
+        // Images smaller than the grid leave some cells empty; they take the overall mean.
+        for (int c = 0; c < grid * grid; ++c) {
+            float* lab = features.values + ImageFeatures::GRID_OFFSET + c * 3;
+            if (cells[c].pixels > 0) {
+                meanToLab(cells[c], comps, lab);
+            } else {
+                memcpy(lab, features.values + ImageFeatures::MEAN_OFFSET, 3 * sizeof(float));
+            }
+        }
+
+        const int color_channels = (comps >= 3) ? 3 : 1;
+        const double n = static_cast<double>(total.pixels);
+        double variance = 0.0;
+        for (int ch = 0; ch < color_channels; ++ch) {
+            const double mean = total.sum[ch] / n;
+            variance += total.squares[ch] / n - mean * mean;
+        }
+        features.values[ImageFeatures::VARIANCE_OFFSET] = static_cast<float>(variance / color_channels / (255.0 * 255.0));
+    }
+
+    void ImageFeatures::encode(unsigned char* bytes) const {
+        for (int d = 0; d < DIMENSIONS; ++d) {
+            uint32_t bits;
+            memcpy(&bits, &values[d], sizeof(bits));
+            for (int b = 0; b < 4; ++b) bytes[d * 4 + b] = static_cast<unsigned char>(bits >> (8 * b));
+        }
+    }
+
+    void ImageFeatures::decode(const unsigned char* bytes) {
+        for (int d = 0; d < DIMENSIONS; ++d) {
+            uint32_t bits = 0;
+            for (int b = 0; b < 4; ++b) bits |= static_cast<uint32_t>(bytes[d * 4 + b]) << (8 * b);
+            memcpy(&values[d], &bits, sizeof(bits));
+        }
+    }
+}
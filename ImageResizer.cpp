@@ -0,0 +1,158 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/ImageResizer.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace NJLIC {
+
+    static const int WEIGHT_BITS = 14;
+    static const int32_t WEIGHT_ONE = 1 << WEIGHT_BITS;
+    static const int32_t WEIGHT_ROUND = 1 << (WEIGHT_BITS - 1);
+
+    static unsigned char clampToByte(int32_t value) {
+        value >>= WEIGHT_BITS;
+        return static_cast<unsigned char>(value < 0 ? 0 : (value > 255 ? 255 : value));
+    }
+
+    ImageResizer::ImageResizer() : m_srcRows(0), m_srcCols(0), m_dstRows(0), m_dstCols(0) {
+    }
+
+    void ImageResizer::computeAxis(int src_size, int dst_size, Axis &axis) {
+        const double scale = static_cast<double>(src_size) / dst_size;
+        const double filter_scale = std::max(scale, 1.0);
+        const double support = filter_scale;
+
+        axis.taps = static_cast<int>(std::ceil(support)) * 2 + 1;
+        axis.starts.assign(dst_size, 0);
+        axis.counts.assign(dst_size, 0);
+        axis.weights.assign(static_cast<size_t>(dst_size) * axis.taps, 0);
+
+        std::vector<double> weights(axis.taps);
+        for (int i = 0; i < dst_size; ++i) {
+            const double center = (i + 0.5) * scale;
+            const int begin = std::max(static_cast<int>(std::floor(center - support + 0.5)), 0);
+            const int end = std::min(static_cast<int>(std::floor(center + support + 0.5)), src_size);
+            const int count = std::min(end - begin, axis.taps);
+
+            double total = 0.0;
+            for (int j = 0; j < count; ++j) {
+                const double x = std::fabs((begin + j + 0.5 - center) / filter_scale);
+                weights[j] = x < 1.0 ? 1.0 - x : 0.0;
+                total += weights[j];
+            }
+
+            // Round to fixed point, then give the rounding error to the largest
+            // weight so every row sums to exactly one and flat colors stay exact.
+            int16_t* fixed = &axis.weights[static_cast<size_t>(i) * axis.taps];
+            int32_t fixed_total = 0;
+            int largest = 0;
+            for (int j = 0; j < count; ++j) {
+                fixed[j] = static_cast<int16_t>(std::lround(weights[j] / total * WEIGHT_ONE));
+                fixed_total += fixed[j];
+                if (fixed[j] > fixed[largest]) largest = j;
+            }
+            fixed[largest] = static_cast<int16_t>(fixed[largest] + WEIGHT_ONE - fixed_total);
+
+            axis.starts[i] = begin;
+            axis.counts[i] = count;
+        }
+    }
+
+    void ImageResizer::configure(int src_rows, int src_cols, int dst_rows, int dst_cols) {
+        m_srcRows = src_rows;
+        m_srcCols = src_cols;
+        m_dstRows = dst_rows;
+        m_dstCols = dst_cols;
+        computeAxis(src_rows, dst_rows, m_vertical);
+        computeAxis(src_cols, dst_cols, m_horizontal);
+    }
+
+    // One output row of the vertical pass: a weighted sum of count source rows,
+    // each width bytes long.
+    static void resampleRow(const unsigned char* src, size_t src_stride, int start, int count, const int16_t* weights, size_t width, unsigned char* out) {
+        size_t x = 0;
+#if defined(__SSE2__)
+        // Taps are taken in pairs so pmaddwd does both multiplies and the add;
+        // an odd last tap pairs with a zero weight on the same row.
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16) {
+            __m128i acc0 = _mm_set1_epi32(WEIGHT_ROUND);
+            __m128i acc1 = acc0;
+            __m128i acc2 = acc0;
+            __m128i acc3 = acc0;
+            for (int j = 0; j < count; j += 2) {
+                const int second = (j + 1 < count) ? j + 1 : j;
+                const int16_t w1 = (j + 1 < count) ? weights[j + 1] : 0;
+                const __m128i w = _mm_set1_epi32(static_cast<int32_t>((static_cast<uint32_t>(static_cast<uint16_t>(w1)) << 16) | static_cast<uint16_t>(weights[j])));
+
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (start + j) * src_stride + x));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (start + second) * src_stride + x));
+                const __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+                const __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+                const __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+                const __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+                acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+                acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+                acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+            }
+
+            const __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS), _mm_srai_epi32(acc1, WEIGHT_BITS));
+            const __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, WEIGHT_BITS), _mm_srai_epi32(acc3, WEIGHT_BITS));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; x < width; ++x) {
+            int32_t acc = WEIGHT_ROUND;
+            for (int j = 0; j < count; ++j) {
+                acc += static_cast<int32_t>(src[(start + j) * src_stride + x]) * weights[j];
+            }
+            out[x] = clampToByte(acc);
+        }
+    }
+
+    void ImageResizer::resize(const unsigned char* src, size_t src_stride, int comps, unsigned char* dst, size_t dst_stride, std::vector<unsigned char> &scratch) const {
+        if (m_dstRows <= 0 || m_dstCols <= 0 || m_srcRows <= 0 || m_srcCols <= 0) return;
+
+        // Vertical first: rows are contiguous, so that pass vectorizes across
+        // the whole row; the horizontal pass then runs on dst_rows rows only.
+        const size_t width = static_cast<size_t>(m_srcCols) * comps;
+        scratch.resize(static_cast<size_t>(m_dstRows) * width);
+        for (int y = 0; y < m_dstRows; ++y) {
+            resampleRow(src, src_stride, m_vertical.starts[y], m_vertical.counts[y],
+                        &m_vertical.weights[static_cast<size_t>(y) * m_vertical.taps], width, &scratch[y * width]);
+        }
+
+        for (int y = 0; y < m_dstRows; ++y) {
+            const unsigned char* row = &scratch[y * width];
+            unsigned char* out = dst + y * dst_stride;
+            for (int x = 0; x < m_dstCols; ++x) {
+                const int16_t* weights = &m_horizontal.weights[static_cast<size_t>(x) * m_horizontal.taps];
+                const unsigned char* in = row + static_cast<size_t>(m_horizontal.starts[x]) * comps;
+                const int count = m_horizontal.counts[x];
+                for (int ch = 0; ch < comps; ++ch) {
+                    int32_t acc = WEIGHT_ROUND;
+                    for (int j = 0; j < count; ++j) {
+                        acc += static_cast<int32_t>(in[j * comps + ch]) * weights[j];
+                    }
+                    out[x * comps + ch] = clampToByte(acc);
+                }
+            }
+        }
+    }
+
+    void resizeImage(const unsigned char* src, int src_rows, int src_cols, int comps, size_t src_stride, unsigned char* dst, int dst_rows, int dst_cols, size_t dst_stride) {
+        ImageResizer resizer;
+        resizer.configure(src_rows, src_cols, dst_rows, dst_cols);
+        std::vector<unsigned char> scratch;
+        resizer.resize(src, src_stride, comps, dst, dst_stride, scratch);
+    }
+}
@@ -0,0 +1,76 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/IntegralImage.h"
+#include "MosaifyDatabase/Parallel.h"
+
+namespace NJLIC {
+
+    IntegralImage::IntegralImage() : m_rows(0), m_cols(0), m_channels(0) {
+    }
+
+    void IntegralImage::clear() {
+        m_rows = 0;
+        m_cols = 0;
+        m_channels = 0;
+        m_sums.clear();
+        m_squares.clear();
+    }
+
+    bool IntegralImage::build(const unsigned char* data, int rows, int cols, int comps, size_t stride, unsigned threads) {
+        clear();
+        if (nullptr == data || rows <= 0 || cols <= 0 || comps < 1 || comps > 4) return false;
+        if (stride < static_cast<size_t>(cols) * comps) return false;
+
+        m_rows = rows;
+        m_cols = cols;
+        m_channels = (comps >= 3) ? 3 : 1;
+        const int channels = m_channels;
+        const size_t row_stride = (static_cast<size_t>(cols) + 1) * channels;
+        m_sums.assign((static_cast<size_t>(rows) + 1) * row_stride, 0);
+        m_squares.assign(m_sums.size(), 0);
+
+        // Rows are independent for the running sums along x...
+        parallelFor(static_cast<size_t>(rows), 64, [&](size_t row_begin, size_t row_end) {
+            for (size_t row = row_begin; row < row_end; ++row) {
+                const unsigned char* line = data + row * stride;
+                uint64_t* sums = &m_sums[(row + 1) * row_stride];
+                uint64_t* squares = &m_squares[(row + 1) * row_stride];
+                for (int x = 0; x < cols; ++x) {
+                    const unsigned char* pixel = line + static_cast<size_t>(x) * comps;
+                    for (int ch = 0; ch < channels; ++ch) {
+                        const uint64_t value = pixel[ch];
+                        const size_t at = static_cast<size_t>(x + 1) * channels + ch;
+                        sums[at] = sums[at - channels] + value;
+                        squares[at] = squares[at - channels] + value * value;
+                    }
+                }
+            }
+        }, threads);
+
+        // ...and columns for the running sums along y.
+        parallelFor(row_stride, 1024, [&](size_t begin, size_t end) {
+            for (int row = 1; row < rows; ++row) {
+                const size_t above = static_cast<size_t>(row) * row_stride;
+                const size_t below = above + row_stride;
+                for (size_t i = begin; i < end; ++i) {
+                    m_sums[below + i] += m_sums[above + i];
+                    m_squares[below + i] += m_squares[above + i];
+                }
+            }
+        }, threads);
+        return true;
+    }
+
+    double IntegralImage::getMean(int x, int y, int width, int height, int channel) const {
+        const double n = static_cast<double>(width) * height;
+        return getSum(x, y, width, height, channel) / n;
+    }
+
+    double IntegralImage::getVariance(int x, int y, int width, int height, int channel) const {
+        const double n = static_cast<double>(width) * height;
+        const double mean = getSum(x, y, width, height, channel) / n;
+        return getSquareSum(x, y, width, height, channel) / n - mean * mean;
+    }
+}
@@ -0,0 +1,135 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/InvalidationListener.h"
+#include <libpq-fe.h>
+#include <sys/select.h>
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+
+namespace NJLIC {
+
+    const char* InvalidationListener::CHANNEL = "mosaify_invalidate";
+
+    InvalidationListener::InvalidationListener() : m_conn(nullptr), m_running(false), m_stop(false) {
+    }
+
+    InvalidationListener::~InvalidationListener() {
+        stop();
+    }
+
+    bool InvalidationListener::start(const std::string &connectionString, const std::function<void(const Invalidation&)> &handler, std::string &error_message) {
+        stop();
+
+        m_conn = PQconnectdb(connectionString.c_str());
+        if (PQstatus(m_conn) != CONNECTION_OK) {
+            error_message = std::string("Invalidation listener failed to connect: ") + PQerrorMessage(m_conn);
+            PQfinish(m_conn);
+            m_conn = nullptr;
+            return false;
+        }
+
+        if (!listen(error_message)) {
+            PQfinish(m_conn);
+            m_conn = nullptr;
+            return false;
+        }
+
+        m_handler = handler;
+        m_stop = false;
+        m_running = true;
+        m_thread = std::thread(&InvalidationListener::run, this);
+        return true;
+    }
+
+    void InvalidationListener::stop() {
+        m_stop = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (nullptr != m_conn) {
+            PQfinish(m_conn);
+            m_conn = nullptr;
+        }
+        m_running = false;
+    }
+
+    bool InvalidationListener::listen(std::string &error_message) {
+        std::string sql = std::string("LISTEN ") + CHANNEL;
+        PGresult* res = PQexec(m_conn, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok) {
+            error_message = std::string("LISTEN failed: ") + PQerrorMessage(m_conn);
+        }
+        PQclear(res);
+        return ok;
+    }
+
+    bool InvalidationListener::parse(const std::string &payload, Invalidation &invalidation) {
+        // Payload format: <table>:<id>:<project_id>
+        std::stringstream ss(payload);
+        std::string table, id, project_id;
+        if (!std::getline(ss, table, ':') || !std::getline(ss, id, ':') || !std::getline(ss, project_id, ':')) {
+            return false;
+        }
+
+        char* end = nullptr;
+        invalidation.table = table;
+        invalidation.id = static_cast<int>(std::strtol(id.c_str(), &end, 10));
+        if (end == id.c_str()) return false;
+        invalidation.project_id = static_cast<int>(std::strtol(project_id.c_str(), &end, 10));
+        if (end == project_id.c_str()) return false;
+        return true;
+    }
+
+    void InvalidationListener::run() {
+        while (!m_stop) {
+            if (PQstatus(m_conn) != CONNECTION_OK) {
+                // Anything sent while we were disconnected is lost, so ask for a full flush.
+                PQreset(m_conn);
+                std::string error_message;
+                if (PQstatus(m_conn) != CONNECTION_OK || !listen(error_message)) {
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    continue;
+                }
+                Invalidation all;
+                all.table = "*";
+                m_handler(all);
+            }
+
+            int sock = PQsocket(m_conn);
+            if (sock < 0) {
+                PQreset(m_conn);
+                continue;
+            }
+
+            fd_set input_mask;
+            FD_ZERO(&input_mask);
+            FD_SET(sock, &input_mask);
+
+            // Wake up periodically so stop() does not have to interrupt select.
+            timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 200 * 1000;
+
+            if (select(sock + 1, &input_mask, nullptr, nullptr, &timeout) <= 0) {
+                continue;
+            }
+
+            if (0 == PQconsumeInput(m_conn)) {
+                continue;
+            }
+
+            PGnotify* notify = nullptr;
+            while (nullptr != (notify = PQnotifies(m_conn))) {
+                Invalidation invalidation;
+                if (nullptr != notify->extra && parse(notify->extra, invalidation)) {
+                    m_handler(invalidation);
+                }
+                PQfreemem(notify);
+            }
+        }
+    }
+}
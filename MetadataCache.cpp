@@ -0,0 +1,162 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/MetadataCache.h"
+#include <algorithm>
+
+namespace NJLIC {
+
+    MetadataCache::MetadataCache(std::chrono::milliseconds ttl, bool negative_caching)
+            : m_ttl(ttl), m_negativeCaching(negative_caching) {
+    }
+
+    template<typename K, typename V>
+    MetadataCache::Lookup MetadataCache::find(std::unordered_map<K, Entry<V>> &map, const K &key, V &value) {
+        auto it = map.find(key);
+        if (it == map.end()) {
+            ++m_stats.misses;
+            return Lookup::Miss;
+        }
+        if (Clock::now() >= it->second.expires) {
+            map.erase(it);
+            ++m_stats.misses;
+            return Lookup::Miss;
+        }
+        if (it->second.missing) {
+            ++m_stats.negative_hits;
+            return Lookup::NegativeHit;
+        }
+        ++m_stats.hits;
+        value = it->second.value;
+        return Lookup::Hit;
+    }
+
+    template<typename K, typename V>
+    void MetadataCache::put(std::unordered_map<K, Entry<V>> &map, const K &key, const V &value, bool missing) {
+        Entry<V> entry;
+        entry.value = value;
+        entry.missing = missing;
+        entry.expires = Clock::now() + m_ttl;
+        map[key] = entry;
+    }
+
+    MetadataCache::Lookup MetadataCache::findUserId(const std::string &email, int &user_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return find(m_userIdsByEmail, email, user_id);
+    }
+
+    void MetadataCache::putUserId(const std::string &email, int user_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_userIdsByEmail, email, user_id, false);
+    }
+
+    void MetadataCache::putMissingEmail(const std::string &email) {
+        if (!m_negativeCaching) return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_userIdsByEmail, email, 0, true);
+    }
+
+    MetadataCache::Lookup MetadataCache::findUser(int user_id, CachedUser &user) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return find(m_users, user_id, user);
+    }
+
+    void MetadataCache::putUser(int user_id, const CachedUser &user) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_users, user_id, user, false);
+    }
+
+    void MetadataCache::putMissingUser(int user_id) {
+        if (!m_negativeCaching) return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_users, user_id, CachedUser(), true);
+    }
+
+    MetadataCache::Lookup MetadataCache::findProject(int project_id, CachedProject &project) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return find(m_projects, project_id, project);
+    }
+
+    void MetadataCache::putProject(int project_id, const CachedProject &project) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_projects, project_id, project, false);
+    }
+
+    MetadataCache::Lookup MetadataCache::findProjects(int user_id, std::vector<int> &project_ids) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return find(m_projectsByUser, user_id, project_ids);
+    }
+
+    void MetadataCache::putProjects(int user_id, const std::vector<int> &project_ids) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        put(m_projectsByUser, user_id, project_ids, false);
+    }
+
+    void MetadataCache::invalidateEmail(const std::string &email) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.invalidations += m_userIdsByEmail.erase(email);
+    }
+
+    void MetadataCache::invalidateUser(int user_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_stats.invalidations += m_users.erase(user_id);
+        m_stats.invalidations += m_projectsByUser.erase(user_id);
+
+        for (auto it = m_userIdsByEmail.begin(); it != m_userIdsByEmail.end();) {
+            if (!it->second.missing && it->second.value == user_id) {
+                it = m_userIdsByEmail.erase(it);
+                ++m_stats.invalidations;
+            } else {
+                ++it;
+            }
+        }
+        for (auto it = m_projects.begin(); it != m_projects.end();) {
+            if (it->second.value.user_id == user_id) {
+                it = m_projects.erase(it);
+                ++m_stats.invalidations;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void MetadataCache::invalidateProject(int project_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_stats.invalidations += m_projects.erase(project_id);
+
+        // The owner is not always known here, so drop any membership list that mentions the project.
+        for (auto it = m_projectsByUser.begin(); it != m_projectsByUser.end();) {
+            const auto &ids = it->second.value;
+            if (std::find(ids.begin(), ids.end(), project_id) != ids.end()) {
+                it = m_projectsByUser.erase(it);
+                ++m_stats.invalidations;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void MetadataCache::invalidateProjects(int user_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.invalidations += m_projectsByUser.erase(user_id);
+    }
+
+    void MetadataCache::clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.invalidations += m_userIdsByEmail.size() + m_users.size() + m_projects.size() + m_projectsByUser.size();
+        m_userIdsByEmail.clear();
+        m_users.clear();
+        m_projects.clear();
+        m_projectsByUser.clear();
+    }
+
+    MetadataCacheStats MetadataCache::getStats() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+    }
+}
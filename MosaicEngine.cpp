@@ -0,0 +1,562 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/MosaicEngine.h"
+#include "MosaifyDatabase/MosaifyDatabase.h"
+#include "MosaifyDatabase/ImageBatch.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <unordered_set>
+
+namespace NJLIC {
+
+    typedef std::chrono::steady_clock Clock;
+
+    static double elapsedMilliseconds(Clock::time_point &start) {
+        const Clock::time_point now = Clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(now - start).count();
+        start = now;
+        return ms;
+    }
+
+    // Checks that the smallest cells the map can have are at least a pixel.
+    static bool checkGrid(const IntegralImage &target, int grid_cols, int grid_rows, int max_depth, std::string &error_message) {
+        const int64_t fine_cols = static_cast<int64_t>(grid_cols) << max_depth;
+        const int64_t fine_rows = static_cast<int64_t>(grid_rows) << max_depth;
+        if (grid_cols <= 0 || grid_rows <= 0 || fine_cols > target.getCols() || fine_rows > target.getRows()) {
+            error_message = "Mosaic grid " + std::to_string(grid_cols) + "x" + std::to_string(grid_rows) +
+                            (max_depth > 0 ? " split " + std::to_string(max_depth) + " levels deep" : "") +
+                            " does not fit the " + std::to_string(target.getCols()) + "x" + std::to_string(target.getRows()) + " mosaic image.";
+            return false;
+        }
+        return true;
+    }
+
+    // Pixels of the target a cell covers. With the grid split into units
+    // (see MosaicCellRect), unit x spans columns [cols * x / units,
+    // cols * (x + 1) / units), rows likewise; on a uniform map a unit is a cell.
+    struct PixelRect {
+        int x0, y0, x1, y1;
+    };
+
+    static PixelRect getPixelRect(const IntegralImage &target, int grid_cols, int grid_rows, int max_depth, const MosaicCellRect &rect) {
+        const int64_t fine_cols = static_cast<int64_t>(grid_cols) << max_depth;
+        const int64_t fine_rows = static_cast<int64_t>(grid_rows) << max_depth;
+        PixelRect pixels;
+        pixels.x0 = static_cast<int>(target.getCols() * static_cast<int64_t>(rect.x) / fine_cols);
+        pixels.x1 = static_cast<int>(target.getCols() * static_cast<int64_t>(rect.x + rect.size) / fine_cols);
+        pixels.y0 = static_cast<int>(target.getRows() * static_cast<int64_t>(rect.y) / fine_rows);
+        pixels.y1 = static_cast<int>(target.getRows() * static_cast<int64_t>(rect.y + rect.size) / fine_rows);
+        return pixels;
+    }
+
+    // Appends the split flags of the quadtree rooted at rect, in pre-order. A
+    // node splits while its intensity variance, scaled like the ImageFeatures
+    // variance, exceeds split_variance and it is above the smallest size.
+    static void splitCell(const IntegralImage &target, int grid_cols, int grid_rows, int max_depth, float split_variance, const MosaicCellRect &rect, std::vector<uint8_t> &splits) {
+        const PixelRect pixels = getPixelRect(target, grid_cols, grid_rows, max_depth, rect);
+        double variance = 0.0;
+        for (int ch = 0; ch < target.getChannels(); ++ch) {
+            variance += target.getVariance(pixels.x0, pixels.y0, pixels.x1 - pixels.x0, pixels.y1 - pixels.y0, ch);
+        }
+        variance /= target.getChannels() * 255.0 * 255.0;
+
+        const bool split = rect.size > 1 && variance > split_variance;
+        splits.push_back(split ? 1 : 0);
+        if (!split) return;
+
+        const int half = rect.size / 2;
+        for (int q = 0; q < 4; ++q) {
+            MosaicCellRect child;
+            child.x = rect.x + (q & 1) * half;
+            child.y = rect.y + (q >> 1) * half;
+            child.size = half;
+            splitCell(target, grid_cols, grid_rows, max_depth, split_variance, child, splits);
+        }
+    }
+
+    // Lays out an empty grid_cols x grid_rows map, split adaptively when
+    // options.max_depth is set. Grid rows are split in parallel.
+    static bool layoutCells(const IntegralImage &target, int grid_cols, int grid_rows, const MosaicEngine::Options &options, MosaicMap &mosaic_map, std::string &error_message) {
+        const int max_depth = std::max(0, options.max_depth);
+        if(!checkGrid(target, grid_cols, grid_rows, max_depth, error_message))return false;
+        mosaic_map.resize(grid_cols, grid_rows, false);
+        if (0 == max_depth) return true;
+
+        std::vector<std::vector<uint8_t>> row_splits(grid_rows);
+        parallelFor(static_cast<size_t>(grid_rows), 1, [&](size_t row_begin, size_t row_end) {
+            for (size_t gy = row_begin; gy < row_end; ++gy) {
+                for (int gx = 0; gx < grid_cols; ++gx) {
+                    MosaicCellRect rect;
+                    rect.x = gx << max_depth;
+                    rect.y = static_cast<int>(gy) << max_depth;
+                    rect.size = 1 << max_depth;
+                    splitCell(target, grid_cols, grid_rows, max_depth, options.split_variance, rect, row_splits[gy]);
+                }
+            }
+        }, options.threads);
+
+        std::vector<uint8_t> splits;
+        for (const std::vector<uint8_t> &row : row_splits) splits.insert(splits.end(), row.begin(), row.end());
+        if (!mosaic_map.setQuadtree(max_depth, splits)) {
+            error_message = "Mosaic quadtree depth " + std::to_string(max_depth) + " is not supported.";
+            return false;
+        }
+        return true;
+    }
+
+    // Features of every cell of the map over the target, in cell order.
+    static bool computeCellFeatures(const IntegralImage &target, const MosaicMap &mosaic_map, unsigned threads, std::vector<float> &cell_features, std::string &error_message) {
+        const int grid_cols = mosaic_map.getGridCols();
+        const int grid_rows = mosaic_map.getGridRows();
+        const int max_depth = mosaic_map.getMaxDepth();
+        if(!checkGrid(target, grid_cols, grid_rows, max_depth, error_message))return false;
+
+        const size_t cells = mosaic_map.getCellCount();
+        cell_features.resize(cells * ImageFeatures::DIMENSIONS);
+        parallelFor(cells, 256, [&](size_t cell_begin, size_t cell_end) {
+            ImageFeatures features;
+            for (size_t cell = cell_begin; cell < cell_end; ++cell) {
+                const PixelRect pixels = getPixelRect(target, grid_cols, grid_rows, max_depth, mosaic_map.getCellRect(cell));
+                computeImageFeatures(target, pixels.x0, pixels.y0, pixels.x1 - pixels.x0, pixels.y1 - pixels.y0, features);
+                std::copy(features.values, features.values + ImageFeatures::DIMENSIONS, &cell_features[cell * ImageFeatures::DIMENSIONS]);
+            }
+        }, threads);
+        return true;
+    }
+
+    // Builds a matcher over the tiles at the given indices of the feature set.
+    // It returns those indices, so a match resolves to an image and its ROI.
+    static void buildMatcher(const ImageFeatureSet &tiles, const std::vector<size_t> &subset, const TileMatcher::Options &options, TileMatcher &matcher) {
+        std::vector<float> vectors(subset.size() * ImageFeatures::DIMENSIONS);
+        std::vector<int> ids(subset.size());
+        for (size_t i = 0; i < subset.size(); ++i) {
+            ids[i] = static_cast<int>(subset[i]);
+            for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+                vectors[i * ImageFeatures::DIMENSIONS + d] = tiles.getValue(subset[i], d);
+            }
+        }
+        matcher.build(vectors.data(), subset.size(), ImageFeatures::DIMENSIONS, ids.data(), options);
+    }
+
+    static void buildMatcher(const ImageFeatureSet &tiles, const TileMatcher::Options &options, TileMatcher &matcher) {
+        std::vector<size_t> all(tiles.size());
+        std::iota(all.begin(), all.end(), 0);
+        buildMatcher(tiles, all, options, matcher);
+    }
+
+    static bool hasRois(const ImageFeatureSet &tiles) {
+        const std::vector<int> &rois = tiles.getRoiIds();
+        return std::any_of(rois.begin(), rois.end(), [](int roi_id) { return 0 != roi_id; });
+    }
+
+    static void setCellTile(const ImageFeatureSet &tiles, size_t tile, size_t cell, MosaicMap &mosaic_map) {
+        mosaic_map.getCells()[cell] = tiles.getImageId(tile);
+        if (mosaic_map.hasRois()) mosaic_map.getRois()[cell] = tiles.getRoiId(tile);
+    }
+
+    // Index of the (image_id, roi_id) tile, or -1. readImageFeatures orders
+    // tiles by image and then ROI, so this is a binary search.
+    static int64_t findTile(const ImageFeatureSet &tiles, int32_t image_id, int32_t roi_id) {
+        const std::vector<int> &ids = tiles.getImageIds();
+        const std::vector<int> &rois = tiles.getRoiIds();
+        auto range = std::equal_range(ids.begin(), ids.end(), image_id);
+        auto it = std::lower_bound(rois.begin() + (range.first - ids.begin()), rois.begin() + (range.second - ids.begin()), roi_id);
+        if (it == rois.begin() + (range.second - ids.begin()) || *it != roi_id) return -1;
+        return it - rois.begin();
+    }
+
+    static TileAssigner::Options getAssignerOptions(const MosaicEngine::Options &options) {
+        TileAssigner::Options assigner_options;
+        assigner_options.max_uses = options.max_uses;
+        assigner_options.min_repeat_distance = options.min_repeat_distance;
+        assigner_options.candidates = options.candidates;
+        assigner_options.dimensions = options.matcher.dimensions;
+        assigner_options.epsilon = options.matcher.epsilon;
+        return assigner_options;
+    }
+
+    // Label of a tile in the persisted index; stable across reads, unlike
+    // its position in the feature set.
+    static int64_t getTileKey(const ImageFeatureSet &tiles, size_t tile) {
+        return (static_cast<int64_t>(tiles.getImageId(tile)) << 32) | static_cast<uint32_t>(tiles.getRoiId(tile));
+    }
+
+    static bool isIndexed(const MosaicEngine::Options &options) {
+        return MatchStrategy::Approximate == options.matcher.strategy && !options.index_path.empty();
+    }
+
+    MosaicEngine::MosaicEngine(MosaifyDatabase &database)
+            : m_database(database), m_strategy(MatchStrategy::Auto), m_targetProjectId(0), m_targetVersion(-1) {
+    }
+
+    bool MosaicEngine::loadTarget(int project_id, unsigned threads, std::string &error_message) {
+        const int64_t known_version = (project_id == m_targetProjectId && !m_target.empty()) ? m_targetVersion : -1;
+        ImageBatch target(m_database.getPixelAllocator());
+        int64_t version = 0;
+        bool modified = false;
+        if(!m_database.readMosaicImage(project_id, known_version, target, version, modified, error_message))return false;
+        if (!modified) return true;
+
+        m_target.clear();
+        m_targetProjectId = 0;
+        const int rows = target.getRows(0);
+        const int cols = target.getCols(0);
+        const int comps = target.getComps(0);
+        const size_t stride = static_cast<size_t>(cols) * comps;
+        if (target.getDataSize(0) < stride * rows) {
+            error_message = "Mosaic image data is smaller than its dimensions.";
+            return false;
+        }
+        if (!m_target.build(target.getData(0), rows, cols, comps, stride, threads)) {
+            error_message = "Unsupported mosaic image format (" + std::to_string(comps) + " components).";
+            return false;
+        }
+        m_targetProjectId = project_id;
+        m_targetVersion = version;
+        return true;
+    }
+
+    bool MosaicEngine::syncTileIndex(int project_id, const Options &options, std::string &error_message) {
+        if (options.index_path.empty()) {
+            error_message = "No tile index path is set.";
+            return false;
+        }
+        if (options.compute_missing_features) {
+            int computed = 0;
+            if(!m_database.computeMissingImageFeatures(project_id, computed, error_message))return false;
+        }
+        ImageFeatureSet tiles;
+        if(!m_database.readImageFeatures(project_id, tiles, error_message))return false;
+        return syncTileIndex(tiles, options, error_message);
+    }
+
+    bool MosaicEngine::syncTileIndex(const ImageFeatureSet &tiles, const Options &options, std::string &error_message) {
+        HnswIndex::Options index_options;
+        index_options.dimensions = options.matcher.dimensions;
+        index_options.m = options.matcher.m;
+        index_options.ef_construction = options.matcher.ef_construction;
+        index_options.ef_search = options.matcher.ef_search;
+        std::vector<int> dims = options.matcher.dimensions;
+        if (dims.empty()) {
+            dims.resize(ImageFeatures::DIMENSIONS);
+            std::iota(dims.begin(), dims.end(), 0);
+        }
+
+        // A missing or unreadable file is only a cold start; the index is
+        // rebuilt from the tiles and saved over it.
+        if (m_indexPath != options.index_path) {
+            std::string load_error;
+            if (!m_index.load(options.index_path, load_error)) m_index.clear();
+            m_indexPath = options.index_path;
+        }
+        if (m_index.getSourceDimensions() != ImageFeatures::DIMENSIONS || m_index.getDimensionIndices() != dims) {
+            m_index.reset(ImageFeatures::DIMENSIONS, index_options);
+        }
+
+        bool changed = false;
+        std::unordered_set<int64_t> keys;
+        keys.reserve(tiles.size());
+        ImageFeatures features;
+        for (size_t tile = 0; tile < tiles.size(); ++tile) {
+            const int64_t key = getTileKey(tiles, tile);
+            keys.insert(key);
+            const float* point = m_index.getPoint(key);
+            bool same = nullptr != point;
+            for (size_t d = 0; same && d < dims.size(); ++d) same = point[d] == tiles.getValue(tile, dims[d]);
+            if (same) continue;
+            tiles.get(tile, features);
+            m_index.insert(features.values, key);
+            changed = true;
+        }
+
+        std::vector<int64_t> ids;
+        m_index.getIds(ids);
+        for (int64_t id : ids) {
+            if (0 == keys.count(id)) {
+                m_index.remove(id);
+                changed = true;
+            }
+        }
+
+        // Tombstones still cost a visit on every search; once they outnumber
+        // the live tiles a rebuild is cheaper than carrying them.
+        if (m_index.getTombstoneCount() > m_index.size()) {
+            std::vector<float> vectors(tiles.size() * ImageFeatures::DIMENSIONS);
+            std::vector<int64_t> labels(tiles.size());
+            for (size_t tile = 0; tile < tiles.size(); ++tile) {
+                for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) vectors[tile * ImageFeatures::DIMENSIONS + d] = tiles.getValue(tile, d);
+                labels[tile] = getTileKey(tiles, tile);
+            }
+            m_index.build(vectors.data(), tiles.size(), ImageFeatures::DIMENSIONS, labels.data(), index_options);
+        }
+        m_index.setEfSearch(options.matcher.ef_search);
+
+        if (changed && !m_index.save(options.index_path, error_message)) {
+            // Reload on the next call rather than trust a file that was not written.
+            m_indexPath.clear();
+            return false;
+        }
+        return true;
+    }
+
+    void MosaicEngine::matchIndexed(const ImageFeatureSet &tiles, const float* queries, size_t count, const Options &options, std::vector<size_t> &found) const {
+        std::vector<int64_t> labels(count);
+        std::vector<float> distances(count);
+        m_index.knnBatch(queries, count, 1, labels.data(), distances.data(), options.threads);
+        found.resize(count);
+
+        // A query the index found nothing for, or a label no tile carries,
+        // is matched exactly instead.
+        std::vector<size_t> missed;
+        for (size_t q = 0; q < count; ++q) {
+            const int64_t tile = labels[q] < 0 ? -1 : findTile(tiles, static_cast<int32_t>(labels[q] >> 32), static_cast<int32_t>(labels[q] & 0xffffffff));
+            if (tile < 0) {
+                missed.push_back(q);
+            } else {
+                found[q] = static_cast<size_t>(tile);
+            }
+        }
+        if (missed.empty()) return;
+
+        std::vector<float> missed_queries(missed.size() * ImageFeatures::DIMENSIONS);
+        for (size_t i = 0; i < missed.size(); ++i) {
+            std::copy(queries + missed[i] * ImageFeatures::DIMENSIONS, queries + (missed[i] + 1) * ImageFeatures::DIMENSIONS, &missed_queries[i * ImageFeatures::DIMENSIONS]);
+        }
+        TileMatcher matcher;
+        buildMatcher(tiles, options.matcher, matcher);
+        std::vector<int> ids(missed.size());
+        std::vector<float> missed_distances(missed.size());
+        matcher.nearestBatch(missed_queries.data(), missed.size(), ids.data(), missed_distances.data(), options.threads);
+        for (size_t i = 0; i < missed.size(); ++i) found[missed[i]] = static_cast<size_t>(ids[i]);
+    }
+
+    void MosaicEngine::assignTiles(const std::vector<float> &cell_features, const ImageFeatureSet &tiles, const Options &options, MosaicMap &mosaic_map) {
+        // Cells of an adaptive map are not a grid; it is assigned as one row,
+        // which only max_uses needs.
+        const int grid_cols = mosaic_map.isAdaptive() ? static_cast<int>(mosaic_map.getCellCount()) : mosaic_map.getGridCols();
+        const int grid_rows = mosaic_map.isAdaptive() ? 1 : mosaic_map.getGridRows();
+        TileAssigner assigner(getAssignerOptions(options));
+        assigner.assign(cell_features.data(), grid_cols, grid_rows, tiles, mosaic_map.getCells(),
+                        mosaic_map.hasRois() ? mosaic_map.getRois() : nullptr, options.threads);
+        m_assignmentStats = assigner.getLastStats();
+        m_strategy = MatchStrategy::Tree;
+    }
+
+    bool MosaicEngine::buildMap(int project_id, int grid_cols, int grid_rows, const Options &options, std::string &error_message) {
+        MosaicMap mosaic_map;
+        return buildMap(project_id, grid_cols, grid_rows, options, mosaic_map, error_message);
+    }
+
+    bool MosaicEngine::buildMap(int project_id, int grid_cols, int grid_rows, const Options &options, MosaicMap &mosaic_map, std::string &error_message) {
+        m_timings = Timings();
+        const Clock::time_point begin = Clock::now();
+        Clock::time_point phase = begin;
+
+        if (options.max_depth > 0 && options.min_repeat_distance > 1) {
+            error_message = "Repeat spacing needs a uniform grid; set max_depth to 0 or min_repeat_distance to at most 1.";
+            return false;
+        }
+
+        if(!loadTarget(project_id, options.threads, error_message))return false;
+        m_timings.read_target = elapsedMilliseconds(phase);
+
+        if(!layoutCells(m_target, grid_cols, grid_rows, options, mosaic_map, error_message))return false;
+        std::vector<float> cell_features;
+        if(!computeCellFeatures(m_target, mosaic_map, options.threads, cell_features, error_message))return false;
+        m_timings.cell_features = elapsedMilliseconds(phase);
+
+        if (options.compute_missing_features) {
+            int computed = 0;
+            if(!m_database.computeMissingImageFeatures(project_id, computed, error_message))return false;
+        }
+        ImageFeatureSet tiles;
+        if(!m_database.readImageFeatures(project_id, tiles, error_message))return false;
+        if (tiles.empty()) {
+            error_message = "The project has no tiles to build a mosaic from.";
+            return false;
+        }
+        m_timings.read_tiles = elapsedMilliseconds(phase);
+
+        if (hasRois(tiles)) mosaic_map.getRois();
+        if (TileAssigner::isLimited(getAssignerOptions(options))) {
+            assignTiles(cell_features, tiles, options, mosaic_map);
+        } else if (isIndexed(options)) {
+            if(!syncTileIndex(tiles, options, error_message))return false;
+            m_strategy = MatchStrategy::Approximate;
+            m_timings.build_matcher = elapsedMilliseconds(phase);
+
+            std::vector<size_t> found;
+            matchIndexed(tiles, cell_features.data(), mosaic_map.getCellCount(), options, found);
+            for (size_t cell = 0; cell < found.size(); ++cell) setCellTile(tiles, found[cell], cell, mosaic_map);
+        } else {
+            TileMatcher matcher;
+            buildMatcher(tiles, options.matcher, matcher);
+            m_strategy = matcher.getStrategy();
+            m_timings.build_matcher = elapsedMilliseconds(phase);
+
+            const size_t cells = mosaic_map.getCellCount();
+            std::vector<int> found(cells);
+            std::vector<float> distances(cells);
+            matcher.nearestBatch(cell_features.data(), cells, found.data(), distances.data(), options.threads);
+            for (size_t cell = 0; cell < cells; ++cell) setCellTile(tiles, static_cast<size_t>(found[cell]), cell, mosaic_map);
+        }
+        mosaic_map.setTileWatermark(tiles.getWatermark());
+        m_timings.match = elapsedMilliseconds(phase);
+
+        int map_id = 0;
+        if(!m_database.upsertMosaicMap(project_id, mosaic_map, map_id, error_message))return false;
+        m_timings.write_map = elapsedMilliseconds(phase);
+
+        m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+
+    bool MosaicEngine::updateMap(int project_id, const Options &options, MosaicMap &mosaic_map, UpdateResult &result, std::string &error_message) {
+        m_timings = Timings();
+        result = UpdateResult();
+        const Clock::time_point begin = Clock::now();
+        Clock::time_point phase = begin;
+
+        if(!m_database.readMosaicMap(project_id, mosaic_map, error_message))return false;
+        if (mosaic_map.isAdaptive() && options.min_repeat_distance > 1) {
+            error_message = "Repeat spacing needs a uniform grid; the stored map is adaptive.";
+            return false;
+        }
+        if(!loadTarget(project_id, options.threads, error_message))return false;
+        m_timings.read_target = elapsedMilliseconds(phase);
+
+        std::vector<float> cell_features;
+        if(!computeCellFeatures(m_target, mosaic_map, options.threads, cell_features, error_message))return false;
+        m_timings.cell_features = elapsedMilliseconds(phase);
+
+        if (options.compute_missing_features) {
+            int computed = 0;
+            if(!m_database.computeMissingImageFeatures(project_id, computed, error_message))return false;
+        }
+        ImageFeatureSet tiles;
+        if(!m_database.readImageFeatures(project_id, tiles, error_message))return false;
+        if (tiles.empty()) {
+            error_message = "The project has no tiles to build a mosaic from.";
+            return false;
+        }
+        m_timings.read_tiles = elapsedMilliseconds(phase);
+
+        // Tiles whose features were written by a transaction that had not
+        // finished when the map was matched; with no watermark, all of them.
+        const int64_t watermark = mosaic_map.getTileWatermark();
+        std::vector<size_t> new_tiles;
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            if (tiles.getTxid(i) >= watermark) new_tiles.push_back(i);
+        }
+        result.new_tiles = new_tiles.size();
+
+        std::vector<int> dims = options.matcher.dimensions;
+        if (dims.empty()) {
+            dims.resize(ImageFeatures::DIMENSIONS);
+            std::iota(dims.begin(), dims.end(), 0);
+        }
+
+        // Cells whose tile is gone are rematched against every tile; the rest
+        // only need to beat their current distance with one of the new tiles.
+        // A cell's tile is gone when its image or its ROI is.
+        const size_t cells = mosaic_map.getCellCount();
+        if (hasRois(tiles)) mosaic_map.getRois();
+        int32_t* cell_ids = mosaic_map.getCells();
+        const int32_t* cell_rois = mosaic_map.getRois();
+        std::vector<float> current(cells, 0.0f);
+        std::vector<size_t> invalid;
+        for (size_t cell = 0; cell < cells; ++cell) {
+            const int64_t found = findTile(tiles, cell_ids[cell], cell_rois ? cell_rois[cell] : 0);
+            if (found < 0) {
+                invalid.push_back(cell);
+                continue;
+            }
+            const size_t tile = static_cast<size_t>(found);
+            const float* query = &cell_features[cell * ImageFeatures::DIMENSIONS];
+            float distance = 0.0f;
+            for (int d : dims) {
+                const float diff = tiles.getValue(tile, d) - query[d];
+                distance += diff * diff;
+            }
+            current[cell] = distance;
+        }
+        result.invalid_cells = invalid.size();
+
+        std::vector<bool> changed(cells, false);
+        if (TileAssigner::isLimited(getAssignerOptions(options))) {
+            const std::vector<int32_t> previous(cell_ids, cell_ids + cells);
+            const std::vector<int32_t> previous_rois(cell_rois, cell_rois ? cell_rois + cells : cell_rois);
+            assignTiles(cell_features, tiles, options, mosaic_map);
+            for (size_t cell = 0; cell < cells; ++cell) {
+                changed[cell] = previous[cell] != cell_ids[cell] || (cell_rois && previous_rois[cell] != cell_rois[cell]);
+            }
+            invalid.clear();
+        } else if (!new_tiles.empty()) {
+            TileMatcher matcher;
+            buildMatcher(tiles, new_tiles, options.matcher, matcher);
+            m_strategy = matcher.getStrategy();
+
+            std::vector<int> found(cells);
+            std::vector<float> distances(cells);
+            matcher.nearestBatch(cell_features.data(), cells, found.data(), distances.data(), options.threads);
+            for (size_t cell = 0; cell < cells; ++cell) {
+                const size_t tile = static_cast<size_t>(found[cell]);
+                if (distances[cell] < current[cell] && (tiles.getImageId(tile) != cell_ids[cell] || (cell_rois && tiles.getRoiId(tile) != cell_rois[cell]))) {
+                    setCellTile(tiles, tile, cell, mosaic_map);
+                    changed[cell] = true;
+                    ++result.improved_cells;
+                }
+            }
+        }
+
+        // The persisted index follows every tile change, not just the ones
+        // this map needs, so the next full build finds it current.
+        if (isIndexed(options) && !TileAssigner::isLimited(getAssignerOptions(options))) {
+            if(!syncTileIndex(tiles, options, error_message))return false;
+        }
+
+        if (!invalid.empty()) {
+            std::vector<float> queries(invalid.size() * ImageFeatures::DIMENSIONS);
+            for (size_t i = 0; i < invalid.size(); ++i) {
+                std::copy(&cell_features[invalid[i] * ImageFeatures::DIMENSIONS], &cell_features[(invalid[i] + 1) * ImageFeatures::DIMENSIONS], &queries[i * ImageFeatures::DIMENSIONS]);
+            }
+            std::vector<size_t> found(invalid.size());
+            if (isIndexed(options)) {
+                m_strategy = MatchStrategy::Approximate;
+                matchIndexed(tiles, queries.data(), invalid.size(), options, found);
+            } else {
+                TileMatcher matcher;
+                buildMatcher(tiles, options.matcher, matcher);
+                m_strategy = matcher.getStrategy();
+
+                std::vector<int> ids(invalid.size());
+                std::vector<float> distances(invalid.size());
+                matcher.nearestBatch(queries.data(), invalid.size(), ids.data(), distances.data(), options.threads);
+                std::copy(ids.begin(), ids.end(), found.begin());
+            }
+            for (size_t i = 0; i < invalid.size(); ++i) {
+                setCellTile(tiles, found[i], invalid[i], mosaic_map);
+                changed[invalid[i]] = true;
+            }
+        }
+        m_timings.match = elapsedMilliseconds(phase);
+
+        for (size_t cell = 0; cell < cells; ++cell) {
+            if (changed[cell]) result.changed_cells.push_back(cell);
+        }
+
+        if (!result.changed_cells.empty() || tiles.getWatermark() != watermark) {
+            mosaic_map.setTileWatermark(tiles.getWatermark());
+            int map_id = 0;
+            if(!m_database.upsertMosaicMap(project_id, mosaic_map, map_id, error_message))return false;
+        }
+        m_timings.write_map = elapsedMilliseconds(phase);
+
+        m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+}
@@ -0,0 +1,464 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/MosaicMap.h"
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+namespace NJLIC {
+
+    static const uint32_t MAP_MAGIC = 0x3150414d; // "MAP1"
+    static const uint16_t MAP_FORMAT_VERSION = 1;
+
+    // Header flags. Unknown flags are rejected so older readers never misread
+    // a map written with sections they do not understand.
+    static const uint16_t MAP_FLAG_TRANSFORMS = 1;
+    // int32 ROI ids follow the transforms in the zlib stream.
+    static const uint16_t MAP_FLAG_ROIS = 4;
+    // A uint32 quadtree depth and node count follow the watermark; the split
+    // bits start the zlib stream.
+    static const uint16_t MAP_FLAG_QUADTREE = 8;
+    // A uint64 transaction id watermark follows the header, before the quadtree counts.
+    static const uint16_t MAP_FLAG_TILE_TXID = 16;
+    static const uint16_t MAP_KNOWN_FLAGS = MAP_FLAG_TRANSFORMS | MAP_FLAG_ROIS | MAP_FLAG_QUADTREE | MAP_FLAG_TILE_TXID;
+
+    // Deepest quadtree a map may hold; a grid cell then spans 2^15 units.
+    static const int MAX_QUADTREE_DEPTH = 15;
+
+    // Deflate never expands a stream more than 1032:1, which bounds what a
+    // header may claim before anything is allocated for it.
+    static const uint64_t MAX_INFLATE_RATIO = 1032;
+
+    struct MapHeader {
+        uint32_t magic;
+        uint16_t format_version;
+        uint16_t flags;
+        uint32_t grid_cols;
+        uint32_t grid_rows;
+    };
+
+    static bool isBigEndian() {
+        const uint16_t probe = 1;
+        return 0 == *reinterpret_cast<const uint8_t*>(&probe);
+    }
+
+    static uint32_t byteSwap(uint32_t value) {
+        return ((value & 0xff) << 24) | ((value & 0xff00) << 8) | ((value >> 8) & 0xff00) | (value >> 24);
+    }
+
+    static uint16_t byteSwap(uint16_t value) {
+        return static_cast<uint16_t>((value << 8) | (value >> 8));
+    }
+
+    static uint64_t byteSwap(uint64_t value) {
+        return (static_cast<uint64_t>(byteSwap(static_cast<uint32_t>(value))) << 32) | byteSwap(static_cast<uint32_t>(value >> 32));
+    }
+
+    static void toLittleEndian(MapHeader &header) {
+        if (!isBigEndian()) return;
+        header.magic = byteSwap(header.magic);
+        header.format_version = byteSwap(header.format_version);
+        header.flags = byteSwap(header.flags);
+        header.grid_cols = byteSwap(header.grid_cols);
+        header.grid_rows = byteSwap(header.grid_rows);
+    }
+
+    static void swapCells(int32_t* cells, size_t count) {
+        if (!isBigEndian()) return;
+        for (size_t i = 0; i < count; ++i) {
+            cells[i] = static_cast<int32_t>(byteSwap(static_cast<uint32_t>(cells[i])));
+        }
+    }
+
+    MosaicMap::MosaicMap() : m_gridCols(0), m_gridRows(0), m_tileWatermark(0), m_maxDepth(0) {
+    }
+
+    MosaicMap::MosaicMap(int grid_cols, int grid_rows, bool with_transforms) : m_gridCols(0), m_gridRows(0), m_tileWatermark(0), m_maxDepth(0) {
+        resize(grid_cols, grid_rows, with_transforms);
+    }
+
+    void MosaicMap::resize(int grid_cols, int grid_rows, bool with_transforms) {
+        m_gridCols = grid_cols;
+        m_gridRows = grid_rows;
+        m_tileWatermark = 0;
+        m_maxDepth = 0;
+        m_splits.clear();
+        m_rects.clear();
+        m_rowCells.clear();
+
+        const size_t count = static_cast<size_t>(grid_cols) * grid_rows;
+        m_cells.assign(count, 0);
+        if (with_transforms) {
+            m_transforms.assign(count, TRANSFORM_NONE);
+        } else {
+            m_transforms.clear();
+        }
+        m_rois.clear();
+    }
+
+    void MosaicMap::clear() {
+        resize(0, 0);
+    }
+
+    uint8_t MosaicMap::getTransform(int col, int row) const {
+        if (m_transforms.empty()) return TRANSFORM_NONE;
+        return m_transforms[static_cast<size_t>(row) * m_gridCols + col];
+    }
+
+    void MosaicMap::setTransform(int col, int row, uint8_t transform) {
+        if (m_transforms.empty()) {
+            if (TRANSFORM_NONE == transform) return;
+            m_transforms.assign(m_cells.size(), TRANSFORM_NONE);
+        }
+        m_transforms[static_cast<size_t>(row) * m_gridCols + col] = transform;
+    }
+
+    int32_t MosaicMap::getRoi(int col, int row) const {
+        if (m_rois.empty()) return 0;
+        return m_rois[static_cast<size_t>(row) * m_gridCols + col];
+    }
+
+    void MosaicMap::setRoi(int col, int row, int32_t roi_id) {
+        if (m_rois.empty() && 0 == roi_id) return;
+        getRois()[static_cast<size_t>(row) * m_gridCols + col] = roi_id;
+    }
+
+    int32_t* MosaicMap::getRois() {
+        if (m_rois.empty()) m_rois.assign(m_cells.size(), 0);
+        return m_rois.data();
+    }
+
+    bool MosaicMap::setQuadtree(int max_depth, const std::vector<uint8_t> &splits) {
+        if (max_depth < 0 || max_depth > MAX_QUADTREE_DEPTH || (0 == max_depth && !splits.empty())) return false;
+
+        std::vector<MosaicCellRect> rects;
+        std::vector<size_t> row_cells;
+        if (max_depth > 0) {
+            const int root = 1 << max_depth;
+            row_cells.resize(static_cast<size_t>(m_gridRows) + 1);
+            std::vector<MosaicCellRect> pending;
+            size_t node = 0;
+            for (int gy = 0; gy < m_gridRows; ++gy) {
+                row_cells[gy] = rects.size();
+                for (int gx = 0; gx < m_gridCols; ++gx) {
+                    MosaicCellRect rect;
+                    rect.x = gx * root;
+                    rect.y = gy * root;
+                    rect.size = root;
+                    pending.push_back(rect);
+                    while (!pending.empty()) {
+                        const MosaicCellRect next = pending.back();
+                        pending.pop_back();
+                        if (node == splits.size()) return false;
+                        if (0 == splits[node++]) {
+                            rects.push_back(next);
+                            continue;
+                        }
+                        if (1 == next.size) return false;
+
+                        // Pushed in reverse so the top left quadrant comes out first.
+                        const int half = next.size / 2;
+                        for (int q = 3; q >= 0; --q) {
+                            MosaicCellRect child;
+                            child.x = next.x + (q & 1) * half;
+                            child.y = next.y + (q >> 1) * half;
+                            child.size = half;
+                            pending.push_back(child);
+                        }
+                    }
+                }
+            }
+            if (node != splits.size()) return false;
+            row_cells[m_gridRows] = rects.size();
+        }
+
+        m_maxDepth = max_depth;
+        m_splits.resize(splits.size());
+        for (size_t i = 0; i < splits.size(); ++i) m_splits[i] = splits[i] ? 1 : 0;
+        m_rects.swap(rects);
+        m_rowCells.swap(row_cells);
+
+        const size_t count = isAdaptive() ? m_rects.size() : static_cast<size_t>(m_gridCols) * m_gridRows;
+        m_cells.assign(count, 0);
+        if (!m_transforms.empty()) m_transforms.assign(count, TRANSFORM_NONE);
+        m_rois.clear();
+        return true;
+    }
+
+    MosaicCellRect MosaicMap::getCellRect(size_t cell) const {
+        if (isAdaptive()) return m_rects[cell];
+        MosaicCellRect rect;
+        rect.x = static_cast<int>(cell % m_gridCols);
+        rect.y = static_cast<int>(cell / m_gridCols);
+        rect.size = 1;
+        return rect;
+    }
+
+    int MosaicMap::getCellLevel(size_t cell) const {
+        int level = m_maxDepth;
+        for (int size = getCellRect(cell).size; size > 1; size >>= 1) --level;
+        return level;
+    }
+
+    size_t MosaicMap::getFirstCell(int grid_row) const {
+        if (isAdaptive()) return m_rowCells[grid_row];
+        return static_cast<size_t>(grid_row) * m_gridCols;
+    }
+
+    bool MosaicMap::encode(std::vector<unsigned char> &out, std::string &error_message) const {
+        MapHeader header;
+        header.magic = MAP_MAGIC;
+        header.format_version = MAP_FORMAT_VERSION;
+        header.flags = (hasTransforms() ? MAP_FLAG_TRANSFORMS : 0) | (m_tileWatermark > 0 ? MAP_FLAG_TILE_TXID : 0) | (hasRois() ? MAP_FLAG_ROIS : 0) |
+                       (isAdaptive() ? MAP_FLAG_QUADTREE : 0);
+        header.grid_cols = static_cast<uint32_t>(m_gridCols);
+        header.grid_rows = static_cast<uint32_t>(m_gridRows);
+        toLittleEndian(header);
+
+        std::vector<int32_t> swapped;
+        std::vector<int32_t> swapped_rois;
+        const int32_t* cells = m_cells.data();
+        const int32_t* rois = m_rois.data();
+        if (isBigEndian()) {
+            swapped = m_cells;
+            swapCells(swapped.data(), swapped.size());
+            cells = swapped.data();
+            swapped_rois = m_rois;
+            swapCells(swapped_rois.data(), swapped_rois.size());
+            rois = swapped_rois.data();
+        }
+
+        std::vector<uint8_t> split_bits((m_splits.size() + 7) / 8, 0);
+        for (size_t i = 0; i < m_splits.size(); ++i) {
+            if (m_splits[i]) split_bits[i / 8] |= static_cast<uint8_t>(1 << (i % 8));
+        }
+
+        const size_t cell_bytes = m_cells.size() * sizeof(int32_t);
+        const size_t roi_bytes = m_rois.size() * sizeof(int32_t);
+        const size_t payload = split_bits.size() + cell_bytes + m_transforms.size() + roi_bytes;
+
+        const size_t header_bytes = sizeof(MapHeader) + (m_tileWatermark > 0 ? sizeof(uint64_t) : 0) + (isAdaptive() ? 2 * sizeof(uint32_t) : 0);
+        out.resize(header_bytes + compressBound(static_cast<uLong>(payload)));
+        memcpy(out.data(), &header, sizeof(header));
+        size_t offset = sizeof(MapHeader);
+        if (m_tileWatermark > 0) {
+            uint64_t watermark = static_cast<uint64_t>(m_tileWatermark);
+            if (isBigEndian()) watermark = byteSwap(watermark);
+            memcpy(out.data() + offset, &watermark, sizeof(watermark));
+            offset += sizeof(watermark);
+        }
+        if (isAdaptive()) {
+            uint32_t quadtree[2] = { static_cast<uint32_t>(m_maxDepth), static_cast<uint32_t>(m_splits.size()) };
+            if (isBigEndian()) {
+                quadtree[0] = byteSwap(quadtree[0]);
+                quadtree[1] = byteSwap(quadtree[1]);
+            }
+            memcpy(out.data() + offset, quadtree, sizeof(quadtree));
+        }
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+        if (Z_OK != result) {
+            error_message = "Failed to initialize mosaic map compression.";
+            return false;
+        }
+
+        stream.next_out = out.data() + header_bytes;
+        stream.avail_out = static_cast<uInt>(out.size() - header_bytes);
+
+        stream.next_in = split_bits.data();
+        stream.avail_in = static_cast<uInt>(split_bits.size());
+        result = deflate(&stream, Z_NO_FLUSH);
+
+        if (Z_OK == result || Z_BUF_ERROR == result) {
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<int32_t*>(cells));
+            stream.avail_in = static_cast<uInt>(cell_bytes);
+            result = deflate(&stream, Z_NO_FLUSH);
+        }
+
+        if (Z_OK == result || Z_BUF_ERROR == result) {
+            stream.next_in = const_cast<Bytef*>(m_transforms.data());
+            stream.avail_in = static_cast<uInt>(m_transforms.size());
+            result = deflate(&stream, Z_NO_FLUSH);
+        }
+
+        if (Z_OK == result || Z_BUF_ERROR == result) {
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<int32_t*>(rois));
+            stream.avail_in = static_cast<uInt>(roi_bytes);
+            result = deflate(&stream, Z_FINISH);
+        }
+
+        const size_t written = stream.total_out;
+        deflateEnd(&stream);
+
+        if (Z_STREAM_END != result) {
+            error_message = "Failed to compress mosaic map.";
+            return false;
+        }
+
+        out.resize(header_bytes + written);
+        return true;
+    }
+
+    bool MosaicMap::decode(const unsigned char* data, size_t size, std::string &error_message) {
+        if (size < sizeof(MapHeader)) {
+            error_message = "Mosaic map is truncated.";
+            return false;
+        }
+
+        MapHeader header;
+        memcpy(&header, data, sizeof(header));
+        toLittleEndian(header);
+
+        if (MAP_MAGIC != header.magic) {
+            error_message = "Mosaic map has an invalid header.";
+            return false;
+        }
+        if (header.format_version > MAP_FORMAT_VERSION || 0 != (header.flags & ~MAP_KNOWN_FLAGS)) {
+            error_message = "Mosaic map was written by a newer version (format " + std::to_string(header.format_version) + ").";
+            return false;
+        }
+
+        size_t header_bytes = sizeof(MapHeader);
+        uint64_t watermark = 0;
+        if (0 != (header.flags & MAP_FLAG_TILE_TXID)) {
+            if (size < header_bytes + sizeof(watermark)) {
+                error_message = "Mosaic map is truncated.";
+                return false;
+            }
+            memcpy(&watermark, data + header_bytes, sizeof(watermark));
+            if (isBigEndian()) watermark = byteSwap(watermark);
+            header_bytes += sizeof(watermark);
+        }
+
+        uint32_t quadtree[2] = { 0, 0 };
+        if (0 != (header.flags & MAP_FLAG_QUADTREE)) {
+            if (size < header_bytes + sizeof(quadtree)) {
+                error_message = "Mosaic map is truncated.";
+                return false;
+            }
+            memcpy(quadtree, data + header_bytes, sizeof(quadtree));
+            if (isBigEndian()) {
+                quadtree[0] = byteSwap(quadtree[0]);
+                quadtree[1] = byteSwap(quadtree[1]);
+            }
+            header_bytes += sizeof(quadtree);
+        }
+        const uint64_t max_payload = static_cast<uint64_t>(size - header_bytes) * MAX_INFLATE_RATIO;
+
+        if (0 != (header.flags & MAP_FLAG_QUADTREE)) {
+            // A full tree of the stated depth bounds the node count, and so
+            // does the stream: at least three nodes in four are leaves, each
+            // holding an int32.
+            const uint64_t grid_cells = static_cast<uint64_t>(header.grid_cols) * header.grid_rows;
+            if (0 == quadtree[0] || quadtree[0] > MAX_QUADTREE_DEPTH || quadtree[1] < grid_cells ||
+                quadtree[1] > grid_cells * (((1ull << (2 * quadtree[0] + 2)) - 1) / 3) ||
+                static_cast<uint64_t>(quadtree[1]) * 3 > max_payload) {
+                error_message = "Mosaic map data is corrupt.";
+                return false;
+            }
+        }
+
+        // Every grid cell holds at least one int32 in the stream.
+        if (header.grid_cols > INT32_MAX || header.grid_rows > INT32_MAX ||
+            static_cast<uint64_t>(header.grid_cols) * header.grid_rows * sizeof(int32_t) > max_payload) {
+            error_message = "Mosaic map data is corrupt.";
+            return false;
+        }
+
+        resize(static_cast<int>(header.grid_cols), static_cast<int>(header.grid_rows), 0 != (header.flags & MAP_FLAG_TRANSFORMS));
+        m_tileWatermark = static_cast<int64_t>(watermark);
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (Z_OK != inflateInit(&stream)) {
+            error_message = "Failed to initialize mosaic map decompression.";
+            return false;
+        }
+
+        stream.next_in = const_cast<Bytef*>(data + header_bytes);
+        stream.avail_in = static_cast<uInt>(size - header_bytes);
+        int result = Z_OK;
+
+        // The split bits come first: they decide how many cells follow. They are
+        // inflated a chunk at a time, so the splits only grow as far as the
+        // stream actually backs them.
+        const size_t split_bytes = (quadtree[1] + 7) / 8;
+        if (0 != (header.flags & MAP_FLAG_QUADTREE)) {
+            std::vector<uint8_t> splits;
+            uint8_t chunk[4096];
+            size_t inflated = 0;
+            while (Z_OK == result && inflated < split_bytes) {
+                const size_t length = std::min(sizeof(chunk), split_bytes - inflated);
+                stream.next_out = chunk;
+                stream.avail_out = static_cast<uInt>(length);
+                result = inflate(&stream, Z_NO_FLUSH);
+                if (0 != stream.avail_out) break;
+
+                for (size_t i = 0; i < length * 8 && splits.size() < quadtree[1]; ++i) splits.push_back((chunk[i / 8] >> (i % 8)) & 1);
+                inflated += length;
+            }
+            if (Z_OK != result || inflated != split_bytes || !setQuadtree(static_cast<int>(quadtree[0]), splits)) {
+                inflateEnd(&stream);
+                error_message = "Mosaic map data is corrupt.";
+                clear();
+                return false;
+            }
+        }
+        if (0 != (header.flags & MAP_FLAG_ROIS)) m_rois.assign(m_cells.size(), 0);
+
+        // Inflate the cells, the transforms and the ROI ids directly into their final arrays.
+        const size_t cell_bytes = m_cells.size() * sizeof(int32_t);
+        const size_t roi_bytes = m_rois.size() * sizeof(int32_t);
+        if (split_bytes + cell_bytes + m_transforms.size() + roi_bytes > max_payload) {
+            inflateEnd(&stream);
+            error_message = "Mosaic map data is corrupt.";
+            clear();
+            return false;
+        }
+        if (cell_bytes > 0) {
+            stream.next_out = reinterpret_cast<Bytef*>(m_cells.data());
+            stream.avail_out = static_cast<uInt>(cell_bytes);
+            result = inflate(&stream, Z_NO_FLUSH);
+        }
+
+        if (Z_OK == result && 0 == stream.avail_out && !m_transforms.empty()) {
+            stream.next_out = m_transforms.data();
+            stream.avail_out = static_cast<uInt>(m_transforms.size());
+            result = inflate(&stream, Z_NO_FLUSH);
+        }
+
+        if (Z_OK == result && 0 == stream.avail_out) {
+            stream.next_out = reinterpret_cast<Bytef*>(m_rois.data());
+            stream.avail_out = static_cast<uInt>(roi_bytes);
+            result = inflate(&stream, Z_FINISH);
+        }
+
+        const bool complete = Z_STREAM_END == result && stream.total_out == split_bytes + cell_bytes + m_transforms.size() + roi_bytes;
+        inflateEnd(&stream);
+
+        if (!complete) {
+            error_message = "Mosaic map data is corrupt.";
+            clear();
+            return false;
+        }
+
+        swapCells(m_cells.data(), m_cells.size());
+        swapCells(m_rois.data(), m_rois.size());
+        return true;
+    }
+
+    bool MosaicMap::operator==(const MosaicMap &other) const {
+        return m_gridCols == other.m_gridCols &&
+               m_gridRows == other.m_gridRows &&
+               m_tileWatermark == other.m_tileWatermark &&
+               m_maxDepth == other.m_maxDepth &&
+               m_splits == other.m_splits &&
+               m_cells == other.m_cells &&
+               m_transforms == other.m_transforms &&
+               m_rois == other.m_rois;
+    }
+}
@@ -0,0 +1,651 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/MosaicRenderer.h"
+#include "MosaifyDatabase/MosaifyDatabase.h"
+#include "MosaifyDatabase/ImageResizer.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+namespace NJLIC {
+
+    typedef std::chrono::steady_clock Clock;
+
+    static double elapsedMilliseconds(Clock::time_point &start) {
+        const Clock::time_point now = Clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(now - start).count();
+        start = now;
+        return ms;
+    }
+
+    // Writes one pixel of src_comps channels as dst_comps channels. Gray
+    // sources are replicated; color to gray uses integer Rec. 601 luma.
+    static inline void convertPixel(const unsigned char* src, int src_comps, unsigned char* dst, int dst_comps) {
+        unsigned char r, g, b, a;
+        if (src_comps >= 3) {
+            r = src[0];
+            g = src[1];
+            b = src[2];
+        } else {
+            r = g = b = src[0];
+        }
+        a = (2 == src_comps || 4 == src_comps) ? src[src_comps - 1] : 255;
+
+        if (1 == dst_comps) {
+            dst[0] = static_cast<unsigned char>((77 * r + 150 * g + 29 * b + 128) >> 8);
+        } else {
+            dst[0] = r;
+            dst[1] = g;
+            dst[2] = b;
+            if (4 == dst_comps) dst[3] = a;
+        }
+    }
+
+    // Copies a resized tile into its cell. For a rotation by 90 or 270 degrees
+    // the tile was resized to the transposed cell size.
+    static void blitCell(const unsigned char* tile, int tile_cols, int tile_rows, int tile_comps, uint8_t transform,
+                         unsigned char* cell, size_t cell_stride, int cell_cols, int cell_rows, int cell_comps) {
+        const size_t tile_stride = static_cast<size_t>(tile_cols) * tile_comps;
+
+        if (TRANSFORM_NONE == transform && tile_comps == cell_comps) {
+            for (int y = 0; y < cell_rows; ++y) {
+                memcpy(cell + y * cell_stride, tile + y * tile_stride, tile_stride);
+            }
+            return;
+        }
+
+        const bool flip_x = 0 != (transform & TRANSFORM_FLIP_HORIZONTAL);
+        const bool flip_y = 0 != (transform & TRANSFORM_FLIP_VERTICAL);
+        const int rotation = transform & TRANSFORM_ROTATION_MASK;
+
+        for (int y = 0; y < cell_rows; ++y) {
+            unsigned char* out = cell + y * cell_stride;
+            const int fy = flip_y ? cell_rows - 1 - y : y;
+            for (int x = 0; x < cell_cols; ++x) {
+                const int fx = flip_x ? cell_cols - 1 - x : x;
+
+                // Inverse of a clockwise rotation of the tile.
+                int sx = fx, sy = fy;
+                switch (rotation) {
+                    case TRANSFORM_ROTATE_90: sx = fy; sy = tile_rows - 1 - fx; break;
+                    case TRANSFORM_ROTATE_180: sx = tile_cols - 1 - fx; sy = tile_rows - 1 - fy; break;
+                    case TRANSFORM_ROTATE_270: sx = tile_cols - 1 - fy; sy = fx; break;
+                    default: break;
+                }
+                convertPixel(tile + sy * tile_stride + static_cast<size_t>(sx) * tile_comps, tile_comps, out + static_cast<size_t>(x) * cell_comps, cell_comps);
+            }
+        }
+    }
+
+    static bool isUsableTile(const ImageBatch &tiles, size_t i) {
+        const int comps = tiles.getComps(i);
+        return tiles.getRows(i) > 0 && tiles.getCols(i) > 0 && comps >= 1 && comps <= 4 &&
+               tiles.getDataSize(i) >= static_cast<size_t>(tiles.getRows(i)) * tiles.getCols(i) * comps;
+    }
+
+    static bool checkOptions(const MosaicRenderer::Options &options, std::string &error_message) {
+        if (options.cell_width <= 0 || options.cell_height <= 0) {
+            error_message = "Mosaic cells must be at least one pixel wide and high.";
+            return false;
+        }
+        if (1 != options.comps && 3 != options.comps && 4 != options.comps) {
+            error_message = "Mosaic output must have 1, 3 or 4 components.";
+            return false;
+        }
+        return true;
+    }
+
+    // Cells of an adaptive map are a power-of-two fraction of a grid cell,
+    // so the grid cell size must halve evenly down to the deepest level.
+    static bool checkLayout(const MosaicMap &mosaic_map, const MosaicRenderer::Options &options, std::string &error_message) {
+        const int units = 1 << mosaic_map.getMaxDepth();
+        if (0 != options.cell_width % units || 0 != options.cell_height % units) {
+            error_message = "Adaptive mosaic cells must be a multiple of " + std::to_string(units) + " pixels wide and high.";
+            return false;
+        }
+        return true;
+    }
+
+    typedef MosaicRenderer::ScaledTiles ScaledTiles;
+    typedef std::pair<int32_t, int32_t> TileKey; // (image id, ROI id)
+    typedef std::unordered_map<int, ImageROI> RoiRects;
+
+    // Grid cells per batch of bands a streaming render loads tiles for.
+    static const size_t STREAM_BATCH_CELLS = 1 << 16;
+
+    static inline uint64_t getTileKey(int32_t image_id, int32_t roi_id) {
+        return static_cast<uint64_t>(static_cast<uint32_t>(image_id)) << 32 | static_cast<uint32_t>(roi_id);
+    }
+
+    // Whether the cell needs a tile at the transposed size.
+    static bool isTransposed(const MosaicMap &mosaic_map, size_t cell, const MosaicRenderer::Options &options) {
+        return options.cell_width != options.cell_height && mosaic_map.hasTransforms() && 0 != (mosaic_map.getTransforms()[cell] & 1);
+    }
+
+    // Index into ScaledTiles' values of the tile size a cell needs.
+    static size_t getSlot(const MosaicMap &mosaic_map, size_t cell, const MosaicRenderer::Options &options) {
+        return 2 * static_cast<size_t>(mosaic_map.getCellLevel(cell)) + (isTransposed(mosaic_map, cell, options) ? 1 : 0);
+    }
+
+    static size_t getSlotCount(const MosaicMap &mosaic_map) {
+        return 2 * (static_cast<size_t>(mosaic_map.getMaxDepth()) + 1);
+    }
+
+    // Tile size of a slot: the cell size halved per quadtree level, transposed for odd slots.
+    static void getSlotSize(size_t slot, const MosaicRenderer::Options &options, int &cols, int &rows) {
+        const int level = static_cast<int>(slot / 2);
+        cols = options.cell_width >> level;
+        rows = options.cell_height >> level;
+        if (slot % 2) std::swap(cols, rows);
+    }
+
+    static void setScaledTile(ScaledTiles &scaled_tiles, uint64_t key, size_t slot, const std::shared_ptr<const ScaledTile> &tile) {
+        std::vector<std::shared_ptr<const ScaledTile>> &slots = scaled_tiles[key];
+        if (slots.size() <= slot) slots.resize(slot + 1);
+        slots[slot] = tile;
+    }
+
+    // Distinct (image, ROI) tiles used by the given grid rows, per slot.
+    static void getTileKeys(const MosaicMap &mosaic_map, const std::vector<int> &grid_rows, const MosaicRenderer::Options &options, std::vector<std::vector<TileKey>> &tile_keys) {
+        tile_keys.assign(getSlotCount(mosaic_map), std::vector<TileKey>());
+        const int32_t* rois = mosaic_map.getRois();
+        for (int gy : grid_rows) {
+            for (size_t cell = mosaic_map.getFirstCell(gy); cell < mosaic_map.getFirstCell(gy + 1); ++cell) {
+                const int32_t id = mosaic_map.getCells()[cell];
+                if (id > 0) tile_keys[getSlot(mosaic_map, cell, options)].emplace_back(id, rois ? rois[cell] : 0);
+            }
+        }
+        for (auto &keys : tile_keys) {
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        }
+    }
+
+    // One tile to scale: the rectangle of sources[source] it shows.
+    struct ScaleJob {
+        size_t source;
+        int x, y, width, height;
+        int64_t version;
+    };
+
+    // The rectangle of tile source the ROI covers, clamped to the image; the
+    // whole image for ROI 0. False when the ROI is unknown or empty.
+    static bool getScaleJob(const ImageBatch &sources, size_t source, int32_t roi_id, const RoiRects &rects, int64_t version, ScaleJob &job) {
+        job = ScaleJob{source, 0, 0, sources.getCols(source), sources.getRows(source), version};
+        if (0 == roi_id) return true;
+
+        auto it = rects.find(roi_id);
+        if (it == rects.end() || it->second.image_id != sources.getId(source)) return false;
+        const ImageROI &roi = it->second;
+        job.x = std::max(0, std::min(roi.x, sources.getCols(source)));
+        job.y = std::max(0, std::min(roi.y, sources.getRows(source)));
+        job.width = std::min(roi.width, sources.getCols(source) - job.x);
+        job.height = std::min(roi.height, sources.getRows(source) - job.y);
+        return job.width > 0 && job.height > 0;
+    }
+
+    // Resizes the jobs' rectangles to cols x rows in parallel, one tile per
+    // task. A ROI is read in place through the source stride, never copied.
+    static void scaleTiles(const ImageBatch &sources, const std::vector<ScaleJob> &jobs,
+                           int cols, int rows, unsigned threads, std::vector<std::shared_ptr<const ScaledTile>> &scaled) {
+        scaled.assign(jobs.size(), nullptr);
+        parallelFor(jobs.size(), 1, [&](size_t begin, size_t end) {
+            std::vector<unsigned char> scratch;
+            ImageResizer resizer;
+            for (size_t j = begin; j < end; ++j) {
+                const ScaleJob &job = jobs[j];
+                const int comps = sources.getComps(job.source);
+                const size_t stride = static_cast<size_t>(sources.getCols(job.source)) * comps;
+                std::shared_ptr<ScaledTile> tile = std::make_shared<ScaledTile>();
+                tile->version = job.version;
+                tile->rows = rows;
+                tile->cols = cols;
+                tile->comps = comps;
+                tile->data.resize(static_cast<size_t>(rows) * cols * comps);
+
+                resizer.configure(job.height, job.width, rows, cols);
+                resizer.resize(sources.getData(job.source) + static_cast<size_t>(job.y) * stride + static_cast<size_t>(job.x) * comps, stride, comps,
+                               tile->data.data(), static_cast<size_t>(cols) * comps, scratch);
+                scaled[j] = tile;
+            }
+        }, threads);
+    }
+
+    static RoiRects getRoiRects(const std::vector<ImageROI> &rois) {
+        RoiRects rects;
+        for (const ImageROI &roi : rois) rects[roi.id] = roi;
+        return rects;
+    }
+
+    // Scales every usable tile of the batch to the sizes the map needs.
+    static void scaleBatch(const MosaicMap &mosaic_map, const ImageBatch &tiles, const RoiRects &rects, const MosaicRenderer::Options &options, const std::vector<int> &grid_rows, ScaledTiles &scaled_tiles) {
+        std::vector<std::vector<TileKey>> tile_keys;
+        getTileKeys(mosaic_map, grid_rows, options, tile_keys);
+
+        std::unordered_map<int, size_t> sources;
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            if (isUsableTile(tiles, i)) sources.emplace(tiles.getId(i), i);
+        }
+
+        for (size_t slot = 0; slot < tile_keys.size(); ++slot) {
+            std::vector<ScaleJob> jobs;
+            std::vector<uint64_t> keys;
+            for (const TileKey &key : tile_keys[slot]) {
+                auto it = sources.find(key.first);
+                ScaleJob job;
+                if (it == sources.end() || !getScaleJob(tiles, it->second, key.second, rects, 0, job)) continue;
+                jobs.push_back(job);
+                keys.push_back(getTileKey(key.first, key.second));
+            }
+
+            std::vector<std::shared_ptr<const ScaledTile>> scaled;
+            int cols = 0, rows = 0;
+            getSlotSize(slot, options, cols, rows);
+            scaleTiles(tiles, jobs, cols, rows, options.threads, scaled);
+            for (size_t j = 0; j < jobs.size(); ++j) setScaledTile(scaled_tiles, keys[j], slot, scaled[j]);
+        }
+    }
+
+    // Renders the listed grid rows, in order, into out: each one is a band of
+    // cell_height full-width canvas rows, and the bands are stored back to back.
+    // A cell of an adaptive map covers its rectangle of the band, at the cell
+    // size halved once per quadtree level.
+    static void composeRows(const MosaicMap &mosaic_map, const ScaledTiles &scaled_tiles, const MosaicRenderer::Options &options, const std::vector<int> &grid_rows, unsigned char* out) {
+        const int grid_cols = mosaic_map.getGridCols();
+        const int max_depth = mosaic_map.getMaxDepth();
+        const int unit_cols = options.cell_width >> max_depth;
+        const int unit_rows = options.cell_height >> max_depth;
+        const int comps = options.comps;
+        const size_t canvas_stride = static_cast<size_t>(grid_cols) * options.cell_width * comps;
+        const int32_t* rois = mosaic_map.getRois();
+
+        // The scaled tiles are shared read-only by the band workers; each cell
+        // is now only a copy, so the work scales with unique tiles, not cells.
+        parallelFor(grid_rows.size(), 1, [&](size_t band_begin, size_t band_end) {
+            for (size_t band = band_begin; band < band_end; ++band) {
+                unsigned char* band_pixels = out + band * options.cell_height * canvas_stride;
+                const int band_y = grid_rows[band] << max_depth;
+                for (size_t cell = mosaic_map.getFirstCell(grid_rows[band]); cell < mosaic_map.getFirstCell(grid_rows[band] + 1); ++cell) {
+                    const MosaicCellRect rect = mosaic_map.getCellRect(cell);
+                    const int cell_cols = rect.size * unit_cols;
+                    const int cell_rows = rect.size * unit_rows;
+                    unsigned char* cell_pixels = band_pixels + static_cast<size_t>(rect.y - band_y) * unit_rows * canvas_stride +
+                                                 static_cast<size_t>(rect.x) * unit_cols * comps;
+
+                    const ScaledTile* tile = nullptr;
+                    auto it = scaled_tiles.find(getTileKey(mosaic_map.getCells()[cell], rois ? rois[cell] : 0));
+                    const size_t slot = getSlot(mosaic_map, cell, options);
+                    if (it != scaled_tiles.end() && slot < it->second.size()) tile = it->second[slot].get();
+                    if (nullptr == tile) {
+                        for (int y = 0; y < cell_rows; ++y) {
+                            memset(cell_pixels + y * canvas_stride, 0, static_cast<size_t>(cell_cols) * comps);
+                        }
+                        continue;
+                    }
+
+                    const uint8_t transform = mosaic_map.hasTransforms() ? mosaic_map.getTransforms()[cell] : static_cast<uint8_t>(TRANSFORM_NONE);
+                    blitCell(tile->data.data(), tile->cols, tile->rows, tile->comps, transform,
+                             cell_pixels, canvas_stride, cell_cols, cell_rows, comps);
+                }
+            }
+        }, options.threads);
+    }
+
+    static std::vector<int> getAllRows(const MosaicMap &mosaic_map) {
+        std::vector<int> grid_rows(mosaic_map.getGridRows());
+        for (int gy = 0; gy < mosaic_map.getGridRows(); ++gy) grid_rows[gy] = gy;
+        return grid_rows;
+    }
+
+    // Grid rows of the given bands of band_grid_rows rows each, in order.
+    static std::vector<int> getBandRows(const MosaicMap &mosaic_map, const std::vector<int> &bands, int band_grid_rows) {
+        std::vector<int> grid_rows;
+        for (int band : bands) {
+            const int end = std::min(mosaic_map.getGridRows(), (band + 1) * band_grid_rows);
+            for (int gy = band * band_grid_rows; gy < end; ++gy) grid_rows.push_back(gy);
+        }
+        return grid_rows;
+    }
+
+    bool MosaicRenderer::compose(const MosaicMap &mosaic_map, const ImageBatch &tiles, const Options &options, PixelBuffer &canvas, std::string &error_message) {
+        return compose(mosaic_map, tiles, std::vector<ImageROI>(), options, canvas, error_message);
+    }
+
+    bool MosaicRenderer::compose(const MosaicMap &mosaic_map, const ImageBatch &tiles, const std::vector<ImageROI> &rois, const Options &options, PixelBuffer &canvas, std::string &error_message) {
+        if(!checkOptions(options, error_message))return false;
+        if(!checkLayout(mosaic_map, options, error_message))return false;
+
+        const size_t canvas_stride = static_cast<size_t>(mosaic_map.getGridCols()) * options.cell_width * options.comps;
+        canvas.resize(canvas_stride * mosaic_map.getGridRows() * options.cell_height);
+        if (0 == canvas.size()) return true;
+
+        const std::vector<int> grid_rows = getAllRows(mosaic_map);
+        ScaledTiles scaled_tiles;
+        scaleBatch(mosaic_map, tiles, getRoiRects(rois), options, grid_rows, scaled_tiles);
+        composeRows(mosaic_map, scaled_tiles, options, grid_rows, canvas.data());
+        return true;
+    }
+
+    MosaicRenderer::MosaicRenderer(MosaifyDatabase &database) : m_database(database) {
+    }
+
+    void MosaicRenderer::setTileCache(std::shared_ptr<ScaledTileCache> cache) {
+        m_tileCache = cache;
+    }
+
+    bool MosaicRenderer::loadScaledTiles(int project_id, const MosaicMap &mosaic_map, const std::vector<int> &grid_rows, const Options &options, ScaledTiles &scaled_tiles, std::string &error_message) {
+        std::vector<std::vector<TileKey>> tile_keys;
+        getTileKeys(mosaic_map, grid_rows, options, tile_keys);
+
+        RoiRects rects;
+        if (mosaic_map.hasRois()) {
+            std::vector<ImageROI> rois;
+            if(!m_database.readImageROIs(project_id, rois, error_message))return false;
+            rects = getRoiRects(rois);
+        }
+
+        for (size_t slot = 0; slot < tile_keys.size(); ++slot) {
+            if (tile_keys[slot].empty()) continue;
+            int cols = 0, rows = 0;
+            getSlotSize(slot, options, cols, rows);
+
+            // Offer the versions we hold so current tiles come back without pixels.
+            std::vector<int> image_ids;
+            std::vector<int> roi_ids;
+            std::vector<int64_t> known_versions;
+            std::unordered_map<uint64_t, std::shared_ptr<const ScaledTile>> cached;
+            for (const TileKey &key : tile_keys[slot]) {
+                std::shared_ptr<const ScaledTile> tile;
+                if (m_tileCache) tile = m_tileCache->find(ScaledTileKey{key.first, cols, rows, key.second});
+                image_ids.push_back(key.first);
+                roi_ids.push_back(key.second);
+                known_versions.push_back(tile ? tile->version : -1);
+                if (tile) cached[getTileKey(key.first, key.second)] = tile;
+            }
+
+            Clock::time_point phase = Clock::now();
+            ImageBatch batch(m_database.getPixelAllocator());
+            std::vector<int> batch_roi_ids;
+            std::vector<int64_t> versions;
+            std::vector<ImageLevelState> states;
+            if(!m_database.readImageLevels(project_id, image_ids, roi_ids, cols, rows, known_versions, batch, batch_roi_ids, versions, states, error_message))return false;
+            m_timings.read_tiles += elapsedMilliseconds(phase);
+
+            // An original arrives once however many of its ROIs need scaling.
+            std::unordered_map<int, size_t> sources;
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (ImageLevelState::Original == states[i] && isUsableTile(batch, i)) sources.emplace(batch.getId(i), i);
+            }
+
+            std::vector<ScaleJob> jobs;
+            std::vector<size_t> originals;
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const uint64_t key = getTileKey(batch.getId(i), batch_roi_ids[i]);
+                if (ImageLevelState::Unchanged == states[i]) {
+                    setScaledTile(scaled_tiles, key, slot, cached[key]);
+                } else if (ImageLevelState::Scaled == states[i]) {
+                    if (!isUsableTile(batch, i)) continue;
+                    std::shared_ptr<ScaledTile> tile = std::make_shared<ScaledTile>();
+                    tile->version = versions[i];
+                    tile->rows = rows;
+                    tile->cols = cols;
+                    tile->comps = batch.getComps(i);
+                    tile->data.assign(batch.getData(i), batch.getData(i) + static_cast<size_t>(rows) * cols * tile->comps);
+                    setScaledTile(scaled_tiles, key, slot, tile);
+                    if (m_tileCache) m_tileCache->insert(ScaledTileKey{batch.getId(i), cols, rows, batch_roi_ids[i]}, tile);
+                } else {
+                    auto it = sources.find(batch.getId(i));
+                    ScaleJob job;
+                    if (it == sources.end() || !getScaleJob(batch, it->second, batch_roi_ids[i], rects, versions[i], job)) continue;
+                    jobs.push_back(job);
+                    originals.push_back(i);
+                }
+            }
+
+            std::vector<std::shared_ptr<const ScaledTile>> scaled;
+            scaleTiles(batch, jobs, cols, rows, options.threads, scaled);
+            for (size_t j = 0; j < originals.size(); ++j) {
+                const int id = batch.getId(originals[j]);
+                const int roi_id = batch_roi_ids[originals[j]];
+                setScaledTile(scaled_tiles, getTileKey(id, roi_id), slot, scaled[j]);
+                if (m_tileCache) m_tileCache->insert(ScaledTileKey{id, cols, rows, roi_id}, scaled[j]);
+            }
+            m_timings.scale_tiles += elapsedMilliseconds(phase);
+
+            if (options.store_levels && !originals.empty()) {
+                ImageBatch levels(m_database.getPixelAllocator());
+                std::vector<int> level_rois;
+                std::vector<int64_t> level_versions;
+                for (size_t j = 0; j < originals.size(); ++j) {
+                    levels.append(batch.getId(originals[j]), "", 0,
+                                  rows, cols, scaled[j]->comps, scaled[j]->data.data(), scaled[j]->data.size());
+                    level_rois.push_back(batch_roi_ids[originals[j]]);
+                    level_versions.push_back(scaled[j]->version);
+                }
+                if(!m_database.writeImageLevels(project_id, cols, rows, levels, level_rois, level_versions, error_message))return false;
+                m_timings.write_levels += elapsedMilliseconds(phase);
+            }
+        }
+        return true;
+    }
+
+    bool MosaicRenderer::renderBands(int project_id, const MosaicMap &mosaic_map, const ScaledTiles &scaled_tiles, const std::vector<int> &bands, int band_grid_rows, const Options &options, std::string &error_message) {
+        const size_t canvas_stride = static_cast<size_t>(mosaic_map.getGridCols()) * options.cell_width * options.comps;
+        const size_t band_bytes = canvas_stride * band_grid_rows * options.cell_height;
+        const bool serial = 1 == (0 == options.threads ? getDefaultThreadCount() : options.threads);
+
+        // Two bands in flight: band i is composed while band i - 1 is
+        // compressed on the encoder thread and band i - 2 has been written.
+        PixelBuffer pixels[2] = { PixelBuffer(band_bytes, m_database.getPixelAllocator()), PixelBuffer(band_bytes, m_database.getPixelAllocator()) };
+        MosaicImageBand encoded[2];
+        std::string encode_error;
+        bool encode_ok = true;
+        double compress_ms = 0.0;
+        auto encode = [&](size_t i, size_t bytes) {
+            Clock::time_point start = Clock::now();
+            encode_ok = MosaifyDatabase::encodeMosaicImageBand(bands[i], pixels[i % 2].data(), bytes, encoded[i % 2], encode_error);
+            compress_ms += elapsedMilliseconds(start);
+        };
+
+        std::thread encoder;
+        auto finish = [&]() {
+            if (encoder.joinable()) encoder.join();
+            m_timings.compress = compress_ms;
+        };
+
+        for (size_t i = 0; i <= bands.size(); ++i) {
+            Clock::time_point phase = Clock::now();
+            size_t bytes = 0;
+            if (i < bands.size()) {
+                const std::vector<int> grid_rows = getBandRows(mosaic_map, {bands[i]}, band_grid_rows);
+                composeRows(mosaic_map, scaled_tiles, options, grid_rows, pixels[i % 2].data());
+                bytes = grid_rows.size() * options.cell_height * canvas_stride;
+                m_timings.render += elapsedMilliseconds(phase);
+            }
+
+            if (encoder.joinable()) encoder.join();
+            if (!encode_ok) {
+                error_message = encode_error;
+                finish();
+                return false;
+            }
+            if (i < bands.size()) {
+                if (serial) {
+                    encode(i, bytes);
+                } else {
+                    encoder = std::thread(encode, i, bytes);
+                }
+            }
+
+            phase = Clock::now();
+            if (i > 0 && !m_database.writeMosaicImageBand(project_id, MosaicImageKind::Rendered, encoded[(i - 1) % 2], error_message)) {
+                finish();
+                return false;
+            }
+            m_timings.write_image += elapsedMilliseconds(phase);
+        }
+        finish();
+        return true;
+    }
+
+    bool MosaicRenderer::render(int project_id, const Options &options, std::string &error_message) {
+        if (options.band_grid_rows <= 0) {
+            PixelBuffer canvas(m_database.getPixelAllocator());
+            int rows = 0;
+            int cols = 0;
+            return render(project_id, options, canvas, rows, cols, error_message);
+        }
+
+        m_timings = Timings();
+        const Clock::time_point begin = Clock::now();
+        Clock::time_point phase = begin;
+
+        MosaicMap mosaic_map;
+        if(!m_database.readMosaicMap(project_id, mosaic_map, error_message))return false;
+        m_timings.read_map = elapsedMilliseconds(phase);
+
+        if(!checkOptions(options, error_message))return false;
+        if(!checkLayout(mosaic_map, options, error_message))return false;
+
+        const int num_bands = (mosaic_map.getGridRows() + options.band_grid_rows - 1) / options.band_grid_rows;
+        const size_t band_cells = static_cast<size_t>(options.band_grid_rows) * mosaic_map.getGridCols();
+        const int batch_bands = static_cast<int>(std::max<size_t>(1, std::min<size_t>(num_bands, STREAM_BATCH_CELLS / std::max<size_t>(1, band_cells))));
+
+        // Readers keep seeing the previous render until the last band is in.
+        const int rows = mosaic_map.getGridRows() * options.cell_height;
+        const int cols = mosaic_map.getGridCols() * options.cell_width;
+        int image_id = 0;
+        if(!m_database.executeSQL("BEGIN", error_message))return false;
+        bool ok = m_database.createMosaicImageBands(project_id, MosaicImageKind::Rendered, rows, cols, options.comps, options.band_grid_rows * options.cell_height, image_id, error_message);
+
+        // Tiles are loaded a batch of bands at a time and dropped after it, so
+        // only the scaled tiles of one batch are held at once.
+        for (int first = 0; ok && first < num_bands; first += batch_bands) {
+            std::vector<int> bands;
+            for (int band = first; band < std::min(num_bands, first + batch_bands); ++band) bands.push_back(band);
+
+            ScaledTiles scaled_tiles;
+            ok = loadScaledTiles(project_id, mosaic_map, getBandRows(mosaic_map, bands, options.band_grid_rows), options, scaled_tiles, error_message) &&
+                 renderBands(project_id, mosaic_map, scaled_tiles, bands, options.band_grid_rows, options, error_message);
+        }
+        if (!ok) {
+            std::string ignored;
+            m_database.executeSQL("ROLLBACK", ignored);
+            return false;
+        }
+        if(!m_database.executeSQL("COMMIT", error_message))return false;
+
+        m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+
+    bool MosaicRenderer::render(int project_id, const Options &options, PixelBuffer &canvas, int &rows, int &cols, std::string &error_message) {
+        m_timings = Timings();
+        const Clock::time_point begin = Clock::now();
+        Clock::time_point phase = begin;
+
+        MosaicMap mosaic_map;
+        if(!m_database.readMosaicMap(project_id, mosaic_map, error_message))return false;
+        m_timings.read_map = elapsedMilliseconds(phase);
+
+        if(!checkOptions(options, error_message))return false;
+        if(!checkLayout(mosaic_map, options, error_message))return false;
+        const std::vector<int> grid_rows = getAllRows(mosaic_map);
+        ScaledTiles scaled_tiles;
+        if(!loadScaledTiles(project_id, mosaic_map, grid_rows, options, scaled_tiles, error_message))return false;
+        phase = Clock::now();
+
+        rows = mosaic_map.getGridRows() * options.cell_height;
+        cols = mosaic_map.getGridCols() * options.cell_width;
+        canvas.resize(static_cast<size_t>(rows) * cols * options.comps);
+        if (canvas.size() > 0) composeRows(mosaic_map, scaled_tiles, options, grid_rows, canvas.data());
+        m_timings.render = elapsedMilliseconds(phase);
+
+        int image_id = 0;
+        if(!m_database.upsertMosaicImage(project_id, MosaicImageKind::Rendered, rows, cols, options.comps, canvas.data(), canvas.size(), image_id, error_message))return false;
+        m_timings.write_image = elapsedMilliseconds(phase);
+
+        m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+
+    bool MosaicRenderer::renderCells(int project_id, const MosaicMap &mosaic_map, const std::vector<size_t> &cells, const Options &options, std::string &error_message) {
+        m_timings = Timings();
+        if(!checkOptions(options, error_message))return false;
+        if(!checkLayout(mosaic_map, options, error_message))return false;
+        if (cells.empty()) return true;
+
+        const Clock::time_point begin = Clock::now();
+        Clock::time_point phase = begin;
+
+        // Fall back to a full render when the stored image has another layout.
+        int rows = 0, cols = 0, comps = 0, band_rows = 0;
+        if(!m_database.readMosaicImageInfo(project_id, MosaicImageKind::Rendered, rows, cols, comps, band_rows, error_message))return false;
+        if (rows != mosaic_map.getGridRows() * options.cell_height || cols != mosaic_map.getGridCols() * options.cell_width || comps != options.comps ||
+            0 != band_rows % options.cell_height) {
+            return render(project_id, options, error_message);
+        }
+        m_timings.read_map = elapsedMilliseconds(phase);
+
+        std::vector<int> grid_rows;
+        for (size_t cell : cells) grid_rows.push_back(mosaic_map.getCellGridRow(cell));
+        std::sort(grid_rows.begin(), grid_rows.end());
+        grid_rows.erase(std::unique(grid_rows.begin(), grid_rows.end()), grid_rows.end());
+
+        // A banded image is patched by rewriting the bands holding the cells.
+        if (band_rows > 0) {
+            const int band_grid_rows = band_rows / options.cell_height;
+            std::vector<int> bands;
+            for (int gy : grid_rows) {
+                if (bands.empty() || bands.back() != gy / band_grid_rows) bands.push_back(gy / band_grid_rows);
+            }
+
+            ScaledTiles scaled_tiles;
+            if(!loadScaledTiles(project_id, mosaic_map, getBandRows(mosaic_map, bands, band_grid_rows), options, scaled_tiles, error_message))return false;
+
+            if(!m_database.executeSQL("BEGIN", error_message))return false;
+            if (!renderBands(project_id, mosaic_map, scaled_tiles, bands, band_grid_rows, options, error_message) ||
+                !m_database.finishMosaicImageBands(project_id, MosaicImageKind::Rendered, error_message)) {
+                std::string ignored;
+                m_database.executeSQL("ROLLBACK", ignored);
+                return false;
+            }
+            if(!m_database.executeSQL("COMMIT", error_message))return false;
+
+            m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+            return true;
+        }
+
+        ScaledTiles scaled_tiles;
+        if(!loadScaledTiles(project_id, mosaic_map, grid_rows, options, scaled_tiles, error_message))return false;
+        phase = Clock::now();
+
+        // A grid row is one contiguous byte range of the stored image; runs of
+        // adjacent rows become a single range.
+        const size_t band_bytes = static_cast<size_t>(cols) * comps * options.cell_height;
+        PixelBuffer bands(band_bytes * grid_rows.size(), m_database.getPixelAllocator());
+        composeRows(mosaic_map, scaled_tiles, options, grid_rows, bands.data());
+
+        std::vector<size_t> offsets;
+        std::vector<size_t> sizes;
+        for (size_t i = 0; i < grid_rows.size(); ++i) {
+            if (i > 0 && grid_rows[i] == grid_rows[i - 1] + 1) {
+                sizes.back() += band_bytes;
+            } else {
+                offsets.push_back(static_cast<size_t>(grid_rows[i]) * band_bytes);
+                sizes.push_back(band_bytes);
+            }
+        }
+        m_timings.render = elapsedMilliseconds(phase);
+
+        if(!m_database.patchMosaicImage(project_id, MosaicImageKind::Rendered, bands.data(), offsets, sizes, error_message))return false;
+        m_timings.write_image = elapsedMilliseconds(phase);
+
+        m_timings.total = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        return true;
+    }
+}
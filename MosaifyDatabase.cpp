@@ -4,6 +4,8 @@
 
 #include "MosaifyDatabase/MosaifyDatabase.h"
 #include "MosaifyDatabase/IImageData.h"
+#include "MosaifyDatabase/MosaicMap.h"
+#include "MosaifyDatabase/ImageFeatures.h"
 #include <cstdlib>  // For std::getenv
 #include <libpq-fe.h>
 #include <vector>
@@ -12,11 +14,12 @@
 #include <libpq-fe.h>
 #include <zlib.h>
 #include <arpa/inet.h>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
 
 namespace NJLIC {
 
-    static PGconn* m_conn = nullptr;
-
     static std::string get_reason(int result) {
         switch (result) {
             case Z_OK:return "Z_OK";
@@ -96,6 +99,41 @@ namespace NJLIC {
 #define HANDLE_ERROR(conn, operation, additionalInfo) \
     handleError(conn, operation, additionalInfo, __FILE__, __LINE__, __func__)
 
+    // Binary-format BIGINT columns arrive in network byte order.
+    static int64_t readInt64(const char* value) {
+        uint32_t parts[2];
+        memcpy(parts, value, sizeof(parts));
+        return static_cast<int64_t>((static_cast<uint64_t>(ntohl(parts[0])) << 32) | ntohl(parts[1]));
+    }
+
+    // Text form of an int/bigint array parameter, e.g. "{1,2,3}".
+    template<typename T>
+    static std::string toArrayLiteral(const std::vector<T> &values) {
+        std::stringstream ss;
+        ss << "{";
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (i > 0) ss << ",";
+            ss << values[i];
+        }
+        ss << "}";
+        return ss.str();
+    }
+
+    // Features in their stored form, see ImageFeatures::encode. Empty when the
+    // pixels can not be described, e.g. the buffer is shorter than
+    // rows * cols * comps.
+    static std::string encodeImageFeatures(int rows, int cols, int comps, const std::vector<unsigned char> &data) {
+        if (rows <= 0 || cols <= 0 || comps <= 0) return std::string();
+        if (data.size() < static_cast<size_t>(rows) * cols * comps) return std::string();
+
+        ImageFeatures features;
+        if (!computeImageFeatures(data.data(), rows, cols, comps, features)) return std::string();
+
+        std::string encoded(ImageFeatures::ENCODED_BYTES, '\0');
+        features.encode(reinterpret_cast<unsigned char*>(&encoded[0]));
+        return encoded;
+    }
+
     static bool executeSQL(PGconn* conn, const std::string &sql, std::string &error_message) {
         bool ret = false;
         PGresult* res = PQexec(conn, sql.c_str());
@@ -149,8 +187,18 @@ namespace NJLIC {
         return true;
     }
 
+    static bool readMosaicImageBands(PGconn* conn, int project_id, MosaicImageKind kind, int band_rows, int rows, size_t stride, PixelBuffer &pixels, std::string& error_message);
+
+    // Sets img's pixels to the inflated bands of a banded image.
+    static bool setMosaicImageBands(PGconn* conn, int project_id, int band_rows, std::unique_ptr<IImageData> &img, std::string& error_message) {
+        PixelBuffer pixels;
+        if(!readMosaicImageBands(conn, project_id, MosaicImageKind::Target, band_rows, img->getRows(), static_cast<size_t>(img->getCols()) * img->getComps(), pixels, error_message))return false;
+        img->setData(std::vector<unsigned char>(pixels.data(), pixels.data() + pixels.size()));
+        return true;
+    }
+
     static bool readMosaicImage(PGconn* conn, int project_id, std::unique_ptr<IImageData> &img, std::string& error_message) {
-        const char* sql = "SELECT rows, cols, comps, data FROM mosaic_images WHERE project_id = $1";
+        const char* sql = "SELECT rows, cols, comps, data, band_rows FROM mosaic_images WHERE project_id = $1 AND kind = 0";
         const char* paramValues[1];
         std::string project_id_str = std::to_string(project_id);
         paramValues[0] = project_id_str.c_str();
@@ -188,6 +236,12 @@ namespace NJLIC {
 //        img->setData(data);
 
 
+        const int band_rows = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 4))));
+        if (band_rows > 0) {
+            PQclear(res);
+            return setMosaicImageBands(conn, project_id, band_rows, img, error_message);
+        }
+
         std::vector<unsigned char> data(PQgetlength(res, 0, 3));
         memcpy(data.data(), PQgetvalue(res, 0, 3), data.size());
 //        NJLIC::unsquish(data, PQgetlength(res, 0, 3));
@@ -198,8 +252,144 @@ namespace NJLIC {
         return true;
     }
 
+    static bool readMosaicImage(PGconn* conn, int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string& error_message) {
+        // The blob is only sent when the caller's version is stale.
+        const char* sql = "SELECT version, rows, cols, comps, CASE WHEN version = $2 THEN NULL ELSE data END, band_rows FROM mosaic_images WHERE project_id = $1 AND kind = 0";
+        std::string project_id_str = std::to_string(project_id);
+        std::string known_version_str = std::to_string(known_version);
+        const char* paramValues[2] = { project_id_str.c_str(), known_version_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image", sql);
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No mosaic image found for the given project ID.";
+            PQclear(res);
+            return false;
+        }
+
+        version = readInt64(PQgetvalue(res, 0, 0));
+        modified = version != known_version;
+        if (modified) {
+            img->setRows(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1))));
+            img->setCols(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2))));
+            img->setComps(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3))));
+
+            const int band_rows = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 5))));
+            if (band_rows > 0) {
+                PQclear(res);
+                return setMosaicImageBands(conn, project_id, band_rows, img, error_message);
+            }
+
+            const unsigned char* data_ptr = reinterpret_cast<const unsigned char*>(PQgetvalue(res, 0, 4));
+            img->setData(std::vector<unsigned char>(data_ptr, data_ptr + PQgetlength(res, 0, 4)));
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readMosaicImage(PGconn* conn, int project_id, MosaicImageKind kind, ImageBatch &batch, std::string& error_message) {
+        const char* sql = "SELECT id, rows, cols, comps, data, band_rows FROM mosaic_images WHERE project_id = $1 AND kind = $2";
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        const char* paramValues[2] = { project_id_str.c_str(), kind_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image", sql);
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No mosaic image found for the given project ID.";
+            PQclear(res);
+            return false;
+        }
+
+        uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 0)));
+        uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
+        uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
+        uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
+        int band_rows = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 5))));
+
+        batch.clear();
+        if (band_rows > 0) {
+            PQclear(res);
+            PixelBuffer pixels(batch.getAllocator());
+            if(!readMosaicImageBands(conn, project_id, kind, band_rows, rows, static_cast<size_t>(cols) * comps, pixels, error_message))return false;
+            batch.reserve(1, pixels.size(), 0);
+            batch.append(id, "", 0, rows, cols, comps, pixels.data(), pixels.size());
+            return true;
+        }
+        batch.reserve(1, PQgetlength(res, 0, 4), 0);
+        batch.append(id, "", 0, rows, cols, comps,
+                     reinterpret_cast<const unsigned char*>(PQgetvalue(res, 0, 4)), PQgetlength(res, 0, 4));
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readMosaicImage(PGconn* conn, int project_id, int64_t known_version, ImageBatch &batch, int64_t &version, bool &modified, std::string& error_message) {
+        // The blob is only sent when the caller's version is stale.
+        const char* sql = "SELECT id, rows, cols, comps, version, band_rows, CASE WHEN version = $2 THEN NULL ELSE data END FROM mosaic_images WHERE project_id = $1 AND kind = 0";
+        std::string project_id_str = std::to_string(project_id);
+        std::string known_version_str = std::to_string(known_version);
+        const char* paramValues[2] = { project_id_str.c_str(), known_version_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image", sql);
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No mosaic image found for the given project ID.";
+            PQclear(res);
+            return false;
+        }
+
+        version = readInt64(PQgetvalue(res, 0, 4));
+        modified = version != known_version;
+        if (!modified) {
+            PQclear(res);
+            return true;
+        }
+
+        uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 0)));
+        uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
+        uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
+        uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
+        int band_rows = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 5))));
+
+        batch.clear();
+        if (band_rows > 0) {
+            PQclear(res);
+            PixelBuffer pixels(batch.getAllocator());
+            if(!readMosaicImageBands(conn, project_id, MosaicImageKind::Target, band_rows, rows, static_cast<size_t>(cols) * comps, pixels, error_message))return false;
+            batch.reserve(1, pixels.size(), 0);
+            batch.append(id, "", 0, rows, cols, comps, pixels.data(), pixels.size());
+            return true;
+        }
+        batch.reserve(1, PQgetlength(res, 0, 6), 0);
+        batch.append(id, "", 0, rows, cols, comps,
+                     reinterpret_cast<const unsigned char*>(PQgetvalue(res, 0, 6)), PQgetlength(res, 0, 6));
+
+        PQclear(res);
+        return true;
+    }
+
     static bool updateMosaicImage(PGconn* conn, int project_id, const std::unique_ptr<IImageData> &img, std::string& error_message) {
-        const char* sql = "UPDATE mosaic_images SET rows = $1, cols = $2, comps = $3, data = $4 WHERE project_id = $5";
+        const char* sql = "UPDATE mosaic_images SET rows = $1, cols = $2, comps = $3, data = $4, version = nextval('mosaify_version_seq') WHERE project_id = $5 AND kind = 0";
         const char* paramValues[5];
         int paramLengths[5];
         int paramFormats[5] = {0, 0, 0, 1, 0}; // Fourth parameter (data) is binary
@@ -233,7 +423,7 @@ namespace NJLIC {
 
     static bool deleteMosaicImage(PGconn* conn, int project_id, std::string& error_message) {
         error_message="";
-        const char* sql = "DELETE FROM mosaic_images WHERE project_id = $1";
+        const char* sql = "DELETE FROM mosaic_images WHERE project_id = $1 AND kind = 0";
         const char* paramValues[1];
         std::string project_id_str = std::to_string(project_id);
         paramValues[0] = project_id_str.c_str();
@@ -251,8 +441,8 @@ namespace NJLIC {
     }
 
     static bool doesMosaicImageExist(PGconn* conn, int project_id, std::string& error_message) {
-        // Prepare the SQL query to count the number of images with the given project_id
-        const char* sql = "SELECT COUNT(*) FROM mosaic_images WHERE project_id = $1";
+        // EXISTS stops at the first matching row instead of counting them all
+        const char* sql = "SELECT EXISTS (SELECT 1 FROM mosaic_images WHERE project_id = $1 AND kind = 0)";
         const char* paramValues[1];
         std::string project_id_str = std::to_string(project_id);
         paramValues[0] = project_id_str.c_str();
@@ -267,12 +457,38 @@ namespace NJLIC {
             return false; // Error case
         }
 
-        // Get the count result
-        int count = std::stoi(PQgetvalue(res, 0, 0));
+        bool exists = 't' == PQgetvalue(res, 0, 0)[0];
         PQclear(res);
 
-        // Return true if at least one image exists for the given project_id
-        return count > 0;
+        return exists;
+    }
+
+    static bool doesMosaicImageExist(PGconn* conn, const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message) {
+        // One probe per project, answered in input order, in a single round trip
+        const char* sql = R"(
+            SELECT EXISTS (SELECT 1 FROM mosaic_images m WHERE m.project_id = p.id AND m.kind = 0)
+            FROM unnest($1::int[]) WITH ORDINALITY AS p(id, ord)
+            ORDER BY p.ord
+        )";
+        std::string project_ids_str = toArrayLiteral(project_ids);
+        const char* paramValues[1] = { project_ids_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Does Mosaic Image Exist", sql);
+            PQclear(res);
+            return false;
+        }
+
+        int num_rows = PQntuples(res);
+        exists.assign(num_rows, false);
+        for (int i = 0; i < num_rows; ++i) {
+            exists[i] = 't' == PQgetvalue(res, i, 0)[0];
+        }
+
+        PQclear(res);
+        return true;
     }
 
 
@@ -314,39 +530,63 @@ namespace NJLIC {
             return false;
         }
 
+        // Maps written through the MosaicMap overloads only have map_bin.
+        if (PQgetisnull(res, 0, 0)) {
+            error_message = "Mosaic map is not stored in the text format.";
+            PQclear(res);
+            return false;
+        }
+
         mosaic_map = std::string(PQgetvalue(res, 0, 0));
 
         PQclear(res);
         return true;
     }
 
-    static bool updateMosaicMap(PGconn* conn, int project_id, const std::string& mosaic_map, std::string &error_message) {
-        const char* sql = "UPDATE mosaic_maps SET map = $1 WHERE project_id = $2";
+    static bool readMosaicMap(PGconn* conn, int project_id, int64_t known_version, std::string& mosaic_map, int64_t &version, bool &modified, std::string &error_message) {
+        const char* sql = "SELECT version, CASE WHEN version = $2 THEN NULL ELSE map END, map IS NULL FROM mosaic_maps WHERE project_id = $1";
         std::string project_id_str = std::to_string(project_id);
-        const char* paramValues[2] = { std::to_string(project_id).c_str(), mosaic_map.c_str() };
+        std::string known_version_str = std::to_string(known_version);
+        const char* paramValues[2] = { project_id_str.c_str(), known_version_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Update Mosaic Map", sql);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Map", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            return false;
+        }
 
+        version = readInt64(PQgetvalue(res, 0, 0));
+        modified = version != known_version;
+        if (PQgetvalue(res, 0, 2)[0]) {
+            error_message = "Mosaic map is not stored in the text format.";
             PQclear(res);
             return false;
         }
+        if (modified) {
+            mosaic_map.assign(PQgetvalue(res, 0, 1), PQgetlength(res, 0, 1));
+        }
 
         PQclear(res);
         return true;
     }
 
-    static bool deleteMosaicMap(PGconn* conn, int project_id, std::string &error_message) {
-        const char* sql = "DELETE FROM mosaic_maps WHERE project_id = $1";
+    static bool updateMosaicMap(PGconn* conn, int project_id, const std::string& mosaic_map, std::string &error_message) {
+        const char* sql = "UPDATE mosaic_maps SET map = $1, version = nextval('mosaify_version_seq') WHERE project_id = $2";
         std::string project_id_str = std::to_string(project_id);
-        const char* paramValues[1] = { project_id_str.c_str() };
+        const char* paramValues[2] = { mosaic_map.c_str(), project_id_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Delete Mosaic Map", sql);
+            error_message = HANDLE_ERROR(conn, "Update Mosaic Map", sql);
 
             PQclear(res);
             return false;
@@ -356,63 +596,76 @@ namespace NJLIC {
         return true;
     }
 
-    static bool doesMosaicMapExist(PGconn* conn, int project_id, std::string& error_message) {
-        // Prepare the SQL query to count the number of images with the given project_id
-        const char* sql = "SELECT COUNT(*) FROM mosaic_maps WHERE project_id = $1";
-        const char* paramValues[1];
+    // Binary mosaic maps live in the map_bin column added by migration 2. An
+    // update clears the legacy text map so the two never disagree.
+    static bool createMosaicMap(PGconn* conn, int project_id, const MosaicMap& mosaic_map, std::string &error_message) {
+        const char* sql = "INSERT INTO mosaic_maps (project_id, map_bin) VALUES ($1, $2) RETURNING id";
+
+        std::vector<unsigned char> encoded;
+        if(!mosaic_map.encode(encoded, error_message))return false;
+
         std::string project_id_str = std::to_string(project_id);
-        paramValues[0] = project_id_str.c_str();
+        const char* paramValues[2] = { project_id_str.c_str(), reinterpret_cast<const char*>(encoded.data()) };
+        int paramLengths[2] = { 0, static_cast<int>(encoded.size()) };
+        int paramFormats[2] = { 0, 1 }; // Map is binary
 
-        // Execute the query
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, paramLengths, paramFormats, 0);
 
-        // Handle query result
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = PQerrorMessage(conn);
+            error_message = HANDLE_ERROR(conn, "Create Mosaic Map", sql);
             PQclear(res);
-            return false; // Error case
+            return false;
         }
 
-        // Get the count result
-        int count = std::stoi(PQgetvalue(res, 0, 0));
         PQclear(res);
-
-        // Return true if at least one image exists for the given map_id
-        return count > 0;
+        return true;
     }
 
+    static bool decodeMosaicMap(PGresult* res, int row, int column, MosaicMap& mosaic_map, std::string &error_message) {
+        if (PQgetisnull(res, row, column)) {
+            error_message = "Mosaic map is not stored in the binary format.";
+            return false;
+        }
 
+        // Decode straight out of the result buffer.
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(PQgetvalue(res, row, column));
+        return mosaic_map.decode(data, PQgetlength(res, row, column), error_message);
+    }
 
+    static bool readMosaicMap(PGconn* conn, int project_id, MosaicMap& mosaic_map, std::string &error_message) {
+        const char* sql = "SELECT map_bin FROM mosaic_maps WHERE project_id = $1";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
 
-
-    static bool createProject(PGconn* conn, int user_id, const std::string& project_name, int &project_id, std::string &error_message) {
-        const char* sql = "INSERT INTO projecttable (user_id, project_name) VALUES ($1, $2) RETURNING id";
-        std::string user_id_str = std::to_string(user_id);
-        const char* paramValues[2] = { user_id_str.c_str(), project_name.c_str() };
-
-        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Create Project", sql);
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Map", sql);
 
             PQclear(res);
             return false;
         }
 
-        project_id = std::stoi(PQgetvalue(res, 0, 0));
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            return false;
+        }
+
+        bool ok = decodeMosaicMap(res, 0, 0, mosaic_map, error_message);
         PQclear(res);
-        return true;
+        return ok;
     }
 
-    static bool readProject(PGconn* conn, int project_id, int &user_id, std::string &project_name, std::string &error_message) {
-        const char* sql = "SELECT user_id, project_name FROM projecttable WHERE id = $1";
+    static bool readMosaicMap(PGconn* conn, int project_id, int64_t known_version, MosaicMap& mosaic_map, int64_t &version, bool &modified, std::string &error_message) {
+        const char* sql = "SELECT version, CASE WHEN version = $2 THEN NULL ELSE map_bin END, map_bin IS NULL FROM mosaic_maps WHERE project_id = $1";
         std::string project_id_str = std::to_string(project_id);
-        const char* paramValues[1] = { project_id_str.c_str() };
+        std::string known_version_str = std::to_string(known_version);
+        const char* paramValues[2] = { project_id_str.c_str(), known_version_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Project", sql);
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Map", sql);
 
             PQclear(res);
             return false;
@@ -423,22 +676,36 @@ namespace NJLIC {
             return false;
         }
 
-        user_id = std::stoi(PQgetvalue(res, 0, 0));
-        project_name = PQgetvalue(res, 0, 1);
+        version = readInt64(PQgetvalue(res, 0, 0));
+        modified = version != known_version;
+
+        bool ok = true;
+        if (modified) {
+            ok = decodeMosaicMap(res, 0, 1, mosaic_map, error_message);
+        } else if (PQgetvalue(res, 0, 2)[0]) {
+            error_message = "Mosaic map is not stored in the binary format.";
+            ok = false;
+        }
 
         PQclear(res);
-        return true;
+        return ok;
     }
 
-    static bool updateProject(PGconn* conn, int project_id, const std::string& new_project_name, std::string &error_message) {
-        const char* sql = "UPDATE projecttable SET project_name = $1 WHERE id = $2";
+    static bool updateMosaicMap(PGconn* conn, int project_id, const MosaicMap& mosaic_map, std::string &error_message) {
+        const char* sql = "UPDATE mosaic_maps SET map_bin = $1, map = NULL, version = nextval('mosaify_version_seq') WHERE project_id = $2";
+
+        std::vector<unsigned char> encoded;
+        if(!mosaic_map.encode(encoded, error_message))return false;
+
         std::string project_id_str = std::to_string(project_id);
-        const char* paramValues[2] = { new_project_name.c_str(), project_id_str.c_str() };
+        const char* paramValues[2] = { reinterpret_cast<const char*>(encoded.data()), project_id_str.c_str() };
+        int paramLengths[2] = { static_cast<int>(encoded.size()), 0 };
+        int paramFormats[2] = { 1, 0 }; // Map is binary
 
-        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, paramLengths, paramFormats, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Update Project", sql);
+            error_message = HANDLE_ERROR(conn, "Update Mosaic Map", sql);
 
             PQclear(res);
             return false;
@@ -448,129 +715,508 @@ namespace NJLIC {
         return true;
     }
 
-    static bool deleteProject(PGconn* conn, int project_id, std::string &error_message) {
-        const char* sql = "DELETE FROM projecttable WHERE id = $1";
+    // Upserts rely on the unique indexes from migrations 3 and 5 and do the
+    // existence check, insert or update in a single statement.
+    static bool upsertMosaicImage(PGconn* conn, int project_id, const std::unique_ptr<IImageData> &img, int &image_id, std::string &error_message) {
+        const char* sql = R"(
+            WITH b AS (
+                DELETE FROM mosaic_image_bands WHERE project_id = $1 AND kind = 0
+            )
+            INSERT INTO mosaic_images (project_id, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5)
+            ON CONFLICT (project_id, kind) DO UPDATE
+            SET rows = EXCLUDED.rows, cols = EXCLUDED.cols, comps = EXCLUDED.comps, data = EXCLUDED.data, band_rows = 0, version = nextval('mosaify_version_seq')
+            RETURNING id
+        )";
+
         std::string project_id_str = std::to_string(project_id);
-        const char* paramValues[1] = { project_id_str.c_str() };
+        std::string rows_str = std::to_string(img->getRows());
+        std::string cols_str = std::to_string(img->getCols());
+        std::string comps_str = std::to_string(img->getComps());
+        const std::vector<unsigned char> &data = img->getData();
 
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        const char* paramValues[5] = { project_id_str.c_str(), rows_str.c_str(), cols_str.c_str(), comps_str.c_str(), reinterpret_cast<const char*>(data.data()) };
+        int paramLengths[5] = { 0, 0, 0, 0, static_cast<int>(data.size()) };
+        int paramFormats[5] = { 0, 0, 0, 0, 1 }; // Last parameter (data) is binary
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Delete Project", sql);
+        PGresult* res = PQexecParams(conn, sql, 5, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Upsert Mosaic Image", sql);
 
             PQclear(res);
             return false;
         }
 
+        image_id = std::stoi(PQgetvalue(res, 0, 0));
         PQclear(res);
         return true;
     }
 
-    static bool readImages(PGconn *conn, int project_id, std::vector<std::unique_ptr<IImageData>>& images, const std::function<std::unique_ptr<IImageData>()>& createImageFunc, std::vector<int> &image_ids, std::string &error_message) {
-        // Prepare the SQL query
-        const char* sql = "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = $1";
-        const char* paramValues[1];
+    static bool upsertMosaicImage(PGconn* conn, int project_id, MosaicImageKind kind, int rows, int cols, int comps, const unsigned char* data, size_t size, int &image_id, std::string &error_message) {
+        const char* sql = R"(
+            WITH b AS (
+                DELETE FROM mosaic_image_bands WHERE project_id = $1 AND kind = $2
+            )
+            INSERT INTO mosaic_images (project_id, kind, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5, $6)
+            ON CONFLICT (project_id, kind) DO UPDATE
+            SET rows = EXCLUDED.rows, cols = EXCLUDED.cols, comps = EXCLUDED.comps, data = EXCLUDED.data, band_rows = 0, version = nextval('mosaify_version_seq')
+            RETURNING id
+        )";
+
         std::string project_id_str = std::to_string(project_id);
-        paramValues[0] = project_id_str.c_str();
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        std::string rows_str = std::to_string(rows);
+        std::string cols_str = std::to_string(cols);
+        std::string comps_str = std::to_string(comps);
 
-        // Execute the query
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
+        const char* paramValues[6] = { project_id_str.c_str(), kind_str.c_str(), rows_str.c_str(), cols_str.c_str(), comps_str.c_str(), reinterpret_cast<const char*>(data) };
+        int paramLengths[6] = { 0, 0, 0, 0, 0, static_cast<int>(size) };
+        int paramFormats[6] = { 0, 0, 0, 0, 0, 1 }; // Last parameter (data) is binary
+
+        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, paramLengths, paramFormats, 0);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Images", sql);
+            error_message = HANDLE_ERROR(conn, "Upsert Mosaic Image", sql);
+
             PQclear(res);
-            return false; // Return an empty vector on error
+            return false;
         }
 
-        // Process the results
-        int num_rows = PQntuples(res);
-        for (int i = 0; i < num_rows; ++i) {
+        image_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
 
-            auto img = createImageFunc();
+    static bool readMosaicImageInfo(PGconn* conn, int project_id, MosaicImageKind kind, int &rows, int &cols, int &comps, int &band_rows, std::string &error_message) {
+        const char* sql = "SELECT rows, cols, comps, band_rows FROM mosaic_images WHERE project_id = $1 AND kind = $2";
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        const char* paramValues[2] = { project_id_str.c_str(), kind_str.c_str() };
 
-            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
-            std::string filename = PQgetvalue(res, i, 1);
-            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
-            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
-            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
-            std::vector<unsigned char> data(PQgetlength(res, i, 5));
-            memcpy(data.data(), PQgetvalue(res, i, 5), data.size());
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
-            img->setFilename(filename);
-            img->setRows(rows);
-            img->setCols(cols);
-            img->setComps(comps);
-            img->setData(data);
-            img->setId(id);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image Info", sql);
+            PQclear(res);
+            return false;
+        }
 
-            images.push_back(std::move(img));
-            image_ids.push_back(id);
+        rows = cols = comps = band_rows = 0;
+        if (PQntuples(res) > 0) {
+            rows = std::stoi(PQgetvalue(res, 0, 0));
+            cols = std::stoi(PQgetvalue(res, 0, 1));
+            comps = std::stoi(PQgetvalue(res, 0, 2));
+            band_rows = std::stoi(PQgetvalue(res, 0, 3));
+        }
+        PQclear(res);
+        return true;
+    }
+
+    // Starts a banded image: the mosaic_images row keeps the size and band
+    // height with no pixels, and any previous bands are dropped.
+    static bool createMosaicImageBands(PGconn* conn, int project_id, MosaicImageKind kind, int rows, int cols, int comps, int band_rows, int &image_id, std::string &error_message) {
+        const char* sql = R"(
+            WITH b AS (
+                DELETE FROM mosaic_image_bands WHERE project_id = $1 AND kind = $2
+            )
+            INSERT INTO mosaic_images (project_id, kind, rows, cols, comps, band_rows, data) VALUES ($1, $2, $3, $4, $5, $6, ''::bytea)
+            ON CONFLICT (project_id, kind) DO UPDATE
+            SET rows = EXCLUDED.rows, cols = EXCLUDED.cols, comps = EXCLUDED.comps, band_rows = EXCLUDED.band_rows, data = EXCLUDED.data, version = nextval('mosaify_version_seq')
+            RETURNING id
+        )";
+
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        std::string rows_str = std::to_string(rows);
+        std::string cols_str = std::to_string(cols);
+        std::string comps_str = std::to_string(comps);
+        std::string band_rows_str = std::to_string(band_rows);
+        const char* paramValues[6] = { project_id_str.c_str(), kind_str.c_str(), rows_str.c_str(), cols_str.c_str(), comps_str.c_str(), band_rows_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Create Mosaic Image Bands", sql);
+            PQclear(res);
+            return false;
         }
 
+        image_id = std::stoi(PQgetvalue(res, 0, 0));
         PQclear(res);
         return true;
     }
 
-    static bool createUser(PGconn* conn, const std::string& email, const std::string& first_name, const std::string& last_name, int &user_id, std::string &error_message) {
-        const char* sql = "INSERT INTO usertable (email, first_name, last_name) VALUES ($1, $2, $3) RETURNING id";
-        const char* paramValues[3] = { email.c_str(), first_name.c_str(), last_name.c_str() };
+    // Stores one band; fails unless the image is banded. The version is left
+    // alone: createMosaicImageBands or finishMosaicImageBands moves it once.
+    static bool writeMosaicImageBand(PGconn* conn, int project_id, MosaicImageKind kind, const MosaicImageBand &band, std::string &error_message) {
+        const char* sql = R"(
+            INSERT INTO mosaic_image_bands (project_id, kind, band, size, data)
+            SELECT $1, $2, $3, $4, $5 WHERE EXISTS (SELECT 1 FROM mosaic_images WHERE project_id = $1 AND kind = $2 AND band_rows > 0)
+            ON CONFLICT (project_id, kind, band) DO UPDATE SET size = EXCLUDED.size, data = EXCLUDED.data
+        )";
 
-        PGresult* res = PQexecParams(conn, sql, 3, nullptr, paramValues, nullptr, nullptr, 0);
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        std::string band_str = std::to_string(band.band);
+        std::string size_str = std::to_string(band.size);
+        const char* paramValues[5] = { project_id_str.c_str(), kind_str.c_str(), band_str.c_str(), size_str.c_str(), reinterpret_cast<const char*>(band.data.data()) };
+        int paramLengths[5] = { 0, 0, 0, 0, static_cast<int>(band.data.size()) };
+        int paramFormats[5] = { 0, 0, 0, 0, 1 }; // Last parameter (data) is binary
+
+        PGresult* res = PQexecParams(conn, sql, 5, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Write Mosaic Image Band", sql);
+            PQclear(res);
+            return false;
+        }
+
+        const bool updated = 0 != strcmp(PQcmdTuples(res), "0");
+        PQclear(res);
+        if (!updated) {
+            error_message = "No banded mosaic image found for project " + std::to_string(project_id) + ".";
+            return false;
+        }
+        return true;
+    }
+
+    // Moves a banded image to a new version once bands were rewritten in place.
+    static bool finishMosaicImageBands(PGconn* conn, int project_id, MosaicImageKind kind, std::string &error_message) {
+        const char* sql = "UPDATE mosaic_images SET version = nextval('mosaify_version_seq') WHERE project_id = $1 AND kind = $2 AND band_rows > 0";
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        const char* paramValues[2] = { project_id_str.c_str(), kind_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Finish Mosaic Image Bands", sql);
+            PQclear(res);
+            return false;
+        }
+
+        const bool updated = 0 != strcmp(PQcmdTuples(res), "0");
+        PQclear(res);
+        if (!updated) {
+            error_message = "No banded mosaic image found for project " + std::to_string(project_id) + ".";
+            return false;
+        }
+        return true;
+    }
+
+    static bool decodeMosaicImageBand(const unsigned char* data, size_t size, unsigned char* pixels, size_t pixel_bytes, std::string &error_message) {
+        uLongf decoded = pixel_bytes;
+        const int result = uncompress(pixels, &decoded, data, size);
+        if (Z_OK != result || decoded != pixel_bytes) {
+            error_message = "Corrupt mosaic image band (" + NJLIC::get_reason(result) + ").";
+            return false;
+        }
+        return true;
+    }
+
+    static bool readMosaicImageBand(PGconn* conn, int project_id, MosaicImageKind kind, int band, PixelBuffer &pixels, std::string &error_message) {
+        const char* sql = "SELECT size, data FROM mosaic_image_bands WHERE project_id = $1 AND kind = $2 AND band = $3";
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        std::string band_str = std::to_string(band);
+        const char* paramValues[3] = { project_id_str.c_str(), kind_str.c_str(), band_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 3, nullptr, paramValues, nullptr, nullptr, 1);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Create User", sql);
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image Band", sql);
             PQclear(res);
+            return false;
+        }
 
+        if (PQntuples(res) == 0) {
+            error_message = "Mosaic image band " + std::to_string(band) + " not found for project " + std::to_string(project_id) + ".";
+            PQclear(res);
             return false;
         }
 
-        user_id = std::stoi(PQgetvalue(res, 0, 0));
+        pixels.resize(static_cast<size_t>(readInt64(PQgetvalue(res, 0, 0))));
+        const bool decoded = decodeMosaicImageBand(reinterpret_cast<const unsigned char*>(PQgetvalue(res, 0, 1)), PQgetlength(res, 0, 1), pixels.data(), pixels.size(), error_message);
+        PQclear(res);
+        return decoded;
+    }
+
+    // Inflates every band of a banded image into pixels, one band row at a time.
+    static bool readMosaicImageBands(PGconn* conn, int project_id, MosaicImageKind kind, int band_rows, int rows, size_t stride, PixelBuffer &pixels, std::string& error_message) {
+        const char* sql = "SELECT band, size, data FROM mosaic_image_bands WHERE project_id = $1 AND kind = $2 ORDER BY band";
+        std::string project_id_str = std::to_string(project_id);
+        std::string kind_str = std::to_string(static_cast<int>(kind));
+        const char* paramValues[2] = { project_id_str.c_str(), kind_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Mosaic Image Bands", sql);
+            PQclear(res);
+            return false;
+        }
+
+        const int num_bands = (rows + band_rows - 1) / band_rows;
+        if (PQntuples(res) != num_bands) {
+            error_message = "Mosaic image of project " + std::to_string(project_id) + " is missing bands.";
+            PQclear(res);
+            return false;
+        }
+
+        pixels.resize(stride * rows);
+        for (int i = 0; i < num_bands; ++i) {
+            const int band = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0))));
+            const size_t offset = static_cast<size_t>(band) * band_rows * stride;
+            const size_t size = static_cast<size_t>(readInt64(PQgetvalue(res, i, 1)));
+            if (band != i || offset + size > pixels.size() ||
+                !decodeMosaicImageBand(reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 2)), PQgetlength(res, i, 2), pixels.data() + offset, size, error_message)) {
+                if (error_message.empty()) error_message = "Mosaic image band " + std::to_string(band) + " does not fit the image.";
+                PQclear(res);
+                return false;
+            }
+        }
+
         PQclear(res);
         return true;
     }
 
-    static bool readUser(PGconn* conn, const std::string& email, int &id, std::string &error_message) {
+    // Overwrites byte ranges of the stored pixels in one statement; data holds
+    // the replacement ranges back to back. The new value is assembled in one
+    // pass from the untouched slices and the replacements, rather than copied
+    // once per range.
+    static bool patchMosaicImage(PGconn* conn, int project_id, MosaicImageKind kind, const unsigned char* data, const std::vector<size_t> &offsets, const std::vector<size_t> &sizes, std::string &error_message) {
+        if (offsets.size() != sizes.size()) {
+            error_message = "Patch offsets and sizes differ in length.";
+            return false;
+        }
+        if (offsets.empty()) return true;
+        for (size_t i = 1; i < offsets.size(); ++i) {
+            if (offsets[i] < offsets[i - 1] + sizes[i - 1]) {
+                error_message = "Patch ranges must be ascending and must not overlap.";
+                return false;
+            }
+        }
 
-        // Prepare the query with parameterized input to prevent SQL injection
-        const char* sql = "SELECT id FROM usertable WHERE email = $1";
-        const char* paramValues[1] = { email.c_str() };
+        std::vector<std::string> strings;
+        std::vector<const char*> paramValues;
+        std::vector<int> paramLengths;
+        std::vector<int> paramFormats;
+        strings.reserve(4 + offsets.size() * 3);
+
+        auto addText = [&](const std::string &value) {
+            strings.push_back(value);
+            paramValues.push_back(nullptr);
+            paramLengths.push_back(0);
+            paramFormats.push_back(0);
+            return paramValues.size();
+        };
+        addText(std::to_string(project_id));
+        addText(std::to_string(static_cast<int>(kind)));
+
+        std::string pieces;
+        int piece = 0;
+        auto addPiece = [&](const std::string &expression) {
+            pieces += (pieces.empty() ? "(" : ", (") + std::to_string(piece++) + ", " + expression + ")";
+        };
+
+        size_t position = 0;
+        size_t end = 0; // Of the previous range in the stored image
+        for (size_t i = 0; i < offsets.size(); ++i) {
+            if (offsets[i] > end) {
+                const size_t from_param = addText(std::to_string(end + 1)); // substring() is 1-based
+                const size_t for_param = addText(std::to_string(offsets[i] - end));
+                addPiece("substring(m.data from $" + std::to_string(from_param) + "::int for $" + std::to_string(for_param) + "::int)");
+            }
+            paramValues.push_back(reinterpret_cast<const char*>(data + position));
+            paramLengths.push_back(static_cast<int>(sizes[i]));
+            paramFormats.push_back(1);
+            strings.push_back(std::string());
+            addPiece("$" + std::to_string(paramValues.size()) + "::bytea");
+            position += sizes[i];
+            end = offsets[i] + sizes[i];
+        }
+        const size_t tail_param = addText(std::to_string(end + 1));
+        addPiece("substring(m.data from $" + std::to_string(tail_param) + "::int)");
+        const size_t end_param = addText(std::to_string(end));
+        for (size_t i = 0; i < strings.size(); ++i) {
+            if (nullptr == paramValues[i]) paramValues[i] = strings[i].c_str();
+        }
 
-        // Execute the sql
-        PGresult* res = PQexecParams(conn,
-                                     sql,
-                                     1,          // number of parameters
-                                     nullptr,    // parameter types (let PostgreSQL infer)
-                                     paramValues,
-                                     nullptr,    // parameter lengths
-                                     nullptr,    // parameter formats
-                                     0);         // result format (text)
+        const std::string sql = "UPDATE mosaic_images m SET data = (SELECT string_agg(p.piece, ''::bytea ORDER BY p.n) FROM (VALUES " + pieces +
+                                ") AS p(n, piece)), version = nextval('mosaify_version_seq') WHERE m.project_id = $1 AND m.kind = $2 AND m.band_rows = 0 AND octet_length(m.data) >= $" +
+                                std::to_string(end_param) + "::bigint";
+        PGresult* res = PQexecParams(conn, sql.c_str(), static_cast<int>(paramValues.size()), nullptr, paramValues.data(), paramLengths.data(), paramFormats.data(), 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Patch Mosaic Image", sql.c_str());
+            PQclear(res);
+            return false;
+        }
+
+        const bool updated = 0 != strcmp(PQcmdTuples(res), "0");
+        PQclear(res);
+        if (!updated) {
+            error_message = "Mosaic image not found for project " + std::to_string(project_id) + ", or it is stored in bands, or the ranges run past its end.";
+            return false;
+        }
+        return true;
+    }
+
+    static bool upsertMosaicMap(PGconn* conn, int project_id, const std::string& mosaic_map, int &map_id, std::string &error_message) {
+        const char* sql = R"(
+            INSERT INTO mosaic_maps (project_id, map) VALUES ($1, $2)
+            ON CONFLICT (project_id) DO UPDATE
+            SET map = EXCLUDED.map, map_bin = NULL, version = nextval('mosaify_version_seq')
+            RETURNING id
+        )";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { project_id_str.c_str(), mosaic_map.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Get User", sql);
+            error_message = HANDLE_ERROR(conn, "Upsert Mosaic Map", sql);
+
             PQclear(res);
-            return false; // Return an empty vector on error
+            return false;
         }
 
-        // Check if we got a result
-        if (PQntuples(res) > 0) {
-            // Get the ID from the first row, first column
-            char* idStr = PQgetvalue(res, 0, 0);
-            id = std::stoi(idStr);
+        map_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
+
+    static bool upsertMosaicMap(PGconn* conn, int project_id, const MosaicMap& mosaic_map, int &map_id, std::string &error_message) {
+        const char* sql = R"(
+            INSERT INTO mosaic_maps (project_id, map_bin) VALUES ($1, $2)
+            ON CONFLICT (project_id) DO UPDATE
+            SET map_bin = EXCLUDED.map_bin, map = NULL, version = nextval('mosaify_version_seq')
+            RETURNING id
+        )";
+
+        std::vector<unsigned char> encoded;
+        if(!mosaic_map.encode(encoded, error_message))return false;
+
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { project_id_str.c_str(), reinterpret_cast<const char*>(encoded.data()) };
+        int paramLengths[2] = { 0, static_cast<int>(encoded.size()) };
+        int paramFormats[2] = { 0, 1 }; // Map is binary
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Upsert Mosaic Map", sql);
+
+            PQclear(res);
+            return false;
         }
 
+        map_id = std::stoi(PQgetvalue(res, 0, 0));
         PQclear(res);
         return true;
     }
 
-    static bool readUser(PGconn *conn, int user_id, std::string& email, std::string& first_name, std::string& last_name, std::string &error_message) {
-        const char* sql = "SELECT email, first_name, last_name FROM usertable WHERE id = $1";
+    static bool deleteMosaicMap(PGconn* conn, int project_id, std::string &error_message) {
+        const char* sql = "DELETE FROM mosaic_maps WHERE project_id = $1";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Delete Mosaic Map", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool doesMosaicMapExist(PGconn* conn, int project_id, std::string& error_message) {
+        // EXISTS stops at the first matching row instead of counting them all
+        const char* sql = "SELECT EXISTS (SELECT 1 FROM mosaic_maps WHERE project_id = $1)";
+        const char* paramValues[1];
+        std::string project_id_str = std::to_string(project_id);
+        paramValues[0] = project_id_str.c_str();
+
+        // Execute the query
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        // Handle query result
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = PQerrorMessage(conn);
+            PQclear(res);
+            return false; // Error case
+        }
+
+        bool exists = 't' == PQgetvalue(res, 0, 0)[0];
+        PQclear(res);
+
+        return exists;
+    }
+
+    static bool doesMosaicMapExist(PGconn* conn, const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message) {
+        // One probe per project, answered in input order, in a single round trip
+        const char* sql = R"(
+            SELECT EXISTS (SELECT 1 FROM mosaic_maps m WHERE m.project_id = p.id)
+            FROM unnest($1::int[]) WITH ORDINALITY AS p(id, ord)
+            ORDER BY p.ord
+        )";
+        std::string project_ids_str = toArrayLiteral(project_ids);
+        const char* paramValues[1] = { project_ids_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Does Mosaic Map Exist", sql);
+            PQclear(res);
+            return false;
+        }
+
+        int num_rows = PQntuples(res);
+        exists.assign(num_rows, false);
+        for (int i = 0; i < num_rows; ++i) {
+            exists[i] = 't' == PQgetvalue(res, i, 0)[0];
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+
+
+
+
+    static bool createProject(PGconn* conn, int user_id, const std::string& project_name, int &project_id, std::string &error_message) {
+        const char* sql = "INSERT INTO projecttable (user_id, project_name) VALUES ($1, $2) RETURNING id";
         std::string user_id_str = std::to_string(user_id);
-        const char* paramValues[1] = { user_id_str.c_str() };
+        const char* paramValues[2] = { user_id_str.c_str(), project_name.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Create Project", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        project_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
+
+    static bool readProject(PGconn* conn, int project_id, int &user_id, std::string &project_name, std::string &error_message) {
+        const char* sql = "SELECT user_id, project_name FROM projecttable WHERE id = $1";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
 
         PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read User", sql);
+            error_message = HANDLE_ERROR(conn, "Read Project", sql);
 
             PQclear(res);
             return false;
@@ -581,23 +1227,902 @@ namespace NJLIC {
             return false;
         }
 
-        email = PQgetvalue(res, 0, 0);
-        first_name = PQgetvalue(res, 0, 1);
-        last_name = PQgetvalue(res, 0, 2);
+        user_id = std::stoi(PQgetvalue(res, 0, 0));
+        project_name = PQgetvalue(res, 0, 1);
 
         PQclear(res);
         return true;
     }
 
-    static bool updateUser(PGconn* conn, int user_id, const std::string& new_email, const std::string& new_first_name, const std::string& new_last_name, std::string &error_message) {
-        const char* sql = "UPDATE usertable SET email = $1, first_name = $2, last_name = $3 WHERE id = $4";
-        std::string user_id_str = std::to_string(user_id);
-        const char* paramValues[4] = { new_email.c_str(), new_first_name.c_str(), new_last_name.c_str(), user_id_str.c_str() };
+    static bool updateProject(PGconn* conn, int project_id, const std::string& new_project_name, std::string &error_message) {
+        const char* sql = "UPDATE projecttable SET project_name = $1 WHERE id = $2";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { new_project_name.c_str(), project_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Update Project", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool deleteProject(PGconn* conn, int project_id, std::string &error_message) {
+        const char* sql = "DELETE FROM projecttable WHERE id = $1";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Delete Project", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readImages(PGconn *conn, int project_id, std::vector<std::unique_ptr<IImageData>>& images, const std::function<std::unique_ptr<IImageData>()>& createImageFunc, std::vector<int> &image_ids, std::string &error_message) {
+        // Prepare the SQL query
+        const char* sql = "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = $1";
+        const char* paramValues[1];
+        std::string project_id_str = std::to_string(project_id);
+        paramValues[0] = project_id_str.c_str();
+
+        // Execute the query
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Images", sql);
+            PQclear(res);
+            return false; // Return an empty vector on error
+        }
+
+        // Process the results
+        int num_rows = PQntuples(res);
+        for (int i = 0; i < num_rows; ++i) {
+
+            auto img = createImageFunc();
+
+            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            std::string filename = PQgetvalue(res, i, 1);
+            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+            std::vector<unsigned char> data(PQgetlength(res, i, 5));
+            memcpy(data.data(), PQgetvalue(res, i, 5), data.size());
+
+            img->setFilename(filename);
+            img->setRows(rows);
+            img->setCols(cols);
+            img->setComps(comps);
+            img->setData(data);
+            img->setId(id);
+
+            images.push_back(std::move(img));
+            image_ids.push_back(id);
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readImages(PGconn *conn, int project_id, ImageBatch &batch, std::string &error_message) {
+        const char* sql = "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = $1";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Images", sql);
+            PQclear(res);
+            return false;
+        }
+
+        // Size the batch up front so the whole result lands in one pixel allocation.
+        int num_rows = PQntuples(res);
+        size_t pixel_bytes = 0;
+        size_t filename_bytes = 0;
+        for (int i = 0; i < num_rows; ++i) {
+            filename_bytes += PQgetlength(res, i, 1);
+            pixel_bytes += PQgetlength(res, i, 5);
+        }
+
+        batch.clear();
+        batch.reserve(num_rows, pixel_bytes, filename_bytes);
+
+        for (int i = 0; i < num_rows; ++i) {
+            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+
+            batch.append(id,
+                         PQgetvalue(res, i, 1), PQgetlength(res, i, 1),
+                         rows, cols, comps,
+                         reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 5)), PQgetlength(res, i, 5));
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readImages(PGconn *conn, int project_id, const std::vector<int> &image_ids, ImageBatch &batch, std::string &error_message) {
+        const char* sql = "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = $1 AND id = ANY($2::int[])";
+        std::string project_id_str = std::to_string(project_id);
+        std::string image_ids_str = toArrayLiteral(image_ids);
+        const char* paramValues[2] = { project_id_str.c_str(), image_ids_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Images", sql);
+            PQclear(res);
+            return false;
+        }
+
+        int num_rows = PQntuples(res);
+        size_t pixel_bytes = 0;
+        size_t filename_bytes = 0;
+        for (int i = 0; i < num_rows; ++i) {
+            filename_bytes += PQgetlength(res, i, 1);
+            pixel_bytes += PQgetlength(res, i, 5);
+        }
+
+        batch.clear();
+        batch.reserve(num_rows, pixel_bytes, filename_bytes);
+
+        for (int i = 0; i < num_rows; ++i) {
+            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+
+            batch.append(id,
+                         PQgetvalue(res, i, 1), PQgetlength(res, i, 1),
+                         rows, cols, comps,
+                         reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 5)), PQgetlength(res, i, 5));
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readImageLevels(PGconn *conn, int project_id, const std::vector<int> &image_ids, const std::vector<int> &roi_ids, int width, int height,
+                                const std::vector<int64_t> &known_versions,
+                                ImageBatch &batch, std::vector<int> &batch_roi_ids, std::vector<int64_t> &versions, std::vector<ImageLevelState> &states, std::string &error_message) {
+        // Per requested (image, ROI): nothing if the caller's copy is current, else
+        // the stored level if it was scaled from the current version, else the
+        // original. The original is sent with the first such row of an image only.
+        const char* sql = R"(
+            WITH s AS (
+                SELECT i.id, k.roi_id, i.filename, i.rows, i.cols, i.comps, i.version,
+                       CASE WHEN i.version = k.version THEN 0 WHEN l.data IS NOT NULL THEN 1 ELSE 2 END AS state, l.data AS level
+                FROM unnest($2::int[], $3::int[], $6::bigint[]) AS k(id, roi_id, version)
+                JOIN images i ON i.project_id = $1 AND i.id = k.id
+                LEFT JOIN image_levels l ON l.project_id = i.project_id AND l.image_id = i.id AND l.roi_id = k.roi_id
+                                         AND l.width = $4 AND l.height = $5 AND l.version = i.version
+            ), r AS (
+                SELECT s.*, row_number() OVER (PARTITION BY s.id, s.state ORDER BY s.roi_id) AS n FROM s
+            )
+            SELECT r.id, r.filename, r.rows, r.cols, r.comps, r.version, r.state::int,
+                   CASE r.state WHEN 1 THEN r.level WHEN 2 THEN o.data END, r.roi_id
+            FROM r
+            LEFT JOIN images o ON r.state = 2 AND r.n = 1 AND o.project_id = $1 AND o.id = r.id
+            ORDER BY r.id, r.roi_id
+        )";
+        std::string project_id_str = std::to_string(project_id);
+        std::string image_ids_str = toArrayLiteral(image_ids);
+        std::string roi_ids_str = toArrayLiteral(roi_ids);
+        std::string width_str = std::to_string(width);
+        std::string height_str = std::to_string(height);
+        std::string known_versions_str = toArrayLiteral(known_versions);
+        const char* paramValues[6] = { project_id_str.c_str(), image_ids_str.c_str(), roi_ids_str.c_str(), width_str.c_str(), height_str.c_str(), known_versions_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image Levels", sql);
+            PQclear(res);
+            return false;
+        }
+
+        int num_rows = PQntuples(res);
+        size_t pixel_bytes = 0;
+        size_t filename_bytes = 0;
+        for (int i = 0; i < num_rows; ++i) {
+            filename_bytes += PQgetlength(res, i, 1);
+            pixel_bytes += PQgetlength(res, i, 7);
+        }
+
+        batch.clear();
+        batch.reserve(num_rows, pixel_bytes, filename_bytes);
+        batch_roi_ids.assign(num_rows, 0);
+        versions.assign(num_rows, 0);
+        states.assign(num_rows, ImageLevelState::Unchanged);
+
+        for (int i = 0; i < num_rows; ++i) {
+            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+            versions[i] = readInt64(PQgetvalue(res, i, 5));
+            states[i] = static_cast<ImageLevelState>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 6))));
+            batch_roi_ids[i] = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 8)));
+
+            if (ImageLevelState::Scaled == states[i]) {
+                rows = height;
+                cols = width;
+            }
+            batch.append(id,
+                         PQgetvalue(res, i, 1), PQgetlength(res, i, 1),
+                         rows, cols, comps,
+                         reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 7)), PQgetlength(res, i, 7));
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool writeImageLevels(PGconn *conn, int project_id, int width, int height, const ImageBatch &levels, const std::vector<int> &roi_ids, const std::vector<int64_t> &versions, std::string &error_message) {
+        if (levels.empty()) return true;
+
+        // Never replace a level scaled from a newer version than ours.
+        const char* sql = R"(
+            INSERT INTO image_levels (project_id, image_id, roi_id, width, height, version, data) VALUES ($1, $2, $7, $3, $4, $5, $6)
+            ON CONFLICT (project_id, image_id, roi_id, width, height) DO UPDATE
+            SET version = EXCLUDED.version, data = EXCLUDED.data
+            WHERE image_levels.version < EXCLUDED.version
+        )";
+
+        // Inside a caller's transaction (a streaming render) the levels go in a
+        // savepoint, so they neither commit the caller's work nor roll it back.
+        const bool nested = PQTRANS_INTRANS == PQtransactionStatus(conn);
+        const char* begin = nested ? "SAVEPOINT write_image_levels" : "BEGIN";
+        const char* commit = nested ? "RELEASE SAVEPOINT write_image_levels" : "COMMIT";
+        const char* rollback = nested ? "ROLLBACK TO SAVEPOINT write_image_levels" : "ROLLBACK";
+        if(!executeSQL(conn, begin, error_message))return false;
+
+        std::string project_id_str = std::to_string(project_id);
+        std::string width_str = std::to_string(width);
+        std::string height_str = std::to_string(height);
+
+        for (size_t i = 0; i < levels.size(); ++i) {
+            std::string image_id_str = std::to_string(levels.getId(i));
+            std::string version_str = std::to_string(versions[i]);
+            std::string roi_id_str = std::to_string(roi_ids.empty() ? 0 : roi_ids[i]);
+            const char* paramValues[7] = { project_id_str.c_str(), image_id_str.c_str(), width_str.c_str(), height_str.c_str(), version_str.c_str(), reinterpret_cast<const char*>(levels.getData(i)), roi_id_str.c_str() };
+            int paramLengths[7] = { 0, 0, 0, 0, 0, static_cast<int>(levels.getDataSize(i)), 0 };
+            int paramFormats[7] = { 0, 0, 0, 0, 0, 1, 0 }; // data is binary
+
+            PGresult* res = PQexecParams(conn, sql, 7, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+            if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+                error_message = HANDLE_ERROR(conn, "Write Image Levels", sql);
+                PQclear(res);
+                std::string ignored;
+                executeSQL(conn, rollback, ignored);
+                return false;
+            }
+            PQclear(res);
+        }
+
+        return executeSQL(conn, commit, error_message);
+    }
+
+    static bool readImages(PGconn *conn, int project_id, TileDiskCache &disk_cache, ImageBatch &batch, std::string &error_message) {
+        // Send the versions we already hold on disk; only images that changed come back with their data.
+        const char* sql = R"(
+            SELECT i.id, i.filename, i.rows, i.cols, i.comps, i.version,
+                   CASE WHEN i.version = k.version THEN NULL ELSE i.data END
+            FROM images i
+            LEFT JOIN unnest($2::int[], $3::bigint[]) AS k(id, version) ON k.id = i.id
+            WHERE i.project_id = $1
+        )";
+        std::vector<int> known_ids;
+        std::vector<int64_t> known_versions;
+        disk_cache.getVersions(project_id, known_ids, known_versions);
+
+        std::string project_id_str = std::to_string(project_id);
+        std::string known_ids_str = toArrayLiteral(known_ids);
+        std::string known_versions_str = toArrayLiteral(known_versions);
+        const char* paramValues[3] = { project_id_str.c_str(), known_ids_str.c_str(), known_versions_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 3, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Images", sql);
+            PQclear(res);
+            return false;
+        }
+
+        int num_rows = PQntuples(res);
+        std::vector<TileDiskCache::Tile> tiles(num_rows);
+        size_t pixel_bytes = 0;
+        size_t filename_bytes = 0;
+        for (int i = 0; i < num_rows; ++i) {
+            filename_bytes += PQgetlength(res, i, 1);
+            if (PQgetisnull(res, i, 6)) {
+                uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+                if (!disk_cache.find(id, tiles[i])) {
+                    error_message = "Tile cache entry for image_id = " + std::to_string(id) + " disappeared while reading.";
+                    PQclear(res);
+                    return false;
+                }
+                pixel_bytes += tiles[i].size;
+            } else {
+                pixel_bytes += PQgetlength(res, i, 6);
+            }
+        }
+
+        batch.clear();
+        batch.reserve(num_rows, pixel_bytes, filename_bytes);
+
+        for (int i = 0; i < num_rows; ++i) {
+            uint32_t id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+            int64_t version = readInt64(PQgetvalue(res, i, 5));
+
+            if (PQgetisnull(res, i, 6)) {
+                batch.append(id, PQgetvalue(res, i, 1), PQgetlength(res, i, 1), rows, cols, comps, tiles[i].data, tiles[i].size);
+                disk_cache.markValidated(id, version);
+            } else {
+                const unsigned char* data = reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 6));
+                size_t size = PQgetlength(res, i, 6);
+                batch.append(id, PQgetvalue(res, i, 1), PQgetlength(res, i, 1), rows, cols, comps, data, size);
+
+                std::string filename(PQgetvalue(res, i, 1), PQgetlength(res, i, 1));
+                if (!disk_cache.put(id, project_id, version, filename, rows, cols, comps, data, size, error_message)) {
+                    PQclear(res);
+                    return false;
+                }
+            }
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool createUser(PGconn* conn, const std::string& email, const std::string& first_name, const std::string& last_name, int &user_id, std::string &error_message) {
+        const char* sql = "INSERT INTO usertable (email, first_name, last_name) VALUES ($1, $2, $3) RETURNING id";
+        const char* paramValues[3] = { email.c_str(), first_name.c_str(), last_name.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 3, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Create User", sql);
+            PQclear(res);
+
+            return false;
+        }
+
+        user_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
+
+    static bool readUser(PGconn* conn, const std::string& email, int &id, bool &found, std::string &error_message) {
+
+        // Prepare the query with parameterized input to prevent SQL injection
+        const char* sql = "SELECT id FROM usertable WHERE email = $1";
+        const char* paramValues[1] = { email.c_str() };
+
+        // Execute the sql
+        PGresult* res = PQexecParams(conn,
+                                     sql,
+                                     1,          // number of parameters
+                                     nullptr,    // parameter types (let PostgreSQL infer)
+                                     paramValues,
+                                     nullptr,    // parameter lengths
+                                     nullptr,    // parameter formats
+                                     0);         // result format (text)
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Get User", sql);
+            PQclear(res);
+            return false; // Return an empty vector on error
+        }
+
+        // Check if we got a result
+        found = PQntuples(res) > 0;
+        if (found) {
+            // Get the ID from the first row, first column
+            char* idStr = PQgetvalue(res, 0, 0);
+            id = std::stoi(idStr);
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readUser(PGconn *conn, int user_id, std::string& email, std::string& first_name, std::string& last_name, std::string &error_message) {
+        const char* sql = "SELECT email, first_name, last_name FROM usertable WHERE id = $1";
+        std::string user_id_str = std::to_string(user_id);
+        const char* paramValues[1] = { user_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read User", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            return false;
+        }
+
+        email = PQgetvalue(res, 0, 0);
+        first_name = PQgetvalue(res, 0, 1);
+        last_name = PQgetvalue(res, 0, 2);
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool updateUser(PGconn* conn, int user_id, const std::string& new_email, const std::string& new_first_name, const std::string& new_last_name, std::string &error_message) {
+        const char* sql = "UPDATE usertable SET email = $1, first_name = $2, last_name = $3 WHERE id = $4";
+        std::string user_id_str = std::to_string(user_id);
+        const char* paramValues[4] = { new_email.c_str(), new_first_name.c_str(), new_last_name.c_str(), user_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 4, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Update User", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool deleteUser(PGconn* conn, int user_id, std::string &error_message) {
+        const char* sql = "DELETE FROM usertable WHERE id = $1";
+        std::string user_id_str = std::to_string(user_id);
+        const char* paramValues[1] = { user_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Delete User", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readProjects(PGconn* conn, int user_id, std::vector<int>& project_ids, std::string &error_message) {
+
+        // Prepare the SQL query
+        const char* sql = "SELECT id FROM projecttable WHERE user_id = $1";
+        const char* paramValues[1];
+        std::string user_id_str = std::to_string(user_id);
+        paramValues[0] = user_id_str.c_str();
+
+        // Execute the query
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Projects", sql);
+            PQclear(res);
+            return false; // Return an empty vector on error
+        }
+
+        // Process the results
+        int num_rows = PQntuples(res);
+        for (int i = 0; i < num_rows; ++i) {
+            int project_id = std::stoi(PQgetvalue(res, i, 0));
+            project_ids.push_back(project_id);
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool createImageROI(PGconn* conn, int project_id, int images_id, int x, int y, int width, int height, int &image_roi_id, std::string &error_message)  {
+        // Prepare the SQL statement
+        const char* sql = "INSERT INTO images_roi (project_id, images_id, x, y, width, height) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id";
+
+        // Convert data to a format suitable for PostgreSQL
+        std::string project_id_str = std::to_string(project_id);
+        std::string images_id_str = std::to_string(images_id);
+        std::string x_str = std::to_string(x);
+        std::string y_str = std::to_string(y);
+        std::string width_str = std::to_string(width);
+        std::string height_str = std::to_string(height);
+        const char* paramValues[6] = { project_id_str.c_str(), images_id_str.c_str(), x_str.c_str(), y_str.c_str(), width_str.c_str(), height_str.c_str() };
+
+        // Execute the SQL statement
+        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Create Image ROI", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        image_roi_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+
+    }
+
+    static bool readImageROI(PGconn* conn, int image_roi_id, int &x, int &y, int &width, int &height, std::string &error_message)  {
+        const char* sql = "SELECT x, y, width, height FROM images_roi WHERE id = $1";
+        const char* paramValues[1];
+        std::string image_id_str = std::to_string(image_roi_id);
+        paramValues[0] = image_id_str.c_str();
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No image found for the given with image_id = " + std::to_string(image_roi_id) ;
+            PQclear(res);
+            return false;
+        }
+
+        std::string filename = PQgetvalue(res, 0, 0);
+
+        x = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
+        y = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
+        width = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
+        height = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 4)));
+
+        PQclear(res);
+        return true;
+
+    }
+
+    static bool updateImageROI(PGconn* conn, int image_roi_id, int x, int y, int width, int height, std::string &error_message)  {
+        // Features and levels taken from the old rectangle go with it, and the
+        // image's version moves on so cached crops of it are not reused.
+        const char* sql = R"(
+            WITH f AS (
+                DELETE FROM image_features f USING images_roi r WHERE r.id = $5 AND f.project_id = r.project_id AND f.image_id = r.images_id AND f.roi_id = r.id
+            ), l AS (
+                DELETE FROM image_levels l USING images_roi r WHERE r.id = $5 AND l.project_id = r.project_id AND l.image_id = r.images_id AND l.roi_id = r.id
+            ), v AS (
+                UPDATE images i SET version = nextval('mosaify_version_seq') FROM images_roi r WHERE r.id = $5 AND i.project_id = r.project_id AND i.id = r.images_id
+            )
+            UPDATE images_roi SET x = $1, y = $2, width = $3, height = $4 WHERE id = $5
+        )";
+        std::string x_str = std::to_string(x);
+        std::string y_str = std::to_string(y);
+        std::string width_str = std::to_string(width);
+        std::string height_str = std::to_string(height);
+        std::string image_roi_id_str = std::to_string(image_roi_id);
+        const char* paramValues[5] = { x_str.c_str(), y_str.c_str(), width_str.c_str(), height_str.c_str(), image_roi_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 5, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Update Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool deleteImageROI(PGconn* conn, int image_roi_id, std::string &error_message)  {
+        const char* sql = R"(
+            WITH f AS (
+                DELETE FROM image_features f USING images_roi r WHERE r.id = $1 AND f.project_id = r.project_id AND f.image_id = r.images_id AND f.roi_id = r.id
+            ), l AS (
+                DELETE FROM image_levels l USING images_roi r WHERE r.id = $1 AND l.project_id = r.project_id AND l.image_id = r.images_id AND l.roi_id = r.id
+            ), v AS (
+                UPDATE images i SET version = nextval('mosaify_version_seq') FROM images_roi r WHERE r.id = $1 AND i.project_id = r.project_id AND i.id = r.images_id
+            )
+            DELETE FROM images_roi WHERE id = $1
+        )";
+        std::string image_roi_id_str = std::to_string(image_roi_id);
+        const char* paramValues[1] = { image_roi_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Delete Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool createImage(PGconn* conn, int project_id, std::unique_ptr<IImageData> img, int &image_id, std::string &error_message) {
+        // Prepare the SQL statement
+        // The image and its features are written by one statement.
+        const char* sql = R"(
+            WITH i AS (
+                INSERT INTO images (project_id, filename, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id, project_id
+            ), f AS (
+                INSERT INTO image_features (project_id, image_id, features) SELECT project_id, id, $7::bytea FROM i WHERE $7::bytea IS NOT NULL
+            )
+            SELECT id FROM i
+        )";
+
+        // Convert data to a format suitable for PostgreSQL
+        const char* paramValues[7] = {"", "", "", "", "", "\0", nullptr};
+        int paramLengths[7] = {0, 0, 0, 0, 0, 0, 0};
+        int paramFormats[7] = {0, 0, 0, 0, 0, 1, 1}; // data and features are binary
+
+        // Set parameter values
+        std::string project_id_str = std::to_string(project_id);
+        std::string rows_str = std::to_string(img->getRows());
+        std::string cols_str = std::to_string(img->getCols());
+        std::string comps_str = std::to_string(img->getComps());
+
+        paramValues[0] = project_id_str.c_str();
+        paramValues[1] = img->getFilename().c_str();
+        paramValues[2] = rows_str.c_str();
+        paramValues[3] = cols_str.c_str();
+        paramValues[4] = comps_str.c_str();
+        auto d = img->getData();
+        NJLIC::squish(d);
+        paramValues[5] = reinterpret_cast<const char*>(d.data());
+        paramLengths[5] = img->getData().size();
+
+        std::string features = encodeImageFeatures(img->getRows(), img->getCols(), img->getComps(), img->getData());
+        if (!features.empty()) {
+            paramValues[6] = features.data();
+            paramLengths[6] = features.size();
+        }
+
+        // Execute the SQL statement
+        PGresult* res = PQexecParams(conn, sql, 7, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Create Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        image_id = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
+
+    static bool createImages(PGconn* conn, int project_id, const std::vector<std::unique_ptr<IImageData>>& images, std::vector<int> &image_ids, std::string& error_message) {
+        // Begin a transaction block
+        PGresult* res = PQexec(conn, "BEGIN");
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image", "BEGIN");
+            PQclear(res);
+            return false;
+        }
+        PQclear(res);
+
+        // Prepare the SQL statement; the image and its features are written together
+        const char* sql = R"(
+            WITH i AS (
+                INSERT INTO images (project_id, filename, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id, project_id
+            ), f AS (
+                INSERT INTO image_features (project_id, image_id, features) SELECT project_id, id, $7::bytea FROM i WHERE $7::bytea IS NOT NULL
+            )
+            SELECT id FROM i
+        )";
+
+        // Convert project_id to string once
+        std::string project_id_str = std::to_string(project_id);
+
+        for (const auto& image : images) {
+            const char* paramValues[7] = {"", "", "", "", "", "\0", nullptr};
+            int paramLengths[7] = {0, 0, 0, 0, 0, 0, 0};
+            int paramFormats[7] = {0, 0, 0, 0, 0, 1, 1}; // data and features are binary
+
+            // Set parameter values
+            std::string rows_str = std::to_string(image->getRows());
+            std::string cols_str = std::to_string(image->getCols());
+            std::string comps_str = std::to_string(image->getComps());
+
+            paramValues[0] = project_id_str.c_str();
+            paramValues[1] = image->getFilename().c_str();
+            paramValues[2] = rows_str.c_str();
+            paramValues[3] = cols_str.c_str();
+            paramValues[4] = comps_str.c_str();
+//            paramValues[5] = reinterpret_cast<const char*>(image->getData().data());
+            auto d = image->getData();
+            NJLIC::squish(d);
+            paramValues[5] = reinterpret_cast<const char*>(d.data());
+            paramLengths[5] = image->getData().size();
+
+            std::string features = encodeImageFeatures(image->getRows(), image->getCols(), image->getComps(), image->getData());
+            if (!features.empty()) {
+                paramValues[6] = features.data();
+                paramLengths[6] = features.size();
+            }
+
+            // Execute the SQL statement
+            res = PQexecParams(conn, sql, 7, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+            if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+                error_message = HANDLE_ERROR(conn, "Create Images", sql);
+                PQclear(res);
+                // Rollback the transaction if any insert fails
+                PQexec(conn, "ROLLBACK");
+                return false;
+            }
+
+            // Retrieve the image_id
+            int image_id = std::stoi(PQgetvalue(res, 0, 0));
+            image_ids.push_back(image_id);
+            PQclear(res);
+        }
+
+        // Commit the transaction
+        res = PQexec(conn, "COMMIT");
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Create Images", "COMMIT");
+            PQclear(res);
+            return false;
+        }
+        PQclear(res);
+
+        return true;
+    }
+
+    static bool readImage(PGconn* conn, int image_id, int project_id, std::unique_ptr<IImageData> &img, std::string &error_message) {
+        const char* sql = "SELECT filename, rows, cols, comps, data FROM images WHERE id = $1 AND project_id = $2";
+        const char* paramValues[2];
+        std::string image_id_str = std::to_string(image_id);
+        std::string project_id_str = std::to_string(project_id);
+        paramValues[0] = image_id_str.c_str();
+        paramValues[1] = project_id_str.c_str();
+
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No image found for the given with image_id = " + std::to_string(image_id) + " and promect_id = " + std::to_string(project_id);
+            PQclear(res);
+            return false;
+        }
+
+        std::string filename = PQgetvalue(res, 0, 0);
+
+        uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
+        uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
+        uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
+
+        std::vector<unsigned char> data(PQgetlength(res, 0, 4));
+        memcpy(data.data(), PQgetvalue(res, 0, 4), data.size());
+
+        img->setFilename(filename);
+        img->setRows(rows);
+        img->setCols(cols);
+        img->setComps(comps);
+
+        NJLIC::unsquish(data, PQgetlength(res, 0, 4));
+        img->setData(data);
+        img->setId(image_id);
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool readImage(PGconn* conn, int image_id, int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string &error_message) {
+        // The blob is only sent when the caller's version is stale.
+        const char* sql = "SELECT version, filename, rows, cols, comps, CASE WHEN version = $3 THEN NULL ELSE data END FROM images WHERE id = $1 AND project_id = $2";
+        std::string image_id_str = std::to_string(image_id);
+        std::string project_id_str = std::to_string(project_id);
+        std::string known_version_str = std::to_string(known_version);
+        const char* paramValues[3] = { image_id_str.c_str(), project_id_str.c_str(), known_version_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, sql, 3, nullptr, paramValues, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image", sql);
+
+            PQclear(res);
+            return false;
+        }
+
+        if (PQntuples(res) == 0) {
+            error_message = "No image found for the given with image_id = " + std::to_string(image_id) + " and project_id = " + std::to_string(project_id);
+            PQclear(res);
+            return false;
+        }
+
+        version = readInt64(PQgetvalue(res, 0, 0));
+        modified = version != known_version;
+        if (modified) {
+            img->setFilename(std::string(PQgetvalue(res, 0, 1), PQgetlength(res, 0, 1)));
+            img->setRows(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2))));
+            img->setCols(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3))));
+            img->setComps(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 4))));
+
+            const unsigned char* data_ptr = reinterpret_cast<const unsigned char*>(PQgetvalue(res, 0, 5));
+            img->setData(std::vector<unsigned char>(data_ptr, data_ptr + PQgetlength(res, 0, 5)));
+            img->setId(image_id);
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool updateImage(PGconn* conn, int image_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message) {
+        // Features are replaced in the same statement; stale ones are removed when the new pixels can not be described.
+        // ROI features describe the old pixels and are always removed; computeMissingImageFeatures recomputes them.
+        // Pre-scaled levels of the old pixels go too.
+        const char* sql = R"(
+            WITH u AS (
+                UPDATE images SET filename = $1, rows = $2, cols = $3, comps = $4, data = $5, version = nextval('mosaify_version_seq') WHERE id = $6 RETURNING id, project_id
+            ), d AS (
+                DELETE FROM image_features WHERE image_id = $6 AND (roi_id <> 0 OR $7::bytea IS NULL)
+            ), l AS (
+                DELETE FROM image_levels WHERE image_id = $6
+            )
+            INSERT INTO image_features (project_id, image_id, features) SELECT project_id, id, $7::bytea FROM u WHERE $7::bytea IS NOT NULL
+            ON CONFLICT (project_id, image_id, roi_id) DO UPDATE SET features = EXCLUDED.features, written_txid = txid_current()
+        )";
+        const char* paramValues[7];
+        int paramLengths[7] = {0, 0, 0, 0, 0, 0, 0};
+        int paramFormats[7] = {0, 0, 0, 0, 1, 0, 1}; // Data and features are binary
+
+        std::string rows_str = std::to_string(new_rows);
+        std::string cols_str = std::to_string(new_cols);
+        std::string comps_str = std::to_string(new_comps);
+        std::string image_id_str = std::to_string(image_id);
+
+        paramValues[0] = new_filename.c_str();
+        paramValues[1] = rows_str.c_str();
+        paramValues[2] = cols_str.c_str();
+        paramValues[3] = comps_str.c_str();
+
+
+        auto d = new_data;
+        NJLIC::squish(d);
+        paramValues[4] = reinterpret_cast<const char*>(d.data());
+//        paramValues[4] = reinterpret_cast<const char*>(new_data.data());
+
+        paramLengths[4] = new_data.size();
+        paramValues[5] = image_id_str.c_str();
+
+        std::string features = encodeImageFeatures(new_rows, new_cols, new_comps, new_data);
+        paramValues[6] = features.empty() ? nullptr : features.data();
+        paramLengths[6] = features.size();
 
-        PGresult* res = PQexecParams(conn, sql, 4, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 7, nullptr, paramValues, paramLengths, paramFormats, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Update User", sql);
+            error_message = HANDLE_ERROR(conn, "Update Image", sql);
 
             PQclear(res);
             return false;
@@ -607,15 +2132,15 @@ namespace NJLIC {
         return true;
     }
 
-    static bool deleteUser(PGconn* conn, int user_id, std::string &error_message) {
-        const char* sql = "DELETE FROM usertable WHERE id = $1";
-        std::string user_id_str = std::to_string(user_id);
-        const char* paramValues[1] = { user_id_str.c_str() };
+    static bool deleteImage(PGconn* conn, int image_id, std::string &error_message) {
+        const char* sql = "WITH f AS (DELETE FROM image_features WHERE image_id = $1), l AS (DELETE FROM image_levels WHERE image_id = $1) DELETE FROM images WHERE id = $1";
+        std::string image_id_str = std::to_string(image_id);
+        const char* paramValues[1] = { image_id_str.c_str() };
 
         PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Delete User", sql);
+            error_message = HANDLE_ERROR(conn, "Delete Image", sql);
 
             PQclear(res);
             return false;
@@ -625,116 +2150,121 @@ namespace NJLIC {
         return true;
     }
 
-    static bool readProjects(PGconn* conn, int user_id, std::vector<int>& project_ids, std::string &error_message) {
+    // The overloads below also filter on project_id. On a partitioned images
+    // table that lets the planner prune to the one partition holding the row
+    // instead of probing every partition's primary key.
+    static bool updateImage(PGconn* conn, int image_id, int project_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message) {
+        const char* sql = R"(
+            WITH u AS (
+                UPDATE images SET filename = $1, rows = $2, cols = $3, comps = $4, data = $5, version = nextval('mosaify_version_seq') WHERE id = $6 AND project_id = $7 RETURNING id, project_id
+            ), d AS (
+                DELETE FROM image_features WHERE project_id = $7 AND image_id = $6 AND (roi_id <> 0 OR $8::bytea IS NULL)
+            ), l AS (
+                DELETE FROM image_levels WHERE project_id = $7 AND image_id = $6
+            )
+            INSERT INTO image_features (project_id, image_id, features) SELECT project_id, id, $8::bytea FROM u WHERE $8::bytea IS NOT NULL
+            ON CONFLICT (project_id, image_id, roi_id) DO UPDATE SET features = EXCLUDED.features, written_txid = txid_current()
+        )";
 
-        // Prepare the SQL query
-        const char* sql = "SELECT id FROM projecttable WHERE user_id = $1";
-        const char* paramValues[1];
-        std::string user_id_str = std::to_string(user_id);
-        paramValues[0] = user_id_str.c_str();
+        std::string rows_str = std::to_string(new_rows);
+        std::string cols_str = std::to_string(new_cols);
+        std::string comps_str = std::to_string(new_comps);
+        std::string image_id_str = std::to_string(image_id);
+        std::string project_id_str = std::to_string(project_id);
 
-        // Execute the query
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        std::string features = encodeImageFeatures(new_rows, new_cols, new_comps, new_data);
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Projects", sql);
-            PQclear(res);
-            return false; // Return an empty vector on error
-        }
+        const char* paramValues[8] = { new_filename.c_str(), rows_str.c_str(), cols_str.c_str(), comps_str.c_str(),
+                                       reinterpret_cast<const char*>(new_data.data()), image_id_str.c_str(), project_id_str.c_str(),
+                                       features.empty() ? nullptr : features.data() };
+        int paramLengths[8] = { 0, 0, 0, 0, static_cast<int>(new_data.size()), 0, 0, static_cast<int>(features.size()) };
+        int paramFormats[8] = { 0, 0, 0, 0, 1, 0, 0, 1 }; // Data and features are binary
 
-        // Process the results
-        int num_rows = PQntuples(res);
-        for (int i = 0; i < num_rows; ++i) {
-            int project_id = std::stoi(PQgetvalue(res, i, 0));
-            project_ids.push_back(project_id);
+        PGresult* res = PQexecParams(conn, sql, 8, nullptr, paramValues, paramLengths, paramFormats, 0);
+
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Update Image", sql);
+
+            PQclear(res);
+            return false;
         }
 
         PQclear(res);
         return true;
     }
 
-    static bool createImageROI(PGconn* conn, int project_id, int images_id, int x, int y, int width, int height, int &image_roi_id, std::string &error_message)  {
-        // Prepare the SQL statement
-        const char* sql = "INSERT INTO images_roi (project_id, images_id, x, y, width, height) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id";
-
-        // Convert data to a format suitable for PostgreSQL
-        const char* paramValues[6] = {"", "", "", "", "", "\0"};
-        int paramLengths[6] = {0, 0, 0, 0, 0, 0};
-        int paramFormats[6] = {0, 0, 0, 0, 0, 0};
-
-        // Set parameter values
-        paramValues[0] = std::to_string(project_id).c_str();
-        paramValues[1] = std::to_string(images_id).c_str();;
-        paramValues[2] = std::to_string(x).c_str();
-        paramValues[3] = std::to_string(y).c_str();
-        paramValues[4] = std::to_string(width).c_str();
-        paramValues[5] = std::to_string(height).c_str();
+    static bool deleteImage(PGconn* conn, int image_id, int project_id, std::string &error_message) {
+        const char* sql = "WITH f AS (DELETE FROM image_features WHERE project_id = $2 AND image_id = $1), l AS (DELETE FROM image_levels WHERE project_id = $2 AND image_id = $1) DELETE FROM images WHERE id = $1 AND project_id = $2";
+        std::string image_id_str = std::to_string(image_id);
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { image_id_str.c_str(), project_id_str.c_str() };
 
-        // Execute the SQL statement
-        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, paramLengths, paramFormats, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Create Image ROI", sql);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            error_message = HANDLE_ERROR(conn, "Delete Image", sql);
 
             PQclear(res);
             return false;
         }
 
-        image_roi_id = std::stoi(PQgetvalue(res, 0, 0));
         PQclear(res);
         return true;
-
     }
 
-    static bool readImageROI(PGconn* conn, int image_roi_id, int &x, int &y, int &width, int &height, std::string &error_message)  {
-        const char* sql = "SELECT x, y, width, height FROM images_roi WHERE id = $1";
-        const char* paramValues[1];
-        std::string image_id_str = std::to_string(image_roi_id);
-        paramValues[0] = image_id_str.c_str();
+    static bool readImageROI(PGconn* conn, int image_roi_id, int project_id, int &x, int &y, int &width, int &height, std::string &error_message)  {
+        const char* sql = "SELECT x, y, width, height FROM images_roi WHERE id = $1 AND project_id = $2";
+        std::string image_roi_id_str = std::to_string(image_roi_id);
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { image_roi_id_str.c_str(), project_id_str.c_str() };
 
         PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Image", sql);
+            error_message = HANDLE_ERROR(conn, "Read Image ROI", sql);
 
             PQclear(res);
             return false;
         }
 
         if (PQntuples(res) == 0) {
-            error_message = "No image found for the given with image_id = " + std::to_string(image_roi_id) ;
+            error_message = "No image roi found for the given with image_roi_id = " + std::to_string(image_roi_id);
             PQclear(res);
             return false;
         }
 
-        std::string filename = PQgetvalue(res, 0, 0);
-
-        x = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
-        y = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
-        width = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
-        height = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 4)));
+        x = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 0)));
+        y = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
+        width = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
+        height = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
 
         PQclear(res);
         return true;
-
     }
 
-    static bool updateImageROI(PGconn* conn, int image_roi_id, int x, int y, int width, int height, std::string &error_message)  {
-        const char* sql = "UPDATE images_roi SET x = $1, y = $2, width = $3, height = $4 WHERE id = $5";
-        const char* paramValues[5];
-        int paramLengths[5];
-        int paramFormats[5] = {0, 0, 0, 0, 0}; // Data is binary
-
-        paramValues[0] = std::to_string(x).c_str();
-        paramValues[1] = std::to_string(y).c_str();
-        paramValues[2] = std::to_string(width).c_str();
-        paramValues[3] = std::to_string(height).c_str();
-        paramValues[4] = std::to_string(image_roi_id).c_str();
+    static bool updateImageROI(PGconn* conn, int image_roi_id, int project_id, int x, int y, int width, int height, std::string &error_message)  {
+        const char* sql = R"(
+            WITH f AS (
+                DELETE FROM image_features f USING images_roi r WHERE r.id = $5 AND r.project_id = $6 AND f.project_id = $6 AND f.image_id = r.images_id AND f.roi_id = r.id
+            ), l AS (
+                DELETE FROM image_levels l USING images_roi r WHERE r.id = $5 AND r.project_id = $6 AND l.project_id = $6 AND l.image_id = r.images_id AND l.roi_id = r.id
+            ), v AS (
+                UPDATE images i SET version = nextval('mosaify_version_seq') FROM images_roi r WHERE r.id = $5 AND r.project_id = $6 AND i.project_id = $6 AND i.id = r.images_id
+            )
+            UPDATE images_roi SET x = $1, y = $2, width = $3, height = $4 WHERE id = $5 AND project_id = $6
+        )";
+        std::string x_str = std::to_string(x);
+        std::string y_str = std::to_string(y);
+        std::string width_str = std::to_string(width);
+        std::string height_str = std::to_string(height);
+        std::string image_roi_id_str = std::to_string(image_roi_id);
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[6] = { x_str.c_str(), y_str.c_str(), width_str.c_str(), height_str.c_str(), image_roi_id_str.c_str(), project_id_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 5, nullptr, paramValues, paramLengths, paramFormats, 0);
+        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Update Image", sql);
+            error_message = HANDLE_ERROR(conn, "Update Image ROI", sql);
 
             PQclear(res);
             return false;
@@ -744,15 +2274,25 @@ namespace NJLIC {
         return true;
     }
 
-    static bool deleteImageROI(PGconn* conn, int image_roi_id, std::string &error_message)  {
-        const char* sql = "DELETE FROM images_roi WHERE id = $1";
-        const char* paramValues[1];
-        paramValues[0] = std::to_string(image_roi_id).c_str();
+    static bool deleteImageROI(PGconn* conn, int image_roi_id, int project_id, std::string &error_message)  {
+        const char* sql = R"(
+            WITH f AS (
+                DELETE FROM image_features f USING images_roi r WHERE r.id = $1 AND r.project_id = $2 AND f.project_id = $2 AND f.image_id = r.images_id AND f.roi_id = r.id
+            ), l AS (
+                DELETE FROM image_levels l USING images_roi r WHERE r.id = $1 AND r.project_id = $2 AND l.project_id = $2 AND l.image_id = r.images_id AND l.roi_id = r.id
+            ), v AS (
+                UPDATE images i SET version = nextval('mosaify_version_seq') FROM images_roi r WHERE r.id = $1 AND r.project_id = $2 AND i.project_id = $2 AND i.id = r.images_id
+            )
+            DELETE FROM images_roi WHERE id = $1 AND project_id = $2
+        )";
+        std::string image_roi_id_str = std::to_string(image_roi_id);
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[2] = { image_roi_id_str.c_str(), project_id_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Delete Image", sql);
+            error_message = HANDLE_ERROR(conn, "Delete Image ROI", sql);
 
             PQclear(res);
             return false;
@@ -762,177 +2302,479 @@ namespace NJLIC {
         return true;
     }
 
-    static bool createImage(PGconn* conn, int project_id, std::unique_ptr<IImageData> img, int &image_id, std::string &error_message) {
-        // Prepare the SQL statement
-        const char* sql = "INSERT INTO images (project_id, filename, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id";
+    static bool readImagePartitionCount(PGconn* conn, int &count, std::string &error_message) {
+        const char* sql = "SELECT COUNT(*) FROM pg_inherits WHERE inhparent = 'images'::regclass";
+        PGresult* res = PQexec(conn, sql);
 
-        // Convert data to a format suitable for PostgreSQL
-        const char* paramValues[6] = {"", "", "", "", "", "\0"};
-        int paramLengths[6] = {0, 0, 0, 0, 0, 0};
-        int paramFormats[6] = {0, 0, 0, 0, 0, 1}; // Last parameter (data) is binary
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image Partitions", sql);
+            PQclear(res);
+            return false;
+        }
 
-        // Set parameter values
-        paramValues[0] = std::to_string(project_id).c_str();
-        paramValues[1] = img->getFilename().c_str();
-        paramValues[2] = std::to_string(img->getRows()).c_str();
-        paramValues[3] = std::to_string(img->getCols()).c_str();
-        paramValues[4] = std::to_string(img->getComps()).c_str();
-        auto d = img->getData();
-        NJLIC::squish(d);
-        paramValues[5] = reinterpret_cast<const char*>(d.data());
-        paramLengths[5] = img->getData().size();
+        count = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
 
-        // Execute the SQL statement
-        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, paramLengths, paramFormats, 0);
+    static bool readImageFeatures(PGconn* conn, int project_id, ImageFeatureSet &features, std::string &error_message) {
+        // An image with ROIs is a candidate once per ROI and not as a whole.
+        // The snapshot's xmin is the features' watermark: every transaction
+        // below it has finished, so its rows are either here or gone.
+        const char* sql = R"(
+            SELECT f.image_id, f.features, f.roi_id, f.written_txid, txid_snapshot_xmin(txid_current_snapshot())
+            FROM image_features f
+            WHERE f.project_id = $1
+              AND (f.roi_id <> 0 OR NOT EXISTS (SELECT 1 FROM images_roi r WHERE r.project_id = f.project_id AND r.images_id = f.image_id))
+            ORDER BY f.image_id, f.roi_id
+        )";
+        std::string project_id_str = std::to_string(project_id);
+        const char* paramValues[1] = { project_id_str.c_str() };
 
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Create Image", sql);
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
 
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Image Features", sql);
             PQclear(res);
             return false;
         }
 
-        image_id = std::stoi(PQgetvalue(res, 0, 0));
+        const int num_rows = PQntuples(res);
+        features.resize(num_rows);
+
+        // Rows arrive image-major; scatter each vector into the dimension-major arrays.
+        ImageFeatures decoded;
+        for (int i = 0; i < num_rows; ++i) {
+            if (PQgetlength(res, i, 1) != ImageFeatures::ENCODED_BYTES) {
+                error_message = "Image features of image " + std::to_string(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)))) + " have an unexpected size.";
+                PQclear(res);
+                features.clear();
+                return false;
+            }
+
+            features.setImageId(i, ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0))));
+            features.setRoiId(i, ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2))));
+            features.setTxid(i, readInt64(PQgetvalue(res, i, 3)));
+            decoded.decode(reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 1)));
+            features.set(i, decoded);
+        }
+
+        if (num_rows > 0) features.setWatermark(readInt64(PQgetvalue(res, 0, 4)));
+
         PQclear(res);
         return true;
     }
 
-    static bool createImages(PGconn* conn, int project_id, const std::vector<std::unique_ptr<IImageData>>& images, std::vector<int> &image_ids, std::string& error_message) {
-        // Begin a transaction block
-        PGresult* res = PQexec(conn, "BEGIN");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Image", "BEGIN");
+    // Fills in features for images stored before the image_features table
+    // existed, and for ROIs that have none yet. Rows come one per missing
+    // (image, ROI) pair, image-major, and only an image's first row carries its
+    // pixels, so an image is sent once however many of its ROIs need features;
+    // each ROI is described in place.
+    static bool computeMissingImageFeatures(PGconn* conn, int project_id, int &computed, std::string &error_message) {
+        const char* selectSql = R"(
+            WITH missing AS (
+                SELECT i.id AS image_id, 0 AS roi_id, 0 AS x, 0 AS y, 0 AS width, 0 AS height
+                FROM images i
+                LEFT JOIN image_features f ON f.project_id = i.project_id AND f.image_id = i.id AND f.roi_id = 0
+                WHERE i.project_id = $1 AND f.image_id IS NULL
+                UNION ALL
+                SELECT r.images_id, r.id, r.x, r.y, r.width, r.height
+                FROM images_roi r
+                WHERE r.project_id = $1
+                  AND NOT EXISTS (SELECT 1 FROM image_features f WHERE f.project_id = r.project_id AND f.image_id = r.images_id AND f.roi_id = r.id)
+            ), ranked AS (
+                SELECT m.*, row_number() OVER (PARTITION BY m.image_id ORDER BY m.roi_id) AS n FROM missing m
+            )
+            SELECT k.image_id, k.roi_id, k.x, k.y, k.width, k.height, i.rows, i.cols, i.comps, CASE WHEN k.n = 1 THEN i.data END
+            FROM ranked k
+            JOIN images i ON i.project_id = $1 AND i.id = k.image_id
+            ORDER BY k.image_id, k.roi_id
+        )";
+        const char* insertSql = "INSERT INTO image_features (project_id, image_id, roi_id, features) VALUES ($1, $2, $3, $4) ON CONFLICT (project_id, image_id, roi_id) DO NOTHING";
+
+        std::string project_id_str = std::to_string(project_id);
+        const char* selectParams[1] = { project_id_str.c_str() };
+
+        PGresult* res = PQexecParams(conn, selectSql, 1, nullptr, selectParams, nullptr, nullptr, 1);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Compute Image Features", selectSql);
             PQclear(res);
             return false;
         }
-        PQclear(res);
 
-        // Prepare the SQL statement
-        const char* sql = "INSERT INTO images (project_id, filename, rows, cols, comps, data) VALUES ($1, $2, $3, $4, $5, $6) RETURNING id";
+        computed = 0;
+        const unsigned char* data = nullptr;
+        size_t data_size = 0;
+        const int num_rows = PQntuples(res);
+        for (int i = 0; i < num_rows; ++i) {
+            int values[9];
+            for (int c = 0; c < 9; ++c) values[c] = static_cast<int>(ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, c))));
+            const int image_id = values[0];
+            const int roi_id = values[1];
+            const int rows = values[6];
+            const int cols = values[7];
+            const int comps = values[8];
+
+            if (!PQgetisnull(res, i, 9)) {
+                data = reinterpret_cast<const unsigned char*>(PQgetvalue(res, i, 9));
+                data_size = PQgetlength(res, i, 9);
+            }
 
-        // Convert project_id to string once
-        std::string project_id_str = std::to_string(project_id);
+            if (rows <= 0 || cols <= 0 || comps <= 0 || data_size < static_cast<size_t>(rows) * cols * comps) continue;
 
-        for (const auto& image : images) {
-            const char* paramValues[6] = {"", "", "", "", "", "\0"};
-            int paramLengths[6];
-            int paramFormats[6] = {0, 0, 0, 0, 0, 1}; // Last parameter (data) is binary
+            // ROIs are clamped to the image, as the renderer does.
+            int x = 0, y = 0, width = cols, height = rows;
+            if (0 != roi_id) {
+                x = std::max(0, std::min(values[2], cols));
+                y = std::max(0, std::min(values[3], rows));
+                width = std::min(values[4], cols - x);
+                height = std::min(values[5], rows - y);
+            }
 
-            // Set parameter values
-            std::string rows_str = std::to_string(image->getRows());
-            std::string cols_str = std::to_string(image->getCols());
-            std::string comps_str = std::to_string(image->getComps());
+            const size_t stride = static_cast<size_t>(cols) * comps;
+            ImageFeatures image_features;
+            if (width <= 0 || height <= 0 ||
+                !computeImageFeatures(data + static_cast<size_t>(y) * stride + static_cast<size_t>(x) * comps, height, width, comps, stride, image_features)) continue;
 
-            paramValues[0] = project_id_str.c_str();
-            paramValues[1] = image->getFilename().c_str();
-            paramValues[2] = rows_str.c_str();
-            paramValues[3] = cols_str.c_str();
-            paramValues[4] = comps_str.c_str();
-//            paramValues[5] = reinterpret_cast<const char*>(image->getData().data());
-            auto d = image->getData();
-            NJLIC::squish(d);
-            paramValues[5] = reinterpret_cast<const char*>(d.data());
-            paramLengths[5] = image->getData().size();
+            unsigned char encoded[ImageFeatures::ENCODED_BYTES];
+            image_features.encode(encoded);
 
-            // Execute the SQL statement
-            res = PQexecParams(conn, sql, 6, nullptr, paramValues, paramLengths, paramFormats, 0);
+            std::string image_id_str = std::to_string(image_id);
+            std::string roi_id_str = std::to_string(roi_id);
+            const char* insertParams[4] = { project_id_str.c_str(), image_id_str.c_str(), roi_id_str.c_str(), reinterpret_cast<const char*>(encoded) };
+            int insertLengths[4] = { 0, 0, 0, ImageFeatures::ENCODED_BYTES };
+            int insertFormats[4] = { 0, 0, 0, 1 };
 
-            if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-                error_message = HANDLE_ERROR(conn, "Create Images", sql);
+            PGresult* insertRes = PQexecParams(conn, insertSql, 4, nullptr, insertParams, insertLengths, insertFormats, 0);
+            if (PQresultStatus(insertRes) != PGRES_COMMAND_OK) {
+                error_message = HANDLE_ERROR(conn, "Compute Image Features", insertSql);
+                PQclear(insertRes);
                 PQclear(res);
-                // Rollback the transaction if any insert fails
-                PQexec(conn, "ROLLBACK");
                 return false;
             }
-
-            // Retrieve the image_id
-            int image_id = std::stoi(PQgetvalue(res, 0, 0));
-            image_ids.push_back(image_id);
-            PQclear(res);
+            PQclear(insertRes);
+            ++computed;
         }
 
-        // Commit the transaction
-        res = PQexec(conn, "COMMIT");
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Create Images", "COMMIT");
-            PQclear(res);
-            return false;
-        }
         PQclear(res);
-
         return true;
     }
 
-    static bool readImage(PGconn* conn, int image_id, int project_id, std::unique_ptr<IImageData> &img, std::string &error_message) {
-        const char* sql = "SELECT filename, rows, cols, comps, data FROM images WHERE id = $1 AND project_id = $2";
-        const char* paramValues[2];
-        std::string image_id_str = std::to_string(image_id);
+    // Every ROI of the project's images, ordered by id.
+    static bool readImageROIs(PGconn* conn, int project_id, std::vector<ImageROI> &rois, std::string &error_message) {
+        const char* sql = "SELECT id, images_id, x, y, width, height FROM images_roi WHERE project_id = $1 ORDER BY id";
         std::string project_id_str = std::to_string(project_id);
-        paramValues[0] = image_id_str.c_str();
-        paramValues[1] = project_id_str.c_str();
+        const char* paramValues[1] = { project_id_str.c_str() };
 
-        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 1);
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 1);
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            error_message = HANDLE_ERROR(conn, "Read Image", sql);
-
+            error_message = HANDLE_ERROR(conn, "Read Image ROIs", sql);
             PQclear(res);
             return false;
         }
 
-        if (PQntuples(res) == 0) {
-            error_message = "No image found for the given with image_id = " + std::to_string(image_id) + " and promect_id = " + std::to_string(project_id);
+        const int num_rows = PQntuples(res);
+        rois.resize(num_rows);
+        for (int i = 0; i < num_rows; ++i) {
+            ImageROI &roi = rois[i];
+            roi.id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 0)));
+            roi.image_id = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 1)));
+            roi.x = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 2)));
+            roi.y = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 3)));
+            roi.width = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 4)));
+            roi.height = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, i, 5)));
+        }
+
+        PQclear(res);
+        return true;
+    }
+
+    static bool createNotifyTriggers(PGconn* conn, std::string &error_message) {
+        // Every change on a cached table notifies listeners with "<table>:<id>:<project_id>".
+        // usertable rows report a project_id of 0, projecttable rows their own id.
+        // The table name is passed as a trigger argument because on a partitioned
+        // table TG_TABLE_NAME is the partition, not the table clients know about.
+        const char* createNotifyFunctionSQL = R"(
+            CREATE OR REPLACE FUNCTION mosaify_notify_change() RETURNS trigger AS $$
+            DECLARE
+                rec RECORD;
+                project_id INTEGER;
+            BEGIN
+                IF TG_OP = 'DELETE' THEN
+                    rec := OLD;
+                ELSE
+                    rec := NEW;
+                END IF;
+                IF TG_ARGV[0] = 'usertable' THEN
+                    project_id := 0;
+                ELSIF TG_ARGV[0] = 'projecttable' THEN
+                    project_id := rec.id;
+                ELSE
+                    project_id := rec.project_id;
+                END IF;
+                PERFORM pg_notify('mosaify_invalidate', TG_ARGV[0] || ':' || rec.id || ':' || project_id);
+                RETURN NULL;
+            END;
+            $$ LANGUAGE plpgsql;
+        )";
+        if(!executeSQL(conn, createNotifyFunctionSQL, error_message))return false;
+
+        // Inserts matter for the metadata tables (new projects, previously missing users).
+        struct { const char* table; const char* events; } triggers[] = {
+                { "images", "UPDATE OR DELETE" },
+                { "mosaic_images", "UPDATE OR DELETE" },
+                { "mosaic_maps", "UPDATE OR DELETE" },
+                { "images_roi", "UPDATE OR DELETE" },
+                { "usertable", "INSERT OR UPDATE OR DELETE" },
+                { "projecttable", "INSERT OR UPDATE OR DELETE" },
+        };
+        for (const auto &trigger : triggers) {
+            std::string table = trigger.table;
+            std::string sql = "DROP TRIGGER IF EXISTS " + table + "_notify ON " + table + ";"
+                    + "CREATE TRIGGER " + table + "_notify AFTER " + trigger.events + " ON " + table
+                    + " FOR EACH ROW EXECUTE PROCEDURE mosaify_notify_change('" + table + "');";
+            if(!executeSQL(conn, sql, error_message))return false;
+        }
+        return true;
+    }
+
+    // Schema migrations. Each migration is applied once and recorded in
+    // schema_migrations. Steps that name an index are built with
+    // CREATE INDEX CONCURRENTLY, which cannot run inside a transaction, so those
+    // migrations run statement by statement; an invalid index left behind by an
+    // interrupted build is dropped and rebuilt.
+    struct MigrationStep {
+        const char* sql;
+        const char* index_name;
+    };
+
+    struct Migration {
+        int version;
+        const char* description;
+        std::vector<MigrationStep> steps;
+    };
+
+    static const std::vector<Migration>& getMigrations() {
+        static const std::vector<Migration> migrations = {
+                { 1, "Foreign key and lookup indexes", {
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS images_project_id_idx ON images (project_id) INCLUDE (version)", "images_project_id_idx" },
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS images_roi_images_id_idx ON images_roi (images_id)", "images_roi_images_id_idx" },
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS images_roi_project_id_idx ON images_roi (project_id)", "images_roi_project_id_idx" },
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS mosaic_images_project_id_idx ON mosaic_images (project_id) INCLUDE (version)", "mosaic_images_project_id_idx" },
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS mosaic_maps_project_id_idx ON mosaic_maps (project_id) INCLUDE (version)", "mosaic_maps_project_id_idx" },
+                        { "CREATE INDEX CONCURRENTLY IF NOT EXISTS projecttable_user_id_idx ON projecttable (user_id) INCLUDE (id)", "projecttable_user_id_idx" },
+                }},
+                { 2, "Binary mosaic maps", {
+                        { "ALTER TABLE mosaic_maps ADD COLUMN IF NOT EXISTS map_bin BYTEA", nullptr },
+                }},
+                // A project holds at most one mosaic image and one map. Duplicates
+                // left by older releases are never deleted here: the migration
+                // fails, naming the projects, until they are cleaned up by hand.
+                // The check and the unique indexes share one transaction with
+                // writers locked out, so no duplicate can slip in between. Both
+                // tables hold a row or two per project, so the indexes are built
+                // in place rather than CONCURRENTLY; one left invalid by an
+                // interrupted CONCURRENTLY build of an earlier release is rebuilt.
+                { 3, "One mosaic image and map per project", {
+                        { "LOCK TABLE mosaic_images, mosaic_maps IN SHARE ROW EXCLUSIVE MODE", nullptr },
+                        { R"(
+                            DO $$
+                            DECLARE
+                                duplicates TEXT;
+                            BEGIN
+                                SELECT string_agg(project_id::text, ', ' ORDER BY project_id) INTO duplicates FROM (
+                                    SELECT project_id FROM mosaic_images GROUP BY project_id HAVING COUNT(*) > 1
+                                    UNION
+                                    SELECT project_id FROM mosaic_maps GROUP BY project_id HAVING COUNT(*) > 1
+                                ) d;
+                                IF duplicates IS NOT NULL THEN
+                                    RAISE EXCEPTION 'Projects % have more than one mosaic image or map; delete the extra rows and migrate again.', duplicates;
+                                END IF;
+                            END
+                            $$
+                        )", nullptr },
+                        { "DROP INDEX IF EXISTS mosaic_images_project_id_key", nullptr },
+                        { "CREATE UNIQUE INDEX mosaic_images_project_id_key ON mosaic_images (project_id) INCLUDE (version)", nullptr },
+                        { "DROP INDEX IF EXISTS mosaic_images_project_id_idx", nullptr },
+                        { "DROP INDEX IF EXISTS mosaic_maps_project_id_key", nullptr },
+                        { "CREATE UNIQUE INDEX mosaic_maps_project_id_key ON mosaic_maps (project_id) INCLUDE (version)", nullptr },
+                        { "DROP INDEX IF EXISTS mosaic_maps_project_id_idx", nullptr },
+                }},
+                // Keyed by project first so a project's features are one index range. There is
+                // no foreign key to images (its key differs when partitioned); image deletes
+                // remove the features explicitly.
+                { 4, "Per-image color features", {
+                        { R"(
+                            CREATE TABLE IF NOT EXISTS image_features (
+                                project_id INTEGER NOT NULL,
+                                image_id INTEGER NOT NULL,
+                                features BYTEA NOT NULL,
+                                PRIMARY KEY (project_id, image_id),
+                                FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE
+                            )
+                        )", nullptr },
+                }},
+                // A project keeps its target image (kind 0) and the rendered mosaic (kind 1) side by side.
+                { 5, "Rendered mosaic images", {
+                        { "ALTER TABLE mosaic_images ADD COLUMN IF NOT EXISTS kind SMALLINT NOT NULL DEFAULT 0", nullptr },
+                        { "CREATE UNIQUE INDEX CONCURRENTLY IF NOT EXISTS mosaic_images_project_id_kind_key ON mosaic_images (project_id, kind) INCLUDE (version)", "mosaic_images_project_id_kind_key" },
+                        { "DROP INDEX CONCURRENTLY IF EXISTS mosaic_images_project_id_key", nullptr },
+                }},
+                // Tiles pre-scaled to a cell size, tagged with the images.version they were
+                // scaled from. Like image_features there is no foreign key to images.
+                { 6, "Pre-scaled tile levels", {
+                        { R"(
+                            CREATE TABLE IF NOT EXISTS image_levels (
+                                project_id INTEGER NOT NULL,
+                                image_id INTEGER NOT NULL,
+                                roi_id INTEGER NOT NULL DEFAULT 0,
+                                width INTEGER NOT NULL,
+                                height INTEGER NOT NULL,
+                                version BIGINT NOT NULL,
+                                data BYTEA NOT NULL,
+                                PRIMARY KEY (project_id, image_id, roi_id, width, height),
+                                FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE
+                            )
+                        )", nullptr },
+                }},
+                // Features are kept per ROI as well as for the whole image (roi_id 0).
+                // The new key is built CONCURRENTLY and then swapped in as the
+                // primary key, so writers are only locked out for the swap. A
+                // re-run after the swap finds roi_id in the key and drops the
+                // rebuilt index instead.
+                { 7, "Per-ROI tile features", {
+                        { "ALTER TABLE image_features ADD COLUMN IF NOT EXISTS roi_id INTEGER NOT NULL DEFAULT 0", nullptr },
+                        { "CREATE UNIQUE INDEX CONCURRENTLY IF NOT EXISTS image_features_roi_key ON image_features (project_id, image_id, roi_id)", "image_features_roi_key" },
+                        { R"(
+                            DO $$
+                            BEGIN
+                                IF EXISTS (
+                                    SELECT 1 FROM pg_constraint c JOIN pg_attribute a ON a.attrelid = c.conrelid AND a.attnum = ANY (c.conkey)
+                                    WHERE c.conrelid = 'image_features'::regclass AND c.contype = 'p' AND a.attname = 'roi_id'
+                                ) THEN
+                                    DROP INDEX image_features_roi_key;
+                                ELSE
+                                    ALTER TABLE image_features
+                                        DROP CONSTRAINT IF EXISTS image_features_pkey,
+                                        ADD CONSTRAINT image_features_pkey PRIMARY KEY USING INDEX image_features_roi_key;
+                                END IF;
+                            END
+                            $$
+                        )", nullptr },
+                }},
+                // Renders too large for one value are stored as independently compressed
+                // bands of band_rows rows; the mosaic_images row keeps the size, no pixels.
+                { 8, "Banded mosaic images", {
+                        { "ALTER TABLE mosaic_images ADD COLUMN IF NOT EXISTS band_rows INTEGER NOT NULL DEFAULT 0", nullptr },
+                        { R"(
+                            CREATE TABLE IF NOT EXISTS mosaic_image_bands (
+                                project_id INTEGER NOT NULL,
+                                kind SMALLINT NOT NULL,
+                                band INTEGER NOT NULL,
+                                size BIGINT NOT NULL,
+                                data BYTEA NOT NULL,
+                                PRIMARY KEY (project_id, kind, band),
+                                FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE
+                            )
+                        )", nullptr },
+                }},
+                // Versions used to count per row. Start the shared sequence past every
+                // version already handed out, then draw new rows from it.
+                { 9, "Shared version sequence", {
+                        { "CREATE SEQUENCE IF NOT EXISTS mosaify_version_seq", nullptr },
+                        { R"(
+                            SELECT setval('mosaify_version_seq', GREATEST(
+                                (SELECT last_value FROM mosaify_version_seq),
+                                (SELECT COALESCE(MAX(version), 0) FROM images),
+                                (SELECT COALESCE(MAX(version), 0) FROM mosaic_images),
+                                (SELECT COALESCE(MAX(version), 0) FROM mosaic_maps)))
+                        )", nullptr },
+                        { "ALTER TABLE images ALTER COLUMN version SET DEFAULT nextval('mosaify_version_seq')", nullptr },
+                        { "ALTER TABLE mosaic_images ALTER COLUMN version SET DEFAULT nextval('mosaify_version_seq')", nullptr },
+                        { "ALTER TABLE mosaic_maps ALTER COLUMN version SET DEFAULT nextval('mosaify_version_seq')", nullptr },
+                }},
+                // The transaction that last wrote a tile's features, so an incremental
+                // map update finds every tile written since the map was matched:
+                // features backfilled for old images and late commits included.
+                { 10, "Feature write transactions", {
+                        { "ALTER TABLE image_features ADD COLUMN IF NOT EXISTS written_txid BIGINT NOT NULL DEFAULT txid_current()", nullptr },
+                }},
+        };
+        return migrations;
+    }
+
+    static const int MIGRATION_LOCK_ID = 0x4d4f5341; // Arbitrary advisory lock key shared by all migrators.
+
+    static bool readSchemaVersion(PGconn* conn, int &version, std::string &error_message) {
+        const char* sql = "SELECT COALESCE(MAX(version), 0) FROM schema_migrations";
+        PGresult* res = PQexec(conn, sql);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Read Schema Version", sql);
             PQclear(res);
             return false;
         }
 
-        std::string filename = PQgetvalue(res, 0, 0);
-
-        uint32_t rows = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 1)));
-        uint32_t cols = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 2)));
-        uint32_t comps = ntohl(*reinterpret_cast<const uint32_t*>(PQgetvalue(res, 0, 3)));
+        version = std::stoi(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return true;
+    }
 
-        std::vector<unsigned char> data(PQgetlength(res, 0, 4));
-        memcpy(data.data(), PQgetvalue(res, 0, 4), data.size());
+    static bool isIndexValid(PGconn* conn, const char* index_name, bool &exists, bool &valid, std::string &error_message) {
+        const char* sql = "SELECT i.indisvalid FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid WHERE c.relname = $1";
+        const char* paramValues[1] = { index_name };
 
-        img->setFilename(filename);
-        img->setRows(rows);
-        img->setCols(cols);
-        img->setComps(comps);
+        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
 
-        NJLIC::unsquish(data, PQgetlength(res, 0, 4));
-        img->setData(data);
-        img->setId(image_id);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Check Index", sql);
+            PQclear(res);
+            return false;
+        }
 
+        exists = PQntuples(res) > 0;
+        valid = exists && 't' == PQgetvalue(res, 0, 0)[0];
         PQclear(res);
         return true;
     }
 
-    static bool updateImage(PGconn* conn, int image_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message) {
-        const char* sql = "UPDATE images SET filename = $1, rows = $2, cols = $3, comps = $4, data = $5 WHERE id = $6";
-        const char* paramValues[6];
-        int paramLengths[6];
-        int paramFormats[6] = {0, 0, 0, 0, 1, 0}; // Data is binary
+    static bool applyMigrationStep(PGconn* conn, const MigrationStep &step, std::string &error_message) {
+        if (nullptr == step.index_name) {
+            return executeSQL(conn, step.sql, error_message);
+        }
 
-        paramValues[0] = new_filename.c_str();
-        paramValues[1] = std::to_string(new_rows).c_str();
-        paramValues[2] = std::to_string(new_cols).c_str();
-        paramValues[3] = std::to_string(new_comps).c_str();
+        bool exists = false;
+        bool valid = false;
+        if(!isIndexValid(conn, step.index_name, exists, valid, error_message))return false;
+        if (exists && valid) {
+            return true;
+        }
+        if (exists) {
+            std::string drop = std::string("DROP INDEX CONCURRENTLY IF EXISTS ") + step.index_name;
+            if(!executeSQL(conn, drop, error_message))return false;
+        }
 
+        if(!executeSQL(conn, step.sql, error_message))return false;
 
-        auto d = new_data;
-        NJLIC::squish(d);
-        paramValues[4] = reinterpret_cast<const char*>(d.data());
-//        paramValues[4] = reinterpret_cast<const char*>(new_data.data());
+        if(!isIndexValid(conn, step.index_name, exists, valid, error_message))return false;
+        if (!valid) {
+            error_message = std::string("Index ") + step.index_name + " was not built successfully.";
+            return false;
+        }
+        return true;
+    }
 
-        paramLengths[4] = new_data.size();
-        paramValues[5] = std::to_string(image_id).c_str();
+    static bool recordMigration(PGconn* conn, const Migration &migration, std::string &error_message) {
+        const char* sql = "INSERT INTO schema_migrations (version, description) VALUES ($1, $2)";
+        std::string version_str = std::to_string(migration.version);
+        const char* paramValues[2] = { version_str.c_str(), migration.description };
 
-        PGresult* res = PQexecParams(conn, sql, 6, nullptr, paramValues, paramLengths, paramFormats, 0);
+        PGresult* res = PQexecParams(conn, sql, 2, nullptr, paramValues, nullptr, nullptr, 0);
 
         if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Update Image", sql);
-
+            error_message = HANDLE_ERROR(conn, "Record Migration", sql);
             PQclear(res);
             return false;
         }
@@ -941,20 +2783,80 @@ namespace NJLIC {
         return true;
     }
 
-    static bool deleteImage(PGconn* conn, int image_id, std::string &error_message) {
-        const char* sql = "DELETE FROM images WHERE id = $1";
-        const char* paramValues[1];
-        paramValues[0] = std::to_string(image_id).c_str();
+    static bool migrate(PGconn* conn, std::string &error_message) {
+        const char* createMigrationsTableSQL = R"(
+            CREATE TABLE IF NOT EXISTS schema_migrations (
+                version INTEGER PRIMARY KEY,
+                description TEXT NOT NULL,
+                applied_at TIMESTAMPTZ NOT NULL DEFAULT now()
+            );
+        )";
+        if(!executeSQL(conn, createMigrationsTableSQL, error_message))return false;
 
-        PGresult* res = PQexecParams(conn, sql, 1, nullptr, paramValues, nullptr, nullptr, 0);
+        // Serialize concurrent migrators; the lock is session level so it also covers the CONCURRENTLY builds.
+        std::string lock = "SELECT pg_advisory_lock(" + std::to_string(MIGRATION_LOCK_ID) + ")";
+        std::string unlock = "SELECT pg_advisory_unlock(" + std::to_string(MIGRATION_LOCK_ID) + ")";
+        if(!executeSQL(conn, lock, error_message))return false;
 
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            error_message = HANDLE_ERROR(conn, "Delete Image", sql);
+        bool ok = true;
+        int current = 0;
+        ok = readSchemaVersion(conn, current, error_message);
+
+        for (const auto &migration : getMigrations()) {
+            if (!ok) break;
+            if (migration.version <= current) continue;
+
+            bool concurrent = false;
+            for (const auto &step : migration.steps) {
+                if (nullptr != step.index_name) concurrent = true;
+            }
+
+            if (!concurrent) {
+                ok = executeSQL(conn, "BEGIN", error_message);
+                for (const auto &step : migration.steps) {
+                    if (!ok) break;
+                    ok = applyMigrationStep(conn, step, error_message);
+                }
+                if (ok) ok = recordMigration(conn, migration, error_message);
+
+                std::string ignored;
+                if (ok) {
+                    ok = executeSQL(conn, "COMMIT", error_message);
+                } else {
+                    executeSQL(conn, "ROLLBACK", ignored);
+                }
+            } else {
+                // Steps are idempotent, so a migration interrupted half way is simply re-run.
+                for (const auto &step : migration.steps) {
+                    if (!ok) break;
+                    ok = applyMigrationStep(conn, step, error_message);
+                }
+                if (ok) ok = recordMigration(conn, migration, error_message);
+            }
+        }
+
+        std::string ignored;
+        executeSQL(conn, unlock, ignored);
+        return ok;
+    }
 
+    static bool explain(PGconn* conn, const std::string &sql, std::string &plan, std::string &error_message) {
+        std::string explain_sql = "EXPLAIN " + sql;
+        PGresult* res = PQexec(conn, explain_sql.c_str());
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            error_message = HANDLE_ERROR(conn, "Explain", explain_sql);
             PQclear(res);
             return false;
         }
 
+        plan.clear();
+        int num_rows = PQntuples(res);
+        for (int i = 0; i < num_rows; ++i) {
+            plan += PQgetvalue(res, i, 0);
+            plan += "\n";
+        }
+
         PQclear(res);
         return true;
     }
@@ -963,7 +2865,7 @@ namespace NJLIC {
         return NJLIC::executeSQL(m_conn, sql, error_message);
     }
 
-    MosaifyDatabase::MosaifyDatabase() {
+    MosaifyDatabase::MosaifyDatabase() : m_conn(nullptr), m_pixelAllocator(getDefaultPixelAllocator()) {
 
     }
 
@@ -980,32 +2882,170 @@ namespace NJLIC {
             error_message = HANDLE_ERROR(m_conn, "Connecting", "");
 
             PQfinish(m_conn);
+            m_conn = nullptr;
             return false;
         }
 
+        m_connectionString = connectionString;
         return true;
     }
 
     void MosaifyDatabase::disconnect() {
-        if(nullptr == m_conn)
+        stopInvalidationListener();
+
+        if(nullptr != m_conn)
             PQfinish(m_conn);
         m_conn = nullptr;
     }
 
+    void MosaifyDatabase::setPixelAllocator(std::shared_ptr<IPixelAllocator> allocator) {
+        m_pixelAllocator = allocator ? allocator : getDefaultPixelAllocator();
+    }
+
+    const std::shared_ptr<IPixelAllocator>& MosaifyDatabase::getPixelAllocator() const {
+        return m_pixelAllocator;
+    }
+
+    // The cache pointers are also read from the listener thread, hence the atomic accesses.
+    void MosaifyDatabase::enableImageCache(size_t byte_budget, size_t num_shards) {
+        std::atomic_store(&m_imageCache, std::make_shared<ImageCache>(byte_budget, num_shards));
+    }
+
+    void MosaifyDatabase::disableImageCache() {
+        std::atomic_store(&m_imageCache, std::shared_ptr<ImageCache>());
+    }
+
+    std::shared_ptr<ImageCache> MosaifyDatabase::getImageCache() const {
+        return std::atomic_load(&m_imageCache);
+    }
+
+    ImageCacheStats MosaifyDatabase::getImageCacheStats() const {
+        auto cache = getImageCache();
+        if (cache) return cache->getStats();
+        return ImageCacheStats();
+    }
+
+    void MosaifyDatabase::enableMetadataCache(std::chrono::milliseconds ttl, bool negative_caching) {
+        std::atomic_store(&m_metadataCache, std::make_shared<MetadataCache>(ttl, negative_caching));
+    }
+
+    void MosaifyDatabase::disableMetadataCache() {
+        std::atomic_store(&m_metadataCache, std::shared_ptr<MetadataCache>());
+    }
+
+    std::shared_ptr<MetadataCache> MosaifyDatabase::getMetadataCache() const {
+        return std::atomic_load(&m_metadataCache);
+    }
+
+    MetadataCacheStats MosaifyDatabase::getMetadataCacheStats() const {
+        auto cache = getMetadataCache();
+        if (cache) return cache->getStats();
+        return MetadataCacheStats();
+    }
+
+    bool MosaifyDatabase::enableTileDiskCache(const std::string &path, std::string &error_message) {
+        return enableTileDiskCache(path, 0, error_message);
+    }
+
+    bool MosaifyDatabase::enableTileDiskCache(const std::string &path, uint64_t byte_budget, std::string &error_message) {
+        auto cache = std::make_shared<TileDiskCache>(byte_budget);
+        if (!cache->open(path, error_message))return false;
+
+        std::atomic_store(&m_tileDiskCache, cache);
+        return true;
+    }
+
+    void MosaifyDatabase::disableTileDiskCache() {
+        std::atomic_store(&m_tileDiskCache, std::shared_ptr<TileDiskCache>());
+    }
+
+    std::shared_ptr<TileDiskCache> MosaifyDatabase::getTileDiskCache() const {
+        return std::atomic_load(&m_tileDiskCache);
+    }
+
+    bool MosaifyDatabase::startInvalidationListener(std::string &error_message) {
+        if (m_connectionString.empty()) {
+            error_message = "Not connected.";
+            return false;
+        }
+
+        if (!m_listener) m_listener.reset(new InvalidationListener());
+        return m_listener->start(m_connectionString, [this](const Invalidation &invalidation) {
+            applyInvalidation(invalidation);
+        }, error_message);
+    }
+
+    void MosaifyDatabase::stopInvalidationListener() {
+        if (m_listener) m_listener->stop();
+    }
+
+    bool MosaifyDatabase::isInvalidationListenerRunning() const {
+        return m_listener && m_listener->isRunning();
+    }
+
+    void MosaifyDatabase::applyInvalidation(const Invalidation &invalidation) {
+        auto imageCache = getImageCache();
+        auto diskCache = getTileDiskCache();
+        auto metadataCache = getMetadataCache();
+
+        if ("*" == invalidation.table) {
+            if (imageCache) imageCache->clear();
+            if (diskCache) diskCache->resetValidation();
+            if (metadataCache) metadataCache->clear();
+        } else if ("images" == invalidation.table) {
+            if (imageCache) imageCache->invalidateImage(invalidation.id);
+            if (diskCache) diskCache->invalidate(invalidation.id);
+        } else if ("usertable" == invalidation.table) {
+            // An insert may satisfy a negatively cached email we cannot map back to an id.
+            if (metadataCache) {
+                if (metadataCache->isNegativeCaching()) {
+                    metadataCache->clear();
+                } else {
+                    metadataCache->invalidateUser(invalidation.id);
+                }
+            }
+        } else if ("projecttable" == invalidation.table) {
+            if (metadataCache) metadataCache->clear();
+        }
+    }
+
     bool MosaifyDatabase::createTables(bool reset, std::string &error_message) {
+        return createTables(reset, 0, error_message);
+    }
+
+    bool MosaifyDatabase::createTables(bool reset, int image_partitions, std::string &error_message) {
+        if (image_partitions < 0) {
+            error_message = "The number of image partitions can not be negative.";
+            return false;
+        }
+
         if(reset) {
             // SQL statements to drop tables if they exist
             const char* sql = R"(
+                DROP TABLE IF EXISTS mosaic_image_bands;
                 DROP TABLE mosaic_images;
                 DROP TABLE mosaic_maps;
                 DROP TABLE images_roi;
                 DROP TABLE images;
+                DROP TABLE IF EXISTS image_levels;
+                DROP TABLE IF EXISTS image_features;
                 DROP TABLE projecttable;
                 DROP TABLE usertable;
+                DROP TABLE IF EXISTS schema_migrations;
             )";
 
             // Execute SQL statements to drop tables
             if(!NJLIC::executeSQL(m_conn, sql, error_message))return false;
+
+            // Ids start over, so anything cached under the old ones would be
+            // served for the new rows. Listeners in other processes flush too.
+            auto imageCache = getImageCache();
+            auto diskCache = getTileDiskCache();
+            auto metadataCache = getMetadataCache();
+            if (imageCache) imageCache->clear();
+            if (diskCache) diskCache->clear();
+            if (metadataCache) metadataCache->clear();
+            if(!NJLIC::executeSQL(m_conn, "SELECT pg_notify('mosaify_invalidate', '*:0:0');", error_message))return false;
         }
 
         // SQL statement to create the user table
@@ -1038,6 +3078,7 @@ namespace NJLIC {
                 cols INTEGER NOT NULL,
                 comps INTEGER NOT NULL,
                 data BYTEA NOT NULL,
+                version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq'),
                 FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE
             );
         )";
@@ -1057,6 +3098,38 @@ namespace NJLIC {
             );
         )";
 
+        // Hash partitioned by project_id. The partition key has to be part of every
+        // unique constraint, so the primary key and the roi foreign key become composite.
+        const char* createPartitionedImagesTableSQL = R"(
+            CREATE TABLE IF NOT EXISTS images (
+                id SERIAL,
+                project_id INTEGER NOT NULL,
+                filename VARCHAR(255) NOT NULL,
+                rows INTEGER NOT NULL,
+                cols INTEGER NOT NULL,
+                comps INTEGER NOT NULL,
+                data BYTEA NOT NULL,
+                version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq'),
+                PRIMARY KEY (id, project_id),
+                FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE
+            ) PARTITION BY HASH (project_id);
+        )";
+
+        const char* createPartitionedImagesROITableSQL = R"(
+            CREATE TABLE IF NOT EXISTS images_roi (
+                id SERIAL,
+                project_id INTEGER NOT NULL,
+                images_id INTEGER NOT NULL,
+                x INTEGER NOT NULL,
+                y INTEGER NOT NULL,
+                width INTEGER NOT NULL,
+                height INTEGER NOT NULL,
+                PRIMARY KEY (id, project_id),
+                FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE CASCADE,
+                FOREIGN KEY (images_id, project_id) REFERENCES images(id, project_id) ON DELETE CASCADE
+            ) PARTITION BY HASH (project_id);
+        )";
+
         const char* createMosaicImagesTableSQL = R"(
             CREATE TABLE IF NOT EXISTS mosaic_images (
                 id SERIAL PRIMARY KEY,
@@ -1065,6 +3138,7 @@ namespace NJLIC {
                 cols INTEGER NOT NULL,
                 comps INTEGER NOT NULL,
                 data BYTEA NOT NULL,
+                version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq'),
                 FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE RESTRICT
             );
         )";
@@ -1074,19 +3148,77 @@ namespace NJLIC {
                 id SERIAL PRIMARY KEY,
                 project_id INTEGER NOT NULL,
                 map TEXT,
+                version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq'),
                 FOREIGN KEY (project_id) REFERENCES projecttable(id) ON DELETE RESTRICT
             );
         )";
 
 
+        // Every versioned row draws from one sequence that a reset leaves alone, so
+        // a row that is deleted and recreated never repeats a version a cache holds.
+        const char* createVersionSequenceSQL = "CREATE SEQUENCE IF NOT EXISTS mosaify_version_seq";
+
         // Execute SQL statements to create tables
+        if(!NJLIC::executeSQL(m_conn, createVersionSequenceSQL, error_message))return false;
         if(!NJLIC::executeSQL(m_conn, createUserTableSQL, error_message))return false;
         if(!NJLIC::executeSQL(m_conn, createProjectTableSQL, error_message))return false;
-        if(!NJLIC::executeSQL(m_conn, createImagesTableSQL, error_message))return false;
+        if (image_partitions > 0) {
+            if(!NJLIC::executeSQL(m_conn, createPartitionedImagesTableSQL, error_message))return false;
+            if(!NJLIC::executeSQL(m_conn, createPartitionedImagesROITableSQL, error_message))return false;
+
+            std::string partitionsSQL;
+            for (int i = 0; i < image_partitions; ++i) {
+                std::string bounds = " FOR VALUES WITH (MODULUS " + std::to_string(image_partitions) + ", REMAINDER " + std::to_string(i) + ");\n";
+                partitionsSQL += "CREATE TABLE IF NOT EXISTS images_p" + std::to_string(i) + " PARTITION OF images" + bounds;
+                partitionsSQL += "CREATE TABLE IF NOT EXISTS images_roi_p" + std::to_string(i) + " PARTITION OF images_roi" + bounds;
+            }
+            if(!NJLIC::executeSQL(m_conn, partitionsSQL, error_message))return false;
+
+            // CREATE INDEX CONCURRENTLY is not supported on partitioned tables. The
+            // tables are new and empty here, so build the migration's indexes directly;
+            // migrate() then finds them valid and skips them.
+            const char* createPartitionedIndexesSQL = R"(
+                CREATE INDEX IF NOT EXISTS images_project_id_idx ON images (project_id) INCLUDE (version);
+                CREATE INDEX IF NOT EXISTS images_roi_images_id_idx ON images_roi (images_id);
+                CREATE INDEX IF NOT EXISTS images_roi_project_id_idx ON images_roi (project_id);
+            )";
+            if(!NJLIC::executeSQL(m_conn, createPartitionedIndexesSQL, error_message))return false;
+        } else {
+            if(!NJLIC::executeSQL(m_conn, createImagesTableSQL, error_message))return false;
+            if(!NJLIC::executeSQL(m_conn, createImagesROITableSQL, error_message))return false;
+        }
         if(!NJLIC::executeSQL(m_conn, createMosaicImagesTableSQL, error_message))return false;
-        if(!NJLIC::executeSQL(m_conn, createImagesROITableSQL, error_message))return false;
         if(!NJLIC::executeSQL(m_conn, createMosaicMapTableSQL, error_message))return false;
-        return true;
+
+        // Tables created before versioning existed get the column on upgrade.
+        const char* addVersionColumnsSQL = R"(
+            ALTER TABLE images ADD COLUMN IF NOT EXISTS version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq');
+            ALTER TABLE mosaic_images ADD COLUMN IF NOT EXISTS version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq');
+            ALTER TABLE mosaic_maps ADD COLUMN IF NOT EXISTS version BIGINT NOT NULL DEFAULT nextval('mosaify_version_seq');
+        )";
+        if(!NJLIC::executeSQL(m_conn, addVersionColumnsSQL, error_message))return false;
+        if(!NJLIC::createNotifyTriggers(m_conn, error_message))return false;
+        return NJLIC::migrate(m_conn, error_message);
+    }
+
+    bool MosaifyDatabase::getImagePartitionCount(int &count, std::string &error_message) {
+        return NJLIC::readImagePartitionCount(m_conn, count, error_message);
+    }
+
+    bool MosaifyDatabase::migrate(std::string &error_message) {
+        return NJLIC::migrate(m_conn, error_message);
+    }
+
+    bool MosaifyDatabase::getSchemaVersion(int &version, std::string &error_message) {
+        return NJLIC::readSchemaVersion(m_conn, version, error_message);
+    }
+
+    int MosaifyDatabase::getLatestSchemaVersion() {
+        return NJLIC::getMigrations().empty() ? 0 : NJLIC::getMigrations().back().version;
+    }
+
+    bool MosaifyDatabase::explain(const std::string &sql, std::string &plan, std::string &error_message) {
+        return NJLIC::explain(m_conn, sql, plan, error_message);
     }
 
     bool MosaifyDatabase::reset(std::string &error_message) {
@@ -1101,10 +3233,83 @@ namespace NJLIC {
         return NJLIC::readMosaicImage(m_conn, project_id, img, error_message);
     }
 
+    bool MosaifyDatabase::readMosaicImage(int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string& error_message) {
+        return NJLIC::readMosaicImage(m_conn, project_id, known_version, img, version, modified, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImage(int project_id, ImageBatch &batch, std::string& error_message) {
+        return readMosaicImage(project_id, MosaicImageKind::Target, batch, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImage(int project_id, MosaicImageKind kind, ImageBatch &batch, std::string& error_message) {
+        batch.setAllocator(m_pixelAllocator);
+        return NJLIC::readMosaicImage(m_conn, project_id, kind, batch, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImage(int project_id, int64_t known_version, ImageBatch &batch, int64_t &version, bool &modified, std::string& error_message) {
+        batch.setAllocator(m_pixelAllocator);
+        return NJLIC::readMosaicImage(m_conn, project_id, known_version, batch, version, modified, error_message);
+    }
+
+    bool MosaifyDatabase::upsertMosaicImage(int project_id, MosaicImageKind kind, int rows, int cols, int comps, const unsigned char* data, size_t size, int &image_id, std::string &error_message) {
+        return NJLIC::upsertMosaicImage(m_conn, project_id, kind, rows, cols, comps, data, size, image_id, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImageInfo(int project_id, MosaicImageKind kind, int &rows, int &cols, int &comps, std::string &error_message) {
+        int band_rows = 0;
+        return NJLIC::readMosaicImageInfo(m_conn, project_id, kind, rows, cols, comps, band_rows, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImageInfo(int project_id, MosaicImageKind kind, int &rows, int &cols, int &comps, int &band_rows, std::string &error_message) {
+        return NJLIC::readMosaicImageInfo(m_conn, project_id, kind, rows, cols, comps, band_rows, error_message);
+    }
+
+    bool MosaifyDatabase::encodeMosaicImageBand(int band, const unsigned char* pixels, size_t size, MosaicImageBand &encoded, std::string &error_message) {
+        encoded.band = band;
+        encoded.size = size;
+        uLongf encoded_size = compressBound(size);
+        encoded.data.resize(encoded_size);
+        const int result = compress2(encoded.data.data(), &encoded_size, pixels, size, Z_BEST_SPEED);
+        if (Z_OK != result) {
+            error_message = "Failed to compress mosaic image band (" + NJLIC::get_reason(result) + ").";
+            return false;
+        }
+        encoded.data.resize(encoded_size);
+        return true;
+    }
+
+    bool MosaifyDatabase::createMosaicImageBands(int project_id, MosaicImageKind kind, int rows, int cols, int comps, int band_rows, int &image_id, std::string &error_message) {
+        if (band_rows <= 0) {
+            error_message = "Mosaic image bands must be at least one row high.";
+            return false;
+        }
+        return NJLIC::createMosaicImageBands(m_conn, project_id, kind, rows, cols, comps, band_rows, image_id, error_message);
+    }
+
+    bool MosaifyDatabase::writeMosaicImageBand(int project_id, MosaicImageKind kind, const MosaicImageBand &band, std::string &error_message) {
+        return NJLIC::writeMosaicImageBand(m_conn, project_id, kind, band, error_message);
+    }
+
+    bool MosaifyDatabase::finishMosaicImageBands(int project_id, MosaicImageKind kind, std::string &error_message) {
+        return NJLIC::finishMosaicImageBands(m_conn, project_id, kind, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicImageBand(int project_id, MosaicImageKind kind, int band, PixelBuffer &pixels, std::string &error_message) {
+        return NJLIC::readMosaicImageBand(m_conn, project_id, kind, band, pixels, error_message);
+    }
+
+    bool MosaifyDatabase::patchMosaicImage(int project_id, MosaicImageKind kind, const unsigned char* data, const std::vector<size_t> &offsets, const std::vector<size_t> &sizes, std::string &error_message) {
+        return NJLIC::patchMosaicImage(m_conn, project_id, kind, data, offsets, sizes, error_message);
+    }
+
     bool MosaifyDatabase::updateMosaicImage(int project_id, const std::unique_ptr<IImageData>& new_mosaic_image, std::string& error_message) {
         return NJLIC::updateMosaicImage(m_conn, project_id, new_mosaic_image, error_message);
     }
 
+    bool MosaifyDatabase::upsertMosaicImage(int project_id, const std::unique_ptr<IImageData> &img, int &image_id, std::string &error_message) {
+        return NJLIC::upsertMosaicImage(m_conn, project_id, img, image_id, error_message);
+    }
+
     bool MosaifyDatabase::deleteMosaicImage(int project_id, std::string& error_message) {
         return NJLIC::deleteMosaicImage(m_conn, project_id, error_message);
     }
@@ -1113,6 +3318,10 @@ namespace NJLIC {
         return NJLIC::doesMosaicImageExist(m_conn, project_id, error_message);
     }
 
+    bool MosaifyDatabase::doesMosaicImageExist(const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message) {
+        return NJLIC::doesMosaicImageExist(m_conn, project_ids, exists, error_message);
+    }
+
 
     bool MosaifyDatabase::createMosaicMap(int project_id, const std::string& mosaic_map, std::string &error_message) {
         return NJLIC::createMosaicMap(m_conn, project_id, mosaic_map, error_message);
@@ -1122,10 +3331,38 @@ namespace NJLIC {
         return NJLIC::readMosaicMap(m_conn, project_id, mosaic_map, error_message);
     }
 
+    bool MosaifyDatabase::readMosaicMap(int project_id, int64_t known_version, std::string& mosaic_map, int64_t &version, bool &modified, std::string &error_message) {
+        return NJLIC::readMosaicMap(m_conn, project_id, known_version, mosaic_map, version, modified, error_message);
+    }
+
     bool MosaifyDatabase::updateMosaicMap(int project_id, const std::string& mosaic_map, std::string &error_message) {
         return NJLIC::updateMosaicMap(m_conn, project_id, mosaic_map, error_message);
     }
 
+    bool MosaifyDatabase::createMosaicMap(int project_id, const MosaicMap& mosaic_map, std::string &error_message) {
+        return NJLIC::createMosaicMap(m_conn, project_id, mosaic_map, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicMap(int project_id, MosaicMap& mosaic_map, std::string &error_message) {
+        return NJLIC::readMosaicMap(m_conn, project_id, mosaic_map, error_message);
+    }
+
+    bool MosaifyDatabase::readMosaicMap(int project_id, int64_t known_version, MosaicMap& mosaic_map, int64_t &version, bool &modified, std::string &error_message) {
+        return NJLIC::readMosaicMap(m_conn, project_id, known_version, mosaic_map, version, modified, error_message);
+    }
+
+    bool MosaifyDatabase::updateMosaicMap(int project_id, const MosaicMap& mosaic_map, std::string &error_message) {
+        return NJLIC::updateMosaicMap(m_conn, project_id, mosaic_map, error_message);
+    }
+
+    bool MosaifyDatabase::upsertMosaicMap(int project_id, const std::string& mosaic_map, int &map_id, std::string &error_message) {
+        return NJLIC::upsertMosaicMap(m_conn, project_id, mosaic_map, map_id, error_message);
+    }
+
+    bool MosaifyDatabase::upsertMosaicMap(int project_id, const MosaicMap& mosaic_map, int &map_id, std::string &error_message) {
+        return NJLIC::upsertMosaicMap(m_conn, project_id, mosaic_map, map_id, error_message);
+    }
+
     bool MosaifyDatabase::deleteMosaicMap(int project_id, std::string &error_message) {
         return NJLIC::deleteMosaicMap(m_conn, project_id, error_message);
     }
@@ -1134,50 +3371,227 @@ namespace NJLIC {
         return NJLIC::doesMosaicMapExist(m_conn, project_id, error_message);
     }
 
+    bool MosaifyDatabase::doesMosaicMapExist(const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message) {
+        return NJLIC::doesMosaicMapExist(m_conn, project_ids, exists, error_message);
+    }
+
 
     bool MosaifyDatabase::createProject(int user_id, const std::string& project_name, int &project_id, std::string &error_message) {
-        return NJLIC::createProject(m_conn, user_id, project_name, project_id, error_message);
+        if(!NJLIC::createProject(m_conn, user_id, project_name, project_id, error_message))return false;
+
+        if (auto cache = getMetadataCache()) cache->invalidateProjects(user_id);
+        return true;
     }
 
     bool MosaifyDatabase::readProject(int project_id, int &user_id, std::string &project_name, std::string &error_message) {
-        return NJLIC::readProject(m_conn, project_id, user_id, project_name, error_message);
+        auto metadataCache = getMetadataCache();
+        if (!metadataCache) {
+            return NJLIC::readProject(m_conn, project_id, user_id, project_name, error_message);
+        }
+
+        CachedProject project;
+        if (MetadataCache::Lookup::Hit == metadataCache->findProject(project_id, project)) {
+            user_id = project.user_id;
+            project_name = project.project_name;
+            return true;
+        }
+
+        if(!NJLIC::readProject(m_conn, project_id, user_id, project_name, error_message))return false;
+
+        project.user_id = user_id;
+        project.project_name = project_name;
+        metadataCache->putProject(project_id, project);
+        return true;
     }
 
     bool MosaifyDatabase::updateProject(int project_id, const std::string& new_project_name, std::string &error_message) {
-        return NJLIC::updateProject(m_conn, project_id, new_project_name, error_message);
+        if(!NJLIC::updateProject(m_conn, project_id, new_project_name, error_message))return false;
+
+        if (auto cache = getMetadataCache()) cache->invalidateProject(project_id);
+        return true;
     }
 
     bool MosaifyDatabase::deleteProject(int project_id, std::string &error_message) {
-        return NJLIC::deleteProject(m_conn, project_id, error_message);
+        if(!NJLIC::deleteProject(m_conn, project_id, error_message))return false;
+
+        if (auto cache = getImageCache()) cache->invalidateProject(project_id);
+        if (auto cache = getTileDiskCache()) cache->invalidateProject(project_id);
+        if (auto cache = getMetadataCache()) cache->invalidateProject(project_id);
+        return true;
     }
 
     bool MosaifyDatabase::readImages(int project_id, std::vector<std::unique_ptr<IImageData>>& images, const std::function<std::unique_ptr<IImageData>()>& createImageFunc, std::vector<int> &image_ids, std::string &error_message) {
        return NJLIC::readImages(m_conn, project_id, images, createImageFunc, image_ids, error_message);
     }
 
+    bool MosaifyDatabase::readImages(int project_id, const std::vector<int> &image_ids, ImageBatch &batch, std::string &error_message) {
+        batch.setAllocator(m_pixelAllocator);
+        return NJLIC::readImages(m_conn, project_id, image_ids, batch, error_message);
+    }
+
+    bool MosaifyDatabase::readImageLevels(int project_id, const std::vector<int> &image_ids, int width, int height,
+                                          const std::vector<int> &known_ids, const std::vector<int64_t> &known_versions,
+                                          ImageBatch &batch, std::vector<int64_t> &versions, std::vector<ImageLevelState> &states, std::string &error_message) {
+        if (known_ids.size() != known_versions.size()) {
+            error_message = "Known image ids and versions differ in length.";
+            return false;
+        }
+
+        std::unordered_map<int, int64_t> known;
+        for (size_t i = 0; i < known_ids.size(); ++i) known[known_ids[i]] = known_versions[i];
+        std::vector<int64_t> request_versions(image_ids.size(), -1);
+        for (size_t i = 0; i < image_ids.size(); ++i) {
+            auto it = known.find(image_ids[i]);
+            if (it != known.end()) request_versions[i] = it->second;
+        }
+
+        std::vector<int> roi_ids;
+        return readImageLevels(project_id, image_ids, std::vector<int>(image_ids.size(), 0), width, height, request_versions, batch, roi_ids, versions, states, error_message);
+    }
+
+    bool MosaifyDatabase::readImageLevels(int project_id, const std::vector<int> &image_ids, const std::vector<int> &roi_ids, int width, int height,
+                                          const std::vector<int64_t> &known_versions,
+                                          ImageBatch &batch, std::vector<int> &batch_roi_ids, std::vector<int64_t> &versions, std::vector<ImageLevelState> &states, std::string &error_message) {
+        if (image_ids.size() != roi_ids.size() || image_ids.size() != known_versions.size()) {
+            error_message = "Image ids, ROI ids and known versions differ in length.";
+            return false;
+        }
+        batch.setAllocator(m_pixelAllocator);
+        return NJLIC::readImageLevels(m_conn, project_id, image_ids, roi_ids, width, height, known_versions, batch, batch_roi_ids, versions, states, error_message);
+    }
+
+    bool MosaifyDatabase::writeImageLevels(int project_id, int width, int height, const ImageBatch &levels, const std::vector<int64_t> &versions, std::string &error_message) {
+        return writeImageLevels(project_id, width, height, levels, std::vector<int>(levels.size(), 0), versions, error_message);
+    }
+
+    bool MosaifyDatabase::writeImageLevels(int project_id, int width, int height, const ImageBatch &levels, const std::vector<int> &roi_ids, const std::vector<int64_t> &versions, std::string &error_message) {
+        if (levels.size() != versions.size() || levels.size() != roi_ids.size()) {
+            error_message = "Image levels, ROI ids and versions differ in length.";
+            return false;
+        }
+        return NJLIC::writeImageLevels(m_conn, project_id, width, height, levels, roi_ids, versions, error_message);
+    }
+
+    bool MosaifyDatabase::readImages(int project_id, ImageBatch &batch, std::string &error_message) {
+        batch.setAllocator(m_pixelAllocator);
+
+        auto diskCache = getTileDiskCache();
+        if (diskCache) {
+            return NJLIC::readImages(m_conn, project_id, *diskCache, batch, error_message);
+        }
+        return NJLIC::readImages(m_conn, project_id, batch, error_message);
+    }
+
     bool MosaifyDatabase::createUser(const std::string& email, const std::string& first_name, const std::string& last_name, int &user_id, std::string &error_message) {
-        return NJLIC::createUser(m_conn, email, first_name, last_name, user_id, error_message);
+        if(!NJLIC::createUser(m_conn, email, first_name, last_name, user_id, error_message))return false;
+
+        if (auto cache = getMetadataCache()) cache->invalidateEmail(email);
+        return true;
     }
 
 //    static bool readUser(PGconn* conn, const std::string& email, int &id, std::string &error_message) {
     bool MosaifyDatabase::readUser(const std::string& email, int &id, std::string &error_message) {
-        return NJLIC::readUser(m_conn, email, id, error_message);
+        bool found = false;
+        auto metadataCache = getMetadataCache();
+        if (!metadataCache) {
+            return NJLIC::readUser(m_conn, email, id, found, error_message);
+        }
+
+        switch (metadataCache->findUserId(email, id)) {
+            case MetadataCache::Lookup::Hit:
+            case MetadataCache::Lookup::NegativeHit:
+                return true;
+            case MetadataCache::Lookup::Miss:
+                break;
+        }
+
+        if(!NJLIC::readUser(m_conn, email, id, found, error_message))return false;
+
+        if (found) {
+            metadataCache->putUserId(email, id);
+        } else {
+            metadataCache->putMissingEmail(email);
+        }
+        return true;
     }
 
     bool MosaifyDatabase::readUser(int user_id, std::string& email, std::string& first_name, std::string& last_name, std::string &error_message) {
-        return NJLIC::readUser(m_conn, user_id, email, first_name, last_name, error_message);
+        auto metadataCache = getMetadataCache();
+        if (!metadataCache) {
+            return NJLIC::readUser(m_conn, user_id, email, first_name, last_name, error_message);
+        }
+
+        CachedUser user;
+        switch (metadataCache->findUser(user_id, user)) {
+            case MetadataCache::Lookup::Hit:
+                email = user.email;
+                first_name = user.first_name;
+                last_name = user.last_name;
+                return true;
+            case MetadataCache::Lookup::NegativeHit:
+                return false;
+            case MetadataCache::Lookup::Miss:
+                break;
+        }
+
+        error_message.clear();
+        if(!NJLIC::readUser(m_conn, user_id, email, first_name, last_name, error_message)) {
+            // A failure without an error message means the user does not exist.
+            if (error_message.empty()) metadataCache->putMissingUser(user_id);
+            return false;
+        }
+
+        user.email = email;
+        user.first_name = first_name;
+        user.last_name = last_name;
+        metadataCache->putUser(user_id, user);
+        return true;
     }
 
     bool MosaifyDatabase::updateUser(int user_id, const std::string& new_email, const std::string& new_first_name, const std::string& new_last_name, std::string &error_message) {
-        return NJLIC::updateUser(m_conn, user_id, new_email, new_first_name, new_last_name, error_message);
+        if(!NJLIC::updateUser(m_conn, user_id, new_email, new_first_name, new_last_name, error_message))return false;
+
+        if (auto cache = getMetadataCache()) {
+            cache->invalidateUser(user_id);
+            cache->invalidateEmail(new_email);
+        }
+        return true;
     }
 
     bool MosaifyDatabase::deleteUser(int user_id, std::string &error_message) {
-        return NJLIC::deleteUser(m_conn, user_id, error_message);
+        // Deleting a user cascades to its projects, so find them first.
+        auto imageCache = getImageCache();
+        std::vector<int> project_ids;
+        if ((imageCache || getTileDiskCache()) && !NJLIC::readProjects(m_conn, user_id, project_ids, error_message))return false;
+
+        if(!NJLIC::deleteUser(m_conn, user_id, error_message))return false;
+
+        auto diskCache = getTileDiskCache();
+        for (int project_id : project_ids) {
+            if (imageCache) imageCache->invalidateProject(project_id);
+            if (diskCache) diskCache->invalidateProject(project_id);
+        }
+        if (auto cache = getMetadataCache()) cache->invalidateUser(user_id);
+        return true;
     }
 
     bool MosaifyDatabase::readProjects(int user_id, std::vector<int>& project_ids, std::string &error_message) {
-        return NJLIC::readProjects(m_conn, user_id, project_ids, error_message);
+        auto metadataCache = getMetadataCache();
+        if (!metadataCache) {
+            return NJLIC::readProjects(m_conn, user_id, project_ids, error_message);
+        }
+
+        std::vector<int> cached;
+        if (MetadataCache::Lookup::Hit == metadataCache->findProjects(user_id, cached)) {
+            project_ids.insert(project_ids.end(), cached.begin(), cached.end());
+            return true;
+        }
+
+        if(!NJLIC::readProjects(m_conn, user_id, cached, error_message))return false;
+
+        metadataCache->putProjects(user_id, cached);
+        project_ids.insert(project_ids.end(), cached.begin(), cached.end());
+        return true;
     }
 
     bool MosaifyDatabase::createImageROI(int project_id, int images_id, int x, int y, int width, int height, int &image_roi_id, std::string &error_message) {
@@ -1192,6 +3606,15 @@ namespace NJLIC {
     bool MosaifyDatabase::deleteImageROI(int image_roi_id, std::string &error_message) {
         return NJLIC::deleteImageROI(m_conn, image_roi_id, error_message);
     }
+    bool MosaifyDatabase::readImageROI(int image_roi_id, int project_id, int &x, int &y, int &width, int &height, std::string &error_message) {
+        return NJLIC::readImageROI(m_conn, image_roi_id, project_id, x, y, width, height, error_message);
+    }
+    bool MosaifyDatabase::updateImageROI(int image_roi_id, int project_id, int x, int y, int width, int height, std::string &error_message) {
+        return NJLIC::updateImageROI(m_conn, image_roi_id, project_id, x, y, width, height, error_message);
+    }
+    bool MosaifyDatabase::deleteImageROI(int image_roi_id, int project_id, std::string &error_message) {
+        return NJLIC::deleteImageROI(m_conn, image_roi_id, project_id, error_message);
+    }
 
     bool MosaifyDatabase::createImage(int project_id, std::unique_ptr<IImageData> img, int &image_id, std::string &error_message) {
         return NJLIC::createImage(m_conn, project_id, std::move(img), image_id, error_message);
@@ -1200,16 +3623,129 @@ namespace NJLIC {
         return NJLIC::createImages(m_conn, project_id, images, image_ids, error_message);
     }
 
+    bool MosaifyDatabase::readImageFeatures(int project_id, ImageFeatureSet &features, std::string &error_message) {
+        return NJLIC::readImageFeatures(m_conn, project_id, features, error_message);
+    }
+
+    bool MosaifyDatabase::computeMissingImageFeatures(int project_id, int &computed, std::string &error_message) {
+        return NJLIC::computeMissingImageFeatures(m_conn, project_id, computed, error_message);
+    }
+
+    bool MosaifyDatabase::readImageROIs(int project_id, std::vector<ImageROI> &rois, std::string &error_message) {
+        return NJLIC::readImageROIs(m_conn, project_id, rois, error_message);
+    }
+
+    bool MosaifyDatabase::buildTileIndex(int project_id, TileIndex &index, const TileIndex::Options &options, std::string &error_message) {
+        ImageFeatureSet features;
+        if(!NJLIC::readImageFeatures(m_conn, project_id, features, error_message))return false;
+
+        index.build(features, options);
+        return true;
+    }
+
+    static void setImageFromTile(const TileDiskCache::Tile &tile, std::unique_ptr<IImageData> &img) {
+        img->setFilename(std::string(tile.filename, tile.filename_length));
+        img->setRows(tile.rows);
+        img->setCols(tile.cols);
+        img->setComps(tile.comps);
+        img->setData(std::vector<unsigned char>(tile.data, tile.data + tile.size));
+        img->setId(tile.image_id);
+    }
+
     bool MosaifyDatabase::readImage(int image_id, int project_id, std::unique_ptr<IImageData> &img, std::string &error_message) {
-        return NJLIC::readImage(m_conn, image_id, project_id, img, error_message);
+        auto imageCache = getImageCache();
+        auto diskCache = getTileDiskCache();
+        if (!imageCache && !diskCache) {
+            return NJLIC::readImage(m_conn, image_id, project_id, img, error_message);
+        }
+
+        // Taken before the database read so an invalidation that lands while the
+        // read is in flight keeps the stale row out of the cache.
+        const uint64_t generation = imageCache ? imageCache->getGeneration(image_id) : 0;
+        if (imageCache) {
+            auto cached = imageCache->find(image_id, project_id);
+            if (cached) {
+                img->setFilename(cached->filename);
+                img->setRows(cached->rows);
+                img->setCols(cached->cols);
+                img->setComps(cached->comps);
+                img->setData(cached->data);
+                img->setId(image_id);
+                return true;
+            }
+        }
+
+        if (diskCache) {
+            // Entries loaded from disk are checked against the database once, with a
+            // conditional read that only transfers pixels when the version moved.
+            TileDiskCache::Tile tile;
+            bool have_tile = diskCache->find(image_id, tile) && tile.project_id == project_id;
+
+            if (have_tile && tile.validated) {
+                setImageFromTile(tile, img);
+            } else {
+                int64_t version = 0;
+                bool modified = true;
+                if(!NJLIC::readImage(m_conn, image_id, project_id, have_tile ? tile.version : 0, img, version, modified, error_message))return false;
+
+                if (!modified) {
+                    diskCache->markValidated(image_id, version);
+                    setImageFromTile(tile, img);
+                } else if (!diskCache->put(image_id, project_id, version, img->getFilename(), img->getRows(), img->getCols(), img->getComps(),
+                                           img->getData().data(), img->getData().size(), error_message)) {
+                    return false;
+                }
+            }
+        } else {
+            if(!NJLIC::readImage(m_conn, image_id, project_id, img, error_message))return false;
+        }
+
+        if (imageCache) {
+            auto entry = std::make_shared<CachedImage>();
+            entry->filename = img->getFilename();
+            entry->rows = img->getRows();
+            entry->cols = img->getCols();
+            entry->comps = img->getComps();
+            entry->data = img->getData();
+            imageCache->insert(image_id, project_id, entry, generation);
+        }
+        return true;
+    }
+
+    bool MosaifyDatabase::readImage(int image_id, int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string &error_message) {
+        return NJLIC::readImage(m_conn, image_id, project_id, known_version, img, version, modified, error_message);
     }
 
     bool MosaifyDatabase::updateImage(int image_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message) {
-        return NJLIC::updateImage(m_conn, image_id, new_filename, new_rows, new_cols, new_comps, new_data, error_message);
+        if(!NJLIC::updateImage(m_conn, image_id, new_filename, new_rows, new_cols, new_comps, new_data, error_message))return false;
+
+        if (auto cache = getImageCache()) cache->invalidateImage(image_id);
+        if (auto cache = getTileDiskCache()) cache->invalidate(image_id);
+        return true;
     }
 
     bool MosaifyDatabase::deleteImage(int image_id, std::string &error_message) {
-        return NJLIC::deleteImage(m_conn, image_id, error_message);
+        if(!NJLIC::deleteImage(m_conn, image_id, error_message))return false;
+
+        if (auto cache = getImageCache()) cache->invalidateImage(image_id);
+        if (auto cache = getTileDiskCache()) cache->invalidate(image_id);
+        return true;
+    }
+
+    bool MosaifyDatabase::updateImage(int image_id, int project_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message) {
+        if(!NJLIC::updateImage(m_conn, image_id, project_id, new_filename, new_rows, new_cols, new_comps, new_data, error_message))return false;
+
+        if (auto cache = getImageCache()) cache->invalidateImage(image_id);
+        if (auto cache = getTileDiskCache()) cache->invalidate(image_id);
+        return true;
+    }
+
+    bool MosaifyDatabase::deleteImage(int image_id, int project_id, std::string &error_message) {
+        if(!NJLIC::deleteImage(m_conn, image_id, project_id, error_message))return false;
+
+        if (auto cache = getImageCache()) cache->invalidateImage(image_id);
+        if (auto cache = getTileDiskCache()) cache->invalidate(image_id);
+        return true;
     }
 
 } // NJLIC
@@ -0,0 +1,140 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#ifndef MYPROJECT_HNSWINDEX_H
+#define MYPROJECT_HNSWINDEX_H
+
+namespace NJLIC {
+
+    // Approximate nearest-neighbour index over tile feature vectors (squared
+    // L2): a hierarchical navigable small world graph (Malkov and Yashunin).
+    //
+    // Every point sits on layer 0 and, with geometrically falling odds, on the
+    // layers above it; each layer links a point to up to m neighbours (2 * m
+    // on layer 0) picked to point in different directions. A query walks
+    // greedily down from the top layer and then runs a best-first search of
+    // ef_search candidates on layer 0, so larger ef_search buys recall with
+    // latency. Unlike TileIndex it grows by insert() without a rebuild, and
+    // removal leaves a tombstone that is skipped in results but still routed
+    // through. Inserts are serial and use a seeded generator, so the same
+    // inserts in the same order give the same graph; queries are read-only
+    // and may run on many threads.
+    //
+    // Like TileIndex, only the dimensions being indexed are stored and
+    // queries are full source vectors. Ids are opaque 64-bit labels.
+    //
+    // save() writes the whole graph to one file in native byte order, via a
+    // temporary file renamed into place, so load() never sees a partial index.
+    class HnswIndex {
+    public:
+        struct Options {
+            // Indices into the source vectors to search on; empty means all of them.
+            std::vector<int> dimensions;
+            // Links per point on the upper layers; layer 0 keeps twice as many.
+            int m = 16;
+            // Candidates considered when linking a new point.
+            int ef_construction = 100;
+            // Candidates considered per query; raised to k when smaller.
+            int ef_search = 64;
+            uint64_t seed = 1;
+        };
+
+        HnswIndex();
+
+        // Starts an empty index for source_dims-float vectors.
+        void reset(int source_dims, const Options &options);
+        // reset() followed by count inserts of vectors stored row major.
+        void build(const float* vectors, size_t count, int source_dims, const int64_t* ids, const Options &options);
+        void clear();
+
+        // Adds one vector of getSourceDimensions() floats. An id that is
+        // already present is replaced: the old point becomes a tombstone.
+        void insert(const float* vector, int64_t id);
+        // Tombstones the point with this id; false when there is none.
+        bool remove(int64_t id);
+
+        bool contains(int64_t id) const { return m_labels.count(id) > 0; }
+        // The stored (indexed dimensions only) vector of id, or nullptr.
+        const float* getPoint(int64_t id) const;
+        // Ids of every point that is not a tombstone, in insertion order.
+        void getIds(std::vector<int64_t> &ids) const;
+
+        // Points that are not tombstones.
+        size_t size() const { return m_labels.size(); }
+        bool empty() const { return m_labels.empty(); }
+        size_t getTombstoneCount() const { return m_nodeIds.size() - m_labels.size(); }
+        int getDimensions() const { return static_cast<int>(m_dims.size()); }
+        int getSourceDimensions() const { return m_sourceDims; }
+        const std::vector<int>& getDimensionIndices() const { return m_dims; }
+
+        void setEfSearch(int ef_search) { m_efSearch = ef_search; }
+        int getEfSearch() const { return m_efSearch; }
+
+        // Writes the k nearest ids and squared distances, nearest first, like
+        // TileIndex::knn. Returns the number of neighbours found.
+        int knn(const float* query, int k, int64_t* ids, float* distances) const;
+        void knnBatch(const float* queries, size_t count, int k, int64_t* ids, float* distances, unsigned threads = 0) const;
+
+        bool save(const std::string &path, std::string &error_message) const;
+        bool load(const std::string &path, std::string &error_message);
+
+    private:
+        struct Candidate {
+            float distance;
+            uint32_t node;
+        };
+        // Per-query scratch: visited marks by epoch and the two search heaps.
+        struct Search {
+            std::vector<uint32_t> visited;
+            uint32_t epoch = 0;
+            std::vector<Candidate> candidates;
+            std::vector<Candidate> results;
+        };
+
+        uint32_t* getLinks(uint32_t node, int layer);
+        const uint32_t* getLinks(uint32_t node, int layer) const;
+        int getMaxLinks(int layer) const { return 0 == layer ? 2 * m_m : m_m; }
+        float getDistance(const float* a, uint32_t node) const;
+        uint32_t greedySearch(const float* point, uint32_t entry, float &distance, int from_layer, int to_layer) const;
+        // Best-first search of one layer; out holds up to ef nodes, nearest first.
+        void searchLayer(const float* point, uint32_t entry, float entry_distance, int ef, int layer, bool skip_tombstones, Search &search, std::vector<Candidate> &out) const;
+        void selectNeighbors(std::vector<Candidate> &candidates, int max_links) const;
+        void link(uint32_t node, int layer, const std::vector<Candidate> &neighbors);
+        // knn with caller-owned scratch, so a batch allocates it once per worker.
+        int knn(const float* query, int k, Search &search, std::vector<Candidate> &found, int64_t* ids, float* distances) const;
+
+        int m_sourceDims;
+        int m_m;
+        int m_efConstruction;
+        int m_efSearch;
+        uint64_t m_seed;
+        double m_levelScale;
+        std::mt19937_64 m_random;
+
+        std::vector<int> m_dims;
+        std::vector<float> m_points;
+        std::vector<int64_t> m_nodeIds;
+        std::vector<int32_t> m_levels;
+        std::vector<uint8_t> m_tombstones;
+        // Layer 0 links of every node: a count then 2 * m slots.
+        std::vector<uint32_t> m_links0;
+        // Links of the layers above 0, per node: m + 1 slots per layer.
+        std::vector<std::vector<uint32_t>> m_upperLinks;
+        int m_maxLevel;
+        uint32_t m_entry;
+        // Node of every id that is not a tombstone.
+        std::unordered_map<int64_t, uint32_t> m_labels;
+
+        Search m_insertSearch;
+    };
+}
+
+#endif //MYPROJECT_HNSWINDEX_H
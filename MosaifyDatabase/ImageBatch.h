@@ -0,0 +1,116 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "MosaifyDatabase/PixelAllocator.h"
+
+#ifndef MYPROJECT_IMAGEBATCH_H
+#define MYPROJECT_IMAGEBATCH_H
+
+namespace NJLIC {
+
+    // A set of images stored contiguously: every image's pixels live in one
+    // shared buffer addressed through an offsets table, and the per-image
+    // fields are kept in parallel arrays. Filling a batch costs a fixed number
+    // of allocations no matter how many images it holds.
+    class ImageBatch {
+    public:
+        // Lightweight view of one image inside the batch. Pointers stay valid
+        // until the batch is cleared or appended to.
+        struct Image {
+            int id;
+            const char* filename;
+            size_t filename_length;
+            int rows;
+            int cols;
+            int comps;
+            const unsigned char* data;
+            size_t size;
+
+            std::string getFilename() const { return std::string(filename, filename_length); }
+        };
+
+        explicit ImageBatch(std::shared_ptr<IPixelAllocator> allocator = nullptr)
+                : m_offsets(1, 0), m_pixels(allocator), m_filenameOffsets(1, 0) {}
+
+        // Changing the allocator of a filled batch moves its pixels.
+        void setAllocator(std::shared_ptr<IPixelAllocator> allocator) { m_pixels.setAllocator(allocator); }
+        const std::shared_ptr<IPixelAllocator>& getAllocator() const { return m_pixels.getAllocator(); }
+
+        void clear() {
+            m_ids.clear();
+            m_rows.clear();
+            m_cols.clear();
+            m_comps.clear();
+            m_offsets.assign(1, 0);
+            m_pixels.clear();
+            m_filenameOffsets.assign(1, 0);
+            m_filenames.clear();
+        }
+
+        void reserve(size_t num_images, size_t pixel_bytes, size_t filename_bytes) {
+            m_ids.reserve(num_images);
+            m_rows.reserve(num_images);
+            m_cols.reserve(num_images);
+            m_comps.reserve(num_images);
+            m_offsets.reserve(num_images + 1);
+            m_pixels.reserve(pixel_bytes);
+            m_filenameOffsets.reserve(num_images + 1);
+            m_filenames.reserve(filename_bytes);
+        }
+
+        void append(int id, const char* filename, size_t filename_length, int rows, int cols, int comps, const unsigned char* data, size_t size) {
+            m_ids.push_back(id);
+            m_rows.push_back(rows);
+            m_cols.push_back(cols);
+            m_comps.push_back(comps);
+            m_pixels.append(data, size);
+            m_offsets.push_back(m_pixels.size());
+            m_filenames.append(filename, filename_length);
+            m_filenameOffsets.push_back(m_filenames.size());
+        }
+
+        size_t size() const { return m_ids.size(); }
+        bool empty() const { return m_ids.empty(); }
+
+        Image operator[](size_t i) const {
+            Image img;
+            img.id = m_ids[i];
+            img.filename = m_filenames.data() + m_filenameOffsets[i];
+            img.filename_length = m_filenameOffsets[i + 1] - m_filenameOffsets[i];
+            img.rows = m_rows[i];
+            img.cols = m_cols[i];
+            img.comps = m_comps[i];
+            img.data = m_pixels.data() + m_offsets[i];
+            img.size = m_offsets[i + 1] - m_offsets[i];
+            return img;
+        }
+
+        int getId(size_t i) const { return m_ids[i]; }
+        int getRows(size_t i) const { return m_rows[i]; }
+        int getCols(size_t i) const { return m_cols[i]; }
+        int getComps(size_t i) const { return m_comps[i]; }
+        const unsigned char* getData(size_t i) const { return m_pixels.data() + m_offsets[i]; }
+        size_t getDataSize(size_t i) const { return m_offsets[i + 1] - m_offsets[i]; }
+
+        const std::vector<int>& getIds() const { return m_ids; }
+        const std::vector<size_t>& getOffsets() const { return m_offsets; }
+        const unsigned char* getPixels() const { return m_pixels.data(); }
+        size_t getPixelBytes() const { return m_pixels.size(); }
+
+    private:
+        std::vector<int> m_ids;
+        std::vector<int> m_rows;
+        std::vector<int> m_cols;
+        std::vector<int> m_comps;
+        std::vector<size_t> m_offsets;
+        PixelBuffer m_pixels;
+        std::vector<size_t> m_filenameOffsets;
+        std::string m_filenames;
+    };
+}
+
+#endif //MYPROJECT_IMAGEBATCH_H
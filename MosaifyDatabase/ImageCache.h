@@ -0,0 +1,78 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <atomic>
+
+#ifndef MYPROJECT_IMAGECACHE_H
+#define MYPROJECT_IMAGECACHE_H
+
+namespace NJLIC {
+
+    struct CachedImage {
+        std::string filename;
+        int rows = 0;
+        int cols = 0;
+        int comps = 0;
+        std::vector<unsigned char> data;
+    };
+
+    struct ImageCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    // Thread-safe LRU cache of decoded images keyed by image_id; the project
+    // an entry was read under is stored with it and must match on find.
+    // The byte budget is split evenly across shards; each shard has its own
+    // lock and evicts least recently used entries once it is over budget.
+    class ImageCache {
+    public:
+        explicit ImageCache(size_t byte_budget, size_t num_shards = 16);
+        ~ImageCache();
+
+        ImageCache(const ImageCache &) = delete;
+        ImageCache& operator=(const ImageCache &) = delete;
+
+        std::shared_ptr<const CachedImage> find(int image_id, int project_id);
+        void insert(int image_id, int project_id, std::shared_ptr<const CachedImage> image);
+
+        // A read that fills the cache takes the generation of the image's shard
+        // before going to the database and inserts with it; the insert is
+        // dropped when an invalidation reached the shard in between.
+        uint64_t getGeneration(int image_id);
+        void insert(int image_id, int project_id, std::shared_ptr<const CachedImage> image, uint64_t generation);
+
+        void invalidateImage(int image_id);
+        void invalidateProject(int project_id);
+        void clear();
+
+        ImageCacheStats getStats() const;
+        size_t getByteBudget() const { return m_byteBudget; }
+
+    private:
+        struct Shard;
+
+        Shard& shardFor(int image_id);
+
+        size_t m_byteBudget;
+        std::vector<std::unique_ptr<Shard>> m_shards;
+
+        std::atomic<uint64_t> m_hits;
+        std::atomic<uint64_t> m_misses;
+        std::atomic<uint64_t> m_insertions;
+        std::atomic<uint64_t> m_evictions;
+        std::atomic<uint64_t> m_invalidations;
+    };
+}
+
+#endif //MYPROJECT_IMAGECACHE_H
@@ -0,0 +1,116 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MYPROJECT_IMAGEFEATURES_H
+#define MYPROJECT_IMAGEFEATURES_H
+
+namespace NJLIC {
+
+    class IntegralImage;
+
+    // Compact color description of an image, used to pick mosaic tiles
+    // without touching full-resolution pixels. Layout of the vector:
+    //
+    //   [0, 3)    mean CIE Lab color of the whole image
+    //   [3, 51)   Lab means of a 4x4 grid of cells, row major, 3 values per cell
+    //   [51]      intensity variance, the mean of the per-channel variances
+    //             of the 8-bit color channels, scaled to [0, 1]
+    //
+    // Means are taken in sRGB and converted to Lab once per cell. Alpha is
+    // ignored; one- and two-channel images are treated as gray.
+    struct ImageFeatures {
+        static const int GRID_SIZE = 4;
+        static const int MEAN_OFFSET = 0;
+        static const int GRID_OFFSET = 3;
+        static const int VARIANCE_OFFSET = GRID_OFFSET + GRID_SIZE * GRID_SIZE * 3;
+        static const int DIMENSIONS = VARIANCE_OFFSET + 1;
+        // Stored form (image_features.features): the values as little-endian
+        // float32s, whatever the host byte order.
+        static const int ENCODED_BYTES = DIMENSIONS * 4;
+
+        float values[DIMENSIONS];
+
+        void encode(unsigned char* bytes) const;
+        void decode(const unsigned char* bytes);
+    };
+
+    // Computes the features of an 8-bit interleaved image. Returns false when
+    // the image is empty or has an unsupported number of components.
+    bool computeImageFeatures(const unsigned char* data, int rows, int cols, int comps, ImageFeatures &features);
+    // Same, for a region of a larger image whose rows are stride bytes apart.
+    bool computeImageFeatures(const unsigned char* data, int rows, int cols, int comps, size_t stride, ImageFeatures &features);
+    // Same, for the width x height region at (x, y) of an image's summed-area
+    // tables: O(1) in the region's size, and equal to the pixel version.
+    bool computeImageFeatures(const IntegralImage &integral, int x, int y, int width, int height, ImageFeatures &features);
+
+    // Features of many images in structure-of-arrays form: dimension d of
+    // image i is getValues()[d * size() + i], so a scan over one dimension
+    // reads contiguous memory.
+    class ImageFeatureSet {
+    public:
+        void clear() {
+            m_imageIds.clear();
+            m_roiIds.clear();
+            m_txids.clear();
+            m_values.clear();
+            m_watermark = 0;
+        }
+
+        // Sizes the set for count images; every value starts at zero.
+        void resize(size_t count) {
+            m_imageIds.assign(count, 0);
+            m_roiIds.assign(count, 0);
+            m_txids.assign(count, 0);
+            m_values.assign(count * ImageFeatures::DIMENSIONS, 0.0f);
+        }
+
+        size_t size() const { return m_imageIds.size(); }
+        bool empty() const { return m_imageIds.empty(); }
+
+        const std::vector<int>& getImageIds() const { return m_imageIds; }
+        int getImageId(size_t i) const { return m_imageIds[i]; }
+        void setImageId(size_t i, int image_id) { m_imageIds[i] = image_id; }
+
+        // The images_roi.id entry i was computed over; 0 is the whole image.
+        // An image with several ROIs appears once per ROI.
+        const std::vector<int>& getRoiIds() const { return m_roiIds; }
+        int getRoiId(size_t i) const { return m_roiIds[i]; }
+        void setRoiId(size_t i, int roi_id) { m_roiIds[i] = roi_id; }
+
+        // Transaction that last wrote entry i's features. Every entry written
+        // by a transaction below getWatermark() is in the set; later ones may
+        // still have been in flight when it was read. Both are 0 when unknown.
+        int64_t getTxid(size_t i) const { return m_txids[i]; }
+        void setTxid(size_t i, int64_t txid) { m_txids[i] = txid; }
+        int64_t getWatermark() const { return m_watermark; }
+        void setWatermark(int64_t watermark) { m_watermark = watermark; }
+
+        const float* getValues() const { return m_values.data(); }
+        const float* getDimension(int d) const { return m_values.data() + static_cast<size_t>(d) * size(); }
+        float* getDimension(int d) { return m_values.data() + static_cast<size_t>(d) * size(); }
+
+        float getValue(size_t i, int d) const { return m_values[static_cast<size_t>(d) * size() + i]; }
+        void setValue(size_t i, int d, float value) { m_values[static_cast<size_t>(d) * size() + i] = value; }
+
+        void get(size_t i, ImageFeatures &features) const {
+            for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) features.values[d] = getValue(i, d);
+        }
+        void set(size_t i, const ImageFeatures &features) {
+            for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) setValue(i, d, features.values[d]);
+        }
+
+    private:
+        std::vector<int> m_imageIds;
+        std::vector<int> m_roiIds;
+        std::vector<int64_t> m_txids;
+        std::vector<float> m_values;
+        int64_t m_watermark = 0;
+    };
+}
+
+#endif //MYPROJECT_IMAGEFEATURES_H
@@ -0,0 +1,60 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MYPROJECT_IMAGERESIZER_H
+#define MYPROJECT_IMAGERESIZER_H
+
+namespace NJLIC {
+
+    // Resizes 8-bit interleaved images between two fixed sizes with a
+    // separable triangle filter whose support widens when shrinking, so
+    // downscales average every source pixel. Weights are 14-bit fixed point
+    // and every output byte comes from integer math alone: results are the
+    // same on every machine and however the work is split across threads.
+    //
+    // configure() computes the weights once; a configured resizer is
+    // read-only and can be shared by threads, each passing its own scratch.
+    class ImageResizer {
+    public:
+        ImageResizer();
+
+        void configure(int src_rows, int src_cols, int dst_rows, int dst_cols);
+
+        int getSrcRows() const { return m_srcRows; }
+        int getSrcCols() const { return m_srcCols; }
+        int getDstRows() const { return m_dstRows; }
+        int getDstCols() const { return m_dstCols; }
+
+        // Rows of src are src_stride bytes apart, rows of dst dst_stride bytes.
+        void resize(const unsigned char* src, size_t src_stride, int comps, unsigned char* dst, size_t dst_stride, std::vector<unsigned char> &scratch) const;
+
+    private:
+        // Output i reads counts[i] inputs starting at starts[i]; its weights
+        // are weights[i * taps, i * taps + counts[i]).
+        struct Axis {
+            int taps = 0;
+            std::vector<int> starts;
+            std::vector<int> counts;
+            std::vector<int16_t> weights;
+        };
+
+        static void computeAxis(int src_size, int dst_size, Axis &axis);
+
+        int m_srcRows;
+        int m_srcCols;
+        int m_dstRows;
+        int m_dstCols;
+        Axis m_vertical;
+        Axis m_horizontal;
+    };
+
+    // One-off resize; prefer a configured ImageResizer when the sizes repeat.
+    void resizeImage(const unsigned char* src, int src_rows, int src_cols, int comps, size_t src_stride, unsigned char* dst, int dst_rows, int dst_cols, size_t dst_stride);
+}
+
+#endif //MYPROJECT_IMAGERESIZER_H
@@ -0,0 +1,67 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MYPROJECT_INTEGRALIMAGE_H
+#define MYPROJECT_INTEGRALIMAGE_H
+
+namespace NJLIC {
+
+    // Summed-area tables of an 8-bit interleaved image: per color channel,
+    // the sum of the values and of their squares over every rectangle
+    // anchored at the top left corner, in 64-bit accumulators. Any rectangle
+    // then costs four lookups per table, whatever its size, so cells of any
+    // grid can be measured without going back to the pixels.
+    //
+    // Like ImageFeatures, alpha is ignored and one- and two-channel images
+    // keep a single gray channel. Entry (x, y) covers [0, x) x [0, y), so the
+    // tables are (cols + 1) x (rows + 1).
+    class IntegralImage {
+    public:
+        IntegralImage();
+
+        // Builds the tables; rows of data are stride bytes apart. Returns
+        // false, leaving the tables empty, when the image is empty or has an
+        // unsupported number of components.
+        bool build(const unsigned char* data, int rows, int cols, int comps, size_t stride, unsigned threads = 0);
+        void clear();
+
+        bool empty() const { return m_sums.empty(); }
+        int getRows() const { return m_rows; }
+        int getCols() const { return m_cols; }
+        // Channels kept: 3 for color images, 1 for gray.
+        int getChannels() const { return m_channels; }
+        size_t getMemoryUsage() const { return (m_sums.size() + m_squares.size()) * sizeof(uint64_t); }
+
+        // Sums over columns [x, x + width) and rows [y, y + height), which
+        // must lie inside the image.
+        uint64_t getSum(int x, int y, int width, int height, int channel) const { return lookup(m_sums, x, y, width, height, channel); }
+        uint64_t getSquareSum(int x, int y, int width, int height, int channel) const { return lookup(m_squares, x, y, width, height, channel); }
+
+        double getMean(int x, int y, int width, int height, int channel) const;
+        // Population variance of the channel over the rectangle.
+        double getVariance(int x, int y, int width, int height, int channel) const;
+
+    private:
+        uint64_t lookup(const std::vector<uint64_t> &table, int x, int y, int width, int height, int channel) const {
+            const size_t row_stride = (static_cast<size_t>(m_cols) + 1) * m_channels;
+            const size_t top = static_cast<size_t>(y) * row_stride;
+            const size_t bottom = static_cast<size_t>(y + height) * row_stride;
+            const size_t left = static_cast<size_t>(x) * m_channels + channel;
+            const size_t right = static_cast<size_t>(x + width) * m_channels + channel;
+            return table[bottom + right] - table[bottom + left] - table[top + right] + table[top + left];
+        }
+
+        int m_rows;
+        int m_cols;
+        int m_channels;
+        std::vector<uint64_t> m_sums;
+        std::vector<uint64_t> m_squares;
+    };
+}
+
+#endif //MYPROJECT_INTEGRALIMAGE_H
@@ -0,0 +1,56 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+
+#ifndef MYPROJECT_INVALIDATIONLISTENER_H
+#define MYPROJECT_INVALIDATIONLISTENER_H
+
+struct pg_conn;
+
+namespace NJLIC {
+
+    // A change reported by the triggers installed in createTables. A table of
+    // "*" means notifications may have been missed (e.g. the connection was
+    // lost) and everything should be invalidated.
+    struct Invalidation {
+        std::string table;
+        int id = 0;
+        int project_id = 0;
+    };
+
+    // Owns a dedicated connection that LISTENs on the invalidation channel and
+    // delivers each notification to a handler from a background thread.
+    class InvalidationListener {
+    public:
+        static const char* CHANNEL;
+
+        InvalidationListener();
+        ~InvalidationListener();
+
+        InvalidationListener(const InvalidationListener &) = delete;
+        InvalidationListener& operator=(const InvalidationListener &) = delete;
+
+        bool start(const std::string &connectionString, const std::function<void(const Invalidation&)> &handler, std::string &error_message);
+        void stop();
+        bool isRunning() const { return m_running; }
+
+        static bool parse(const std::string &payload, Invalidation &invalidation);
+
+    private:
+        void run();
+        bool listen(std::string &error_message);
+
+        pg_conn* m_conn;
+        std::function<void(const Invalidation&)> m_handler;
+        std::thread m_thread;
+        std::atomic<bool> m_running;
+        std::atomic<bool> m_stop;
+    };
+}
+
+#endif //MYPROJECT_INVALIDATIONLISTENER_H
@@ -0,0 +1,113 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#ifndef MYPROJECT_LRUCACHE_H
+#define MYPROJECT_LRUCACHE_H
+
+namespace NJLIC {
+
+    // Byte-budgeted least recently used map of shared values. Not thread
+    // safe: ImageCache and ScaledTileCache wrap it in their own locks and
+    // keep their own statistics.
+    template<typename K, typename V, typename Hash = std::hash<K>>
+    class LruCache {
+    public:
+        explicit LruCache(size_t byte_budget = 0) : m_byteBudget(byte_budget), m_bytes(0) {
+        }
+
+        void setByteBudget(size_t byte_budget) { m_byteBudget = byte_budget; }
+        size_t getByteBudget() const { return m_byteBudget; }
+
+        // Marks the entry most recently used; nullptr when there is none.
+        std::shared_ptr<const V> find(const K &key) {
+            auto it = m_index.find(key);
+            if (it == m_index.end()) return nullptr;
+
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            return it->second->value;
+        }
+
+        // Replaces any entry for key, then evicts from the cold end until the
+        // budget holds. A value larger than the whole budget is not stored.
+        // Returns the number of entries evicted.
+        size_t insert(const K &key, std::shared_ptr<const V> value, size_t bytes) {
+            if (!value || bytes > m_byteBudget) return 0;
+
+            auto it = m_index.find(key);
+            if (it != m_index.end()) erase(it->second);
+
+            m_lru.push_front(Entry{key, std::move(value), bytes});
+            m_index[key] = m_lru.begin();
+            m_bytes += bytes;
+
+            size_t evicted = 0;
+            while (m_bytes > m_byteBudget && !m_lru.empty()) {
+                erase(std::prev(m_lru.end()));
+                ++evicted;
+            }
+            return evicted;
+        }
+
+        // Removes the entry for key; returns whether there was one.
+        bool erase(const K &key) {
+            auto it = m_index.find(key);
+            if (it == m_index.end()) return false;
+
+            erase(it->second);
+            return true;
+        }
+
+        // Removes every entry for which pred(key, value) holds; returns how
+        // many. Walks the whole cache, so prefer erase when the key is known.
+        template<typename Pred>
+        size_t eraseIf(const Pred &pred) {
+            size_t erased = 0;
+            for (auto it = m_lru.begin(); it != m_lru.end();) {
+                auto next = std::next(it);
+                if (pred(it->key, *it->value)) {
+                    erase(it);
+                    ++erased;
+                }
+                it = next;
+            }
+            return erased;
+        }
+
+        void clear() {
+            m_lru.clear();
+            m_index.clear();
+            m_bytes = 0;
+        }
+
+        size_t size() const { return m_lru.size(); }
+        size_t getBytes() const { return m_bytes; }
+
+    private:
+        struct Entry {
+            K key;
+            std::shared_ptr<const V> value;
+            size_t bytes;
+        };
+
+        void erase(typename std::list<Entry>::iterator it) {
+            m_bytes -= it->bytes;
+            m_index.erase(it->key);
+            m_lru.erase(it);
+        }
+
+        size_t m_byteBudget;
+        size_t m_bytes;
+        std::list<Entry> m_lru; // Most recently used at the front.
+        std::unordered_map<K, typename std::list<Entry>::iterator, Hash> m_index;
+    };
+}
+
+#endif //MYPROJECT_LRUCACHE_H
@@ -0,0 +1,96 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <cstdint>
+#include <unordered_map>
+
+#ifndef MYPROJECT_METADATACACHE_H
+#define MYPROJECT_METADATACACHE_H
+
+namespace NJLIC {
+
+    struct CachedUser {
+        std::string email;
+        std::string first_name;
+        std::string last_name;
+    };
+
+    struct CachedProject {
+        int user_id = 0;
+        std::string project_name;
+    };
+
+    struct MetadataCacheStats {
+        uint64_t hits = 0;
+        uint64_t negative_hits = 0;
+        uint64_t misses = 0;
+        uint64_t invalidations = 0;
+    };
+
+    // Small read-through cache for users, projects and project membership.
+    // Entries expire after a fixed TTL; the database also invalidates them
+    // explicitly on update*/delete*. With negative caching enabled, lookups
+    // of users that do not exist are remembered too.
+    class MetadataCache {
+    public:
+        enum class Lookup { Miss, Hit, NegativeHit };
+
+        explicit MetadataCache(std::chrono::milliseconds ttl, bool negative_caching = false);
+
+        Lookup findUserId(const std::string &email, int &user_id);
+        void putUserId(const std::string &email, int user_id);
+        void putMissingEmail(const std::string &email);
+
+        Lookup findUser(int user_id, CachedUser &user);
+        void putUser(int user_id, const CachedUser &user);
+        void putMissingUser(int user_id);
+
+        Lookup findProject(int project_id, CachedProject &project);
+        void putProject(int project_id, const CachedProject &project);
+
+        Lookup findProjects(int user_id, std::vector<int> &project_ids);
+        void putProjects(int user_id, const std::vector<int> &project_ids);
+
+        void invalidateEmail(const std::string &email);
+        void invalidateUser(int user_id);
+        void invalidateProject(int project_id);
+        void invalidateProjects(int user_id);
+        void clear();
+
+        MetadataCacheStats getStats() const;
+        bool isNegativeCaching() const { return m_negativeCaching; }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        template<typename V>
+        struct Entry {
+            V value;
+            bool missing;
+            Clock::time_point expires;
+        };
+
+        template<typename K, typename V>
+        Lookup find(std::unordered_map<K, Entry<V>> &map, const K &key, V &value);
+
+        template<typename K, typename V>
+        void put(std::unordered_map<K, Entry<V>> &map, const K &key, const V &value, bool missing);
+
+        std::chrono::milliseconds m_ttl;
+        bool m_negativeCaching;
+
+        mutable std::mutex m_mutex;
+        std::unordered_map<std::string, Entry<int>> m_userIdsByEmail;
+        std::unordered_map<int, Entry<CachedUser>> m_users;
+        std::unordered_map<int, Entry<CachedProject>> m_projects;
+        std::unordered_map<int, Entry<std::vector<int>>> m_projectsByUser;
+        MetadataCacheStats m_stats;
+    };
+}
+
+#endif //MYPROJECT_METADATACACHE_H
@@ -0,0 +1,145 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include "MosaifyDatabase/MosaicMap.h"
+#include "MosaifyDatabase/IntegralImage.h"
+#include "MosaifyDatabase/TileMatcher.h"
+#include "MosaifyDatabase/TileAssigner.h"
+
+#ifndef MYPROJECT_MOSAICENGINE_H
+#define MYPROJECT_MOSAICENGINE_H
+
+namespace NJLIC {
+
+    class MosaifyDatabase;
+
+    // Turns a project's mosaic image and tile library into a mosaic map.
+    //
+    // buildMap reads the target from mosaic_images, splits it into a
+    // grid_cols x grid_rows grid, computes the features of every cell from
+    // the target's summed-area tables (see IntegralImage), matches
+    // each cell to the nearest tile and upserts the result into mosaic_maps.
+    // With repeat limits set, tiles are assigned by a TileAssigner instead.
+    // Every ROI of a tile image is a candidate of its own (see
+    // readImageFeatures); the map records which one each cell shows.
+    // Database round trips run on the caller's connection; the per-cell work
+    // runs on Options::threads threads.
+    //
+    // The tables are kept between calls and rebuilt only when the target's
+    // version changes, so trying another grid size costs a version check
+    // and a lookup per cell rather than a pass over the target.
+    class MosaicEngine {
+    public:
+        struct Options {
+            TileMatcher::Options matcher;
+            // 0 uses every hardware thread.
+            unsigned threads = 0;
+            // Backfill features of tiles stored before features existed.
+            bool compute_missing_features = true;
+            // Repeat limits, see TileAssigner; 0 disables each. The assigner
+            // matches on matcher.dimensions with matcher.epsilon.
+            int max_uses = 0;
+            int min_repeat_distance = 0;
+            int candidates = 16;
+            // Adaptive mode: each grid cell is split into quadrants, up to
+            // max_depth times, while its intensity variance (scaled like the
+            // ImageFeatures variance) exceeds split_variance, so flat areas
+            // keep large cells and detailed ones get small cells. 0 keeps the
+            // grid uniform. Adaptive maps support max_uses but not
+            // min_repeat_distance.
+            int max_depth = 0;
+            float split_variance = 0.005f;
+            // With matcher.strategy Approximate, the HnswIndex is kept in
+            // this file (one per project) between runs instead of being
+            // rebuilt: each build or update loads it, inserts the tiles added
+            // since it was saved, drops deleted ones and saves it again.
+            // Empty builds a throwaway index every time.
+            std::string index_path;
+        };
+
+        // Wall time of each phase of the last buildMap, in milliseconds.
+        struct Timings {
+            // Includes building the target's tables when it changed.
+            double read_target = 0.0;
+            // Includes splitting the grid in adaptive mode.
+            double cell_features = 0.0;
+            double read_tiles = 0.0;
+            double build_matcher = 0.0;
+            double match = 0.0;
+            double write_map = 0.0;
+            double total = 0.0;
+        };
+
+        // Outcome of updateMap.
+        struct UpdateResult {
+            // Indices (row major) of the cells that now hold a different tile.
+            std::vector<size_t> changed_cells;
+            // Tiles added since the map was matched.
+            size_t new_tiles = 0;
+            // Cells whose tile was deleted; all of them are rematched.
+            size_t invalid_cells = 0;
+            // Cells a new tile matches more closely than their current one.
+            size_t improved_cells = 0;
+        };
+
+        explicit MosaicEngine(MosaifyDatabase &database);
+
+        // With Options::max_depth set, the map is adaptive and its smallest
+        // cells are 1 / 2^max_depth of a grid cell, which must still cover at
+        // least one target pixel.
+        bool buildMap(int project_id, int grid_cols, int grid_rows, const Options &options, MosaicMap &mosaic_map, std::string &error_message);
+        bool buildMap(int project_id, int grid_cols, int grid_rows, const Options &options, std::string &error_message);
+
+        // Brings the stored map up to date with the project's tiles without a
+        // full rematch. Only tiles whose features were written since the map's
+        // tile watermark (new images, updated ones, backfilled features and new
+        // ROIs alike) are searched for cells that still have a tile; cells
+        // whose tile was deleted are matched against the whole library. The
+        // map is stored only when something changed. Pass result.changed_cells
+        // to MosaicRenderer::renderCells to patch the rendered image. Repeat
+        // limits are global, so with them set every cell is reassigned and
+        // changed_cells lists the cells that differ.
+        bool updateMap(int project_id, const Options &options, MosaicMap &mosaic_map, UpdateResult &result, std::string &error_message);
+
+        // Brings the cached tables of the project's target up to date; a no-op
+        // apart from the version check when they already are.
+        bool loadTarget(int project_id, unsigned threads, std::string &error_message);
+        // Tables of the target last loaded; empty before the first load.
+        const IntegralImage& getTarget() const { return m_target; }
+
+        // Brings the index at options.index_path up to date with the
+        // project's tiles, so the next build does not pay for the inserts.
+        // Call it after adding tiles; buildMap and updateMap do the same.
+        bool syncTileIndex(int project_id, const Options &options, std::string &error_message);
+        // The index last synced; empty before the first sync.
+        const HnswIndex& getTileIndex() const { return m_index; }
+
+        const Timings& getLastTimings() const { return m_timings; }
+        // Strategy the matcher used in the last buildMap.
+        MatchStrategy getLastStrategy() const { return m_strategy; }
+        // Assignment statistics of the last call that enforced repeat limits.
+        const TileAssigner::Stats& getLastAssignmentStats() const { return m_assignmentStats; }
+
+    private:
+        void assignTiles(const std::vector<float> &cell_features, const ImageFeatureSet &tiles, const Options &options, MosaicMap &mosaic_map);
+        bool syncTileIndex(const ImageFeatureSet &tiles, const Options &options, std::string &error_message);
+        // Nearest tile index in tiles of each query, through the synced index;
+        // queries it cannot resolve to a tile are matched exactly.
+        void matchIndexed(const ImageFeatureSet &tiles, const float* queries, size_t count, const Options &options, std::vector<size_t> &found) const;
+
+        MosaifyDatabase &m_database;
+        Timings m_timings;
+        MatchStrategy m_strategy;
+        TileAssigner::Stats m_assignmentStats;
+        IntegralImage m_target;
+        int m_targetProjectId;
+        int64_t m_targetVersion;
+        HnswIndex m_index;
+        std::string m_indexPath;
+    };
+}
+
+#endif //MYPROJECT_MOSAICENGINE_H
@@ -0,0 +1,140 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#ifndef MYPROJECT_MOSAICMAP_H
+#define MYPROJECT_MOSAICMAP_H
+
+namespace NJLIC {
+
+    // Per-cell orientation applied to a tile before it is drawn. Rotation is
+    // applied first, then the flips.
+    enum MosaicTransform : uint8_t {
+        TRANSFORM_NONE = 0,
+        TRANSFORM_ROTATE_90 = 1,
+        TRANSFORM_ROTATE_180 = 2,
+        TRANSFORM_ROTATE_270 = 3,
+        TRANSFORM_ROTATION_MASK = 3,
+        TRANSFORM_FLIP_HORIZONTAL = 4,
+        TRANSFORM_FLIP_VERTICAL = 8,
+    };
+
+    // A row of images_roi: the part of an image a tile shows.
+    struct ImageROI {
+        int id = 0;
+        int image_id = 0;
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+    };
+
+    // Where a cell of an adaptive map sits, in units of its smallest possible
+    // cell: a grid cell is 1 << getMaxDepth() units wide and high.
+    struct MosaicCellRect {
+        int x = 0;
+        int y = 0;
+        int size = 0;
+    };
+
+    // A grid of tile image ids, row major. Cells that have not been assigned
+    // hold 0, which is never a valid images.id. A cell may also name an
+    // images_roi.id, the part of its image it shows; 0 is the whole image.
+    //
+    // An adaptive map splits each grid cell into a quadtree of up to
+    // getMaxDepth() levels, so flat areas take few cells and detailed ones
+    // many. Its cells are the quadtree leaves: grid cells in row-major order,
+    // each one's leaves in pre-order (top left, top right, bottom left, bottom
+    // right quadrant). The cells of a grid row are therefore contiguous, see
+    // getFirstCell(). The col/row accessors address uniform maps only.
+    //
+    // Stored in mosaic_maps.map_bin as a small little-endian header (plus the
+    // tile watermark, if set, and the quadtree depth and node count of an
+    // adaptive map) followed by a zlib stream of the split flags of an
+    // adaptive map, one bit per node in pre-order, then the int32 cells
+    // (then the per-cell transforms and the int32 ROI ids, if any).
+    // decode() inflates straight into the cell array, so a read costs one pass
+    // over the compressed bytes and no intermediate buffers.
+    class MosaicMap {
+    public:
+        MosaicMap();
+        MosaicMap(int grid_cols, int grid_rows, bool with_transforms = false);
+
+        void resize(int grid_cols, int grid_rows, bool with_transforms = false);
+        void clear();
+
+        int getGridCols() const { return m_gridCols; }
+        int getGridRows() const { return m_gridRows; }
+        size_t getCellCount() const { return m_cells.size(); }
+
+        int32_t getCell(int col, int row) const { return m_cells[static_cast<size_t>(row) * m_gridCols + col]; }
+        void setCell(int col, int row, int32_t image_id) { m_cells[static_cast<size_t>(row) * m_gridCols + col] = image_id; }
+
+        bool hasTransforms() const { return !m_transforms.empty(); }
+        uint8_t getTransform(int col, int row) const;
+        void setTransform(int col, int row, uint8_t transform);
+
+        bool hasRois() const { return !m_rois.empty(); }
+        int32_t getRoi(int col, int row) const;
+        void setRoi(int col, int row, int32_t roi_id);
+
+        // Splits every grid cell per splits, one flag per quadtree node in the
+        // order cells are stored; a set flag splits the node into four. Cells
+        // are reset to 0 and ROI ids dropped, as by resize(). Returns false,
+        // leaving the map unchanged, when splits does not describe exactly one
+        // tree of at most max_depth levels per grid cell. max_depth 0 makes
+        // the map uniform again.
+        bool setQuadtree(int max_depth, const std::vector<uint8_t> &splits);
+        bool isAdaptive() const { return m_maxDepth > 0; }
+        int getMaxDepth() const { return m_maxDepth; }
+        const std::vector<uint8_t>& getSplits() const { return m_splits; }
+
+        MosaicCellRect getCellRect(size_t cell) const;
+        // Quadtree level of a cell; 0 is a whole grid cell.
+        int getCellLevel(size_t cell) const;
+        // Index of the first cell of a grid row; getFirstCell(getGridRows()) is getCellCount().
+        size_t getFirstCell(int grid_row) const;
+        int getCellGridRow(size_t cell) const { return getCellRect(cell).y >> m_maxDepth; }
+
+        const int32_t* getCells() const { return m_cells.data(); }
+        int32_t* getCells() { return m_cells.data(); }
+        const uint8_t* getTransforms() const { return m_transforms.data(); }
+        // nullptr unless hasRois().
+        const int32_t* getRois() const { return m_rois.empty() ? nullptr : m_rois.data(); }
+        // Allocates the ROI ids (all 0) if the map has none yet.
+        int32_t* getRois();
+
+        // Transaction id below which every tile's features were written when
+        // the map was matched (ImageFeatureSet::getWatermark()); tiles stamped
+        // at or above it may be new. 0 means unknown. resize() resets it.
+        int64_t getTileWatermark() const { return m_tileWatermark; }
+        void setTileWatermark(int64_t watermark) { m_tileWatermark = watermark; }
+
+        bool encode(std::vector<unsigned char> &out, std::string &error_message) const;
+        bool decode(const unsigned char* data, size_t size, std::string &error_message);
+
+        bool operator==(const MosaicMap &other) const;
+        bool operator!=(const MosaicMap &other) const { return !(*this == other); }
+
+    private:
+        int m_gridCols;
+        int m_gridRows;
+        std::vector<int32_t> m_cells;
+        std::vector<uint8_t> m_transforms;
+        std::vector<int32_t> m_rois;
+        int64_t m_tileWatermark;
+        int m_maxDepth;
+        std::vector<uint8_t> m_splits;
+        // Per cell of an adaptive map.
+        std::vector<MosaicCellRect> m_rects;
+        // getFirstCell() of every grid row of an adaptive map, and the end.
+        std::vector<size_t> m_rowCells;
+    };
+}
+
+#endif //MYPROJECT_MOSAICMAP_H
@@ -0,0 +1,121 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "MosaifyDatabase/ImageBatch.h"
+#include "MosaifyDatabase/MosaicMap.h"
+#include "MosaifyDatabase/PixelAllocator.h"
+#include "MosaifyDatabase/ScaledTileCache.h"
+
+#ifndef MYPROJECT_MOSAICRENDERER_H
+#define MYPROJECT_MOSAICRENDERER_H
+
+namespace NJLIC {
+
+    class MosaifyDatabase;
+
+    // Turns a project's mosaic map back into pixels.
+    //
+    // Every distinct tile the map references is fetched once, in one query,
+    // and resized to the cell size once (see ImageResizer), in parallel. A
+    // cell that names an ROI shows only that rectangle of its image, scaled
+    // straight from the original, which is fetched once for all its ROIs. Each
+    // cell then only copies its pre-scaled tile, oriented by the cell's
+    // transform and converted to the output channel count, so render time
+    // follows the number of unique tiles rather than cells. Scaled tiles come
+    // from, in order: the optional ScaledTileCache (revalidated by version),
+    // a stored level in image_levels, or the original. Grid rows are rendered
+    // as independent bands on Options::threads threads, and all pixel math is
+    // integer, so the output is bit-identical whatever the thread count. The
+    // result is stored as the project's rendered mosaic image
+    // (MosaicImageKind::Rendered); the target image is left alone.
+    //
+    // Cells of an adaptive map (see MosaicMap) are drawn at the grid cell
+    // size halved once per quadtree level, so Options::cell_width and
+    // cell_height must be multiples of 2^MosaicMap::getMaxDepth().
+    //
+    // With Options::band_grid_rows set, the canvas is never held whole: it is
+    // rendered band by band, each band is compressed on a worker thread while
+    // the next one is composed, and written as soon as it is ready (see
+    // MosaifyDatabase::createMosaicImageBands). Peak memory is two raw and
+    // two compressed bands plus the scaled tiles.
+    class MosaicRenderer {
+    public:
+        struct Options {
+            int cell_width = 32;
+            int cell_height = 32;
+            // 1 (gray), 3 (RGB) or 4 (RGBA).
+            int comps = 3;
+            // 0 uses every hardware thread.
+            unsigned threads = 0;
+            // Store tiles this render had to scale as levels in image_levels,
+            // so later renders at the same cell size skip the originals.
+            bool store_levels = false;
+            // Grid rows per stored band; 0 stores the canvas as one value.
+            // Only render() without a canvas streams bands, loading tiles
+            // for a bounded batch of bands at a time.
+            int band_grid_rows = 0;
+        };
+
+        // Wall time of each phase of the last render, in milliseconds.
+        struct Timings {
+            double read_map = 0.0;
+            double read_tiles = 0.0;
+            double scale_tiles = 0.0;
+            double write_levels = 0.0;
+            double render = 0.0;
+            double compress = 0.0;
+            double write_image = 0.0;
+            double total = 0.0;
+        };
+
+        explicit MosaicRenderer(MosaifyDatabase &database);
+
+        // Renders the project's map into canvas (rows x cols x Options::comps) and stores it.
+        bool render(int project_id, const Options &options, PixelBuffer &canvas, int &rows, int &cols, std::string &error_message);
+        bool render(int project_id, const Options &options, std::string &error_message);
+
+        // Re-renders only the grid rows containing the given cells (indices
+        // into mosaic_map, e.g. MosaicEngine::UpdateResult::changed_cells) and
+        // patches those byte ranges of the stored rendered image in place, or
+        // rewrites the bands holding them if it is banded. Does a full render
+        // if the stored image does not match options.
+        bool renderCells(int project_id, const MosaicMap &mosaic_map, const std::vector<size_t> &cells, const Options &options, std::string &error_message);
+
+        const Timings& getLastTimings() const { return m_timings; }
+
+        // Optional cache of pre-scaled tiles kept across renders; may be
+        // shared by several renderers. nullptr disables it.
+        void setTileCache(std::shared_ptr<ScaledTileCache> cache);
+        const std::shared_ptr<ScaledTileCache>& getTileCache() const { return m_tileCache; }
+
+        // Tiles pre-scaled for one render, by image id (high 32 bits) and ROI
+        // id (low 32 bits). [2 * level] is the size of a cell at that
+        // quadtree level (0 for uniform maps), [2 * level + 1] the transposed
+        // size used by non-square cells rotated by 90 or 270. Sizes no cell
+        // needs are null or absent.
+        typedef std::unordered_map<uint64_t, std::vector<std::shared_ptr<const ScaledTile>>> ScaledTiles;
+
+        // The rendering step alone. tiles must hold every id the map uses;
+        // cells whose tile is missing, unassigned or unreadable stay black.
+        // canvas is resized to grid_rows * cell_height rows of
+        // grid_cols * cell_width pixels.
+        static bool compose(const MosaicMap &mosaic_map, const ImageBatch &tiles, const Options &options, PixelBuffer &canvas, std::string &error_message);
+        // Same, cropping cells that name an ROI to the matching rectangle of rois.
+        static bool compose(const MosaicMap &mosaic_map, const ImageBatch &tiles, const std::vector<ImageROI> &rois, const Options &options, PixelBuffer &canvas, std::string &error_message);
+
+    private:
+        bool renderBands(int project_id, const MosaicMap &mosaic_map, const ScaledTiles &scaled_tiles, const std::vector<int> &bands, int band_grid_rows, const Options &options, std::string &error_message);
+        bool loadScaledTiles(int project_id, const MosaicMap &mosaic_map, const std::vector<int> &grid_rows, const Options &options, ScaledTiles &scaled_tiles, std::string &error_message);
+
+        MosaifyDatabase &m_database;
+        std::shared_ptr<ScaledTileCache> m_tileCache;
+        Timings m_timings;
+    };
+}
+
+#endif //MYPROJECT_MOSAICRENDERER_H
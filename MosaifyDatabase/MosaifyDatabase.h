@@ -7,16 +7,58 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include <chrono>
+#include <cstdint>
+#include "MosaifyDatabase/ImageBatch.h"
+#include "MosaifyDatabase/PixelAllocator.h"
+#include "MosaifyDatabase/ImageCache.h"
+#include "MosaifyDatabase/MetadataCache.h"
+#include "MosaifyDatabase/TileDiskCache.h"
+#include "MosaifyDatabase/InvalidationListener.h"
+#include "MosaifyDatabase/MosaicMap.h"
+#include "MosaifyDatabase/ImageFeatures.h"
+#include "MosaifyDatabase/TileIndex.h"
 
 #ifndef MYPROJECT_DATABASE_H
 #define MYPROJECT_DATABASE_H
 
+struct pg_conn;
+
 namespace NJLIC {
 
     class IImageData;
 
+    // Rows of mosaic_images. The functions without a kind work on the target.
+    enum class MosaicImageKind { Target = 0, Rendered = 1 };
+
+    // Per image outcome of readImageLevels.
+    enum class ImageLevelState {
+        Unchanged = 0, // The caller's known version is current; no pixels sent.
+        Scaled = 1,    // The stored pre-scaled level.
+        Original = 2   // No current level; the full image.
+    };
+
+    // One horizontal band of a banded mosaic image, compressed with
+    // MosaifyDatabase::encodeMosaicImageBand. size is the raw byte count.
+    struct MosaicImageBand {
+        int band = 0;
+        size_t size = 0;
+        std::vector<unsigned char> data;
+    };
+
+    // Each instance owns its connection; connecting or disconnecting one
+    // leaves the others alone.
     class MosaifyDatabase {
     private:
+        pg_conn* m_conn;
+        std::shared_ptr<IPixelAllocator> m_pixelAllocator;
+        std::shared_ptr<ImageCache> m_imageCache;
+        std::shared_ptr<MetadataCache> m_metadataCache;
+        std::shared_ptr<TileDiskCache> m_tileDiskCache;
+        std::string m_connectionString;
+        std::unique_ptr<InvalidationListener> m_listener;
+
+        void applyInvalidation(const Invalidation &invalidation);
 
     public:
         bool executeSQL(const std::string &sql, std::string &error_message);
@@ -24,29 +66,168 @@ namespace NJLIC {
         MosaifyDatabase();
         ~MosaifyDatabase();
 
+        MosaifyDatabase(const MosaifyDatabase &) = delete;
+        MosaifyDatabase& operator=(const MosaifyDatabase &) = delete;
+
         bool connect(const std::string connectionString, std::string &error_message);
         void disconnect();
 
+        // Allocator used for every pixel buffer the database hands out (batches,
+        // decode scratch space, render targets). nullptr restores the default.
+        void setPixelAllocator(std::shared_ptr<IPixelAllocator> allocator);
+        const std::shared_ptr<IPixelAllocator>& getPixelAllocator() const;
+
+        // Optional in-process cache for readImage. Local updateImage, deleteImage,
+        // deleteProject and deleteUser calls invalidate the affected entries.
+        void enableImageCache(size_t byte_budget, size_t num_shards = 16);
+        void disableImageCache();
+        std::shared_ptr<ImageCache> getImageCache() const;
+        ImageCacheStats getImageCacheStats() const;
+
+        // Optional on-disk cache of decoded tiles used by readImage and
+        // readImages(ImageBatch). After a restart its entries are revalidated
+        // lazily: a conditional read on first use, pixels only if they changed.
+        // A byte_budget of 0 leaves it unbounded.
+        bool enableTileDiskCache(const std::string &path, std::string &error_message);
+        bool enableTileDiskCache(const std::string &path, uint64_t byte_budget, std::string &error_message);
+        void disableTileDiskCache();
+        std::shared_ptr<TileDiskCache> getTileDiskCache() const;
+
+        // Optional TTL cache for readUser, readProject and readProjects. Local
+        // create*/update*/delete* calls invalidate the affected entries.
+        void enableMetadataCache(std::chrono::milliseconds ttl, bool negative_caching = false);
+        void disableMetadataCache();
+        std::shared_ptr<MetadataCache> getMetadataCache() const;
+        MetadataCacheStats getMetadataCacheStats() const;
+
+        // Opens a second connection that LISTENs for the change notifications
+        // sent by the createTables triggers and applies them to the local
+        // caches, so caches stay coherent with writes from other processes.
+        bool startInvalidationListener(std::string &error_message);
+        void stopInvalidationListener();
+        bool isInvalidationListenerRunning() const;
+
+        // reset drops every table first and clears the attached caches, since
+        // ids start over; reset() is createTables(true).
         bool createTables(bool reset, std::string &error_message);
+        // With image_partitions > 0, images and images_roi are hash partitioned by
+        // project_id into that many partitions. 0 keeps them unpartitioned.
+        bool createTables(bool reset, int image_partitions, std::string &error_message);
+        bool getImagePartitionCount(int &count, std::string &error_message);
         bool reset(std::string &error_message);
 
+        // Brings an existing database up to the latest schema version without
+        // downtime (indexes are built CONCURRENTLY). createTables runs it too.
+        bool migrate(std::string &error_message);
+        bool getSchemaVersion(int &version, std::string &error_message);
+        static int getLatestSchemaVersion();
+
+        // Runs EXPLAIN on sql and returns the plan text, one node per line.
+        bool explain(const std::string &sql, std::string &plan, std::string &error_message);
+
         bool createMosaicImage(int project_id, const std::unique_ptr<IImageData> &img, int &image_id, std::string &error_message);
         bool readMosaicImage(int project_id, std::unique_ptr<IImageData> &img, std::string& error_message);
+        bool readMosaicImage(int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string& error_message);
+        // Reads the mosaic image into a one-image batch; the image id is mosaic_images.id.
+        bool readMosaicImage(int project_id, ImageBatch &batch, std::string& error_message);
+        bool readMosaicImage(int project_id, MosaicImageKind kind, ImageBatch &batch, std::string& error_message);
+        // Conditional read into a batch; the batch is left alone unless modified.
+        bool readMosaicImage(int project_id, int64_t known_version, ImageBatch &batch, int64_t &version, bool &modified, std::string& error_message);
         bool updateMosaicImage(int project_id, const std::unique_ptr<IImageData> &img, std::string& error_message);
         bool deleteMosaicImage(int project_id, std::string& error_message);
+        // Creates the project's mosaic image or replaces it, in one round trip.
+        bool upsertMosaicImage(int project_id, const std::unique_ptr<IImageData> &img, int &image_id, std::string &error_message);
+        bool upsertMosaicImage(int project_id, MosaicImageKind kind, int rows, int cols, int comps, const unsigned char* data, size_t size, int &image_id, std::string &error_message);
+        // Size of the stored image without its pixels; all zero when there is none.
+        bool readMosaicImageInfo(int project_id, MosaicImageKind kind, int &rows, int &cols, int &comps, std::string &error_message);
+        // Same, plus the band height of a banded image (0 when stored whole).
+        bool readMosaicImageInfo(int project_id, MosaicImageKind kind, int &rows, int &cols, int &comps, int &band_rows, std::string &error_message);
+
+        // Banded mosaic images, for outputs too large to hold at once. Band i
+        // holds rows [i * band_rows, (i + 1) * band_rows) of the image, zlib
+        // compressed on its own, in mosaic_image_bands. createMosaicImageBands
+        // replaces the image with an empty banded one under a new version;
+        // bands are then written in any order. Rewriting bands of an existing
+        // image ends with finishMosaicImageBands, which moves the version once.
+        // readMosaicImage assembles the whole image; readMosaicImageBand reads
+        // one band. Upserting the image whole drops its bands.
+        bool createMosaicImageBands(int project_id, MosaicImageKind kind, int rows, int cols, int comps, int band_rows, int &image_id, std::string &error_message);
+        bool writeMosaicImageBand(int project_id, MosaicImageKind kind, const MosaicImageBand &band, std::string &error_message);
+        bool finishMosaicImageBands(int project_id, MosaicImageKind kind, std::string &error_message);
+        bool readMosaicImageBand(int project_id, MosaicImageKind kind, int band, PixelBuffer &pixels, std::string &error_message);
+        // Compresses a band for writeMosaicImageBand. Needs no connection, so
+        // bands can be compressed on other threads while one is written.
+        static bool encodeMosaicImageBand(int band, const unsigned char* pixels, size_t size, MosaicImageBand &encoded, std::string &error_message);
+
+        // Overwrites byte ranges of the stored pixels in place. data holds the
+        // replacement for each (offsets[i], sizes[i]) range, back to back; the
+        // ranges are ascending, disjoint and inside the image. Banded images
+        // are patched by rewriting bands instead.
+        bool patchMosaicImage(int project_id, MosaicImageKind kind, const unsigned char* data, const std::vector<size_t> &offsets, const std::vector<size_t> &sizes, std::string &error_message);
         bool doesMosaicImageExist(int project_id, std::string& error_message);
+        // Batch form: exists[i] tells whether project_ids[i] has a mosaic image.
+        bool doesMosaicImageExist(const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message);
 
         bool createMosaicMap(int project_id, const std::string& mosaic_map, std::string &error_message);
         bool readMosaicMap(int project_id, std::string& mosaic_map, std::string &error_message);
+        bool readMosaicMap(int project_id, int64_t known_version, std::string& mosaic_map, int64_t &version, bool &modified, std::string &error_message);
         bool updateMosaicMap(int project_id, const std::string& mosaic_map, std::string &error_message);
         bool deleteMosaicMap(int project_id, std::string &error_message);
+        // Creates the project's mosaic map or replaces it, in one round trip.
+        bool upsertMosaicMap(int project_id, const std::string& mosaic_map, int &map_id, std::string &error_message);
+        bool upsertMosaicMap(int project_id, const MosaicMap& mosaic_map, int &map_id, std::string &error_message);
         bool doesMosaicMapExist(int project_id, std::string& error_message);
+        // Batch form: exists[i] tells whether project_ids[i] has a mosaic map.
+        bool doesMosaicMapExist(const std::vector<int>& project_ids, std::vector<bool>& exists, std::string& error_message);
+
+        // Typed maps stored in the compact binary format; see MosaicMap.h.
+        bool createMosaicMap(int project_id, const MosaicMap& mosaic_map, std::string &error_message);
+        bool readMosaicMap(int project_id, MosaicMap& mosaic_map, std::string &error_message);
+        bool readMosaicMap(int project_id, int64_t known_version, MosaicMap& mosaic_map, int64_t &version, bool &modified, std::string &error_message);
+        bool updateMosaicMap(int project_id, const MosaicMap& mosaic_map, std::string &error_message);
 
         bool createProject(int user_id, const std::string& project_name, int &project_id, std::string &error_message);
         bool readProject(int project_id, int &user_id, std::string &project_name, std::string &error_message);
         bool updateProject(int project_id, const std::string& new_project_name, std::string &error_message);
         bool deleteProject(int project_id, std::string &error_message);
         bool readImages(int project_id, std::vector<std::unique_ptr<IImageData>>& images, const std::function<std::unique_ptr<IImageData>()>& createImageFunc, std::vector<int> &image_ids, std::string &error_message);
+        bool readImages(int project_id, ImageBatch &batch, std::string &error_message);
+        // Only the listed images, in no particular order; ids not in the project are skipped.
+        bool readImages(int project_id, const std::vector<int> &image_ids, ImageBatch &batch, std::string &error_message);
+
+        // Pre-scaled tile levels (image_levels), width x height versions of
+        // images kept next to them. For each of image_ids the batch holds,
+        // per states[i], nothing when known_versions has its current version,
+        // else its stored level when that was scaled from the current
+        // version, else the original to scale. versions[i] is images.version.
+        bool readImageLevels(int project_id, const std::vector<int> &image_ids, int width, int height,
+                             const std::vector<int> &known_ids, const std::vector<int64_t> &known_versions,
+                             ImageBatch &batch, std::vector<int64_t> &versions, std::vector<ImageLevelState> &states, std::string &error_message);
+        // Same, per (image_ids[i], roi_ids[i]) pair with known_versions[i] the
+        // version the caller holds (-1 for none). batch_roi_ids[i] is the ROI of
+        // batch entry i. An image's original is sent once: further Original
+        // entries of that image carry no pixels.
+        bool readImageLevels(int project_id, const std::vector<int> &image_ids, const std::vector<int> &roi_ids, int width, int height,
+                             const std::vector<int64_t> &known_versions,
+                             ImageBatch &batch, std::vector<int> &batch_roi_ids, std::vector<int64_t> &versions, std::vector<ImageLevelState> &states, std::string &error_message);
+        // Stores width x height levels; versions[i] is the images.version levels[i] was scaled from.
+        bool writeImageLevels(int project_id, int width, int height, const ImageBatch &levels, const std::vector<int64_t> &versions, std::string &error_message);
+        // Same, for levels scaled from ROI roi_ids[i] of their image.
+        bool writeImageLevels(int project_id, int width, int height, const ImageBatch &levels, const std::vector<int> &roi_ids, const std::vector<int64_t> &versions, std::string &error_message);
+
+        // Reads the project's images straight into concrete ImageT values.
+        // ImageT must be constructible from an ImageBatch::Image.
+        template<typename ImageT>
+        bool readImages(int project_id, std::vector<ImageT> &images, std::string &error_message) {
+            ImageBatch batch(getPixelAllocator());
+            if(!readImages(project_id, batch, error_message))return false;
+
+            images.reserve(images.size() + batch.size());
+            for (size_t i = 0; i < batch.size(); ++i) {
+                images.emplace_back(batch[i]);
+            }
+            return true;
+        }
 
         bool createUser(const std::string& email, const std::string& first_name, const std::string& last_name, int &user_id, std::string &error_message);
         bool readUser(const std::string& email, int &id, std::string &error_message);
@@ -56,15 +237,47 @@ namespace NJLIC {
         bool readProjects(int user_id, std::vector<int>& project_ids, std::string &error_message);
 
         bool createImageROI(int project_id, int images_id, int x, int y, int width, int height, int &image_roi_id, std::string &error_message);
+        // Without a project_id these look the ROI up in every partition of a
+        // partitioned images_roi; prefer the project scoped variants below.
         bool readImageROI(int image_roi_id, int &x, int &y, int &width, int &height, std::string &error_message);
         bool updateImageROI(int image_roi_id, int x, int y, int width, int height, std::string &error_message);
         bool deleteImageROI(int image_roi_id, std::string &error_message);
 
+        // Project scoped variants; these prune to a single partition when images_roi is partitioned.
+        bool readImageROI(int image_roi_id, int project_id, int &x, int &y, int &width, int &height, std::string &error_message);
+        bool updateImageROI(int image_roi_id, int project_id, int x, int y, int width, int height, std::string &error_message);
+        bool deleteImageROI(int image_roi_id, int project_id, std::string &error_message);
+        // Every ROI of the project, ordered by id.
+        bool readImageROIs(int project_id, std::vector<ImageROI> &rois, std::string &error_message);
+
         bool createImage(int project_id, std::unique_ptr<IImageData> img, int &image_id, std::string &error_message);
         bool createImages(int project_id, const std::vector<std::unique_ptr<IImageData>>& images, std::vector<int> &image_ids, std::string& error_message);
         bool readImage(int image_id, int project_id, std::unique_ptr<IImageData> &img, std::string &error_message);
+
+        // Conditional reads: images, mosaic_images and mosaic_maps carry a version
+        // that every update* bumps. When known_version matches, modified is false,
+        // the output is left untouched and no pixel data is transferred.
+        bool readImage(int image_id, int project_id, int64_t known_version, std::unique_ptr<IImageData> &img, int64_t &version, bool &modified, std::string &error_message);
+        // Without a project_id these look the image up in every partition of a
+        // partitioned images; prefer the project scoped variants below.
         bool updateImage(int image_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message);
         bool deleteImage(int image_id, std::string &error_message);
+
+        // Project scoped variants; these prune to a single partition when images is partitioned.
+        bool updateImage(int image_id, int project_id, const std::string& new_filename, int new_rows, int new_cols, int new_comps, const std::vector<unsigned char>& new_data, std::string &error_message);
+        bool deleteImage(int image_id, int project_id, std::string &error_message);
+
+        // Color features (see ImageFeatures.h) are computed by createImage,
+        // createImages and updateImage and stored in image_features. An image
+        // with ROIs is read once per ROI, with features taken over that
+        // rectangle, and not as a whole. Entries carry the transaction that
+        // wrote them and the set a watermark, see ImageFeatureSet::getTxid().
+        bool readImageFeatures(int project_id, ImageFeatureSet &features, std::string &error_message);
+        // Backfills features for images written before they existed, and for
+        // ROIs, which are described here rather than when they are created.
+        bool computeMissingImageFeatures(int project_id, int &computed, std::string &error_message);
+        // Builds a nearest-tile index over the project's stored features.
+        bool buildTileIndex(int project_id, TileIndex &index, const TileIndex::Options &options, std::string &error_message);
     };
 
 } // NJLIC
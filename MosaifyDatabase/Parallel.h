@@ -0,0 +1,54 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#ifndef MYPROJECT_PARALLEL_H
+#define MYPROJECT_PARALLEL_H
+
+namespace NJLIC {
+
+    // Number of worker threads to use when the caller passes 0.
+    inline unsigned getDefaultThreadCount() {
+        const unsigned hardware = std::thread::hardware_concurrency();
+        return hardware > 0 ? hardware : 1;
+    }
+
+    // Calls fn(begin, end) over [0, count) in chunks of at most grain items.
+    // Chunks are handed out dynamically, so uneven work balances itself. The
+    // calling thread takes part; with one thread everything runs inline.
+    template<typename F>
+    void parallelFor(size_t count, size_t grain, const F &fn, unsigned threads = 0) {
+        if (0 == count) return;
+        if (0 == grain) grain = 1;
+        if (0 == threads) threads = getDefaultThreadCount();
+
+        const size_t chunks = (count + grain - 1) / grain;
+        threads = static_cast<unsigned>(std::min<size_t>(threads, chunks));
+
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t chunk = next++; chunk < chunks; chunk = next++) {
+                const size_t begin = chunk * grain;
+                fn(begin, std::min(count, begin + grain));
+            }
+        };
+
+        std::vector<std::thread> pool;
+        pool.reserve(threads - 1);
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto &thread : pool) {
+            thread.join();
+        }
+    }
+}
+
+#endif //MYPROJECT_PARALLEL_H
@@ -0,0 +1,83 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <cstddef>
+#include <memory>
+
+#ifndef MYPROJECT_PIXELALLOCATOR_H
+#define MYPROJECT_PIXELALLOCATOR_H
+
+namespace NJLIC {
+
+    // Source of the large pixel buffers used for batches, decoding and
+    // rendering. Implementations can place memory on huge pages, a NUMA node,
+    // a pool, etc.
+    class IPixelAllocator {
+    public:
+        virtual ~IPixelAllocator() = default;
+
+        virtual void* allocate(size_t size) = 0;
+        virtual void deallocate(void* ptr, size_t size) = 0;
+    };
+
+    // Cache-line aligned heap memory.
+    class DefaultPixelAllocator : public IPixelAllocator {
+    public:
+        void* allocate(size_t size) override;
+        void deallocate(void* ptr, size_t size) override;
+    };
+
+    // Buffers of at least min_size bytes are mapped directly and advised to
+    // use transparent huge pages where the platform supports it; smaller ones
+    // fall back to the default allocator.
+    class HugePagePixelAllocator : public IPixelAllocator {
+    public:
+        explicit HugePagePixelAllocator(size_t min_size = 2 * 1024 * 1024);
+
+        void* allocate(size_t size) override;
+        void deallocate(void* ptr, size_t size) override;
+
+    private:
+        size_t m_minSize;
+        DefaultPixelAllocator m_fallback;
+    };
+
+    std::shared_ptr<IPixelAllocator> getDefaultPixelAllocator();
+
+    // Move-only byte buffer whose storage comes from an IPixelAllocator.
+    class PixelBuffer {
+    public:
+        explicit PixelBuffer(std::shared_ptr<IPixelAllocator> allocator = nullptr);
+        PixelBuffer(size_t size, std::shared_ptr<IPixelAllocator> allocator);
+        ~PixelBuffer();
+
+        PixelBuffer(PixelBuffer &&other) noexcept;
+        PixelBuffer& operator=(PixelBuffer &&other) noexcept;
+        PixelBuffer(const PixelBuffer &) = delete;
+        PixelBuffer& operator=(const PixelBuffer &) = delete;
+
+        void reserve(size_t capacity);
+        void resize(size_t size);
+        void append(const unsigned char* data, size_t size);
+        void clear() { m_size = 0; }
+        void release();
+
+        unsigned char* data() { return m_data; }
+        const unsigned char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        size_t capacity() const { return m_capacity; }
+        bool empty() const { return 0 == m_size; }
+
+        const std::shared_ptr<IPixelAllocator>& getAllocator() const { return m_allocator; }
+        void setAllocator(std::shared_ptr<IPixelAllocator> allocator);
+
+    private:
+        std::shared_ptr<IPixelAllocator> m_allocator;
+        unsigned char* m_data;
+        size_t m_size;
+        size_t m_capacity;
+    };
+}
+
+#endif //MYPROJECT_PIXELALLOCATOR_H
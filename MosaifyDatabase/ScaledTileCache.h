@@ -0,0 +1,85 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/LruCache.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+#ifndef MYPROJECT_SCALEDTILECACHE_H
+#define MYPROJECT_SCALEDTILECACHE_H
+
+namespace NJLIC {
+
+    // A tile resized to one cell size. roi_id 0 is the whole image.
+    struct ScaledTileKey {
+        int image_id = 0;
+        int width = 0;
+        int height = 0;
+        int roi_id = 0;
+
+        bool operator==(const ScaledTileKey &other) const {
+            return image_id == other.image_id && width == other.width && height == other.height && roi_id == other.roi_id;
+        }
+    };
+
+    struct ScaledTile {
+        // images.version of the source the pixels were scaled from.
+        int64_t version = 0;
+        int rows = 0;
+        int cols = 0;
+        int comps = 0;
+        std::vector<unsigned char> data;
+    };
+
+    struct ScaledTileCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    // Thread-safe LRU cache of tiles pre-scaled to a cell size, shared by the
+    // render threads: the same LruCache as ImageCache, under one lock.
+    // Entries carry the version of their source image so a renderer can
+    // revalidate them with a conditional read instead of fetching and
+    // rescaling the original.
+    class ScaledTileCache {
+    public:
+        explicit ScaledTileCache(size_t byte_budget);
+
+        ScaledTileCache(const ScaledTileCache &) = delete;
+        ScaledTileCache& operator=(const ScaledTileCache &) = delete;
+
+        std::shared_ptr<const ScaledTile> find(const ScaledTileKey &key);
+        void insert(const ScaledTileKey &key, std::shared_ptr<const ScaledTile> tile);
+
+        void invalidateImage(int image_id);
+        void clear();
+
+        ScaledTileCacheStats getStats() const;
+        size_t getByteBudget() const { return m_lru.getByteBudget(); }
+
+    private:
+        struct KeyHash {
+            size_t operator()(const ScaledTileKey &key) const {
+                uint64_t h = static_cast<uint32_t>(key.image_id);
+                h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.width);
+                h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.height);
+                h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint32_t>(key.roi_id);
+                return static_cast<size_t>(h ^ (h >> 29));
+            }
+        };
+
+        mutable std::mutex m_mutex;
+        LruCache<ScaledTileKey, ScaledTile, KeyHash> m_lru;
+        ScaledTileCacheStats m_stats;
+    };
+}
+
+#endif //MYPROJECT_SCALEDTILECACHE_H
@@ -0,0 +1,74 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "MosaifyDatabase/ImageFeatures.h"
+
+#ifndef MYPROJECT_TILEASSIGNER_H
+#define MYPROJECT_TILEASSIGNER_H
+
+namespace NJLIC {
+
+    // Assigns tiles to grid cells under repeat limits: a tile may fill at most
+    // max_uses cells, and two cells holding the same tile must be at least
+    // min_repeat_distance cells apart (Chebyshev distance, so 2 forbids
+    // touching repeats).
+    //
+    // Each cell first gets its k nearest tiles from a TileIndex. Assignment
+    // then runs in rounds, like an auction in which a full or blocked tile is
+    // priced out: every unassigned cell bids for its nearest tile that is
+    // still open to it, and each tile accepts its closest bidders while it
+    // has uses left and they do not block one another. Rejected cells move on
+    // to their next candidate. Bids are placed in parallel over cells and
+    // settled in parallel over tiles; ties break on cell index, so the result
+    // does not depend on the thread count. A cell that runs out of candidates
+    // has its search widened, up to 16 times options.candidates tiles; if
+    // none of those can satisfy the limits, or every tile's uses are spent,
+    // it gets its nearest tile regardless.
+    class TileAssigner {
+    public:
+        struct Options {
+            // 0 means unlimited.
+            int max_uses = 0;
+            // 0 or 1 means no spacing is enforced.
+            int min_repeat_distance = 0;
+            // Nearest tiles fetched per cell before widening the search.
+            int candidates = 16;
+            // Indices into the feature vectors to match on; empty means all of them.
+            std::vector<int> dimensions;
+            // See TileIndex::Options.
+            float epsilon = 0.0f;
+        };
+
+        struct Stats {
+            size_t rounds = 0;
+            // Cells whose candidate list had to be widened.
+            size_t widened_cells = 0;
+            // Cells left outside the limits; they got their nearest tile and
+            // do not count against its max_uses.
+            size_t unconstrained_cells = 0;
+        };
+
+        // Whether options limit repeats at all; if not, plain nearest matching is equivalent.
+        static bool isLimited(const Options &options);
+
+        explicit TileAssigner(const Options &options);
+
+        // cell_features holds grid_cols * grid_rows ImageFeatures vectors, row
+        // major. Writes one tile image id per cell to cells, or 0 for every
+        // cell when tiles is empty, and the tile's ROI id to rois unless it
+        // is nullptr. Each ROI of an image is a tile of its own.
+        void assign(const float* cell_features, int grid_cols, int grid_rows, const ImageFeatureSet &tiles, int32_t* cells, int32_t* rois = nullptr, unsigned threads = 0);
+
+        const Stats& getLastStats() const { return m_stats; }
+
+    private:
+        Options m_options;
+        Stats m_stats;
+    };
+}
+
+#endif //MYPROJECT_TILEASSIGNER_H
@@ -0,0 +1,126 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+
+#ifndef MYPROJECT_TILEDISKCACHE_H
+#define MYPROJECT_TILEDISKCACHE_H
+
+namespace NJLIC {
+
+    // Persistent cache of decoded tiles keyed by (image_id, version).
+    //
+    // Records are appended to a data file that is memory mapped for reading;
+    // a companion "<path>.idx" file holds one fixed-size entry per record so a
+    // restarted process can rebuild its lookup table without scanning pixels.
+    // Entries loaded from disk start out unvalidated: the caller checks them
+    // against the database once (a conditional read) and marks them validated.
+    //
+    // With a byte budget, least recently found entries are evicted to keep the
+    // live records under it. Replaced and evicted records stay in the data file
+    // until they outweigh the live ones; the files are then rewritten with
+    // only the live records, so the data file stays under twice the live size.
+    class TileDiskCache {
+    public:
+        // View of a cached tile. The pointers stay valid as long as the Tile
+        // (or a copy of it) is alive, through remaps, rewrites and close().
+        struct Tile {
+            int image_id = 0;
+            int project_id = 0;
+            int64_t version = 0;
+            int rows = 0;
+            int cols = 0;
+            int comps = 0;
+            const char* filename = nullptr;
+            size_t filename_length = 0;
+            const unsigned char* data = nullptr;
+            size_t size = 0;
+            bool validated = false;
+            std::shared_ptr<const void> mapping;
+        };
+
+        // A byte_budget of 0 leaves the cache unbounded.
+        explicit TileDiskCache(uint64_t byte_budget = 0);
+        ~TileDiskCache();
+
+        TileDiskCache(const TileDiskCache &) = delete;
+        TileDiskCache& operator=(const TileDiskCache &) = delete;
+
+        bool open(const std::string &path, std::string &error_message);
+        void close();
+        bool isOpen() const { return m_dataFd >= 0; }
+
+        bool find(int image_id, Tile &tile);
+        bool put(int image_id, int project_id, int64_t version, const std::string &filename, int rows, int cols, int comps, const unsigned char* data, size_t size, std::string &error_message);
+
+        void markValidated(int image_id, int64_t version);
+        void invalidate(int image_id);
+        void invalidateProject(int project_id);
+        // Forces every entry to be revalidated before it is served again.
+        void resetValidation();
+        // Drops every entry, here and on disk. The records are reclaimed by the
+        // next rewrite or open().
+        void clear();
+
+        // Latest cached version of every image of the project.
+        void getVersions(int project_id, std::vector<int> &image_ids, std::vector<int64_t> &versions);
+
+        size_t size();
+        uint64_t getByteBudget() const { return m_byteBudget; }
+        // Bytes of the records entries refer to, and the size of the data file.
+        uint64_t getLiveBytes();
+        uint64_t getFileBytes();
+
+    private:
+        struct IndexEntry {
+            int32_t image_id;
+            int32_t project_id;
+            int64_t version;
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        struct Entry {
+            IndexEntry index;
+            bool validated;
+            uint64_t last_use;
+        };
+
+        // Unmapped once neither the cache nor any handed out Tile refers to it.
+        struct Mapping {
+            void* address;
+            size_t length;
+            ~Mapping();
+        };
+
+        bool loadIndex(std::string &error_message);
+        const unsigned char* mapped(uint64_t offset, uint64_t length);
+        bool remap();
+        void closeLocked();
+        bool fillTile(const Entry &entry, Tile &tile);
+        void eraseLocked(std::unordered_map<int, Entry>::iterator it);
+        void evictLocked(uint64_t incoming);
+        bool compactLocked(std::string &error_message);
+
+        std::mutex m_mutex;
+        std::string m_path;
+        int m_dataFd;
+        int m_indexFd;
+        uint64_t m_dataSize;
+        uint64_t m_byteBudget;
+        uint64_t m_liveBytes;
+        uint64_t m_clock;
+
+        std::shared_ptr<Mapping> m_mapping;
+
+        std::unordered_map<int, Entry> m_entries;
+    };
+}
+
+#endif //MYPROJECT_TILEDISKCACHE_H
@@ -0,0 +1,80 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "MosaifyDatabase/ImageFeatures.h"
+
+#ifndef MYPROJECT_TILEINDEX_H
+#define MYPROJECT_TILEINDEX_H
+
+namespace NJLIC {
+
+    // Exact nearest-neighbour index over tile feature vectors (squared L2).
+    //
+    // A k-d tree with leaf buckets, flattened into one node array. Points are
+    // reordered so every leaf owns a contiguous, row-major block of them, and
+    // only the dimensions being indexed are stored. Queries are full
+    // ImageFeatures vectors (or any vector with the stride given to build);
+    // the index picks out its dimensions itself.
+    class TileIndex {
+    public:
+        struct Options {
+            // Indices into the source vectors to search on; empty means all of them.
+            std::vector<int> dimensions;
+            int leaf_size = 16;
+            // 0 gives exact results. A positive epsilon prunes subtrees that cannot
+            // beat the current k-th distance by more than a factor of (1 + epsilon),
+            // trading a bounded error for much faster queries in high dimensions.
+            float epsilon = 0.0f;
+        };
+
+        TileIndex();
+
+        // Builds from count vectors of source_dims floats each, stored row major.
+        void build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options);
+        void build(const float* vectors, size_t count, int source_dims, const int* ids);
+        void build(const ImageFeatureSet &features, const Options &options);
+        void build(const ImageFeatureSet &features);
+        void clear();
+
+        size_t size() const { return m_ids.size(); }
+        bool empty() const { return m_ids.empty(); }
+        int getDimensions() const { return static_cast<int>(m_dims.size()); }
+        int getSourceDimensions() const { return m_sourceDims; }
+
+        // Writes the k nearest ids and squared distances, nearest first. When
+        // the index holds fewer than k tiles the rest are set to -1 and
+        // infinity. Returns the number of neighbours found.
+        int knn(const float* query, int k, int* ids, float* distances) const;
+
+        // Runs count queries (stride getSourceDimensions()) across threads.
+        // Results for query q start at ids[q * k] and distances[q * k].
+        void knnBatch(const float* queries, size_t count, int k, int* ids, float* distances, unsigned threads = 0) const;
+
+    private:
+        struct Node {
+            // Interior: split_dim >= 0, children at left and right.
+            // Leaf: split_dim == -1, points [begin, end).
+            int32_t split_dim;
+            float split_value;
+            uint32_t left_or_begin;
+            uint32_t right_or_end;
+        };
+
+        struct Search;
+        void search(Search &search, uint32_t node_index, float bound) const;
+        uint32_t buildNode(std::vector<uint32_t> &order, const float* projected, uint32_t begin, uint32_t end, int leaf_size);
+
+        int m_sourceDims;
+        float m_pruneScale;
+        std::vector<int> m_dims;
+        std::vector<Node> m_nodes;
+        std::vector<float> m_points;
+        std::vector<int> m_ids;
+    };
+}
+
+#endif //MYPROJECT_TILEINDEX_H
@@ -0,0 +1,116 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "MosaifyDatabase/ImageFeatures.h"
+#include "MosaifyDatabase/TileIndex.h"
+#include "MosaifyDatabase/HnswIndex.h"
+
+#ifndef MYPROJECT_TILEMATCHER_H
+#define MYPROJECT_TILEMATCHER_H
+
+namespace NJLIC {
+
+    enum class SimdLevel { Scalar = 0, AVX2 = 1, AVX512 = 2 };
+
+    // Highest instruction set the running CPU supports (checked once via CPUID).
+    SimdLevel getSupportedSimdLevel();
+    const char* getSimdLevelName(SimdLevel level);
+
+    // Exhaustive nearest-tile search (squared L2, k = 1). Tiles are stored in
+    // blocks of 16, dimension major within a block, so every kernel streams
+    // through memory once per query. The quantized variant stores one byte per
+    // value, using a single scale for all dimensions so distances keep their
+    // proportions; it returns the nearest tile under that rounding and a
+    // distance converted back to feature units. Ties go to the tile added first.
+    class BruteForceMatcher {
+    public:
+        struct Options {
+            // Indices into the source vectors to match on; empty means all of them.
+            std::vector<int> dimensions;
+            bool quantized = false;
+        };
+
+        BruteForceMatcher();
+
+        void build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options);
+        void build(const ImageFeatureSet &features, const Options &options);
+        void clear();
+
+        // Uses the given kernel, or the best supported one below it.
+        void setSimdLevel(SimdLevel level);
+        SimdLevel getSimdLevel() const { return m_simdLevel; }
+
+        size_t size() const { return m_ids.size(); }
+        bool empty() const { return m_ids.empty(); }
+        bool isQuantized() const { return m_quantized; }
+        int getSourceDimensions() const { return m_sourceDims; }
+
+        // Returns the nearest tile id, or -1 when there are no tiles.
+        int nearest(const float* query, float &distance) const;
+        void nearestBatch(const float* queries, size_t count, int* ids, float* distances, unsigned threads = 0) const;
+
+    private:
+        int m_sourceDims;
+        std::vector<int> m_dims;
+        bool m_quantized;
+        SimdLevel m_simdLevel;
+
+        size_t m_numBlocks;
+        std::vector<float> m_blocks;
+        std::vector<uint8_t> m_quantizedBlocks;
+        float m_quantizeMin;
+        float m_quantizeScale;
+
+        std::vector<int> m_ids;
+    };
+
+    // Approximate trades exact answers for speed on very large libraries; it
+    // is never picked by Auto.
+    enum class MatchStrategy { Auto, BruteForce, Tree, Approximate };
+
+    // Picks the faster exact strategy for a library of num_tiles tiles matched
+    // on dims dimensions; see bench_tile_matcher for where the crossover comes from.
+    MatchStrategy chooseMatchStrategy(size_t num_tiles, int dims);
+
+    // Front end used by the mosaic engine: builds a TileIndex, a
+    // BruteForceMatcher or an HnswIndex and answers nearest-tile queries
+    // through whichever it built.
+    class TileMatcher {
+    public:
+        struct Options {
+            MatchStrategy strategy = MatchStrategy::Auto;
+            std::vector<int> dimensions;
+            // Brute force only.
+            bool quantized = false;
+            // Tree only; see TileIndex::Options.
+            float epsilon = 0.0f;
+            // Approximate only; see HnswIndex::Options. Raising ef_search
+            // raises recall and query time.
+            int m = 16;
+            int ef_construction = 100;
+            int ef_search = 64;
+        };
+
+        void build(const ImageFeatureSet &features, const Options &options);
+        void build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options);
+
+        // The strategy actually in use; never Auto after build.
+        MatchStrategy getStrategy() const { return m_strategy; }
+        size_t size() const;
+
+        int nearest(const float* query, float &distance) const;
+        void nearestBatch(const float* queries, size_t count, int* ids, float* distances, unsigned threads = 0) const;
+
+    private:
+        MatchStrategy m_strategy = MatchStrategy::Tree;
+        BruteForceMatcher m_bruteForce;
+        TileIndex m_tree;
+        HnswIndex m_approximate;
+    };
+}
+
+#endif //MYPROJECT_TILEMATCHER_H
@@ -0,0 +1,147 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/PixelAllocator.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+namespace NJLIC {
+
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    void* DefaultPixelAllocator::allocate(size_t size) {
+        if (0 == size) return nullptr;
+
+        void* ptr = nullptr;
+        if (0 != posix_memalign(&ptr, CACHE_LINE_SIZE, size)) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void DefaultPixelAllocator::deallocate(void* ptr, size_t /*size*/) {
+        free(ptr);
+    }
+
+    HugePagePixelAllocator::HugePagePixelAllocator(size_t min_size) : m_minSize(min_size) {
+    }
+
+    void* HugePagePixelAllocator::allocate(size_t size) {
+        if (size < m_minSize) {
+            return m_fallback.allocate(size);
+        }
+
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == ptr) {
+            throw std::bad_alloc();
+        }
+#if defined(MADV_HUGEPAGE)
+        // Only a hint; the kernel silently falls back to normal pages.
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+        return ptr;
+    }
+
+    void HugePagePixelAllocator::deallocate(void* ptr, size_t size) {
+        if (nullptr == ptr) return;
+
+        if (size < m_minSize) {
+            m_fallback.deallocate(ptr, size);
+            return;
+        }
+        munmap(ptr, size);
+    }
+
+    std::shared_ptr<IPixelAllocator> getDefaultPixelAllocator() {
+        static std::shared_ptr<IPixelAllocator> allocator = std::make_shared<DefaultPixelAllocator>();
+        return allocator;
+    }
+
+    PixelBuffer::PixelBuffer(std::shared_ptr<IPixelAllocator> allocator)
+            : m_allocator(allocator ? allocator : getDefaultPixelAllocator()), m_data(nullptr), m_size(0), m_capacity(0) {
+    }
+
+    PixelBuffer::PixelBuffer(size_t size, std::shared_ptr<IPixelAllocator> allocator) : PixelBuffer(allocator) {
+        resize(size);
+    }
+
+    PixelBuffer::~PixelBuffer() {
+        release();
+    }
+
+    PixelBuffer::PixelBuffer(PixelBuffer &&other) noexcept
+            : m_allocator(std::move(other.m_allocator)), m_data(other.m_data), m_size(other.m_size), m_capacity(other.m_capacity) {
+        other.m_allocator = getDefaultPixelAllocator();
+        other.m_data = nullptr;
+        other.m_size = 0;
+        other.m_capacity = 0;
+    }
+
+    PixelBuffer& PixelBuffer::operator=(PixelBuffer &&other) noexcept {
+        if (this != &other) {
+            release();
+            m_allocator = std::move(other.m_allocator);
+            m_data = other.m_data;
+            m_size = other.m_size;
+            m_capacity = other.m_capacity;
+
+            other.m_allocator = getDefaultPixelAllocator();
+            other.m_data = nullptr;
+            other.m_size = 0;
+            other.m_capacity = 0;
+        }
+        return *this;
+    }
+
+    void PixelBuffer::reserve(size_t capacity) {
+        if (capacity <= m_capacity) return;
+
+        unsigned char* data = static_cast<unsigned char*>(m_allocator->allocate(capacity));
+        if (m_size > 0) {
+            memcpy(data, m_data, m_size);
+        }
+        if (nullptr != m_data) {
+            m_allocator->deallocate(m_data, m_capacity);
+        }
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+    void PixelBuffer::resize(size_t size) {
+        reserve(size);
+        m_size = size;
+    }
+
+    void PixelBuffer::append(const unsigned char* data, size_t size) {
+        if (m_size + size > m_capacity) {
+            reserve(std::max(m_size + size, m_capacity * 2));
+        }
+        if (size > 0) {
+            memcpy(m_data + m_size, data, size);
+        }
+        m_size += size;
+    }
+
+    void PixelBuffer::release() {
+        if (nullptr != m_data) {
+            m_allocator->deallocate(m_data, m_capacity);
+        }
+        m_data = nullptr;
+        m_size = 0;
+        m_capacity = 0;
+    }
+
+    void PixelBuffer::setAllocator(std::shared_ptr<IPixelAllocator> allocator) {
+        if (!allocator) allocator = getDefaultPixelAllocator();
+        if (allocator == m_allocator) return;
+
+        // Move any existing contents over to the new allocator.
+        PixelBuffer moved(allocator);
+        moved.append(m_data, m_size);
+        *this = std::move(moved);
+    }
+}
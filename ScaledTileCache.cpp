@@ -0,0 +1,53 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/ScaledTileCache.h"
+
+namespace NJLIC {
+
+    ScaledTileCache::ScaledTileCache(size_t byte_budget) : m_lru(byte_budget) {
+    }
+
+    std::shared_ptr<const ScaledTile> ScaledTileCache::find(const ScaledTileKey &key) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::shared_ptr<const ScaledTile> tile = m_lru.find(key);
+        if (!tile) {
+            ++m_stats.misses;
+            return nullptr;
+        }
+
+        ++m_stats.hits;
+        return tile;
+    }
+
+    void ScaledTileCache::insert(const ScaledTileKey &key, std::shared_ptr<const ScaledTile> tile) {
+        if (!tile) return;
+
+        const size_t bytes = sizeof(ScaledTile) + tile->data.size();
+        if (bytes > m_lru.getByteBudget()) return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.evictions += m_lru.insert(key, std::move(tile), bytes);
+        ++m_stats.insertions;
+    }
+
+    void ScaledTileCache::invalidateImage(int image_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lru.eraseIf([image_id](const ScaledTileKey &key, const ScaledTile &) { return key.image_id == image_id; });
+    }
+
+    void ScaledTileCache::clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lru.clear();
+    }
+
+    ScaledTileCacheStats ScaledTileCache::getStats() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ScaledTileCacheStats stats = m_stats;
+        stats.entries = m_lru.size();
+        stats.bytes = m_lru.getBytes();
+        return stats;
+    }
+}
@@ -0,0 +1,257 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/TileAssigner.h"
+#include "MosaifyDatabase/TileIndex.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <unordered_set>
+
+namespace NJLIC {
+
+    namespace {
+        struct Bid {
+            int32_t tile;
+            float distance;
+            uint32_t cell;
+
+            bool operator<(const Bid &other) const {
+                if (tile != other.tile) return tile < other.tile;
+                if (distance != other.distance) return distance < other.distance;
+                return cell < other.cell;
+            }
+        };
+
+        // Candidate tiles of every cell, nearest first, in a fixed slot of k
+        // entries per cell. Widening refills a cell's slot with the next k
+        // nearest tiles, so the pool never grows.
+        struct Candidates {
+            std::vector<int> tiles;
+            std::vector<float> distances;
+            std::vector<int> count;
+            std::vector<int> cursor;
+            // Nearest tiles fetched so far; the slot holds the last count of them.
+            std::vector<int> fetched;
+        };
+
+        // How far past options.candidates a cell's search may be widened.
+        const int MAX_WIDENING = 16;
+    }
+
+    bool TileAssigner::isLimited(const Options &options) {
+        return options.max_uses > 0 || options.min_repeat_distance > 1;
+    }
+
+    TileAssigner::TileAssigner(const Options &options) : m_options(options) {
+    }
+
+    void TileAssigner::assign(const float* cell_features, int grid_cols, int grid_rows, const ImageFeatureSet &tiles, int32_t* cells, int32_t* rois, unsigned threads) {
+        m_stats = Stats();
+        const size_t num_cells = static_cast<size_t>(grid_cols) * grid_rows;
+        const int num_tiles = static_cast<int>(tiles.size());
+        if (0 == num_cells) return;
+        if (0 == num_tiles) {
+            std::fill(cells, cells + num_cells, 0);
+            if (rois) std::fill(rois, rois + num_cells, 0);
+            return;
+        }
+
+        // Index the tiles by position so per-tile state lives in flat arrays.
+        std::vector<float> vectors(tiles.size() * ImageFeatures::DIMENSIONS);
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+                vectors[i * ImageFeatures::DIMENSIONS + d] = tiles.getValue(i, d);
+            }
+        }
+        std::vector<int> positions(tiles.size());
+        std::iota(positions.begin(), positions.end(), 0);
+
+        TileIndex::Options index_options;
+        index_options.dimensions = m_options.dimensions;
+        index_options.epsilon = m_options.epsilon;
+        TileIndex index;
+        index.build(vectors.data(), tiles.size(), ImageFeatures::DIMENSIONS, positions.data(), index_options);
+
+        const int capacity = m_options.max_uses > 0 ? m_options.max_uses : std::numeric_limits<int>::max();
+        const int radius = std::max(0, m_options.min_repeat_distance - 1);
+
+        Candidates candidates;
+        const int k = std::max(1, std::min(m_options.candidates, num_tiles));
+        const int max_fetched = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(k) * MAX_WIDENING, num_tiles));
+        candidates.tiles.resize(num_cells * k);
+        candidates.distances.resize(num_cells * k);
+        index.knnBatch(cell_features, num_cells, k, candidates.tiles.data(), candidates.distances.data(), threads);
+        candidates.count.assign(num_cells, k);
+        candidates.cursor.assign(num_cells, 0);
+        candidates.fetched.assign(num_cells, k);
+
+        // Slots get overwritten on widening; keep each cell's nearest tile for
+        // the unconstrained fallback.
+        std::vector<int32_t> nearest(num_cells);
+        for (size_t cell = 0; cell < num_cells; ++cell) nearest[cell] = candidates.tiles[cell * k];
+
+        // Uses left across all tiles. Once they run out, every pending cell is
+        // surplus and takes its nearest tile without searching further.
+        int64_t open_uses = m_options.max_uses > 0 ? static_cast<int64_t>(m_options.max_uses) * num_tiles : std::numeric_limits<int64_t>::max();
+
+        std::vector<int32_t> assigned(num_cells, -1);
+        std::vector<int> uses(tiles.size(), 0);
+
+        // Whether tile already holds a cell closer than min_repeat_distance.
+        auto isBlocked = [&](size_t cell, int32_t tile) {
+            if (0 == radius) return false;
+            const int x = static_cast<int>(cell % grid_cols);
+            const int y = static_cast<int>(cell / grid_cols);
+            for (int wy = std::max(0, y - radius); wy <= std::min(grid_rows - 1, y + radius); ++wy) {
+                const int32_t* row = &assigned[static_cast<size_t>(wy) * grid_cols];
+                for (int wx = std::max(0, x - radius); wx <= std::min(grid_cols - 1, x + radius); ++wx) {
+                    if (row[wx] == tile) return true;
+                }
+            }
+            return false;
+        };
+
+        std::vector<uint32_t> pending(num_cells);
+        std::iota(pending.begin(), pending.end(), 0);
+        std::vector<Bid> bids;
+        std::vector<char> accepted;
+
+        // Cells outside the limits do not count against any tile's uses.
+        auto assignNearest = [&](uint32_t cell) {
+            assigned[cell] = nearest[cell];
+            ++m_stats.unconstrained_cells;
+        };
+
+        while (!pending.empty()) {
+            if (open_uses <= 0) {
+                for (uint32_t cell : pending) assignNearest(cell);
+                break;
+            }
+            ++m_stats.rounds;
+
+            // Every pending cell bids for its nearest candidate that is still open.
+            // Only state from earlier rounds is read, so cells are independent.
+            bids.resize(pending.size());
+            parallelFor(pending.size(), 1024, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const uint32_t cell = pending[i];
+                    const size_t base = static_cast<size_t>(cell) * k;
+                    int &cursor = candidates.cursor[cell];
+                    for (; cursor < candidates.count[cell]; ++cursor) {
+                        const int32_t tile = candidates.tiles[base + cursor];
+                        if (tile >= 0 && uses[tile] < capacity && !isBlocked(cell, tile)) break;
+                    }
+                    if (cursor < candidates.count[cell]) {
+                        bids[i] = Bid{candidates.tiles[base + cursor], candidates.distances[base + cursor], cell};
+                    } else {
+                        bids[i] = Bid{-1, 0.0f, cell};
+                    }
+                }
+            }, threads);
+
+            // Cells out of candidates widen their search, or take their nearest
+            // tile once the widest search has been ruled out. Only as many as
+            // the uses left after this round's bids could ever be placed; the
+            // rest are surplus and skip the search.
+            int64_t placeable = open_uses;
+            for (const Bid &bid : bids) {
+                if (bid.tile >= 0) --placeable;
+            }
+            std::vector<uint32_t> widen;
+            for (const Bid &bid : bids) {
+                if (bid.tile >= 0) continue;
+                if (candidates.fetched[bid.cell] < max_fetched && placeable > 0) {
+                    --placeable;
+                    widen.push_back(bid.cell);
+                } else {
+                    assignNearest(bid.cell);
+                }
+            }
+            if (!widen.empty()) {
+                int widest = 0;
+                for (uint32_t cell : widen) widest = std::max(widest, candidates.fetched[cell]);
+                const int wider = std::min(widest + k, max_fetched);
+
+                std::vector<float> queries(widen.size() * ImageFeatures::DIMENSIONS);
+                for (size_t i = 0; i < widen.size(); ++i) {
+                    const float* features = cell_features + static_cast<size_t>(widen[i]) * ImageFeatures::DIMENSIONS;
+                    std::copy(features, features + ImageFeatures::DIMENSIONS, &queries[i * ImageFeatures::DIMENSIONS]);
+                }
+                std::vector<int> wider_tiles(widen.size() * wider);
+                std::vector<float> wider_distances(widen.size() * wider);
+                index.knnBatch(queries.data(), widen.size(), wider, wider_tiles.data(), wider_distances.data(), threads);
+
+                // Copy only the tiles each cell has not seen yet into its slot.
+                for (size_t i = 0; i < widen.size(); ++i) {
+                    const uint32_t cell = widen[i];
+                    const int from = candidates.fetched[cell];
+                    const int to = std::min(from + k, max_fetched);
+                    const size_t base = static_cast<size_t>(cell) * k;
+                    std::copy(&wider_tiles[i * wider + from], &wider_tiles[i * wider + to], &candidates.tiles[base]);
+                    std::copy(&wider_distances[i * wider + from], &wider_distances[i * wider + to], &candidates.distances[base]);
+                    if (k == from) ++m_stats.widened_cells;
+                    candidates.count[cell] = to - from;
+                    candidates.cursor[cell] = 0;
+                    candidates.fetched[cell] = to;
+                }
+            }
+
+            bids.erase(std::remove_if(bids.begin(), bids.end(), [](const Bid &bid) { return bid.tile < 0; }), bids.end());
+            std::sort(bids.begin(), bids.end());
+
+            // Each tile settles its own bids, closest first. Tiles touch disjoint
+            // state, so they are settled in parallel.
+            std::vector<size_t> groups;
+            for (size_t i = 0; i < bids.size(); ++i) {
+                if (0 == i || bids[i].tile != bids[i - 1].tile) groups.push_back(i);
+            }
+            groups.push_back(bids.size());
+
+            accepted.assign(bids.size(), 0);
+            parallelFor(groups.size() - 1, 16, [&](size_t group_begin, size_t group_end) {
+                std::unordered_set<uint32_t> taken;
+                for (size_t g = group_begin; g < group_end; ++g) {
+                    taken.clear();
+                    const int32_t tile = bids[groups[g]].tile;
+                    for (size_t i = groups[g]; i < groups[g + 1] && uses[tile] < capacity; ++i) {
+                        const uint32_t cell = bids[i].cell;
+                        bool blocked = false;
+                        if (radius > 0 && !taken.empty()) {
+                            const int x = static_cast<int>(cell % grid_cols);
+                            const int y = static_cast<int>(cell / grid_cols);
+                            for (int wy = std::max(0, y - radius); !blocked && wy <= std::min(grid_rows - 1, y + radius); ++wy) {
+                                for (int wx = std::max(0, x - radius); wx <= std::min(grid_cols - 1, x + radius); ++wx) {
+                                    if (taken.count(static_cast<uint32_t>(wy) * grid_cols + wx)) {
+                                        blocked = true;
+                                        break;
+                                    }
+                                }
+                            }
+                        }
+                        if (blocked) continue;
+
+                        accepted[i] = 1;
+                        ++uses[tile];
+                        if (radius > 0) taken.insert(cell);
+                    }
+                }
+            }, threads);
+
+            for (size_t i = 0; i < bids.size(); ++i) {
+                if (!accepted[i]) continue;
+                assigned[bids[i].cell] = bids[i].tile;
+                --open_uses;
+            }
+
+            pending.erase(std::remove_if(pending.begin(), pending.end(), [&](uint32_t cell) { return assigned[cell] >= 0; }), pending.end());
+        }
+
+        for (size_t cell = 0; cell < num_cells; ++cell) {
+            cells[cell] = tiles.getImageId(static_cast<size_t>(assigned[cell]));
+            if (rois) rois[cell] = tiles.getRoiId(static_cast<size_t>(assigned[cell]));
+        }
+    }
+}
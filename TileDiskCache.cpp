@@ -0,0 +1,479 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/TileDiskCache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace NJLIC {
+
+    static const uint32_t RECORD_MAGIC = 0x3143544d; // "MTC1"
+
+    struct RecordHeader {
+        uint32_t magic;
+        int32_t image_id;
+        int32_t project_id;
+        int32_t rows;
+        int32_t cols;
+        int32_t comps;
+        int64_t version;
+        uint32_t filename_length;
+        uint32_t reserved;
+        uint64_t data_size;
+    };
+
+    static const uint64_t MIN_MAPPING_LENGTH = 64ull << 20;
+
+    static uint64_t alignRecord(uint64_t length) {
+        return (length + 7) & ~static_cast<uint64_t>(7);
+    }
+
+    // Mappings reserve headroom past the end of the file and at least double
+    // each time, so appends rarely remap.
+    static uint64_t mappingLength(uint64_t size) {
+        uint64_t length = MIN_MAPPING_LENGTH;
+        while (length < size) length *= 2;
+        return length;
+    }
+
+    static bool writeAll(int fd, const void* data, size_t size, off_t offset) {
+        const char* ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, ptr, size, offset);
+            if (written < 0) {
+                if (EINTR == errno) continue;
+                return false;
+            }
+            ptr += written;
+            offset += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    TileDiskCache::Mapping::~Mapping() {
+        munmap(address, length);
+    }
+
+    TileDiskCache::TileDiskCache(uint64_t byte_budget)
+            : m_dataFd(-1), m_indexFd(-1), m_dataSize(0), m_byteBudget(byte_budget), m_liveBytes(0), m_clock(0) {
+    }
+
+    TileDiskCache::~TileDiskCache() {
+        close();
+    }
+
+    bool TileDiskCache::open(const std::string &path, std::string &error_message) {
+        close();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_path = path;
+
+        m_dataFd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_dataFd < 0) {
+            error_message = "Failed to open tile cache " + path + ": " + strerror(errno);
+            return false;
+        }
+
+        std::string index_path = path + ".idx";
+        m_indexFd = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_indexFd < 0) {
+            error_message = "Failed to open tile cache index " + index_path + ": " + strerror(errno);
+            ::close(m_dataFd);
+            m_dataFd = -1;
+            return false;
+        }
+
+        // Records no index entry refers to (everything, after clear()) are dropped.
+        struct stat st;
+        if (0 == fstat(m_indexFd, &st) && 0 == st.st_size && 0 != ftruncate(m_dataFd, 0)) {
+            error_message = "Failed to truncate tile cache " + path + ": " + strerror(errno);
+            closeLocked();
+            return false;
+        }
+        if (0 != fstat(m_dataFd, &st)) {
+            error_message = "Failed to stat tile cache " + path + ": " + strerror(errno);
+            closeLocked();
+            return false;
+        }
+        m_dataSize = static_cast<uint64_t>(st.st_size);
+
+        if (m_dataSize > 0 && !remap()) {
+            error_message = "Failed to map tile cache " + path + ": " + strerror(errno);
+            closeLocked();
+            return false;
+        }
+
+        if (!loadIndex(error_message)) {
+            closeLocked();
+            return false;
+        }
+
+        if (m_byteBudget > 0) evictLocked(0);
+        // Should the rewrite fail, the files stay as they are; the next put tries again.
+        if (m_dataSize > 2 * m_liveBytes) {
+            std::string ignored;
+            compactLocked(ignored);
+        }
+        return true;
+    }
+
+    void TileDiskCache::close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        closeLocked();
+    }
+
+    void TileDiskCache::closeLocked() {
+        m_mapping.reset();
+        m_entries.clear();
+        m_liveBytes = 0;
+
+        if (m_dataFd >= 0) ::close(m_dataFd);
+        if (m_indexFd >= 0) ::close(m_indexFd);
+        m_dataFd = -1;
+        m_indexFd = -1;
+        m_dataSize = 0;
+    }
+
+    bool TileDiskCache::remap() {
+        // Only the part below m_dataSize is ever read, so the headroom past the
+        // end of the file costs address space, not memory. Short of address
+        // space the headroom is halved until a mapping fits; mapping the exact
+        // size straight away would remap on every append.
+        uint64_t length = mappingLength(m_dataSize);
+        void* address = MAP_FAILED;
+        for (;;) {
+            address = mmap(nullptr, static_cast<size_t>(length), PROT_READ, MAP_SHARED | MAP_NORESERVE, m_dataFd, 0);
+            if (MAP_FAILED != address || length == m_dataSize) break;
+            length = m_dataSize + (length - m_dataSize) / 2;
+        }
+        if (MAP_FAILED == address) {
+            return false;
+        }
+        // The superseded mapping goes away with the last Tile that points into it.
+        m_mapping = std::shared_ptr<Mapping>(new Mapping{address, static_cast<size_t>(length)});
+        return true;
+    }
+
+    const unsigned char* TileDiskCache::mapped(uint64_t offset, uint64_t length) {
+        if (offset + length > m_dataSize) return nullptr;
+
+        if (!m_mapping || offset + length > m_mapping->length) {
+            if (!remap()) return nullptr;
+        }
+        return static_cast<const unsigned char*>(m_mapping->address) + offset;
+    }
+
+    bool TileDiskCache::loadIndex(std::string &error_message) {
+        struct stat st;
+        if (0 != fstat(m_indexFd, &st)) {
+            error_message = "Failed to stat tile cache index: " + std::string(strerror(errno));
+            return false;
+        }
+
+        const size_t count = static_cast<size_t>(st.st_size) / sizeof(IndexEntry);
+        std::vector<IndexEntry> entries(count);
+        if (count > 0 && pread(m_indexFd, entries.data(), count * sizeof(IndexEntry), 0) != static_cast<ssize_t>(count * sizeof(IndexEntry))) {
+            error_message = "Failed to read tile cache index: " + std::string(strerror(errno));
+            return false;
+        }
+
+        // Stop at the first entry that does not point at a complete record; anything
+        // after it was written by a process that died mid-append.
+        size_t valid = 0;
+        for (; valid < count; ++valid) {
+            const IndexEntry &index = entries[valid];
+            const unsigned char* record = mapped(index.offset, index.length);
+            if (nullptr == record || index.length < sizeof(RecordHeader)) break;
+
+            RecordHeader header;
+            memcpy(&header, record, sizeof(header));
+            if (RECORD_MAGIC != header.magic || header.image_id != index.image_id || header.version != index.version) break;
+
+            // Entries evicted before the last rewrite are still listed; the
+            // most recently written ones are taken as the most recently used.
+            auto it = m_entries.find(index.image_id);
+            if (it == m_entries.end()) {
+                m_entries[index.image_id] = Entry{index, false, ++m_clock};
+                m_liveBytes += alignRecord(index.length);
+            } else if (it->second.index.version <= index.version) {
+                m_liveBytes += alignRecord(index.length) - alignRecord(it->second.index.length);
+                it->second = Entry{index, false, ++m_clock};
+            }
+        }
+
+        if (valid != count || 0 != static_cast<size_t>(st.st_size) % sizeof(IndexEntry)) {
+            if (0 != ftruncate(m_indexFd, valid * sizeof(IndexEntry))) {
+                error_message = "Failed to truncate tile cache index: " + std::string(strerror(errno));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool TileDiskCache::fillTile(const Entry &entry, Tile &tile) {
+        const unsigned char* record = mapped(entry.index.offset, entry.index.length);
+        if (nullptr == record) return false;
+
+        RecordHeader header;
+        memcpy(&header, record, sizeof(header));
+
+        tile.image_id = header.image_id;
+        tile.project_id = header.project_id;
+        tile.version = header.version;
+        tile.rows = header.rows;
+        tile.cols = header.cols;
+        tile.comps = header.comps;
+        tile.filename = reinterpret_cast<const char*>(record + sizeof(RecordHeader));
+        tile.filename_length = header.filename_length;
+        tile.data = record + sizeof(RecordHeader) + header.filename_length;
+        tile.size = header.data_size;
+        tile.validated = entry.validated;
+        tile.mapping = m_mapping;
+        return true;
+    }
+
+    bool TileDiskCache::find(int image_id, Tile &tile) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_entries.find(image_id);
+        if (it == m_entries.end()) return false;
+
+        it->second.last_use = ++m_clock;
+        return fillTile(it->second, tile);
+    }
+
+    void TileDiskCache::eraseLocked(std::unordered_map<int, Entry>::iterator it) {
+        m_liveBytes -= alignRecord(it->second.index.length);
+        m_entries.erase(it);
+    }
+
+    void TileDiskCache::evictLocked(uint64_t incoming) {
+        if (m_liveBytes + incoming <= m_byteBudget) return;
+
+        // Down to three quarters of the budget, so puts at the limit do not
+        // sort the entries every time.
+        const uint64_t target = m_byteBudget - m_byteBudget / 4;
+        std::vector<std::pair<uint64_t, int>> by_use;
+        by_use.reserve(m_entries.size());
+        for (const auto &entry : m_entries) {
+            by_use.emplace_back(entry.second.last_use, entry.first);
+        }
+        std::sort(by_use.begin(), by_use.end());
+
+        for (const auto &use : by_use) {
+            if (m_liveBytes + incoming <= target) break;
+            eraseLocked(m_entries.find(use.second));
+        }
+    }
+
+    bool TileDiskCache::compactLocked(std::string &error_message) {
+        const std::string data_path = m_path + ".compact";
+        const std::string index_path = m_path + ".idx.compact";
+
+        int data_fd = ::open(data_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        int index_fd = data_fd < 0 ? -1 : ::open(index_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        auto discard = [&](const std::string &message) {
+            error_message = message + ": " + strerror(errno);
+            if (data_fd >= 0) ::close(data_fd);
+            if (index_fd >= 0) ::close(index_fd);
+            std::remove(data_path.c_str());
+            std::remove(index_path.c_str());
+            return false;
+        };
+        if (index_fd < 0) return discard("Failed to create compacted tile cache");
+
+        // Copy the live records in file order, so the old file is read sequentially.
+        std::vector<std::unordered_map<int, Entry>::iterator> live;
+        live.reserve(m_entries.size());
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) live.push_back(it);
+        std::sort(live.begin(), live.end(), [](std::unordered_map<int, Entry>::iterator a, std::unordered_map<int, Entry>::iterator b) {
+            return a->second.index.offset < b->second.index.offset;
+        });
+
+        std::vector<IndexEntry> indexes;
+        indexes.reserve(live.size());
+        uint64_t size = 0;
+        for (auto it : live) {
+            IndexEntry index = it->second.index;
+            const unsigned char* record = mapped(index.offset, index.length);
+            if (nullptr == record) return discard("Failed to map tile cache");
+            if (!writeAll(data_fd, record, index.length, size)) return discard("Failed to write compacted tile cache");
+
+            index.offset = size;
+            indexes.push_back(index);
+            size += alignRecord(index.length);
+        }
+        if (0 != ftruncate(data_fd, size)) return discard("Failed to extend compacted tile cache");
+        if (!writeAll(index_fd, indexes.data(), indexes.size() * sizeof(IndexEntry), 0)) return discard("Failed to write compacted tile cache index");
+
+        // Data first: should the index rename fail, the old index no longer
+        // matches the records and open() drops the entries it cannot verify.
+        if (0 != rename(data_path.c_str(), m_path.c_str())) return discard("Failed to replace tile cache");
+        const bool index_renamed = 0 == rename(index_path.c_str(), (m_path + ".idx").c_str());
+        if (!index_renamed) error_message = "Failed to replace tile cache index: " + std::string(strerror(errno));
+
+        ::close(m_dataFd);
+        ::close(m_indexFd);
+        m_dataFd = data_fd;
+        m_indexFd = index_fd;
+        m_dataSize = size;
+        m_mapping.reset();
+        for (size_t i = 0; i < live.size(); ++i) {
+            live[i]->second.index = indexes[i];
+        }
+        return index_renamed;
+    }
+
+    bool TileDiskCache::put(int image_id, int project_id, int64_t version, const std::string &filename, int rows, int cols, int comps, const unsigned char* data, size_t size, std::string &error_message) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_dataFd < 0) {
+            error_message = "Tile cache is not open.";
+            return false;
+        }
+
+        RecordHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = RECORD_MAGIC;
+        header.image_id = image_id;
+        header.project_id = project_id;
+        header.rows = rows;
+        header.cols = cols;
+        header.comps = comps;
+        header.version = version;
+        header.filename_length = static_cast<uint32_t>(filename.size());
+        header.data_size = size;
+
+        const uint64_t offset = m_dataSize;
+        const uint64_t length = sizeof(RecordHeader) + filename.size() + size;
+
+        // Whatever happens below, the version being replaced is not served again.
+        auto old = m_entries.find(image_id);
+        if (old != m_entries.end()) eraseLocked(old);
+        if (m_byteBudget > 0) {
+            // A tile larger than the whole budget is served from the database.
+            if (alignRecord(length) > m_byteBudget) return true;
+            evictLocked(alignRecord(length));
+        }
+
+        // Data first, index second: a crash in between leaves an unreferenced record, never a dangling index entry.
+        if (!writeAll(m_dataFd, &header, sizeof(header), offset) ||
+            !writeAll(m_dataFd, filename.data(), filename.size(), offset + sizeof(header)) ||
+            !writeAll(m_dataFd, data, size, offset + sizeof(header) + filename.size())) {
+            error_message = "Failed to append to tile cache: " + std::string(strerror(errno));
+            return false;
+        }
+        m_dataSize = offset + alignRecord(length);
+        if (0 != ftruncate(m_dataFd, m_dataSize)) {
+            error_message = "Failed to extend tile cache: " + std::string(strerror(errno));
+            return false;
+        }
+
+        IndexEntry index;
+        index.image_id = image_id;
+        index.project_id = project_id;
+        index.version = version;
+        index.offset = offset;
+        index.length = length;
+
+        struct stat st;
+        if (0 != fstat(m_indexFd, &st) || !writeAll(m_indexFd, &index, sizeof(index), st.st_size)) {
+            error_message = "Failed to append to tile cache index: " + std::string(strerror(errno));
+            return false;
+        }
+
+        // Freshly written data came from the database, so it is already validated.
+        m_entries[image_id] = Entry{index, true, ++m_clock};
+        m_liveBytes += alignRecord(length);
+
+        // Rewriting once the dead records outweigh the live ones copies at most
+        // as much as was appended since the last rewrite. Should it fail, the
+        // files stay as they are and the next put tries again.
+        if (m_dataSize > 2 * m_liveBytes) {
+            std::string ignored;
+            compactLocked(ignored);
+        }
+        return true;
+    }
+
+    void TileDiskCache::markValidated(int image_id, int64_t version) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_entries.find(image_id);
+        if (it != m_entries.end() && it->second.index.version == version) {
+            it->second.validated = true;
+        }
+    }
+
+    void TileDiskCache::invalidate(int image_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_entries.find(image_id);
+        if (it != m_entries.end()) eraseLocked(it);
+    }
+
+    void TileDiskCache::invalidateProject(int project_id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            if (it->second.index.project_id == project_id) {
+                m_liveBytes -= alignRecord(it->second.index.length);
+                it = m_entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void TileDiskCache::resetValidation() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto &entry : m_entries) {
+            entry.second.validated = false;
+        }
+    }
+
+    void TileDiskCache::clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_entries.clear();
+        m_liveBytes = 0;
+        // Should this fail, the entries come back unvalidated on the next
+        // open() and are checked against the database like any others.
+        if (m_indexFd >= 0 && 0 != ftruncate(m_indexFd, 0)) return;
+    }
+
+    void TileDiskCache::getVersions(int project_id, std::vector<int> &image_ids, std::vector<int64_t> &versions) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (const auto &entry : m_entries) {
+            if (entry.second.index.project_id == project_id) {
+                image_ids.push_back(entry.first);
+                versions.push_back(entry.second.index.version);
+            }
+        }
+    }
+
+    size_t TileDiskCache::size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+
+    uint64_t TileDiskCache::getLiveBytes() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_liveBytes;
+    }
+
+    uint64_t TileDiskCache::getFileBytes() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_dataSize;
+    }
+}
@@ -0,0 +1,228 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/TileIndex.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace NJLIC {
+
+    TileIndex::TileIndex() : m_sourceDims(0), m_pruneScale(1.0f) {
+    }
+
+    void TileIndex::clear() {
+        m_sourceDims = 0;
+        m_pruneScale = 1.0f;
+        m_dims.clear();
+        m_nodes.clear();
+        m_points.clear();
+        m_ids.clear();
+    }
+
+    void TileIndex::build(const float* vectors, size_t count, int source_dims, const int* ids) {
+        build(vectors, count, source_dims, ids, Options());
+    }
+
+    void TileIndex::build(const ImageFeatureSet &features) {
+        build(features, Options());
+    }
+
+    void TileIndex::build(const ImageFeatureSet &features, const Options &options) {
+        // The set is dimension major; the tree wants one vector per tile.
+        const size_t count = features.size();
+        std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+        for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+            const float* column = features.getDimension(d);
+            for (size_t i = 0; i < count; ++i) {
+                vectors[i * ImageFeatures::DIMENSIONS + d] = column[i];
+            }
+        }
+        build(vectors.data(), count, ImageFeatures::DIMENSIONS, features.getImageIds().data(), options);
+    }
+
+    void TileIndex::build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options) {
+        clear();
+        m_sourceDims = source_dims;
+        m_pruneScale = (1.0f + std::max(0.0f, options.epsilon)) * (1.0f + std::max(0.0f, options.epsilon));
+
+        if (options.dimensions.empty()) {
+            m_dims.resize(source_dims);
+            std::iota(m_dims.begin(), m_dims.end(), 0);
+        } else {
+            for (int d : options.dimensions) {
+                if (d >= 0 && d < source_dims) m_dims.push_back(d);
+            }
+        }
+        if (0 == count || m_dims.empty()) return;
+
+        const size_t dims = m_dims.size();
+        std::vector<float> projected(count * dims);
+        for (size_t i = 0; i < count; ++i) {
+            for (size_t d = 0; d < dims; ++d) {
+                projected[i * dims + d] = vectors[i * source_dims + m_dims[d]];
+            }
+        }
+
+        std::vector<uint32_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+
+        m_nodes.reserve(2 * count / std::max(1, options.leaf_size) + 1);
+        buildNode(order, projected.data(), 0, static_cast<uint32_t>(count), std::max(1, options.leaf_size));
+
+        // Lay the points out in leaf order so each leaf scans one contiguous block.
+        m_points.resize(count * dims);
+        m_ids.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            std::copy(projected.begin() + order[i] * dims, projected.begin() + (order[i] + 1) * dims, m_points.begin() + i * dims);
+            m_ids[i] = ids[order[i]];
+        }
+    }
+
+    uint32_t TileIndex::buildNode(std::vector<uint32_t> &order, const float* projected, uint32_t begin, uint32_t end, int leaf_size) {
+        const size_t dims = m_dims.size();
+        const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.push_back(Node{-1, 0.0f, begin, end});
+
+        if (end - begin <= static_cast<uint32_t>(leaf_size)) return index;
+
+        // Split the widest dimension at its median.
+        int split_dim = -1;
+        float widest = 0.0f;
+        for (size_t d = 0; d < dims; ++d) {
+            float lo = std::numeric_limits<float>::max();
+            float hi = std::numeric_limits<float>::lowest();
+            for (uint32_t i = begin; i < end; ++i) {
+                const float v = projected[order[i] * dims + d];
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+            if (hi - lo > widest) {
+                widest = hi - lo;
+                split_dim = static_cast<int>(d);
+            }
+        }
+        if (split_dim < 0) return index; // Every point is identical.
+
+        const uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b) {
+            return projected[a * dims + split_dim] < projected[b * dims + split_dim];
+        });
+        const float split_value = projected[order[mid] * dims + split_dim];
+
+        const uint32_t left = buildNode(order, projected, begin, mid, leaf_size);
+        const uint32_t right = buildNode(order, projected, mid, end, leaf_size);
+
+        Node &node = m_nodes[index];
+        node.split_dim = split_dim;
+        node.split_value = split_value;
+        node.left_or_begin = left;
+        node.right_or_end = right;
+        return index;
+    }
+
+    // Search state for one query. Bounds use the incremental rule of Arya and
+    // Mount: the squared distance to a cell is the sum of the squared offsets
+    // across every split dimension crossed to reach it, which prunes far more
+    // than the distance to the last splitting plane alone.
+    struct TileIndex::Search {
+        const float* query;
+        float* offsets;
+        int k;
+        int* ids;
+        float* distances;
+        int found;
+    };
+
+    void TileIndex::search(Search &search, uint32_t node_index, float bound) const {
+        const Node &node = m_nodes[node_index];
+
+        if (node.split_dim < 0) {
+            const size_t dims = m_dims.size();
+            const int last = search.k - 1;
+            for (uint32_t i = node.left_or_begin; i < node.right_or_end; ++i) {
+                // Partial distances: give up on a point once it can no longer make the list.
+                const float* point = &m_points[i * dims];
+                const float worst = search.distances[last];
+                float distance = 0.0f;
+                size_t d = 0;
+                for (; d + 8 <= dims && distance < worst; d += 8) {
+                    for (size_t j = d; j < d + 8; ++j) {
+                        const float diff = point[j] - search.query[j];
+                        distance += diff * diff;
+                    }
+                }
+                for (; d < dims && distance < worst; ++d) {
+                    const float diff = point[d] - search.query[d];
+                    distance += diff * diff;
+                }
+                if (d < dims || distance >= worst) continue;
+
+                // distances[] is kept sorted, so the current k-th best is always distances[k - 1].
+                int slot = std::min(search.found, last);
+                while (slot > 0 && search.distances[slot - 1] > distance) {
+                    search.distances[slot] = search.distances[slot - 1];
+                    search.ids[slot] = search.ids[slot - 1];
+                    --slot;
+                }
+                search.distances[slot] = distance;
+                search.ids[slot] = m_ids[i];
+                if (search.found < search.k) ++search.found;
+            }
+            return;
+        }
+
+        const float diff = search.query[node.split_dim] - node.split_value;
+        const uint32_t near = diff < 0.0f ? node.left_or_begin : node.right_or_end;
+        const uint32_t far = diff < 0.0f ? node.right_or_end : node.left_or_begin;
+
+        this->search(search, near, bound);
+
+        const float old_offset = search.offsets[node.split_dim];
+        const float far_bound = bound - old_offset * old_offset + diff * diff;
+        if (far_bound * m_pruneScale < search.distances[search.k - 1]) {
+            search.offsets[node.split_dim] = diff;
+            this->search(search, far, far_bound);
+            search.offsets[node.split_dim] = old_offset;
+        }
+    }
+
+    int TileIndex::knn(const float* query, int k, int* ids, float* distances) const {
+        const float infinity = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < k; ++i) {
+            ids[i] = -1;
+            distances[i] = infinity;
+        }
+        if (k <= 0 || m_nodes.empty()) return 0;
+
+        const size_t dims = m_dims.size();
+        float local[2 * ImageFeatures::DIMENSIONS];
+        std::vector<float> large;
+        float* buffer = local;
+        if (dims > static_cast<size_t>(ImageFeatures::DIMENSIONS)) {
+            large.resize(2 * dims);
+            buffer = large.data();
+        }
+
+        float* projected = buffer;
+        float* offsets = buffer + dims;
+        for (size_t d = 0; d < dims; ++d) {
+            projected[d] = query[m_dims[d]];
+            offsets[d] = 0.0f;
+        }
+
+        Search state{projected, offsets, k, ids, distances, 0};
+        search(state, 0, 0.0f);
+        return state.found;
+    }
+
+    void TileIndex::knnBatch(const float* queries, size_t count, int k, int* ids, float* distances, unsigned threads) const {
+        parallelFor(count, 256, [&](size_t begin, size_t end) {
+            for (size_t q = begin; q < end; ++q) {
+                knn(queries + q * m_sourceDims, k, ids + q * k, distances + q * k);
+            }
+        }, threads);
+    }
+}
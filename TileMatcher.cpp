@@ -0,0 +1,514 @@
+//
+// Created by James Folk on 10/18/26.
+//
+
+#include "MosaifyDatabase/TileMatcher.h"
+#include "MosaifyDatabase/Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MOSAIFY_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace NJLIC {
+
+    static const int BLOCK = 16;
+
+    // Kernels return the block-relative tile index with the smallest distance;
+    // equal distances resolve to the lower index.
+    typedef void (*FloatKernel)(const float* blocks, size_t num_blocks, int dims, const float* query, uint32_t &best_index, float &best_distance);
+    typedef void (*QuantizedKernel)(const uint8_t* blocks, size_t num_blocks, int pairs, const int16_t* query, uint32_t &best_index, int32_t &best_distance);
+
+    static void nearestFloatScalar(const float* blocks, size_t num_blocks, int dims, const float* query, uint32_t &best_index, float &best_distance) {
+        best_index = 0;
+        best_distance = std::numeric_limits<float>::infinity();
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const float* block = blocks + b * dims * BLOCK;
+            float distances[BLOCK] = {0};
+            for (int d = 0; d < dims; ++d) {
+                for (int lane = 0; lane < BLOCK; ++lane) {
+                    const float diff = block[d * BLOCK + lane] - query[d];
+                    distances[lane] += diff * diff;
+                }
+            }
+            for (int lane = 0; lane < BLOCK; ++lane) {
+                if (distances[lane] < best_distance) {
+                    best_distance = distances[lane];
+                    best_index = static_cast<uint32_t>(b * BLOCK + lane);
+                }
+            }
+        }
+    }
+
+    static void nearestQuantizedScalar(const uint8_t* blocks, size_t num_blocks, int pairs, const int16_t* query, uint32_t &best_index, int32_t &best_distance) {
+        best_index = 0;
+        best_distance = std::numeric_limits<int32_t>::max();
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const uint8_t* block = blocks + b * pairs * BLOCK * 2;
+            int32_t distances[BLOCK] = {0};
+            for (int p = 0; p < pairs; ++p) {
+                for (int lane = 0; lane < BLOCK; ++lane) {
+                    const int32_t d0 = block[p * BLOCK * 2 + lane * 2] - query[p * 2];
+                    const int32_t d1 = block[p * BLOCK * 2 + lane * 2 + 1] - query[p * 2 + 1];
+                    distances[lane] += d0 * d0 + d1 * d1;
+                }
+            }
+            for (int lane = 0; lane < BLOCK; ++lane) {
+                if (distances[lane] < best_distance) {
+                    best_distance = distances[lane];
+                    best_index = static_cast<uint32_t>(b * BLOCK + lane);
+                }
+            }
+        }
+    }
+
+#if MOSAIFY_X86_KERNELS
+    // Picks the lane with the smallest distance, then the smallest index.
+    template<typename T>
+    static void reduceLanes(const T* distances, const uint32_t* indices, int lanes, uint32_t &best_index, T &best_distance) {
+        best_index = indices[0];
+        best_distance = distances[0];
+        for (int lane = 1; lane < lanes; ++lane) {
+            if (distances[lane] < best_distance || (distances[lane] == best_distance && indices[lane] < best_index)) {
+                best_distance = distances[lane];
+                best_index = indices[lane];
+            }
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void nearestFloatAVX2(const float* blocks, size_t num_blocks, int dims, const float* query, uint32_t &best_index, float &best_distance) {
+        __m256 best0 = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+        __m256 best1 = best0;
+        __m256i best_index0 = _mm256_setzero_si256();
+        __m256i best_index1 = best_index0;
+        __m256i index0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i index1 = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+        const __m256i step = _mm256_set1_epi32(BLOCK);
+
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const float* block = blocks + b * dims * BLOCK;
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            for (int d = 0; d < dims; ++d) {
+                const __m256 q = _mm256_set1_ps(query[d]);
+                const __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(block + d * BLOCK), q);
+                const __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(block + d * BLOCK + 8), q);
+                acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+                acc1 = _mm256_fmadd_ps(diff1, diff1, acc1);
+            }
+
+            const __m256 less0 = _mm256_cmp_ps(acc0, best0, _CMP_LT_OQ);
+            const __m256 less1 = _mm256_cmp_ps(acc1, best1, _CMP_LT_OQ);
+            best0 = _mm256_blendv_ps(best0, acc0, less0);
+            best1 = _mm256_blendv_ps(best1, acc1, less1);
+            best_index0 = _mm256_blendv_epi8(best_index0, index0, _mm256_castps_si256(less0));
+            best_index1 = _mm256_blendv_epi8(best_index1, index1, _mm256_castps_si256(less1));
+            index0 = _mm256_add_epi32(index0, step);
+            index1 = _mm256_add_epi32(index1, step);
+        }
+
+        alignas(32) float distances[BLOCK];
+        alignas(32) uint32_t indices[BLOCK];
+        _mm256_store_ps(distances, best0);
+        _mm256_store_ps(distances + 8, best1);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(indices), best_index0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(indices + 8), best_index1);
+        reduceLanes(distances, indices, BLOCK, best_index, best_distance);
+    }
+
+    __attribute__((target("avx512f")))
+    static void nearestFloatAVX512(const float* blocks, size_t num_blocks, int dims, const float* query, uint32_t &best_index, float &best_distance) {
+        __m512 best = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+        __m512i best_indices = _mm512_setzero_si512();
+        __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m512i step = _mm512_set1_epi32(BLOCK);
+
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const float* block = blocks + b * dims * BLOCK;
+            __m512 acc = _mm512_setzero_ps();
+            for (int d = 0; d < dims; ++d) {
+                const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(block + d * BLOCK), _mm512_set1_ps(query[d]));
+                acc = _mm512_fmadd_ps(diff, diff, acc);
+            }
+
+            const __mmask16 less = _mm512_cmp_ps_mask(acc, best, _CMP_LT_OQ);
+            best = _mm512_mask_blend_ps(less, best, acc);
+            best_indices = _mm512_mask_blend_epi32(less, best_indices, index);
+            index = _mm512_add_epi32(index, step);
+        }
+
+        alignas(64) float distances[BLOCK];
+        alignas(64) uint32_t indices[BLOCK];
+        _mm512_store_ps(distances, best);
+        _mm512_store_si512(indices, best_indices);
+        reduceLanes(distances, indices, BLOCK, best_index, best_distance);
+    }
+
+    // Each 32-byte row holds two dimensions of 16 tiles, interleaved per tile,
+    // so widening to 16 bits and pmaddwd yields d0^2 + d1^2 per tile directly.
+    __attribute__((target("avx2")))
+    static void nearestQuantizedAVX2(const uint8_t* blocks, size_t num_blocks, int pairs, const int16_t* query, uint32_t &best_index, int32_t &best_distance) {
+        __m256i best0 = _mm256_set1_epi32(std::numeric_limits<int32_t>::max());
+        __m256i best1 = best0;
+        __m256i best_index0 = _mm256_setzero_si256();
+        __m256i best_index1 = best_index0;
+        __m256i index0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i index1 = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+        const __m256i step = _mm256_set1_epi32(BLOCK);
+
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const uint8_t* block = blocks + b * pairs * BLOCK * 2;
+            __m256i acc0 = _mm256_setzero_si256();
+            __m256i acc1 = _mm256_setzero_si256();
+            for (int p = 0; p < pairs; ++p) {
+                const __m256i q = _mm256_set1_epi32(static_cast<int32_t>((static_cast<uint32_t>(static_cast<uint16_t>(query[p * 2 + 1])) << 16) | static_cast<uint16_t>(query[p * 2])));
+                const __m256i row = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + p * BLOCK * 2));
+                const __m256i lo = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(row)), q);
+                const __m256i hi = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(row, 1)), q);
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(lo, lo));
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(hi, hi));
+            }
+
+            const __m256i less0 = _mm256_cmpgt_epi32(best0, acc0);
+            const __m256i less1 = _mm256_cmpgt_epi32(best1, acc1);
+            best0 = _mm256_blendv_epi8(best0, acc0, less0);
+            best1 = _mm256_blendv_epi8(best1, acc1, less1);
+            best_index0 = _mm256_blendv_epi8(best_index0, index0, less0);
+            best_index1 = _mm256_blendv_epi8(best_index1, index1, less1);
+            index0 = _mm256_add_epi32(index0, step);
+            index1 = _mm256_add_epi32(index1, step);
+        }
+
+        alignas(32) int32_t distances[BLOCK];
+        alignas(32) uint32_t indices[BLOCK];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(distances), best0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(distances + 8), best1);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(indices), best_index0);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(indices + 8), best_index1);
+        reduceLanes(distances, indices, BLOCK, best_index, best_distance);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    static void nearestQuantizedAVX512(const uint8_t* blocks, size_t num_blocks, int pairs, const int16_t* query, uint32_t &best_index, int32_t &best_distance) {
+        __m512i best = _mm512_set1_epi32(std::numeric_limits<int32_t>::max());
+        __m512i best_indices = _mm512_setzero_si512();
+        __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const __m512i step = _mm512_set1_epi32(BLOCK);
+
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const uint8_t* block = blocks + b * pairs * BLOCK * 2;
+            __m512i acc = _mm512_setzero_si512();
+            for (int p = 0; p < pairs; ++p) {
+                const __m512i q = _mm512_set1_epi32(static_cast<int32_t>((static_cast<uint32_t>(static_cast<uint16_t>(query[p * 2 + 1])) << 16) | static_cast<uint16_t>(query[p * 2])));
+                const __m256i row = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + p * BLOCK * 2));
+                const __m512i diff = _mm512_sub_epi16(_mm512_cvtepu8_epi16(row), q);
+                acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff, diff));
+            }
+
+            const __mmask16 less = _mm512_cmplt_epi32_mask(acc, best);
+            best = _mm512_mask_blend_epi32(less, best, acc);
+            best_indices = _mm512_mask_blend_epi32(less, best_indices, index);
+            index = _mm512_add_epi32(index, step);
+        }
+
+        alignas(64) int32_t distances[BLOCK];
+        alignas(64) uint32_t indices[BLOCK];
+        _mm512_store_si512(distances, best);
+        _mm512_store_si512(indices, best_indices);
+        reduceLanes(distances, indices, BLOCK, best_index, best_distance);
+    }
+#endif
+
+    SimdLevel getSupportedSimdLevel() {
+#if MOSAIFY_X86_KERNELS
+        static const SimdLevel level = []() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel::AVX512;
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+            return SimdLevel::Scalar;
+        }();
+        return level;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }
+
+    const char* getSimdLevelName(SimdLevel level) {
+        switch (level) {
+            case SimdLevel::Scalar:return "scalar";
+            case SimdLevel::AVX2:return "avx2";
+            case SimdLevel::AVX512:return "avx512";
+        }
+        return "unknown";
+    }
+
+    static FloatKernel getFloatKernel(SimdLevel level) {
+#if MOSAIFY_X86_KERNELS
+        if (SimdLevel::AVX512 == level) return nearestFloatAVX512;
+        if (SimdLevel::AVX2 == level) return nearestFloatAVX2;
+#endif
+        return nearestFloatScalar;
+    }
+
+    static QuantizedKernel getQuantizedKernel(SimdLevel level) {
+#if MOSAIFY_X86_KERNELS
+        if (SimdLevel::AVX512 == level) return nearestQuantizedAVX512;
+        if (SimdLevel::AVX2 == level) return nearestQuantizedAVX2;
+#endif
+        return nearestQuantizedScalar;
+    }
+
+    BruteForceMatcher::BruteForceMatcher()
+            : m_sourceDims(0), m_quantized(false), m_simdLevel(getSupportedSimdLevel()),
+              m_numBlocks(0), m_quantizeMin(0.0f), m_quantizeScale(1.0f) {
+    }
+
+    void BruteForceMatcher::clear() {
+        m_sourceDims = 0;
+        m_dims.clear();
+        m_numBlocks = 0;
+        m_blocks.clear();
+        m_quantizedBlocks.clear();
+        m_ids.clear();
+    }
+
+    void BruteForceMatcher::setSimdLevel(SimdLevel level) {
+        m_simdLevel = std::min(level, getSupportedSimdLevel());
+    }
+
+    void BruteForceMatcher::build(const ImageFeatureSet &features, const Options &options) {
+        const size_t count = features.size();
+        std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+        for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+            const float* column = features.getDimension(d);
+            for (size_t i = 0; i < count; ++i) {
+                vectors[i * ImageFeatures::DIMENSIONS + d] = column[i];
+            }
+        }
+        build(vectors.data(), count, ImageFeatures::DIMENSIONS, features.getImageIds().data(), options);
+    }
+
+    void BruteForceMatcher::build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options) {
+        clear();
+        m_sourceDims = source_dims;
+        m_quantized = options.quantized;
+
+        if (options.dimensions.empty()) {
+            m_dims.resize(source_dims);
+            std::iota(m_dims.begin(), m_dims.end(), 0);
+        } else {
+            for (int d : options.dimensions) {
+                if (d >= 0 && d < source_dims) m_dims.push_back(d);
+            }
+        }
+        if (0 == count || m_dims.empty()) return;
+
+        m_ids.assign(ids, ids + count);
+        m_numBlocks = (count + BLOCK - 1) / BLOCK;
+        const int dims = static_cast<int>(m_dims.size());
+
+        // Padding lanes repeat the last tile; its lower index wins the tie.
+        auto value = [&](size_t tile, int d) {
+            return vectors[std::min(tile, count - 1) * source_dims + m_dims[d]];
+        };
+
+        if (!m_quantized) {
+            m_blocks.resize(m_numBlocks * dims * BLOCK);
+            for (size_t b = 0; b < m_numBlocks; ++b) {
+                for (int d = 0; d < dims; ++d) {
+                    for (int lane = 0; lane < BLOCK; ++lane) {
+                        m_blocks[(b * dims + d) * BLOCK + lane] = value(b * BLOCK + lane, d);
+                    }
+                }
+            }
+            return;
+        }
+
+        float lo = std::numeric_limits<float>::max();
+        float hi = std::numeric_limits<float>::lowest();
+        for (size_t i = 0; i < count; ++i) {
+            for (int d = 0; d < dims; ++d) {
+                lo = std::min(lo, value(i, d));
+                hi = std::max(hi, value(i, d));
+            }
+        }
+        m_quantizeMin = lo;
+        m_quantizeScale = (hi > lo) ? 255.0f / (hi - lo) : 1.0f;
+
+        const int pairs = (dims + 1) / 2;
+        m_quantizedBlocks.assign(m_numBlocks * pairs * BLOCK * 2, 0);
+        for (size_t b = 0; b < m_numBlocks; ++b) {
+            for (int d = 0; d < dims; ++d) {
+                for (int lane = 0; lane < BLOCK; ++lane) {
+                    const float scaled = std::round((value(b * BLOCK + lane, d) - m_quantizeMin) * m_quantizeScale);
+                    m_quantizedBlocks[((b * pairs + d / 2) * BLOCK + lane) * 2 + d % 2] = static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, scaled)));
+                }
+            }
+        }
+    }
+
+    int BruteForceMatcher::nearest(const float* query, float &distance) const {
+        distance = std::numeric_limits<float>::infinity();
+        if (m_ids.empty()) return -1;
+
+        const int dims = static_cast<int>(m_dims.size());
+        uint32_t best = 0;
+
+        if (!m_quantized) {
+            float projected[2 * ImageFeatures::DIMENSIONS];
+            std::vector<float> large;
+            float* q = projected;
+            if (dims > 2 * ImageFeatures::DIMENSIONS) {
+                large.resize(dims);
+                q = large.data();
+            }
+            for (int d = 0; d < dims; ++d) q[d] = query[m_dims[d]];
+
+            getFloatKernel(m_simdLevel)(m_blocks.data(), m_numBlocks, dims, q, best, distance);
+        } else {
+            // Queries may fall outside the tiles' range, so they keep 16 bits; the
+            // clamp keeps the 16-bit differences in the kernels from wrapping.
+            const int pairs = (dims + 1) / 2;
+            int16_t quantized[2 * ImageFeatures::DIMENSIONS];
+            std::vector<int16_t> large;
+            int16_t* q = quantized;
+            if (2 * pairs > 2 * ImageFeatures::DIMENSIONS) {
+                large.resize(2 * pairs);
+                q = large.data();
+            }
+            for (int d = 0; d < 2 * pairs; ++d) {
+                if (d >= dims) {
+                    q[d] = 0;
+                    continue;
+                }
+                const float scaled = std::round((query[m_dims[d]] - m_quantizeMin) * m_quantizeScale);
+                q[d] = static_cast<int16_t>(std::max(-16384.0f, std::min(16383.0f, scaled)));
+            }
+
+            int32_t quantized_distance = 0;
+            getQuantizedKernel(m_simdLevel)(m_quantizedBlocks.data(), m_numBlocks, pairs, q, best, quantized_distance);
+            distance = static_cast<float>(quantized_distance) / (m_quantizeScale * m_quantizeScale);
+        }
+
+        return m_ids[std::min<size_t>(best, m_ids.size() - 1)];
+    }
+
+    void BruteForceMatcher::nearestBatch(const float* queries, size_t count, int* ids, float* distances, unsigned threads) const {
+        parallelFor(count, 64, [&](size_t begin, size_t end) {
+            for (size_t q = begin; q < end; ++q) {
+                ids[q] = nearest(queries + q * m_sourceDims, distances[q]);
+            }
+        }, threads);
+    }
+
+    MatchStrategy chooseMatchStrategy(size_t num_tiles, int dims) {
+        // From bench_tile_matcher: with the mean color alone the tree prunes
+        // almost everything and passes the scan at around 2k tiles; on the full
+        // grid its pruning is weak and the scan stays ahead until about 16k,
+        // after which the scan is bound by memory bandwidth.
+        const size_t crossover = (dims <= 8) ? 2048 : 16384;
+        return num_tiles <= crossover ? MatchStrategy::BruteForce : MatchStrategy::Tree;
+    }
+
+    static HnswIndex::Options getApproximateOptions(const TileMatcher::Options &options) {
+        HnswIndex::Options approximate_options;
+        approximate_options.dimensions = options.dimensions;
+        approximate_options.m = options.m;
+        approximate_options.ef_construction = options.ef_construction;
+        approximate_options.ef_search = options.ef_search;
+        return approximate_options;
+    }
+
+    void TileMatcher::build(const ImageFeatureSet &features, const Options &options) {
+        m_strategy = options.strategy;
+        if (MatchStrategy::Auto == m_strategy) {
+            const int dims = options.dimensions.empty() ? ImageFeatures::DIMENSIONS : static_cast<int>(options.dimensions.size());
+            m_strategy = chooseMatchStrategy(features.size(), dims);
+        }
+
+        m_bruteForce.clear();
+        m_tree.clear();
+        m_approximate.clear();
+        if (MatchStrategy::BruteForce == m_strategy) {
+            BruteForceMatcher::Options brute_options;
+            brute_options.dimensions = options.dimensions;
+            brute_options.quantized = options.quantized;
+            m_bruteForce.build(features, brute_options);
+        } else if (MatchStrategy::Approximate == m_strategy) {
+            const size_t count = features.size();
+            std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+            for (size_t i = 0; i < count; ++i) {
+                for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) vectors[i * ImageFeatures::DIMENSIONS + d] = features.getValue(i, d);
+            }
+            build(vectors.data(), count, ImageFeatures::DIMENSIONS, features.getImageIds().data(), options);
+        } else {
+            TileIndex::Options tree_options;
+            tree_options.dimensions = options.dimensions;
+            tree_options.epsilon = options.epsilon;
+            m_tree.build(features, tree_options);
+        }
+    }
+
+    void TileMatcher::build(const float* vectors, size_t count, int source_dims, const int* ids, const Options &options) {
+        m_strategy = options.strategy;
+        if (MatchStrategy::Auto == m_strategy) {
+            const int dims = options.dimensions.empty() ? source_dims : static_cast<int>(options.dimensions.size());
+            m_strategy = chooseMatchStrategy(count, dims);
+        }
+
+        m_bruteForce.clear();
+        m_tree.clear();
+        m_approximate.clear();
+        if (MatchStrategy::BruteForce == m_strategy) {
+            BruteForceMatcher::Options brute_options;
+            brute_options.dimensions = options.dimensions;
+            brute_options.quantized = options.quantized;
+            m_bruteForce.build(vectors, count, source_dims, ids, brute_options);
+        } else if (MatchStrategy::Approximate == m_strategy) {
+            const std::vector<int64_t> labels(ids, ids + count);
+            m_approximate.build(vectors, count, source_dims, labels.data(), getApproximateOptions(options));
+        } else {
+            TileIndex::Options tree_options;
+            tree_options.dimensions = options.dimensions;
+            tree_options.epsilon = options.epsilon;
+            m_tree.build(vectors, count, source_dims, ids, tree_options);
+        }
+    }
+
+    size_t TileMatcher::size() const {
+        if (MatchStrategy::BruteForce == m_strategy) return m_bruteForce.size();
+        if (MatchStrategy::Approximate == m_strategy) return m_approximate.size();
+        return m_tree.size();
+    }
+
+    int TileMatcher::nearest(const float* query, float &distance) const {
+        if (MatchStrategy::BruteForce == m_strategy) {
+            return m_bruteForce.nearest(query, distance);
+        }
+        if (MatchStrategy::Approximate == m_strategy) {
+            int64_t label = -1;
+            m_approximate.knn(query, 1, &label, &distance);
+            return static_cast<int>(label);
+        }
+        int id = -1;
+        m_tree.knn(query, 1, &id, &distance);
+        return id;
+    }
+
+    void TileMatcher::nearestBatch(const float* queries, size_t count, int* ids, float* distances, unsigned threads) const {
+        if (MatchStrategy::BruteForce == m_strategy) {
+            m_bruteForce.nearestBatch(queries, count, ids, distances, threads);
+        } else if (MatchStrategy::Approximate == m_strategy) {
+            std::vector<int64_t> labels(count);
+            m_approximate.knnBatch(queries, count, 1, labels.data(), distances, threads);
+            for (size_t q = 0; q < count; ++q) ids[q] = static_cast<int>(labels[q]);
+        } else {
+            m_tree.knnBatch(queries, count, 1, ids, distances, threads);
+        }
+    }
+}
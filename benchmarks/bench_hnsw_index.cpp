@@ -0,0 +1,150 @@
+//
+// Created by James Folk on 10/18/26.
+//
+// Recall against throughput of the approximate HnswIndex on libraries up to a
+// million tiles, with the exact brute-force scan on the same queries as the
+// baseline. Features and match dimensions are the ones bench_tile_index uses.
+// Indexes are built once per library size and shared by every ef_search run;
+// the recall counter is the share of queries whose exact nearest tile was
+// found. BM_HnswIndexInsert is the cost of adding tiles to a built index.
+//
+
+#include <benchmark/benchmark.h>
+#include "MosaifyDatabase/HnswIndex.h"
+#include "MosaifyDatabase/TileMatcher.h"
+
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace NJLIC;
+
+static std::vector<float> randomFeatures(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> lightness(0.0f, 100.0f);
+    std::uniform_real_distribution<float> chroma(-80.0f, 80.0f);
+    std::normal_distribution<float> noise(0.0f, 8.0f);
+    std::uniform_real_distribution<float> variance(0.0f, 0.1f);
+
+    std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+    for (size_t i = 0; i < count; ++i) {
+        float* v = &vectors[i * ImageFeatures::DIMENSIONS];
+        v[0] = lightness(rng);
+        v[1] = chroma(rng);
+        v[2] = chroma(rng);
+        for (int c = 0; c < ImageFeatures::GRID_SIZE * ImageFeatures::GRID_SIZE; ++c) {
+            for (int j = 0; j < 3; ++j) {
+                v[ImageFeatures::GRID_OFFSET + c * 3 + j] = v[j] + noise(rng);
+            }
+        }
+        v[ImageFeatures::VARIANCE_OFFSET] = variance(rng);
+    }
+    return vectors;
+}
+
+static std::vector<int> matchDimensions() {
+    std::vector<int> dims(ImageFeatures::VARIANCE_OFFSET);
+    std::iota(dims.begin(), dims.end(), 0);
+    return dims;
+}
+
+static const size_t CELLS = 10000;
+
+// A library, its index and the exact answer for every query.
+struct Library {
+    std::vector<float> vectors;
+    std::vector<float> queries;
+    HnswIndex index;
+    std::vector<int> exact;
+};
+
+static Library& getLibrary(size_t tiles) {
+    static std::map<size_t, std::unique_ptr<Library>> libraries;
+    std::unique_ptr<Library> &library = libraries[tiles];
+    if (library) return *library;
+
+    library.reset(new Library());
+    library->vectors = randomFeatures(tiles, 1);
+    library->queries = randomFeatures(CELLS, 2);
+
+    std::vector<int64_t> labels(tiles);
+    std::iota(labels.begin(), labels.end(), 0);
+    HnswIndex::Options options;
+    options.dimensions = matchDimensions();
+    library->index.build(library->vectors.data(), tiles, ImageFeatures::DIMENSIONS, labels.data(), options);
+
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 0);
+    BruteForceMatcher::Options brute_options;
+    brute_options.dimensions = options.dimensions;
+    BruteForceMatcher matcher;
+    matcher.build(library->vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), brute_options);
+    library->exact.resize(CELLS);
+    std::vector<float> distances(CELLS);
+    matcher.nearestBatch(library->queries.data(), CELLS, library->exact.data(), distances.data());
+    return *library;
+}
+
+static void BM_HnswIndexKnnBatch(benchmark::State &state) {
+    Library &library = getLibrary(static_cast<size_t>(state.range(0)));
+    HnswIndex &index = library.index;
+    index.setEfSearch(static_cast<int>(state.range(1)));
+
+    std::vector<int64_t> found_ids(CELLS);
+    std::vector<float> found_distances(CELLS);
+    for (auto _ : state) {
+        index.knnBatch(library.queries.data(), CELLS, 1, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+
+    size_t hits = 0;
+    for (size_t q = 0; q < CELLS; ++q) {
+        if (found_ids[q] == library.exact[q]) ++hits;
+    }
+    state.counters["recall"] = static_cast<double>(hits) / CELLS;
+    state.SetItemsProcessed(state.iterations() * CELLS);
+}
+// Second argument is ef_search.
+BENCHMARK(BM_HnswIndexKnnBatch)->ArgsProduct({{10000, 100000, 1000000}, {8, 16, 32, 64, 128}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_ExactKnnBatch(benchmark::State &state) {
+    const Library &library = getLibrary(static_cast<size_t>(state.range(0)));
+    const size_t tiles = library.vectors.size() / ImageFeatures::DIMENSIONS;
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 0);
+    BruteForceMatcher::Options options;
+    options.dimensions = matchDimensions();
+    BruteForceMatcher matcher;
+    matcher.build(library.vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), options);
+
+    std::vector<int> found_ids(CELLS);
+    std::vector<float> found_distances(CELLS);
+    for (auto _ : state) {
+        matcher.nearestBatch(library.queries.data(), CELLS, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * CELLS);
+}
+BENCHMARK(BM_ExactKnnBatch)->Arg(10000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_HnswIndexInsert(benchmark::State &state) {
+    const Library &library = getLibrary(static_cast<size_t>(state.range(0)));
+    const size_t added = 1000;
+    std::vector<float> vectors = randomFeatures(added, 3);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        HnswIndex index = library.index;
+        state.ResumeTiming();
+        for (size_t i = 0; i < added; ++i) {
+            index.insert(&vectors[i * ImageFeatures::DIMENSIONS], -1 - static_cast<int64_t>(i));
+        }
+        benchmark::DoNotOptimize(index.size());
+    }
+    state.SetItemsProcessed(state.iterations() * added);
+}
+BENCHMARK(BM_HnswIndexInsert)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,58 @@
+//
+// Created by James Folk on 10/18/26.
+//
+// Random reads over a large mosaic-sized buffer, once from the default
+// allocator and once from the huge page allocator. The access pattern touches
+// a new 4KiB page on almost every load, so the difference between the two is
+// dominated by TLB misses. Run with
+//   --benchmark_perf_counters=dTLB-load-misses
+// (Google Benchmark built with libpfm) to see the miss counts directly.
+//
+
+#include <benchmark/benchmark.h>
+#include "MosaifyDatabase/PixelAllocator.h"
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace NJLIC;
+
+static void randomPageWalk(benchmark::State &state, std::shared_ptr<IPixelAllocator> allocator) {
+    const size_t bytes = static_cast<size_t>(state.range(0)) * 1024 * 1024;
+    PixelBuffer buffer(bytes, allocator);
+    for (size_t i = 0; i < bytes; i += 4096) {
+        buffer.data()[i] = static_cast<unsigned char>(i >> 12);
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<uint32_t> offsets(1 << 16);
+    std::uniform_int_distribution<size_t> dist(0, bytes - 1);
+    for (auto &o : offsets) {
+        o = static_cast<uint32_t>(dist(rng));
+    }
+
+    uint64_t sum = 0;
+    for (auto _ : state) {
+        for (auto o : offsets) {
+            sum += buffer.data()[o];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * offsets.size());
+}
+
+static void BM_DefaultAllocator(benchmark::State &state) {
+    randomPageWalk(state, std::make_shared<DefaultPixelAllocator>());
+}
+
+static void BM_HugePageAllocator(benchmark::State &state) {
+    randomPageWalk(state, std::make_shared<HugePagePixelAllocator>());
+}
+
+// 64MB .. 1GB, i.e. 4k x 4k RGBA up to a 16k x 16k RGBA mosaic.
+BENCHMARK(BM_DefaultAllocator)->RangeMultiplier(4)->Range(64, 1024)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_HugePageAllocator)->RangeMultiplier(4)->Range(64, 1024)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,83 @@
+//
+// Created by James Folk on 10/18/26.
+//
+// Batched nearest-tile queries against tile libraries of increasing size.
+// Synthetic features look like real ones: a random mean color with grid cells
+// scattered around it, so the dimensions are strongly correlated. The index is
+// built on the mean and grid Lab dimensions, which is what the engine matches on.
+//
+
+#include <benchmark/benchmark.h>
+#include "MosaifyDatabase/TileIndex.h"
+
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace NJLIC;
+
+static std::vector<float> randomFeatures(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> lightness(0.0f, 100.0f);
+    std::uniform_real_distribution<float> chroma(-80.0f, 80.0f);
+    std::normal_distribution<float> noise(0.0f, 8.0f);
+    std::uniform_real_distribution<float> variance(0.0f, 0.1f);
+
+    std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+    for (size_t i = 0; i < count; ++i) {
+        float* v = &vectors[i * ImageFeatures::DIMENSIONS];
+        v[0] = lightness(rng);
+        v[1] = chroma(rng);
+        v[2] = chroma(rng);
+        for (int c = 0; c < ImageFeatures::GRID_SIZE * ImageFeatures::GRID_SIZE; ++c) {
+            for (int j = 0; j < 3; ++j) {
+                v[ImageFeatures::GRID_OFFSET + c * 3 + j] = v[j] + noise(rng);
+            }
+        }
+        v[ImageFeatures::VARIANCE_OFFSET] = variance(rng);
+    }
+    return vectors;
+}
+
+static void BM_TileIndexBuild(benchmark::State &state) {
+    const size_t tiles = static_cast<size_t>(state.range(0));
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 1);
+
+    for (auto _ : state) {
+        TileIndex index;
+        index.build(vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data());
+        benchmark::DoNotOptimize(index.size());
+    }
+}
+BENCHMARK(BM_TileIndexBuild)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_TileIndexKnnBatch(benchmark::State &state) {
+    const size_t tiles = static_cast<size_t>(state.range(0));
+    const size_t cells = 10000;
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<float> queries = randomFeatures(cells, 2);
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 1);
+
+    TileIndex::Options options;
+    options.epsilon = static_cast<float>(state.range(1)) / 10.0f;
+    options.dimensions.resize(ImageFeatures::VARIANCE_OFFSET);
+    std::iota(options.dimensions.begin(), options.dimensions.end(), 0);
+
+    TileIndex index;
+    index.build(vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), options);
+
+    std::vector<int> found_ids(cells);
+    std::vector<float> found_distances(cells);
+    for (auto _ : state) {
+        index.knnBatch(queries.data(), cells, 1, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * cells);
+}
+// Second argument is epsilon * 10; 0 is an exact search.
+BENCHMARK(BM_TileIndexKnnBatch)->ArgsProduct({{1000, 10000, 100000}, {0, 5}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
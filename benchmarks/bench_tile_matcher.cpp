@@ -0,0 +1,170 @@
+//
+// Created by James Folk on 10/18/26.
+//
+// Brute-force nearest-tile matching with each kernel the CPU supports, float
+// and quantized, against the k-d tree on the same queries. Matches on the mean
+// and grid Lab dimensions like bench_tile_index; the BM_TileMatcherDims pair
+// covers the few-dimension case. chooseMatchStrategy is tuned from these.
+// BM_TileAssigner times repeat-limited assignment on large grids.
+//
+
+#include <benchmark/benchmark.h>
+#include "MosaifyDatabase/TileMatcher.h"
+#include "MosaifyDatabase/TileAssigner.h"
+
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace NJLIC;
+
+static std::vector<float> randomFeatures(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> lightness(0.0f, 100.0f);
+    std::uniform_real_distribution<float> chroma(-80.0f, 80.0f);
+    std::normal_distribution<float> noise(0.0f, 8.0f);
+    std::uniform_real_distribution<float> variance(0.0f, 0.1f);
+
+    std::vector<float> vectors(count * ImageFeatures::DIMENSIONS);
+    for (size_t i = 0; i < count; ++i) {
+        float* v = &vectors[i * ImageFeatures::DIMENSIONS];
+        v[0] = lightness(rng);
+        v[1] = chroma(rng);
+        v[2] = chroma(rng);
+        for (int c = 0; c < ImageFeatures::GRID_SIZE * ImageFeatures::GRID_SIZE; ++c) {
+            for (int j = 0; j < 3; ++j) {
+                v[ImageFeatures::GRID_OFFSET + c * 3 + j] = v[j] + noise(rng);
+            }
+        }
+        v[ImageFeatures::VARIANCE_OFFSET] = variance(rng);
+    }
+    return vectors;
+}
+
+static std::vector<int> matchDimensions(int count) {
+    std::vector<int> dimensions(count);
+    std::iota(dimensions.begin(), dimensions.end(), 0);
+    return dimensions;
+}
+
+static const size_t CELLS = 2000;
+
+// range(1): SimdLevel, range(2): quantized.
+static void BM_BruteForceMatcher(benchmark::State &state) {
+    const size_t tiles = static_cast<size_t>(state.range(0));
+    const SimdLevel level = static_cast<SimdLevel>(state.range(1));
+    if (level > getSupportedSimdLevel()) {
+        state.SkipWithError("instruction set not supported");
+        return;
+    }
+
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<float> queries = randomFeatures(CELLS, 2);
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 1);
+
+    BruteForceMatcher::Options options;
+    options.dimensions = matchDimensions(ImageFeatures::VARIANCE_OFFSET);
+    options.quantized = 0 != state.range(2);
+
+    BruteForceMatcher matcher;
+    matcher.build(vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), options);
+    matcher.setSimdLevel(level);
+    state.SetLabel(getSimdLevelName(matcher.getSimdLevel()));
+
+    std::vector<int> found_ids(CELLS);
+    std::vector<float> found_distances(CELLS);
+    for (auto _ : state) {
+        matcher.nearestBatch(queries.data(), CELLS, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * CELLS);
+}
+BENCHMARK(BM_BruteForceMatcher)->ArgsProduct({{1000, 10000, 100000}, {0, 1, 2}, {0, 1}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_TreeMatcher(benchmark::State &state) {
+    const size_t tiles = static_cast<size_t>(state.range(0));
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<float> queries = randomFeatures(CELLS, 2);
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 1);
+
+    TileMatcher::Options options;
+    options.strategy = MatchStrategy::Tree;
+    options.dimensions = matchDimensions(ImageFeatures::VARIANCE_OFFSET);
+
+    TileMatcher matcher;
+    matcher.build(vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), options);
+
+    std::vector<int> found_ids(CELLS);
+    std::vector<float> found_distances(CELLS);
+    for (auto _ : state) {
+        matcher.nearestBatch(queries.data(), CELLS, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * CELLS);
+}
+BENCHMARK(BM_TreeMatcher)->Arg(1000)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Mean color only. range(1): MatchStrategy.
+static void BM_TileMatcherDims(benchmark::State &state) {
+    const size_t tiles = static_cast<size_t>(state.range(0));
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<float> queries = randomFeatures(CELLS, 2);
+    std::vector<int> ids(tiles);
+    std::iota(ids.begin(), ids.end(), 1);
+
+    TileMatcher::Options options;
+    options.strategy = static_cast<MatchStrategy>(state.range(1));
+    options.dimensions = matchDimensions(ImageFeatures::GRID_OFFSET);
+
+    TileMatcher matcher;
+    matcher.build(vectors.data(), tiles, ImageFeatures::DIMENSIONS, ids.data(), options);
+
+    std::vector<int> found_ids(CELLS);
+    std::vector<float> found_distances(CELLS);
+    for (auto _ : state) {
+        matcher.nearestBatch(queries.data(), CELLS, found_ids.data(), found_distances.data());
+        benchmark::DoNotOptimize(found_ids.data());
+    }
+    state.SetItemsProcessed(state.iterations() * CELLS);
+}
+BENCHMARK(BM_TileMatcherDims)->ArgsProduct({{1000, 10000, 100000}, {1, 2}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// range(0): grid side in cells, range(1): max uses per tile, range(2):
+// min repeat distance. 10000 tiles matched on mean color.
+static void BM_TileAssigner(benchmark::State &state) {
+    const int side = static_cast<int>(state.range(0));
+    const size_t cells = static_cast<size_t>(side) * side;
+    const size_t tiles = 10000;
+    std::vector<float> vectors = randomFeatures(tiles, 1);
+    std::vector<float> queries = randomFeatures(cells, 2);
+
+    ImageFeatureSet features;
+    features.resize(tiles);
+    for (size_t i = 0; i < tiles; ++i) {
+        features.setImageId(i, static_cast<int>(i) + 1);
+        for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) features.setValue(i, d, vectors[i * ImageFeatures::DIMENSIONS + d]);
+    }
+
+    TileAssigner::Options options;
+    options.max_uses = static_cast<int>(state.range(1));
+    options.min_repeat_distance = static_cast<int>(state.range(2));
+    options.dimensions = matchDimensions(ImageFeatures::GRID_OFFSET);
+
+    TileAssigner assigner(options);
+    std::vector<int32_t> assigned(cells);
+    for (auto _ : state) {
+        assigner.assign(queries.data(), side, side, features, assigned.data());
+        benchmark::DoNotOptimize(assigned.data());
+    }
+    state.counters["rounds"] = static_cast<double>(assigner.getLastStats().rounds);
+    state.counters["widened"] = static_cast<double>(assigner.getLastStats().widened_cells);
+    state.counters["unconstrained"] = static_cast<double>(assigner.getLastStats().unconstrained_cells);
+    state.SetItemsProcessed(state.iterations() * cells);
+}
+BENCHMARK(BM_TileAssigner)->ArgsProduct({{250, 1000}, {0, 200}, {0, 4}})->Unit(benchmark::kMillisecond)->UseRealTime();
+// Over-subscribed: 10000 tiles at 50 uses cannot fill a million cells.
+BENCHMARK(BM_TileAssigner)->ArgsProduct({{1000}, {50}, {0, 4}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
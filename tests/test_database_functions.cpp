@@ -1,11 +1,25 @@
 #include <gtest/gtest.h>
 #include "MosaifyDatabase/MosaifyDatabase.h"  // Include your database header
 #include "MosaifyDatabase/IImageData.h"
+#include "MosaifyDatabase/TileMatcher.h"
+#include "MosaifyDatabase/TileAssigner.h"
+#include "MosaifyDatabase/MosaicEngine.h"
+#include "MosaifyDatabase/MosaicRenderer.h"
+#include "MosaifyDatabase/ImageResizer.h"
+#include "MosaifyDatabase/IntegralImage.h"
+#include "MosaifyDatabase/HnswIndex.h"
+#include "MosaifyDatabase/ScaledTileCache.h"
 
 #include <string>
 #include <memory>
 #include <vector>
 #include <fstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <map>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -28,6 +42,7 @@ public:
 //    images.push_back(std::make_unique<ImageData>("image2.png", 200, 200, 3, std::vector<unsigned char>{5, 6, 7, 8, 9}));
     ImageData() : rows(0), cols(0), comps(0), id(std::numeric_limits<size_t>::min()) {}
     ImageData(const std::string &fname, int r, int c, int cps, const std::vector<unsigned char>&d) : filename(fname), rows(r), cols(c), comps(cps), data(d) {}
+    explicit ImageData(const ImageBatch::Image &img) : filename(img.getFilename()), rows(img.rows), cols(img.cols), comps(img.comps), data(img.data, img.data + img.size), id(img.id) {}
 
     // Getters
     const std::string &getFilename() const override {
@@ -331,3 +346,2230 @@ TEST_F(MosaifyDatabaseTest, ReadProjects) {
     std::vector<int> project_ids;
     EXPECT_TRUE(db.readProjects(user_id, project_ids, error_message)) << "Read projects failed: " << error_message;
 }
+
+TEST_F(MosaifyDatabaseTest, ReadImageBatch) {
+    int user_id =-1;
+    int project_id = -1;
+
+    EXPECT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "New Project", project_id, error_message));
+
+    std::vector<std::unique_ptr<IImageData>> images;
+    images.push_back(std::make_unique<ImageData>("image1.png", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4}));
+    images.push_back(std::make_unique<ImageData>("image2.png", 1, 3, 1, std::vector<unsigned char>{5, 6, 7}));
+
+    std::vector<int> image_ids;
+    ASSERT_TRUE(db.createImages(project_id, images, image_ids, error_message)) << "Create images failed: " << error_message;
+
+    ImageBatch batch;
+    EXPECT_TRUE(db.readImages(project_id, batch, error_message)) << "Read image batch failed: " << error_message;
+    ASSERT_EQ(batch.size(), 2u);
+    EXPECT_EQ(batch.getPixelBytes(), 8u);
+    EXPECT_EQ(batch.getOffsets().back(), 8u);
+
+    std::vector<ImageData> read_images;
+    EXPECT_TRUE(db.readImages(project_id, read_images, error_message)) << "Read templated images failed: " << error_message;
+    ASSERT_EQ(read_images.size(), 2u);
+    for (const auto &img : read_images) {
+        if (img.getFilename() == "image2.png") {
+            EXPECT_EQ(img.getData(), (std::vector<unsigned char>{5, 6, 7}));
+        }
+    }
+}
+
+TEST(PixelAllocatorTest, BuffersUseTheirAllocator) {
+    // Records every call and hands out default-allocated memory.
+    struct CountingAllocator : public IPixelAllocator {
+        std::vector<size_t> allocated;
+        std::vector<size_t> deallocated;
+        size_t live = 0;
+
+        void* allocate(size_t size) override {
+            allocated.push_back(size);
+            ++live;
+            return m_heap.allocate(size);
+        }
+        void deallocate(void* ptr, size_t size) override {
+            deallocated.push_back(size);
+            --live;
+            m_heap.deallocate(ptr, size);
+        }
+
+        DefaultPixelAllocator m_heap;
+    };
+    auto allocator = std::make_shared<CountingAllocator>();
+
+    {
+        const unsigned char bytes[] = {1, 2, 3, 4, 5};
+        PixelBuffer buffer(allocator);
+        EXPECT_EQ(buffer.getAllocator(), allocator);
+        buffer.append(bytes, 3);
+        buffer.append(bytes, 5);
+        ASSERT_EQ(buffer.size(), 8u);
+        EXPECT_EQ(buffer.data()[7], 5);
+        // Growing to 8 bytes moved the first 3-byte block out.
+        EXPECT_EQ(allocator->allocated, (std::vector<size_t>{3, 8}));
+        EXPECT_EQ(allocator->deallocated, (std::vector<size_t>{3}));
+
+        PixelBuffer moved(std::move(buffer));
+        EXPECT_EQ(moved.getAllocator(), allocator);
+        EXPECT_EQ(buffer.data(), nullptr);
+        EXPECT_EQ(allocator->live, 1u);
+
+        // Handing the contents to another allocator frees them from this one.
+        moved.setAllocator(nullptr);
+        EXPECT_EQ(allocator->live, 0u);
+        EXPECT_EQ(moved.getAllocator(), getDefaultPixelAllocator());
+        EXPECT_EQ(moved.data()[0], 1);
+    }
+
+    {
+        ImageBatch batch(allocator);
+        const unsigned char pixels[] = {9, 8, 7, 6};
+        batch.reserve(2, 8, 16);
+        batch.append(1, "a.png", 5, 1, 4, 1, pixels, 4);
+        batch.append(2, "b.png", 5, 1, 4, 1, pixels, 4);
+        EXPECT_EQ(batch.getPixelBytes(), 8u);
+        EXPECT_EQ(allocator->allocated.back(), 8u);
+        EXPECT_EQ(allocator->live, 1u);
+    }
+    // Every block handed out was handed back with the size it was allocated at.
+    EXPECT_EQ(allocator->live, 0u);
+    std::vector<size_t> allocated = allocator->allocated;
+    std::vector<size_t> deallocated = allocator->deallocated;
+    std::sort(allocated.begin(), allocated.end());
+    std::sort(deallocated.begin(), deallocated.end());
+    EXPECT_EQ(allocated, deallocated);
+}
+
+TEST_F(MosaifyDatabaseTest, ImageCacheHitsAndInvalidation) {
+    int user_id =-1;
+    int project_id = -1;
+    int image_id = -1;
+
+    EXPECT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "New Project", project_id, error_message));
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("image1.png", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4}), image_id, error_message));
+
+    db.enableImageCache(1024 * 1024, 4);
+
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    EXPECT_TRUE(db.readImage(image_id, project_id, img, error_message)) << "Read image failed: " << error_message;
+    EXPECT_TRUE(db.readImage(image_id, project_id, img, error_message)) << "Read image failed: " << error_message;
+
+    auto stats = db.getImageCacheStats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.entries, 1u);
+
+    EXPECT_TRUE(db.updateImage(image_id, project_id, "new_image.png", 1, 3, 1, {5, 6, 7}, error_message)) << "Update image failed: " << error_message;
+    EXPECT_EQ(db.getImageCacheStats().entries, 0u);
+
+    EXPECT_TRUE(db.readImage(image_id, project_id, img, error_message)) << "Read image failed: " << error_message;
+    EXPECT_EQ(img->getFilename(), "new_image.png");
+
+    db.disableImageCache();
+}
+
+TEST_F(MosaifyDatabaseTest, ResetClearsCaches) {
+    int user_id = -1;
+    int project_id = -1;
+    int image_id = -1;
+    std::string path = testing::TempDir() + "reset_tile_cache.bin";
+    std::remove(path.c_str());
+    std::remove((path + ".idx").c_str());
+
+    db.enableImageCache(1024 * 1024);
+    db.enableMetadataCache(std::chrono::seconds(60));
+    ASSERT_TRUE(db.enableTileDiskCache(path, error_message)) << error_message;
+
+    ASSERT_TRUE(db.createUser("reset@example.com", "Re", "Set", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Before", project_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("old.png", 1, 3, 1, std::vector<unsigned char>{1, 2, 3}), image_id, error_message)) << error_message;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readImage(image_id, project_id, img, error_message)) << error_message;
+    int owner = 0;
+    std::string name;
+    ASSERT_TRUE(db.readProject(project_id, owner, name, error_message)) << error_message;
+    ASSERT_EQ(db.getImageCacheStats().entries, 1u);
+
+    // The same ids come back after a reset and must not hit the old entries.
+    ASSERT_TRUE(db.reset(error_message)) << error_message;
+    EXPECT_EQ(db.getImageCacheStats().entries, 0u);
+    EXPECT_EQ(db.getTileDiskCache()->size(), 0u);
+
+    int new_user_id = -1;
+    int new_project_id = -1;
+    int new_image_id = -1;
+    ASSERT_TRUE(db.createUser("reset@example.com", "Re", "Set", new_user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(new_user_id, "After", new_project_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createImage(new_project_id, std::make_unique<ImageData>("new.png", 1, 2, 1, std::vector<unsigned char>{9, 8}), new_image_id, error_message)) << error_message;
+    ASSERT_EQ(new_image_id, image_id);
+    ASSERT_EQ(new_project_id, project_id);
+
+    ASSERT_TRUE(db.readImage(new_image_id, new_project_id, img, error_message)) << error_message;
+    EXPECT_EQ(img->getFilename(), "new.png");
+    EXPECT_EQ(img->getData(), (std::vector<unsigned char>{9, 8}));
+    ASSERT_TRUE(db.readProject(new_project_id, owner, name, error_message)) << error_message;
+    EXPECT_EQ(name, "After");
+
+    db.disableTileDiskCache();
+    db.disableMetadataCache();
+    db.disableImageCache();
+}
+
+TEST(ImageCacheTest, EvictsLeastRecentlyUsedOverBudget) {
+    auto makeImage = [](size_t bytes) {
+        auto image = std::make_shared<CachedImage>();
+        image->data.resize(bytes);
+        return image;
+    };
+
+    // One shard so the eviction order is fully determined.
+    ImageCache cache(3 * (sizeof(CachedImage) + 1000), 1);
+    cache.insert(1, 10, makeImage(1000));
+    cache.insert(2, 10, makeImage(1000));
+    cache.insert(3, 10, makeImage(1000));
+    EXPECT_TRUE(cache.find(1, 10) != nullptr);
+
+    cache.insert(4, 10, makeImage(1000));
+    EXPECT_TRUE(cache.find(2, 10) == nullptr);
+    EXPECT_TRUE(cache.find(1, 10) != nullptr);
+    EXPECT_EQ(cache.getStats().evictions, 1u);
+
+    cache.invalidateProject(10);
+    EXPECT_EQ(cache.getStats().entries, 0u);
+}
+
+TEST(ImageCacheTest, DropsFillsThatRaceAnInvalidation) {
+    auto image = std::make_shared<CachedImage>();
+    image->data.resize(100);
+    ImageCache cache(1024 * 1024, 4);
+
+    // The read started before the invalidation, so what it read may be stale.
+    uint64_t generation = cache.getGeneration(7);
+    cache.invalidateImage(7);
+    cache.insert(7, 10, image, generation);
+    EXPECT_TRUE(cache.find(7, 10) == nullptr);
+
+    generation = cache.getGeneration(7);
+    cache.insert(7, 10, image, generation);
+    EXPECT_TRUE(cache.find(7, 10) != nullptr);
+    EXPECT_TRUE(cache.find(7, 11) == nullptr);
+
+    cache.insert(8, 11, image);
+    cache.invalidateImage(7);
+    EXPECT_TRUE(cache.find(7, 10) == nullptr);
+    EXPECT_TRUE(cache.find(8, 11) != nullptr);
+    EXPECT_EQ(cache.getStats().invalidations, 1u);
+
+    cache.invalidateProject(11);
+    EXPECT_EQ(cache.getStats().entries, 0u);
+}
+
+TEST_F(MosaifyDatabaseTest, InvalidationListenerEvictsRemoteUpdates) {
+    int user_id =-1;
+    int project_id = -1;
+    int image_id = -1;
+
+    EXPECT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "New Project", project_id, error_message));
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("image1.png", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4}), image_id, error_message));
+
+    db.enableImageCache(1024 * 1024);
+    ASSERT_TRUE(db.startInvalidationListener(error_message)) << "Start listener failed: " << error_message;
+
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readImage(image_id, project_id, img, error_message));
+    ASSERT_EQ(db.getImageCacheStats().entries, 1u);
+
+    // A second client on its own connection stands in for another worker
+    // process; closing it must leave this one's connection alone.
+    {
+        MosaifyDatabase other;
+        ASSERT_TRUE(other.connect(std::getenv("DB_CONN_STRING"), error_message));
+        ASSERT_TRUE(other.updateImage(image_id, "remote.png", 1, 3, 1, {5, 6, 7}, error_message));
+    }
+
+    for (int i = 0; i < 50 && db.getImageCacheStats().entries > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    EXPECT_EQ(db.getImageCacheStats().entries, 0u);
+    ASSERT_TRUE(db.readImage(image_id, project_id, img, error_message)) << error_message;
+    EXPECT_EQ(img->getFilename(), "remote.png");
+
+    db.stopInvalidationListener();
+    db.disableImageCache();
+}
+
+TEST(InvalidationListenerTest, ParsesPayload) {
+    Invalidation invalidation;
+    ASSERT_TRUE(InvalidationListener::parse("images:42:7", invalidation));
+    EXPECT_EQ(invalidation.table, "images");
+    EXPECT_EQ(invalidation.id, 42);
+    EXPECT_EQ(invalidation.project_id, 7);
+    EXPECT_FALSE(InvalidationListener::parse("images:42", invalidation));
+}
+
+TEST_F(MosaifyDatabaseTest, MetadataCacheReadThroughAndInvalidation) {
+    int user_id =-1;
+    int project_id = -1;
+
+    db.enableMetadataCache(std::chrono::seconds(60), true);
+
+    int missing_id = -1;
+    EXPECT_TRUE(db.readUser("test@example.com", missing_id, error_message)) << "Read user failed: " << error_message;
+    EXPECT_TRUE(db.readUser("test@example.com", missing_id, error_message)) << "Read user failed: " << error_message;
+    EXPECT_EQ(db.getMetadataCacheStats().negative_hits, 1u);
+    EXPECT_EQ(missing_id, -1);
+
+    ASSERT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    int read_id = -1;
+    EXPECT_TRUE(db.readUser("test@example.com", read_id, error_message)) << "Read user failed: " << error_message;
+    EXPECT_EQ(read_id, user_id);
+
+    ASSERT_TRUE(db.createProject(user_id, "New Project", project_id, error_message));
+    std::vector<int> project_ids;
+    EXPECT_TRUE(db.readProjects(user_id, project_ids, error_message));
+    project_ids.clear();
+    EXPECT_TRUE(db.readProjects(user_id, project_ids, error_message));
+    EXPECT_EQ(project_ids, std::vector<int>{project_id});
+
+    int owner = -1;
+    std::string name;
+    EXPECT_TRUE(db.readProject(project_id, owner, name, error_message));
+    EXPECT_TRUE(db.updateProject(project_id, "Renamed", error_message));
+    EXPECT_TRUE(db.readProject(project_id, owner, name, error_message));
+    EXPECT_EQ(name, "Renamed");
+
+    db.disableMetadataCache();
+}
+
+TEST(MetadataCacheTest, ExpiresAfterTtl) {
+    MetadataCache cache(std::chrono::milliseconds(0));
+    cache.putUserId("test@example.com", 7);
+
+    int user_id = -1;
+    EXPECT_EQ(cache.findUserId("test@example.com", user_id), MetadataCache::Lookup::Miss);
+
+    MetadataCache negative(std::chrono::seconds(60), true);
+    negative.putMissingEmail("missing@example.com");
+    EXPECT_EQ(negative.findUserId("missing@example.com", user_id), MetadataCache::Lookup::NegativeHit);
+    negative.invalidateEmail("missing@example.com");
+    EXPECT_EQ(negative.findUserId("missing@example.com", user_id), MetadataCache::Lookup::Miss);
+}
+
+TEST_F(MosaifyDatabaseTest, ConditionalReadSkipsUnchangedImage) {
+    int user_id =-1;
+    int project_id = -1;
+    int image_id = -1;
+
+    EXPECT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "New Project", project_id, error_message));
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("image1.png", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4}), image_id, error_message));
+
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    int64_t version = 0;
+    bool modified = false;
+    ASSERT_TRUE(db.readImage(image_id, project_id, 0, img, version, modified, error_message)) << "Read image failed: " << error_message;
+    EXPECT_TRUE(modified);
+    EXPECT_GT(version, 0);
+    const int64_t first_version = version;
+
+    std::unique_ptr<IImageData> unchanged = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readImage(image_id, project_id, version, unchanged, version, modified, error_message));
+    EXPECT_FALSE(modified);
+    EXPECT_TRUE(unchanged->getData().empty());
+
+    ASSERT_TRUE(db.updateImage(image_id, project_id, "new_image.png", 1, 3, 1, {5, 6, 7}, error_message));
+    ASSERT_TRUE(db.readImage(image_id, project_id, first_version, img, version, modified, error_message));
+    EXPECT_TRUE(modified);
+    EXPECT_GT(version, first_version);
+    const int64_t updated_version = version;
+
+    // A recreated row must not reuse a version an old cache entry may hold.
+    ASSERT_TRUE(db.deleteImage(image_id, project_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("image1.png", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4}), image_id, error_message)) << error_message;
+    ASSERT_TRUE(db.readImage(image_id, project_id, 0, img, version, modified, error_message)) << error_message;
+    EXPECT_GT(version, updated_version);
+}
+
+TEST(TileDiskCacheTest, PersistsAcrossReopen) {
+    std::string path = testing::TempDir() + "tile_disk_cache_test.bin";
+    std::remove(path.c_str());
+    std::remove((path + ".idx").c_str());
+
+    std::string error_message;
+    std::vector<unsigned char> pixels{1, 2, 3, 4, 5, 6};
+    {
+        TileDiskCache cache;
+        ASSERT_TRUE(cache.open(path, error_message)) << error_message;
+        ASSERT_TRUE(cache.put(7, 3, 1, "tile.png", 1, 2, 3, pixels.data(), pixels.size(), error_message)) << error_message;
+        ASSERT_TRUE(cache.put(7, 3, 2, "tile.png", 1, 2, 3, pixels.data(), pixels.size(), error_message)) << error_message;
+    }
+
+    TileDiskCache cache;
+    ASSERT_TRUE(cache.open(path, error_message)) << error_message;
+
+    TileDiskCache::Tile tile;
+    ASSERT_TRUE(cache.find(7, tile));
+    EXPECT_EQ(tile.version, 2);
+    EXPECT_EQ(tile.project_id, 3);
+    EXPECT_FALSE(tile.validated);
+    EXPECT_EQ(std::vector<unsigned char>(tile.data, tile.data + tile.size), pixels);
+    EXPECT_EQ(std::string(tile.filename, tile.filename_length), "tile.png");
+
+    cache.markValidated(7, 2);
+    ASSERT_TRUE(cache.find(7, tile));
+    EXPECT_TRUE(tile.validated);
+
+    // Cleared entries are gone for good, and their records with them.
+    cache.clear();
+    EXPECT_FALSE(cache.find(7, tile));
+    TileDiskCache reopened;
+    ASSERT_TRUE(reopened.open(path, error_message)) << error_message;
+    EXPECT_EQ(reopened.size(), 0u);
+    std::ifstream data(path, std::ios::binary | std::ios::ate);
+    EXPECT_EQ(data.tellg(), 0);
+}
+
+TEST(TileDiskCacheTest, CompactsWithinByteBudget) {
+    std::string path = testing::TempDir() + "tile_disk_cache_budget_test.bin";
+    std::remove(path.c_str());
+    std::remove((path + ".idx").c_str());
+
+    std::string error_message;
+    const uint64_t budget = 8 * 1024;
+    TileDiskCache cache(budget);
+    ASSERT_TRUE(cache.open(path, error_message)) << error_message;
+
+    std::vector<unsigned char> first(1000, 1);
+    ASSERT_TRUE(cache.put(1, 3, 1, "tile.png", 10, 100, 1, first.data(), first.size(), error_message)) << error_message;
+    TileDiskCache::Tile held;
+    ASSERT_TRUE(cache.find(1, held));
+
+    // Rewrites of ten tiles, each found right after it is written: older
+    // versions go dead and the coldest tiles are evicted.
+    for (int round = 0; round < 20; ++round) {
+        for (int id = 2; id <= 11; ++id) {
+            std::vector<unsigned char> pixels(1000, static_cast<unsigned char>(id + round));
+            ASSERT_TRUE(cache.put(id, 3, round + 1, "tile.png", 10, 100, 1, pixels.data(), pixels.size(), error_message)) << error_message;
+            TileDiskCache::Tile tile;
+            ASSERT_TRUE(cache.find(id, tile));
+        }
+        EXPECT_LE(cache.getLiveBytes(), budget);
+        EXPECT_LE(cache.getFileBytes(), 2 * cache.getLiveBytes());
+    }
+
+    // The tile found before the rewrites still points at its pixels.
+    EXPECT_EQ(std::vector<unsigned char>(held.data, held.data + held.size), first);
+    TileDiskCache::Tile tile;
+    EXPECT_FALSE(cache.find(1, tile));
+    ASSERT_TRUE(cache.find(11, tile));
+    EXPECT_EQ(tile.version, 20);
+    EXPECT_EQ(std::vector<unsigned char>(tile.data, tile.data + tile.size), std::vector<unsigned char>(1000, 30));
+
+    cache.close();
+    TileDiskCache reopened(budget);
+    ASSERT_TRUE(reopened.open(path, error_message)) << error_message;
+    EXPECT_LE(reopened.getLiveBytes(), budget);
+    EXPECT_LE(reopened.getFileBytes(), 2 * reopened.getLiveBytes());
+    ASSERT_TRUE(reopened.find(11, tile));
+    EXPECT_EQ(tile.version, 20);
+    EXPECT_EQ(std::vector<unsigned char>(tile.data, tile.data + tile.size), std::vector<unsigned char>(1000, 30));
+}
+
+TEST_F(MosaifyDatabaseTest, BatchMosaicExistence) {
+    int user_id = -1;
+    int with_mosaic = -1;
+    int without_mosaic = -1;
+    int mosaic_image_id = -1;
+
+    EXPECT_TRUE(db.createUser("test@example.com", "Test", "User", user_id, error_message)) << "Create user failed: " << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "With Mosaic", with_mosaic, error_message));
+    ASSERT_TRUE(db.createProject(user_id, "Without Mosaic", without_mosaic, error_message));
+
+    std::unique_ptr<IImageData> mosaic_image = std::make_unique<ImageData>("", 1, 5, 1, std::vector<unsigned char>{0, 1, 2, 3, 4});
+    ASSERT_TRUE(db.createMosaicImage(with_mosaic, mosaic_image, mosaic_image_id, error_message));
+    ASSERT_TRUE(db.createMosaicMap(with_mosaic, "map", error_message));
+
+    EXPECT_TRUE(db.doesMosaicImageExist(with_mosaic, error_message));
+    EXPECT_FALSE(db.doesMosaicImageExist(without_mosaic, error_message));
+
+    std::vector<bool> exists;
+    ASSERT_TRUE(db.doesMosaicImageExist({without_mosaic, with_mosaic, without_mosaic}, exists, error_message)) << error_message;
+    EXPECT_EQ(exists, (std::vector<bool>{false, true, false}));
+
+    ASSERT_TRUE(db.doesMosaicMapExist({with_mosaic, without_mosaic}, exists, error_message)) << error_message;
+    EXPECT_EQ(exists, (std::vector<bool>{true, false}));
+}
+
+TEST_F(MosaifyDatabaseTest, MigrationsAreRecordedAndIdempotent) {
+    int version = -1;
+    ASSERT_TRUE(db.getSchemaVersion(version, error_message)) << error_message;
+    EXPECT_EQ(version, MosaifyDatabase::getLatestSchemaVersion());
+
+    EXPECT_TRUE(db.migrate(error_message)) << "Migrate failed: " << error_message;
+    ASSERT_TRUE(db.getSchemaVersion(version, error_message)) << error_message;
+    EXPECT_EQ(version, MosaifyDatabase::getLatestSchemaVersion());
+}
+
+TEST_F(MosaifyDatabaseTest, MigrationRefusesDuplicateMosaics) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("duplicates@example.com", "Du", "Plicate", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Duplicates", project_id, error_message)) << error_message;
+
+    // Back to before migration 3, with two maps for one project.
+    ASSERT_TRUE(db.executeSQL("DROP INDEX mosaic_maps_project_id_key", error_message)) << error_message;
+    ASSERT_TRUE(db.executeSQL("DELETE FROM schema_migrations WHERE version >= 3", error_message)) << error_message;
+    ASSERT_TRUE(db.createMosaicMap(project_id, "older", error_message)) << error_message;
+    ASSERT_TRUE(db.createMosaicMap(project_id, "newer", error_message)) << error_message;
+
+    // The upgrade stops and names the project rather than deleting a map.
+    EXPECT_FALSE(db.migrate(error_message));
+    EXPECT_NE(error_message.find("Projects " + std::to_string(project_id) + " have more than one mosaic image or map"), std::string::npos) << error_message;
+    int version = -1;
+    ASSERT_TRUE(db.getSchemaVersion(version, error_message)) << error_message;
+    EXPECT_EQ(version, 2);
+
+    // Once the extra row is gone by hand, it goes through.
+    ASSERT_TRUE(db.executeSQL("DELETE FROM mosaic_maps WHERE id = (SELECT MIN(id) FROM mosaic_maps)", error_message)) << error_message;
+    ASSERT_TRUE(db.migrate(error_message)) << error_message;
+    ASSERT_TRUE(db.getSchemaVersion(version, error_message)) << error_message;
+    EXPECT_EQ(version, MosaifyDatabase::getLatestSchemaVersion());
+    EXPECT_TRUE(db.doesMosaicMapExist(project_id, error_message));
+}
+
+TEST_F(MosaifyDatabaseTest, HotQueriesUseIndexes) {
+    // With sequential scans disabled the planner only avoids one if a usable index exists.
+    ASSERT_TRUE(db.executeSQL("SET enable_seqscan = off", error_message)) << error_message;
+
+    const char* queries[] = {
+            "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = 1",
+            "SELECT id FROM images_roi WHERE images_id = 1",
+            "SELECT id FROM images_roi WHERE project_id = 1",
+            "SELECT EXISTS (SELECT 1 FROM mosaic_images WHERE project_id = 1)",
+            "SELECT EXISTS (SELECT 1 FROM mosaic_maps WHERE project_id = 1)",
+            "SELECT id FROM projecttable WHERE user_id = 1",
+    };
+
+    for (const char* sql : queries) {
+        std::string plan;
+        ASSERT_TRUE(db.explain(sql, plan, error_message)) << error_message;
+        EXPECT_EQ(plan.find("Seq Scan"), std::string::npos) << sql << "\n" << plan;
+        EXPECT_NE(plan.find("Index"), std::string::npos) << sql << "\n" << plan;
+    }
+
+    std::string plan;
+    ASSERT_TRUE(db.explain("SELECT id FROM projecttable WHERE user_id = 1", plan, error_message)) << error_message;
+    EXPECT_NE(plan.find("Index Only Scan"), std::string::npos) << plan;
+
+    ASSERT_TRUE(db.executeSQL("RESET enable_seqscan", error_message)) << error_message;
+}
+
+TEST_F(MosaifyDatabaseTest, PartitionedImagesPruneToOnePartition) {
+    const int partitions = 8;
+    ASSERT_TRUE(db.createTables(true, partitions, error_message)) << "Create partitioned tables failed: " << error_message;
+
+    int count = 0;
+    ASSERT_TRUE(db.getImagePartitionCount(count, error_message)) << error_message;
+    EXPECT_EQ(count, partitions);
+
+    int user_id = 0;
+    int project_id = 0;
+    int image_id = 0;
+    int roi_id = 0;
+    ASSERT_TRUE(db.createUser("partition@example.com", "Part", "Ition", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Partitioned", project_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("image.png", 1, 3, 1, std::vector<unsigned char>{1, 2, 3}), image_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createImageROI(project_id, image_id, 0, 0, 1, 1, roi_id, error_message)) << error_message;
+
+    int x = 0, y = 0, width = 0, height = 0;
+    EXPECT_TRUE(db.updateImageROI(roi_id, project_id, 1, 2, 3, 4, error_message)) << error_message;
+    EXPECT_TRUE(db.readImageROI(roi_id, project_id, x, y, width, height, error_message)) << error_message;
+    EXPECT_EQ(x, 1);
+    EXPECT_EQ(height, 4);
+    EXPECT_TRUE(db.updateImage(image_id, project_id, "new_image.png", 1, 3, 1, {5, 6, 7}, error_message)) << error_message;
+
+    const std::string id = std::to_string(image_id);
+    const std::string project = std::to_string(project_id);
+    const std::string queries[] = {
+            "SELECT id, filename, rows, cols, comps, data FROM images WHERE project_id = " + project,
+            "SELECT filename, rows, cols, comps, data FROM images WHERE id = " + id + " AND project_id = " + project,
+            "UPDATE images SET version = version + 1 WHERE id = " + id + " AND project_id = " + project,
+            "DELETE FROM images WHERE id = " + id + " AND project_id = " + project,
+            "SELECT x, y, width, height FROM images_roi WHERE id = 1 AND project_id = " + project,
+            "UPDATE images_roi SET x = 0 WHERE id = 1 AND project_id = " + project,
+            "DELETE FROM images_roi WHERE id = 1 AND project_id = " + project,
+    };
+
+    for (const auto &sql : queries) {
+        std::string plan;
+        ASSERT_TRUE(db.explain(sql, plan, error_message)) << error_message;
+
+        int scanned = 0;
+        for (int i = 0; i < partitions; ++i) {
+            const std::string images_partition = " images_p" + std::to_string(i) + " ";
+            const std::string roi_partition = " images_roi_p" + std::to_string(i) + " ";
+            if (plan.find(images_partition) != std::string::npos || plan.find(roi_partition) != std::string::npos) ++scanned;
+        }
+        EXPECT_EQ(scanned, 1) << sql << "\n" << plan;
+    }
+
+    EXPECT_TRUE(db.deleteImage(image_id, project_id, error_message)) << error_message;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    EXPECT_FALSE(db.readImage(image_id, project_id, img, error_message));
+
+    ASSERT_TRUE(db.reset(error_message)) << error_message;
+}
+
+TEST(MosaicMapTest, EncodeDecodeRoundTrip) {
+    std::string error_message;
+
+    MosaicMap map(500, 400);
+    for (int row = 0; row < map.getGridRows(); ++row) {
+        for (int col = 0; col < map.getGridCols(); ++col) {
+            map.setCell(col, row, 1 + (row * 31 + col * 7) % 1000);
+        }
+    }
+    map.setTransform(3, 2, TRANSFORM_ROTATE_90 | TRANSFORM_FLIP_HORIZONTAL);
+    ASSERT_TRUE(map.hasTransforms());
+
+    std::vector<unsigned char> encoded;
+    ASSERT_TRUE(map.encode(encoded, error_message)) << error_message;
+    EXPECT_LT(encoded.size(), map.getCellCount() * sizeof(int32_t));
+
+    MosaicMap decoded;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded, map);
+    EXPECT_EQ(decoded.getTransform(3, 2), TRANSFORM_ROTATE_90 | TRANSFORM_FLIP_HORIZONTAL);
+
+    MosaicMap plain(3, 2);
+    plain.setCell(2, 1, 42);
+    ASSERT_TRUE(plain.encode(encoded, error_message)) << error_message;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded, plain);
+    EXPECT_FALSE(decoded.hasTransforms());
+    EXPECT_EQ(decoded.getTileWatermark(), 0);
+
+    plain.setTileWatermark(12345678901LL);
+    ASSERT_TRUE(plain.encode(encoded, error_message)) << error_message;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded, plain);
+    EXPECT_EQ(decoded.getTileWatermark(), 12345678901LL);
+
+    map.setRoi(4, 1, 77);
+    ASSERT_TRUE(map.hasRois());
+    ASSERT_TRUE(map.encode(encoded, error_message)) << error_message;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded, map);
+    EXPECT_EQ(decoded.getRoi(4, 1), 77);
+    EXPECT_EQ(decoded.getRoi(3, 2), 0);
+    EXPECT_EQ(decoded.getTransform(3, 2), TRANSFORM_ROTATE_90 | TRANSFORM_FLIP_HORIZONTAL);
+
+    MosaicMap empty;
+    ASSERT_TRUE(empty.encode(encoded, error_message)) << error_message;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded.getCellCount(), 0u);
+
+    encoded.resize(encoded.size() - 1);
+    EXPECT_FALSE(decoded.decode(encoded.data(), encoded.size(), error_message));
+
+    // A grid far larger than the payload could inflate to is rejected before it is allocated.
+    ASSERT_TRUE(plain.encode(encoded, error_message)) << error_message;
+    const uint32_t huge = 1u << 20;
+    memcpy(encoded.data() + 8, &huge, sizeof(huge));
+    memcpy(encoded.data() + 12, &huge, sizeof(huge));
+    EXPECT_FALSE(decoded.decode(encoded.data(), encoded.size(), error_message));
+    EXPECT_EQ(error_message, "Mosaic map data is corrupt.");
+}
+
+TEST(MosaicMapTest, QuadtreeLayoutRoundTrip) {
+    // Two grid cells, two levels: the first splits once and its second
+    // quadrant again; the second stays whole.
+    MosaicMap map(2, 1);
+    const std::vector<uint8_t> splits = {1, 0, 1, 0, 0, 0, 0, 0, 0, 0};
+    ASSERT_TRUE(map.setQuadtree(2, splits));
+    EXPECT_TRUE(map.isAdaptive());
+    ASSERT_EQ(map.getCellCount(), 8u);
+    EXPECT_EQ(map.getFirstCell(0), 0u);
+    EXPECT_EQ(map.getFirstCell(1), 8u);
+
+    const int expected[8][3] = {{0, 0, 2}, {2, 0, 1}, {3, 0, 1}, {2, 1, 1}, {3, 1, 1}, {0, 2, 2}, {2, 2, 2}, {4, 0, 4}};
+    for (size_t cell = 0; cell < 8; ++cell) {
+        const MosaicCellRect rect = map.getCellRect(cell);
+        EXPECT_EQ(rect.x, expected[cell][0]) << "cell " << cell;
+        EXPECT_EQ(rect.y, expected[cell][1]) << "cell " << cell;
+        EXPECT_EQ(rect.size, expected[cell][2]) << "cell " << cell;
+        map.getCells()[cell] = static_cast<int32_t>(cell + 1);
+    }
+    EXPECT_EQ(map.getCellLevel(1), 2);
+    EXPECT_EQ(map.getCellLevel(7), 0);
+    map.getRois()[3] = 9;
+    map.setTileWatermark(12);
+
+    std::string error_message;
+    std::vector<unsigned char> encoded;
+    ASSERT_TRUE(map.encode(encoded, error_message)) << error_message;
+    MosaicMap decoded;
+    ASSERT_TRUE(decoded.decode(encoded.data(), encoded.size(), error_message)) << error_message;
+    EXPECT_EQ(decoded, map);
+    EXPECT_EQ(decoded.getCellRect(4).x, 3);
+
+    // A node count the deepest tree allows but the payload cannot back is
+    // rejected before anything is allocated for it; one the payload could
+    // back but that does not match the split bits fails on inflation.
+    std::vector<unsigned char> corrupt = encoded;
+    const uint32_t depth = 15, nodes = 1u << 30;
+    memcpy(corrupt.data() + 24, &depth, sizeof(depth));
+    memcpy(corrupt.data() + 28, &nodes, sizeof(nodes));
+    EXPECT_FALSE(decoded.decode(corrupt.data(), corrupt.size(), error_message));
+    EXPECT_EQ(error_message, "Mosaic map data is corrupt.");
+    corrupt = encoded;
+    const uint32_t more_nodes = 42;
+    memcpy(corrupt.data() + 28, &more_nodes, sizeof(more_nodes));
+    EXPECT_FALSE(decoded.decode(corrupt.data(), corrupt.size(), error_message));
+    EXPECT_EQ(decoded.getCellCount(), 0u);
+
+    // Splits that leave nodes over, run short or go below the deepest level.
+    MosaicMap other(2, 1);
+    EXPECT_FALSE(other.setQuadtree(2, {0, 0, 0}));
+    EXPECT_FALSE(other.setQuadtree(2, {1, 0, 0, 0}));
+    EXPECT_FALSE(other.setQuadtree(1, {1, 1, 0, 0, 0, 0, 0, 0, 0, 0}));
+    EXPECT_FALSE(other.isAdaptive());
+    EXPECT_EQ(other.getCellCount(), 2u);
+
+    ASSERT_TRUE(map.setQuadtree(0, {}));
+    EXPECT_FALSE(map.isAdaptive());
+    EXPECT_EQ(map.getCellCount(), 2u);
+}
+
+TEST_F(MosaifyDatabaseTest, BinaryMosaicMapRoundTrip) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("map@example.com", "Map", "Maker", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Map Project", project_id, error_message)) << error_message;
+
+    MosaicMap map(20, 10);
+    for (int row = 0; row < 10; ++row) {
+        for (int col = 0; col < 20; ++col) {
+            map.setCell(col, row, row * 20 + col + 1);
+        }
+    }
+    ASSERT_TRUE(db.createMosaicMap(project_id, map, error_message)) << error_message;
+
+    MosaicMap read_map;
+    ASSERT_TRUE(db.readMosaicMap(project_id, read_map, error_message)) << error_message;
+    EXPECT_EQ(read_map, map);
+
+    int64_t version = 0;
+    bool modified = false;
+    ASSERT_TRUE(db.readMosaicMap(project_id, 0, read_map, version, modified, error_message)) << error_message;
+    EXPECT_TRUE(modified);
+
+    map.setTransform(0, 0, TRANSFORM_FLIP_VERTICAL);
+    ASSERT_TRUE(db.updateMosaicMap(project_id, map, error_message)) << error_message;
+
+    int64_t new_version = 0;
+    ASSERT_TRUE(db.readMosaicMap(project_id, version, read_map, new_version, modified, error_message)) << error_message;
+    EXPECT_TRUE(modified);
+    EXPECT_GT(new_version, version);
+    EXPECT_EQ(read_map, map);
+
+    ASSERT_TRUE(db.readMosaicMap(project_id, new_version, read_map, version, modified, error_message)) << error_message;
+    EXPECT_FALSE(modified);
+
+    // The text readers refuse a map that only has the binary form.
+    std::string text_map = "unchanged";
+    EXPECT_FALSE(db.readMosaicMap(project_id, text_map, error_message));
+    EXPECT_NE(error_message.find("not stored in the text format"), std::string::npos) << error_message;
+    EXPECT_EQ(text_map, "unchanged");
+    error_message.clear();
+    EXPECT_FALSE(db.readMosaicMap(project_id, 0, text_map, version, modified, error_message));
+    EXPECT_NE(error_message.find("not stored in the text format"), std::string::npos) << error_message;
+}
+
+TEST_F(MosaifyDatabaseTest, UpsertMosaicImageAndMap) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("upsert@example.com", "Up", "Sert", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Upsert Project", project_id, error_message)) << error_message;
+
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("", 1, 3, 1, std::vector<unsigned char>{1, 2, 3});
+    int first_id = 0;
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, first_id, error_message)) << error_message;
+
+    img = std::make_unique<ImageData>("", 1, 2, 1, std::vector<unsigned char>{4, 5});
+    int second_id = 0;
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, second_id, error_message)) << error_message;
+    EXPECT_EQ(first_id, second_id);
+
+    std::unique_ptr<IImageData> read_img = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readMosaicImage(project_id, read_img, error_message)) << error_message;
+    EXPECT_EQ(read_img->getCols(), 2);
+    EXPECT_EQ(read_img->getData(), (std::vector<unsigned char>{4, 5}));
+
+    // The unique constraint rejects a second row for the same project.
+    int duplicate_id = 0;
+    EXPECT_FALSE(db.createMosaicImage(project_id, img, duplicate_id, error_message));
+
+    MosaicMap map(2, 2);
+    map.setCell(1, 1, 7);
+    int map_id = 0;
+    int same_map_id = 0;
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, map, map_id, error_message)) << error_message;
+    map.setCell(0, 0, 9);
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, map, same_map_id, error_message)) << error_message;
+    EXPECT_EQ(map_id, same_map_id);
+
+    MosaicMap read_map;
+    ASSERT_TRUE(db.readMosaicMap(project_id, read_map, error_message)) << error_message;
+    EXPECT_EQ(read_map, map);
+
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, std::string("text map"), same_map_id, error_message)) << error_message;
+    EXPECT_EQ(map_id, same_map_id);
+    std::string text_map;
+    ASSERT_TRUE(db.readMosaicMap(project_id, text_map, error_message)) << error_message;
+    EXPECT_EQ(text_map, "text map");
+}
+
+// sRGB in [0, 255] to CIE Lab under D65, computed in double precision.
+static void referenceLab(double r, double g, double b, double* lab) {
+    auto linearize = [](double c) { c /= 255.0; return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4); };
+    auto curve = [](double t) { return t > 0.008856 ? std::cbrt(t) : 7.787 * t + 16.0 / 116.0; };
+    r = linearize(r);
+    g = linearize(g);
+    b = linearize(b);
+    const double fx = curve((0.4124564 * r + 0.3575761 * g + 0.1804375 * b) / 0.95047);
+    const double fy = curve(0.2126729 * r + 0.7151522 * g + 0.0721750 * b);
+    const double fz = curve((0.0193339 * r + 0.1191920 * g + 0.9503041 * b) / 1.08883);
+    lab[0] = 116.0 * fy - 16.0;
+    lab[1] = 500.0 * (fx - fy);
+    lab[2] = 200.0 * (fy - fz);
+}
+
+TEST(ImageFeaturesTest, MatchesReferenceComputation) {
+    // 160 columns make 40 pixel cells: every component count runs the vector
+    // loop for whole periods (48 bytes at 3 components) and then a scalar tail.
+    const int grid = ImageFeatures::GRID_SIZE;
+    // Cell g spans [size * g / grid, size * (g + 1) / grid).
+    auto gridIndex = [grid](int index, int size) {
+        int g = grid - 1;
+        while (g > 0 && size * g / grid > index) --g;
+        return g;
+    };
+    for (int cols : {53, 160}) {
+        for (int comps = 1; comps <= 4; ++comps) {
+            const int rows = 37;
+            std::vector<unsigned char> data(rows * cols * comps);
+            for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<unsigned char>((i * 2654435761u) >> 24);
+
+            ImageFeatures features;
+            ASSERT_TRUE(computeImageFeatures(data.data(), rows, cols, comps, features));
+
+            const int color_channels = comps >= 3 ? 3 : 1;
+            double sums[grid * grid][3] = {};
+            double counts[grid * grid] = {};
+            double total[3] = {};
+            double variance = 0.0;
+            for (int ch = 0; ch < color_channels; ++ch) {
+                double sum = 0.0, squares = 0.0;
+                for (int row = 0; row < rows; ++row) {
+                    for (int col = 0; col < cols; ++col) {
+                        const double v = data[(row * cols + col) * comps + ch];
+                        const int cell = gridIndex(row, rows) * grid + gridIndex(col, cols);
+                        sums[cell][ch] += v;
+                        if (0 == ch) counts[cell] += 1.0;
+                        sum += v;
+                        squares += v * v;
+                    }
+                }
+                const double mean = sum / (rows * cols);
+                total[ch] = mean;
+                variance += squares / (rows * cols) - mean * mean;
+            }
+            EXPECT_NEAR(features.values[ImageFeatures::VARIANCE_OFFSET], variance / color_channels / (255.0 * 255.0), 1e-5) << "comps = " << comps;
+
+            double lab[3];
+            for (int c = -1; c < grid * grid; ++c) {
+                const double* mean = total;
+                double cell_mean[3];
+                if (c >= 0) {
+                    for (int ch = 0; ch < color_channels; ++ch) cell_mean[ch] = sums[c][ch] / counts[c];
+                    mean = cell_mean;
+                }
+                if (1 == color_channels) {
+                    referenceLab(mean[0], mean[0], mean[0], lab);
+                } else {
+                    referenceLab(mean[0], mean[1], mean[2], lab);
+                }
+                const int offset = c < 0 ? ImageFeatures::MEAN_OFFSET : ImageFeatures::GRID_OFFSET + c * 3;
+                for (int k = 0; k < 3; ++k) {
+                    EXPECT_NEAR(features.values[offset + k], lab[k], 1e-3) << "cols = " << cols << ", comps = " << comps << ", value " << offset + k;
+                }
+            }
+        }
+    }
+
+    // A solid color has the same Lab value everywhere and no variance.
+    std::vector<unsigned char> red(10 * 10 * 3, 0);
+    for (int p = 0; p < 100; ++p) red[p * 3] = 255;
+
+    ImageFeatures features;
+    ASSERT_TRUE(computeImageFeatures(red.data(), 10, 10, 3, features));
+    EXPECT_NEAR(features.values[0], 53.24f, 0.01f);
+    EXPECT_NEAR(features.values[1], 80.09f, 0.01f);
+    EXPECT_NEAR(features.values[2], 67.20f, 0.01f);
+    for (int c = 0; c < ImageFeatures::GRID_SIZE * ImageFeatures::GRID_SIZE; ++c) {
+        EXPECT_FLOAT_EQ(features.values[ImageFeatures::GRID_OFFSET + c * 3], features.values[0]);
+    }
+    EXPECT_NEAR(features.values[ImageFeatures::VARIANCE_OFFSET], 0.0f, 1e-6f);
+
+    EXPECT_FALSE(computeImageFeatures(red.data(), 0, 10, 3, features));
+
+    // A region of a larger image, addressed through its row stride.
+    std::vector<unsigned char> region(6 * 4 * 3);
+    for (int row = 0; row < 6; ++row) {
+        std::copy(red.begin() + (row + 2) * 30 + 9, red.begin() + (row + 2) * 30 + 21, region.begin() + row * 12);
+    }
+    ImageFeatures expected;
+    ASSERT_TRUE(computeImageFeatures(region.data(), 6, 4, 3, expected));
+    ASSERT_TRUE(computeImageFeatures(red.data() + 2 * 30 + 9, 6, 4, 3, 30, features));
+    for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+        EXPECT_FLOAT_EQ(features.values[d], expected.values[d]);
+    }
+    EXPECT_FALSE(computeImageFeatures(red.data(), 6, 4, 3, 11, features));
+}
+
+TEST(ImageFeaturesTest, EncodesLittleEndianFloats) {
+    ImageFeatures features;
+    for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) features.values[d] = d * 0.5f - 3.0f;
+    features.values[0] = 1.0f;
+
+    unsigned char bytes[ImageFeatures::ENCODED_BYTES];
+    features.encode(bytes);
+    // 1.0f is 0x3f800000.
+    EXPECT_EQ(bytes[0], 0x00);
+    EXPECT_EQ(bytes[1], 0x00);
+    EXPECT_EQ(bytes[2], 0x80);
+    EXPECT_EQ(bytes[3], 0x3f);
+
+    ImageFeatures decoded;
+    decoded.decode(bytes);
+    EXPECT_EQ(0, memcmp(decoded.values, features.values, sizeof(features.values)));
+}
+
+TEST(IntegralImageTest, MatchesPixelSumsAndFeatures) {
+    for (int comps = 1; comps <= 4; ++comps) {
+        const int rows = 29;
+        const int cols = 41;
+        std::vector<unsigned char> data(rows * cols * comps);
+        for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<unsigned char>((i * 2654435761u) >> 24);
+
+        IntegralImage integral;
+        ASSERT_TRUE(integral.build(data.data(), rows, cols, comps, static_cast<size_t>(cols) * comps, 3));
+        EXPECT_EQ(integral.getChannels(), comps >= 3 ? 3 : 1);
+
+        const int x = 5, y = 7, width = 23, height = 13;
+        for (int ch = 0; ch < integral.getChannels(); ++ch) {
+            uint64_t sum = 0, squares = 0;
+            for (int row = y; row < y + height; ++row) {
+                for (int col = x; col < x + width; ++col) {
+                    const uint64_t v = data[(static_cast<size_t>(row) * cols + col) * comps + ch];
+                    sum += v;
+                    squares += v * v;
+                }
+            }
+            EXPECT_EQ(integral.getSum(x, y, width, height, ch), sum) << "comps = " << comps;
+            EXPECT_EQ(integral.getSquareSum(x, y, width, height, ch), squares) << "comps = " << comps;
+            const double mean = static_cast<double>(sum) / (width * height);
+            EXPECT_NEAR(integral.getVariance(x, y, width, height, ch), static_cast<double>(squares) / (width * height) - mean * mean, 1e-9);
+        }
+
+        // Features from the tables equal those from the pixels, including
+        // regions smaller than the feature grid.
+        const int regions[3][4] = {{x, y, width, height}, {0, 0, cols, rows}, {cols - 3, rows - 2, 3, 2}};
+        for (const auto &region : regions) {
+            ImageFeatures expected, features;
+            ASSERT_TRUE(computeImageFeatures(data.data() + (static_cast<size_t>(region[1]) * cols + region[0]) * comps,
+                                             region[3], region[2], comps, static_cast<size_t>(cols) * comps, expected));
+            ASSERT_TRUE(computeImageFeatures(integral, region[0], region[1], region[2], region[3], features));
+            for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+                EXPECT_FLOAT_EQ(features.values[d], expected.values[d]) << "comps = " << comps << ", d = " << d;
+            }
+        }
+
+        ImageFeatures features;
+        EXPECT_FALSE(computeImageFeatures(integral, cols - 3, 0, 4, 1, features));
+    }
+
+    IntegralImage integral;
+    std::vector<unsigned char> pixel(5);
+    EXPECT_FALSE(integral.build(pixel.data(), 1, 1, 5, 5));
+    EXPECT_TRUE(integral.empty());
+}
+
+TEST_F(MosaifyDatabaseTest, ImageFeaturesAreComputedAtIngest) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("features@example.com", "Fea", "Tures", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Features", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> images;
+    images.push_back(std::make_unique<ImageData>("black.png", 2, 2, 3, std::vector<unsigned char>(12, 0)));
+    images.push_back(std::make_unique<ImageData>("white.png", 2, 2, 3, std::vector<unsigned char>(12, 255)));
+    // Too little data for its size; stored without features.
+    images.push_back(std::make_unique<ImageData>("broken.png", 200, 200, 3, std::vector<unsigned char>{1, 2, 3}));
+
+    std::vector<int> image_ids;
+    ASSERT_TRUE(db.createImages(project_id, images, image_ids, error_message)) << error_message;
+
+    ImageFeatureSet features;
+    ASSERT_TRUE(db.readImageFeatures(project_id, features, error_message)) << error_message;
+    ASSERT_EQ(features.size(), 2u);
+    EXPECT_EQ(features.getImageId(0), image_ids[0]);
+    EXPECT_NEAR(features.getValue(0, 0), 0.0f, 0.01f);
+    EXPECT_NEAR(features.getValue(1, 0), 100.0f, 0.01f);
+
+    ASSERT_TRUE(db.updateImage(image_ids[0], project_id, "white.png", 2, 2, 3, std::vector<unsigned char>(12, 255), error_message)) << error_message;
+    ASSERT_TRUE(db.readImageFeatures(project_id, features, error_message)) << error_message;
+    EXPECT_NEAR(features.getDimension(0)[0], 100.0f, 0.01f);
+
+    ASSERT_TRUE(db.deleteImage(image_ids[1], project_id, error_message)) << error_message;
+    ASSERT_TRUE(db.readImageFeatures(project_id, features, error_message)) << error_message;
+    EXPECT_EQ(features.size(), 1u);
+
+    int computed = -1;
+    ASSERT_TRUE(db.computeMissingImageFeatures(project_id, computed, error_message)) << error_message;
+    EXPECT_EQ(computed, 0);
+}
+
+TEST_F(MosaifyDatabaseTest, MosaicEngineBuildsMap) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("engine@example.com", "En", "Gine", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Engine", project_id, error_message)) << error_message;
+
+    const unsigned char colors[4][3] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 255}};
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    for (const auto &color : colors) {
+        std::vector<unsigned char> data;
+        for (int p = 0; p < 16; ++p) data.insert(data.end(), color, color + 3);
+        tiles.push_back(std::make_unique<ImageData>("tile.png", 4, 4, 3, data));
+    }
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // 8x6 target: red, green / blue, white quadrants.
+    std::vector<unsigned char> target;
+    for (int row = 0; row < 6; ++row) {
+        for (int col = 0; col < 8; ++col) {
+            const unsigned char* color = colors[(row / 3) * 2 + col / 4];
+            target.insert(target.end(), color, color + 3);
+        }
+    }
+    int mosaic_image_id = 0;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("target.png", 6, 8, 3, target);
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, mosaic_image_id, error_message)) << error_message;
+
+    MosaicEngine engine(db);
+    MosaicEngine::Options options;
+    options.threads = 2;
+    EXPECT_FALSE(engine.buildMap(project_id, 9, 2, options, error_message));
+
+    MosaicMap built;
+    ASSERT_TRUE(engine.buildMap(project_id, 2, 2, options, built, error_message)) << error_message;
+    EXPECT_EQ(built.getCell(0, 0), tile_ids[0]);
+    EXPECT_EQ(built.getCell(1, 0), tile_ids[1]);
+    EXPECT_EQ(built.getCell(0, 1), tile_ids[2]);
+    EXPECT_EQ(built.getCell(1, 1), tile_ids[3]);
+    EXPECT_NE(engine.getLastStrategy(), MatchStrategy::Auto);
+
+    const MosaicEngine::Timings &timings = engine.getLastTimings();
+    EXPECT_GE(timings.total, timings.read_target + timings.cell_features + timings.match + timings.write_map);
+
+    MosaicMap stored;
+    ASSERT_TRUE(db.readMosaicMap(project_id, stored, error_message)) << error_message;
+    EXPECT_EQ(stored, built);
+
+    // Rebuilding replaces the stored map.
+    ASSERT_TRUE(engine.buildMap(project_id, 4, 3, options, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicMap(project_id, stored, error_message)) << error_message;
+    EXPECT_EQ(stored.getGridCols(), 4);
+    EXPECT_EQ(stored.getCell(3, 2), tile_ids[3]);
+
+    // With one use per tile, the four cells get four different tiles.
+    options.max_uses = 1;
+    ASSERT_TRUE(engine.buildMap(project_id, 2, 2, options, built, error_message)) << error_message;
+    std::vector<int32_t> used(built.getCells(), built.getCells() + built.getCellCount());
+    std::sort(used.begin(), used.end());
+    EXPECT_EQ(std::unique(used.begin(), used.end()), used.end());
+    EXPECT_EQ(engine.getLastAssignmentStats().unconstrained_cells, 0u);
+
+    // The target's tables are kept until the target changes.
+    EXPECT_EQ(engine.getTarget().getCols(), 8);
+    img = std::make_unique<ImageData>("target.png", 3, 16, 3, std::vector<unsigned char>(3 * 16 * 3, 255));
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, mosaic_image_id, error_message)) << error_message;
+    options.max_uses = 0;
+    ASSERT_TRUE(engine.buildMap(project_id, 4, 1, options, built, error_message)) << error_message;
+    EXPECT_EQ(engine.getTarget().getCols(), 16);
+    EXPECT_EQ(built.getCell(2, 0), tile_ids[3]);
+}
+
+TEST(ImageResizerTest, KeepsFlatColorsAndMatchesScalar) {
+    // Wide enough for the vectorized pass plus a scalar tail.
+    const int rows = 23, cols = 41, comps = 3;
+    std::vector<unsigned char> flat(rows * cols * comps);
+    for (size_t i = 0; i < flat.size(); ++i) flat[i] = static_cast<unsigned char>(40 + 50 * (i % 3));
+
+    const int sizes[][2] = {{5, 7}, {23, 41}, {64, 100}, {1, 1}};
+    for (const auto &size : sizes) {
+        std::vector<unsigned char> out(size[0] * size[1] * comps);
+        resizeImage(flat.data(), rows, cols, comps, cols * comps, out.data(), size[0], size[1], size[1] * comps);
+        for (size_t i = 0; i < out.size(); ++i) {
+            ASSERT_EQ(out[i], flat[i % 3]) << size[0] << "x" << size[1] << " byte " << i;
+        }
+    }
+
+    // Away from the edges, shrinking alternating stripes averages them.
+    std::vector<unsigned char> stripes(40 * 40);
+    for (size_t i = 0; i < stripes.size(); ++i) stripes[i] = (i / 40) % 2 ? 200 : 100;
+    std::vector<unsigned char> quarter(10 * 40);
+    resizeImage(stripes.data(), 40, 40, 1, 40, quarter.data(), 10, 40, 40);
+    for (size_t i = 40; i < 9 * 40; ++i) EXPECT_NEAR(quarter[i], 150, 1) << "byte " << i;
+}
+
+TEST(MosaicRendererTest, ComposeIsDeterministicAndHonorsTransforms) {
+    // 2x2 tile: red, green / blue, white.
+    const unsigned char quad[] = {255, 0, 0, 0, 255, 0, 0, 0, 255, 255, 255, 255};
+    std::vector<unsigned char> noise(37 * 29 * 3);
+    for (size_t i = 0; i < noise.size(); ++i) noise[i] = static_cast<unsigned char>((i * 2654435761u) >> 24);
+
+    ImageBatch tiles;
+    tiles.append(1, "quad.png", 8, 2, 2, 3, quad, sizeof(quad));
+    tiles.append(2, "noise.png", 9, 37, 29, 3, noise.data(), noise.size());
+
+    MosaicMap mosaic_map(6, 5, true);
+    for (int y = 0; y < 5; ++y) {
+        for (int x = 0; x < 6; ++x) {
+            mosaic_map.setCell(x, y, (x + y) % 3 == 0 ? 1 : 2);
+            mosaic_map.setTransform(x, y, static_cast<uint8_t>((x * 5 + y) % 16));
+        }
+    }
+    mosaic_map.setCell(5, 4, 0);
+
+    MosaicRenderer::Options options;
+    options.cell_width = 8;
+    options.cell_height = 6;
+    options.threads = 1;
+    std::string error_message;
+    PixelBuffer single;
+    ASSERT_TRUE(MosaicRenderer::compose(mosaic_map, tiles, options, single, error_message)) << error_message;
+    ASSERT_EQ(single.size(), 6u * 8 * 5 * 6 * 3);
+
+    options.threads = 3;
+    PixelBuffer threaded;
+    ASSERT_TRUE(MosaicRenderer::compose(mosaic_map, tiles, options, threaded, error_message)) << error_message;
+    ASSERT_EQ(threaded.size(), single.size());
+    EXPECT_EQ(0, memcmp(single.data(), threaded.data(), single.size()));
+
+    // Top-left pixel of a cell holding the quad tile under a few transforms.
+    const size_t stride = 6 * 8 * 3;
+    auto topLeft = [&](const PixelBuffer &canvas, int gx, int gy) {
+        const unsigned char* p = canvas.data() + gy * 6 * stride + gx * 8 * 3;
+        return std::vector<unsigned char>(p, p + 3);
+    };
+    MosaicMap one(1, 1, true);
+    one.setCell(0, 0, 1);
+    const std::pair<uint8_t, std::vector<unsigned char>> expected[] = {
+            {TRANSFORM_NONE, {255, 0, 0}},
+            {TRANSFORM_ROTATE_90, {0, 0, 255}},
+            {TRANSFORM_ROTATE_180, {255, 255, 255}},
+            {TRANSFORM_ROTATE_270, {0, 255, 0}},
+            {TRANSFORM_FLIP_HORIZONTAL, {0, 255, 0}},
+            {TRANSFORM_FLIP_VERTICAL, {0, 0, 255}},
+    };
+    for (const auto &e : expected) {
+        one.setTransform(0, 0, e.first);
+        PixelBuffer canvas;
+        ASSERT_TRUE(MosaicRenderer::compose(one, tiles, options, canvas, error_message)) << error_message;
+        EXPECT_EQ(std::vector<unsigned char>(canvas.data(), canvas.data() + 3), e.second) << int(e.first);
+    }
+
+    // Unassigned cells stay black.
+    EXPECT_EQ(topLeft(single, 5, 4), std::vector<unsigned char>(3, 0));
+}
+
+TEST(MosaicRendererTest, ComposeCropsCellsToTheirRoi) {
+    // 4x2 tile: left half red, right half blue.
+    std::vector<unsigned char> halves;
+    for (int row = 0; row < 2; ++row) {
+        for (int col = 0; col < 4; ++col) {
+            const unsigned char pixel[3] = {static_cast<unsigned char>(col < 2 ? 255 : 0), 0, static_cast<unsigned char>(col < 2 ? 0 : 255)};
+            halves.insert(halves.end(), pixel, pixel + 3);
+        }
+    }
+    ImageBatch tiles;
+    tiles.append(1, "halves.png", 10, 2, 4, 3, halves.data(), halves.size());
+
+    ImageROI right;
+    right.id = 7;
+    right.image_id = 1;
+    right.x = 2;
+    right.width = 10; // clamped to the image
+    right.height = 2;
+
+    MosaicMap mosaic_map(3, 1);
+    mosaic_map.setCell(0, 0, 1);
+    mosaic_map.setCell(1, 0, 1);
+    mosaic_map.setRoi(1, 0, 7);
+    mosaic_map.setCell(2, 0, 1);
+    mosaic_map.setRoi(2, 0, 8); // unknown ROI
+
+    MosaicRenderer::Options options;
+    options.cell_width = 2;
+    options.cell_height = 2;
+    options.threads = 1;
+    std::string error_message;
+    PixelBuffer canvas;
+    ASSERT_TRUE(MosaicRenderer::compose(mosaic_map, tiles, {right}, options, canvas, error_message)) << error_message;
+    ASSERT_EQ(canvas.size(), 3u * 2 * 2 * 3);
+
+    auto pixel = [&](int x, int y) { return std::vector<unsigned char>(canvas.data() + (y * 6 + x) * 3, canvas.data() + (y * 6 + x) * 3 + 3); };
+    // The whole tile blends its halves; the ROI is blue through and through.
+    EXPECT_GT(pixel(0, 0)[0], pixel(0, 0)[2]);
+    EXPECT_EQ(pixel(3, 1), (std::vector<unsigned char>{0, 0, 255}));
+    EXPECT_EQ(pixel(2, 0), (std::vector<unsigned char>{0, 0, 255}));
+    EXPECT_EQ(pixel(4, 0), std::vector<unsigned char>(3, 0));
+}
+
+TEST(MosaicRendererTest, ComposeDrawsQuadtreeCellsAtTheirSize) {
+    const unsigned char colors[4][3] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 255}};
+    ImageBatch tiles;
+    for (int t = 0; t < 4; ++t) {
+        std::vector<unsigned char> data;
+        for (int p = 0; p < 9; ++p) data.insert(data.end(), colors[t], colors[t] + 3);
+        tiles.append(t + 1, "tile.png", 8, 3, 3, 3, data.data(), data.size());
+    }
+
+    // One grid cell split into quadrants, the last of which is left empty,
+    // next to a grid cell left whole.
+    MosaicMap mosaic_map(2, 1);
+    ASSERT_TRUE(mosaic_map.setQuadtree(1, {1, 0, 0, 0, 0, 0}));
+    for (int cell = 0; cell < 3; ++cell) mosaic_map.getCells()[cell] = cell + 1;
+    mosaic_map.getCells()[4] = 4;
+
+    MosaicRenderer::Options options;
+    options.cell_width = 4;
+    options.cell_height = 4;
+    options.threads = 2;
+    std::string error_message;
+    PixelBuffer canvas;
+    ASSERT_TRUE(MosaicRenderer::compose(mosaic_map, tiles, options, canvas, error_message)) << error_message;
+    ASSERT_EQ(canvas.size(), 8u * 4 * 3);
+
+    auto pixel = [&](int x, int y) { return std::vector<unsigned char>(canvas.data() + (y * 8 + x) * 3, canvas.data() + (y * 8 + x) * 3 + 3); };
+    EXPECT_EQ(pixel(1, 1), (std::vector<unsigned char>{255, 0, 0}));
+    EXPECT_EQ(pixel(2, 0), (std::vector<unsigned char>{0, 255, 0}));
+    EXPECT_EQ(pixel(0, 3), (std::vector<unsigned char>{0, 0, 255}));
+    EXPECT_EQ(pixel(3, 2), std::vector<unsigned char>(3, 0));
+    EXPECT_EQ(pixel(4, 0), (std::vector<unsigned char>{255, 255, 255}));
+    EXPECT_EQ(pixel(7, 3), (std::vector<unsigned char>{255, 255, 255}));
+
+    options.cell_width = 5;
+    EXPECT_FALSE(MosaicRenderer::compose(mosaic_map, tiles, options, canvas, error_message));
+}
+
+TEST_F(MosaifyDatabaseTest, AdaptiveMapSplitsDetailedCells) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("adaptive@example.com", "Ada", "Ptive", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Adaptive", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    for (int t = 0; t < 4; ++t) {
+        std::vector<unsigned char> data(8 * 8 * 3, static_cast<unsigned char>(t * 80));
+        tiles.push_back(std::make_unique<ImageData>("tile.png", 8, 8, 3, data));
+    }
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // 32x16 target: the left half is flat, the right half a checkerboard.
+    std::vector<unsigned char> target;
+    for (int row = 0; row < 16; ++row) {
+        for (int col = 0; col < 32; ++col) {
+            const unsigned char value = col < 16 ? 100 : (((row / 2) + (col / 2)) % 2 ? 255 : 0);
+            target.insert(target.end(), 3, value);
+        }
+    }
+    int mosaic_image_id = 0;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("target.png", 16, 32, 3, target);
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, mosaic_image_id, error_message)) << error_message;
+
+    MosaicEngine engine(db);
+    MosaicEngine::Options options;
+    options.max_depth = 2;
+    MosaicMap built;
+    ASSERT_TRUE(engine.buildMap(project_id, 2, 1, options, built, error_message)) << error_message;
+    ASSERT_TRUE(built.isAdaptive());
+    // The flat grid cell stays whole; the detailed one is split to the bottom.
+    EXPECT_EQ(built.getCellCount(), 17u);
+    EXPECT_EQ(built.getCellLevel(0), 0);
+    EXPECT_EQ(built.getCellLevel(16), 2);
+    EXPECT_EQ(built.getCells()[0], tile_ids[1]);
+
+    MosaicMap stored;
+    ASSERT_TRUE(db.readMosaicMap(project_id, stored, error_message)) << error_message;
+    EXPECT_EQ(stored, built);
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options render_options;
+    render_options.cell_width = 8;
+    render_options.cell_height = 8;
+    PixelBuffer canvas;
+    int rows = 0, cols = 0;
+    ASSERT_TRUE(renderer.render(project_id, render_options, canvas, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(cols, 16);
+    EXPECT_EQ(canvas.data()[0], 80);
+
+    // 2 << 5 smallest cells do not fit 32 pixels.
+    options.max_depth = 5;
+    EXPECT_FALSE(engine.buildMap(project_id, 2, 1, options, built, error_message));
+    options.max_depth = 2;
+    options.min_repeat_distance = 2;
+    EXPECT_FALSE(engine.buildMap(project_id, 2, 1, options, built, error_message));
+}
+
+TEST_F(MosaifyDatabaseTest, RenderMosaicKeepsTarget) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("render@example.com", "Ren", "Der", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Render", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    tiles.push_back(std::make_unique<ImageData>("red.png", 2, 2, 3, std::vector<unsigned char>{255, 0, 0, 255, 0, 0, 255, 0, 0, 255, 0, 0}));
+    tiles.push_back(std::make_unique<ImageData>("gray.png", 3, 3, 1, std::vector<unsigned char>(9, 128)));
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    int target_id = 0;
+    std::unique_ptr<IImageData> target = std::make_unique<ImageData>("target.png", 2, 2, 3, std::vector<unsigned char>(12, 7));
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, target, target_id, error_message)) << error_message;
+
+    MosaicMap mosaic_map(3, 1);
+    mosaic_map.setCell(0, 0, tile_ids[0]);
+    mosaic_map.setCell(1, 0, tile_ids[1]);
+    mosaic_map.setCell(2, 0, tile_ids[0]);
+    int map_id = 0;
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, mosaic_map, map_id, error_message)) << error_message;
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options options;
+    options.cell_width = 4;
+    options.cell_height = 5;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    EXPECT_GE(renderer.getLastTimings().total, renderer.getLastTimings().render);
+
+    ImageBatch rendered;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, rendered, error_message)) << error_message;
+    ASSERT_EQ(rendered.size(), 1u);
+    EXPECT_EQ(rendered.getRows(0), 5);
+    EXPECT_EQ(rendered.getCols(0), 12);
+    EXPECT_EQ(rendered.getComps(0), 3);
+    const unsigned char* pixels = rendered.getData(0);
+    EXPECT_EQ(pixels[0], 255);
+    EXPECT_EQ(pixels[4 * 3], 128);
+    EXPECT_EQ(pixels[4 * 3 + 2], 128);
+
+    // Rendering again replaces the rendered image, never the target.
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    ImageBatch stored_target;
+    ASSERT_TRUE(db.readMosaicImage(project_id, stored_target, error_message)) << error_message;
+    EXPECT_EQ(stored_target.getId(0), target_id);
+    EXPECT_EQ(stored_target.getRows(0), 2);
+    EXPECT_TRUE(db.doesMosaicImageExist(project_id, error_message));
+}
+
+TEST_F(MosaifyDatabaseTest, IncrementalUpdateAndPatch) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("incremental@example.com", "In", "Cremental", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Incremental", project_id, error_message)) << error_message;
+
+    const unsigned char colors[3][3] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+    auto makeTile = [](const unsigned char* color) {
+        std::vector<unsigned char> data;
+        for (int p = 0; p < 16; ++p) data.insert(data.end(), color, color + 3);
+        return std::make_unique<ImageData>("tile.png", 4, 4, 3, data);
+    };
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    tiles.push_back(makeTile(colors[0]));
+    tiles.push_back(makeTile(colors[1]));
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // 4x2 target with one cell per color: red, green / blue, blue.
+    std::vector<unsigned char> target;
+    for (int row = 0; row < 2; ++row) {
+        for (int col = 0; col < 4; ++col) {
+            const unsigned char* color = colors[0 == row ? col / 2 : 2];
+            target.insert(target.end(), color, color + 3);
+        }
+    }
+    int target_id = 0;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("target.png", 2, 4, 3, target);
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, target_id, error_message)) << error_message;
+
+    MosaicEngine engine(db);
+    MosaicEngine::Options options;
+    MosaicMap mosaic_map;
+    ASSERT_TRUE(engine.buildMap(project_id, 2, 2, options, mosaic_map, error_message)) << error_message;
+    const int64_t built_watermark = mosaic_map.getTileWatermark();
+    EXPECT_GT(built_watermark, 0);
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options render_options;
+    render_options.cell_width = 2;
+    render_options.cell_height = 2;
+    ASSERT_TRUE(renderer.render(project_id, render_options, error_message)) << error_message;
+
+    // Nothing new: the map is left alone.
+    MosaicEngine::UpdateResult result;
+    ASSERT_TRUE(engine.updateMap(project_id, options, mosaic_map, result, error_message)) << error_message;
+    EXPECT_EQ(result.new_tiles, 0u);
+    EXPECT_TRUE(result.changed_cells.empty());
+
+    // A closer tile only replaces the cells it improves.
+    int blue_id = 0;
+    ASSERT_TRUE(db.createImage(project_id, makeTile(colors[2]), blue_id, error_message)) << error_message;
+    ASSERT_TRUE(engine.updateMap(project_id, options, mosaic_map, result, error_message)) << error_message;
+    EXPECT_EQ(result.new_tiles, 1u);
+    EXPECT_EQ(result.improved_cells, 2u);
+    EXPECT_EQ(result.changed_cells, (std::vector<size_t>{2, 3}));
+    EXPECT_EQ(mosaic_map.getCell(0, 0), tile_ids[0]);
+    EXPECT_EQ(mosaic_map.getCell(0, 1), blue_id);
+    EXPECT_GT(mosaic_map.getTileWatermark(), built_watermark);
+
+    ASSERT_TRUE(renderer.renderCells(project_id, mosaic_map, result.changed_cells, render_options, error_message)) << error_message;
+    ImageBatch rendered;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, rendered, error_message)) << error_message;
+    ASSERT_EQ(rendered.size(), 1u);
+    const unsigned char* pixels = rendered.getData(0);
+    EXPECT_EQ(pixels[0], 255);              // untouched first row: red
+    EXPECT_EQ(pixels[2 * 4 * 3 + 2], 255);  // patched second row: blue
+    EXPECT_EQ(pixels[2 * 4 * 3], 0);
+
+    // Deleting a used tile rematches the cells that pointed at it.
+    ASSERT_TRUE(db.deleteImage(tile_ids[1], project_id, error_message)) << error_message;
+    ASSERT_TRUE(engine.updateMap(project_id, options, mosaic_map, result, error_message)) << error_message;
+    EXPECT_EQ(result.invalid_cells, 1u);
+    EXPECT_EQ(result.changed_cells, (std::vector<size_t>{1}));
+    EXPECT_NE(mosaic_map.getCell(1, 0), tile_ids[1]);
+
+    MosaicMap stored;
+    ASSERT_TRUE(db.readMosaicMap(project_id, stored, error_message)) << error_message;
+    EXPECT_EQ(stored, mosaic_map);
+
+    // Features backfilled for an image the map already knew count as new.
+    int roi_id = 0;
+    ASSERT_TRUE(db.createImageROI(project_id, blue_id, 0, 0, 2, 2, roi_id, error_message)) << error_message;
+    ASSERT_TRUE(engine.updateMap(project_id, options, mosaic_map, result, error_message)) << error_message;
+    EXPECT_EQ(result.new_tiles, 1u);
+    EXPECT_EQ(mosaic_map.getCell(0, 1), blue_id);
+    EXPECT_EQ(mosaic_map.getRoi(0, 1), roi_id);
+
+    // Several ranges are patched in one pass; unordered ones are refused.
+    const unsigned char patch[6] = {1, 2, 3, 4, 5, 6};
+    ASSERT_TRUE(db.patchMosaicImage(project_id, MosaicImageKind::Rendered, patch, {3, 12}, {3, 3}, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, rendered, error_message)) << error_message;
+    const std::vector<unsigned char> patched(rendered.getData(0), rendered.getData(0) + 18);
+    EXPECT_EQ(patched, (std::vector<unsigned char>{255, 0, 0, 1, 2, 3, 0, 255, 0, 0, 255, 0, 4, 5, 6, 255, 0, 0}));
+    EXPECT_FALSE(db.patchMosaicImage(project_id, MosaicImageKind::Rendered, patch, {12, 3}, {3, 3}, error_message));
+    EXPECT_FALSE(db.patchMosaicImage(project_id + 1, MosaicImageKind::Rendered, pixels, {0}, {3}, error_message));
+}
+
+TEST(ScaledTileCacheTest, EvictsLeastRecentlyUsedAndInvalidates) {
+    auto makeTile = [](int64_t version) {
+        std::shared_ptr<ScaledTile> tile = std::make_shared<ScaledTile>();
+        tile->version = version;
+        tile->rows = tile->cols = 10;
+        tile->comps = 1;
+        tile->data.assign(100, static_cast<unsigned char>(version));
+        return tile;
+    };
+    const size_t entry_bytes = sizeof(ScaledTile) + 100;
+
+    ScaledTileCache cache(entry_bytes * 2);
+    cache.insert(ScaledTileKey{1, 10, 10, 0}, makeTile(1));
+    cache.insert(ScaledTileKey{1, 20, 5, 0}, makeTile(2));
+    ASSERT_TRUE(cache.find(ScaledTileKey{1, 10, 10, 0}));
+    EXPECT_FALSE(cache.find(ScaledTileKey{1, 10, 10, 7}));
+
+    // {1, 20, 5} is now the least recently used.
+    cache.insert(ScaledTileKey{2, 10, 10, 0}, makeTile(3));
+    EXPECT_FALSE(cache.find(ScaledTileKey{1, 20, 5, 0}));
+    EXPECT_EQ(cache.find(ScaledTileKey{1, 10, 10, 0})->version, 1);
+
+    cache.invalidateImage(1);
+    EXPECT_FALSE(cache.find(ScaledTileKey{1, 10, 10, 0}));
+    EXPECT_EQ(cache.find(ScaledTileKey{2, 10, 10, 0})->version, 3);
+
+    const ScaledTileCacheStats stats = cache.getStats();
+    EXPECT_EQ(stats.insertions, 3u);
+    EXPECT_EQ(stats.evictions, 1u);
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_EQ(stats.bytes, entry_bytes);
+}
+
+TEST_F(MosaifyDatabaseTest, RenderReusesScaledTiles) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("levels@example.com", "Lev", "Els", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Levels", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    tiles.push_back(std::make_unique<ImageData>("red.png", 8, 8, 3, std::vector<unsigned char>(8 * 8 * 3, 200)));
+    tiles.push_back(std::make_unique<ImageData>("gray.png", 6, 6, 1, std::vector<unsigned char>(36, 90)));
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // Many cells, two unique tiles, one of them also rotated on a non-square cell.
+    MosaicMap mosaic_map(6, 4);
+    for (int row = 0; row < 4; ++row) {
+        for (int col = 0; col < 6; ++col) mosaic_map.setCell(col, row, tile_ids[(row + col) % 2]);
+    }
+    mosaic_map.setTransform(0, 0, TRANSFORM_ROTATE_90);
+    int map_id = 0;
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, mosaic_map, map_id, error_message)) << error_message;
+
+    MosaicRenderer renderer(db);
+    renderer.setTileCache(std::make_shared<ScaledTileCache>(1 << 20));
+    MosaicRenderer::Options options;
+    options.cell_width = 4;
+    options.cell_height = 3;
+    options.store_levels = true;
+
+    PixelBuffer first;
+    int rows = 0, cols = 0;
+    ASSERT_TRUE(renderer.render(project_id, options, first, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(renderer.getTileCache()->getStats().insertions, 3u);
+
+    // The second render revalidates the cached tiles and scales nothing.
+    PixelBuffer second;
+    ASSERT_TRUE(renderer.render(project_id, options, second, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(renderer.getTileCache()->getStats().insertions, 3u);
+    EXPECT_EQ(renderer.getTileCache()->getStats().hits, 3u);
+    ASSERT_EQ(first.size(), second.size());
+    EXPECT_EQ(0, memcmp(first.data(), second.data(), first.size()));
+
+    // Stored levels serve a renderer without a cache, until the image changes.
+    ImageBatch batch;
+    std::vector<int64_t> versions;
+    std::vector<ImageLevelState> states;
+    ASSERT_TRUE(db.readImageLevels(project_id, tile_ids, 4, 3, {}, {}, batch, versions, states, error_message)) << error_message;
+    ASSERT_EQ(states.size(), 2u);
+    EXPECT_EQ(states[0], ImageLevelState::Scaled);
+    EXPECT_EQ(batch.getRows(0), 3);
+    EXPECT_EQ(batch.getDataSize(0), batch.getRows(0) * batch.getCols(0) * batch.getComps(0));
+
+    MosaicRenderer uncached(db);
+    PixelBuffer third;
+    ASSERT_TRUE(uncached.render(project_id, options, third, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(0, memcmp(first.data(), third.data(), first.size()));
+
+    ASSERT_TRUE(db.updateImage(tile_ids[1], project_id, "gray.png", 6, 6, 1, std::vector<unsigned char>(36, 30), error_message)) << error_message;
+    ASSERT_TRUE(db.readImageLevels(project_id, {tile_ids[1]}, 4, 3, {}, {}, batch, versions, states, error_message)) << error_message;
+    ASSERT_EQ(states.size(), 1u);
+    EXPECT_EQ(states[0], ImageLevelState::Original);
+
+    ASSERT_TRUE(renderer.render(project_id, options, second, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(second.data()[4 * 3], 30); // cell (1, 0) uses the updated gray tile
+}
+
+TEST_F(MosaifyDatabaseTest, RoiTilesAreMatchedAndRendered) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("roi@example.com", "R", "Oi", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Roi", project_id, error_message)) << error_message;
+
+    // One 8x4 image, green on the left and blue on the right, with an ROI per half.
+    std::vector<unsigned char> halves;
+    for (int p = 0; p < 8 * 4; ++p) {
+        const unsigned char pixel[3] = {0, static_cast<unsigned char>(p % 8 < 4 ? 255 : 0), static_cast<unsigned char>(p % 8 < 4 ? 0 : 255)};
+        halves.insert(halves.end(), pixel, pixel + 3);
+    }
+    int image_id = 0;
+    ASSERT_TRUE(db.createImage(project_id, std::make_unique<ImageData>("halves.png", 4, 8, 3, halves), image_id, error_message)) << error_message;
+    int green_roi = 0, blue_roi = 0;
+    ASSERT_TRUE(db.createImageROI(project_id, image_id, 0, 0, 4, 4, green_roi, error_message)) << error_message;
+    ASSERT_TRUE(db.createImageROI(project_id, image_id, 4, 0, 4, 4, blue_roi, error_message)) << error_message;
+
+    int computed = 0;
+    ASSERT_TRUE(db.computeMissingImageFeatures(project_id, computed, error_message)) << error_message;
+    EXPECT_EQ(computed, 2);
+
+    // The image is now two tiles, and never a whole one.
+    ImageFeatureSet features;
+    ASSERT_TRUE(db.readImageFeatures(project_id, features, error_message)) << error_message;
+    ASSERT_EQ(features.size(), 2u);
+    EXPECT_EQ(features.getRoiId(0), green_roi);
+    EXPECT_EQ(features.getRoiId(1), blue_roi);
+
+    // Blue on the left, green on the right.
+    std::vector<unsigned char> target;
+    for (int p = 0; p < 8 * 4; ++p) {
+        const unsigned char pixel[3] = {0, static_cast<unsigned char>(p % 8 < 4 ? 0 : 255), static_cast<unsigned char>(p % 8 < 4 ? 255 : 0)};
+        target.insert(target.end(), pixel, pixel + 3);
+    }
+    int mosaic_image_id = 0;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("target.png", 4, 8, 3, target);
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, mosaic_image_id, error_message)) << error_message;
+
+    MosaicEngine engine(db);
+    MosaicEngine::Options engine_options;
+    MosaicMap built;
+    ASSERT_TRUE(engine.buildMap(project_id, 2, 1, engine_options, built, error_message)) << error_message;
+    EXPECT_EQ(built.getCell(0, 0), image_id);
+    EXPECT_EQ(built.getRoi(0, 0), blue_roi);
+    EXPECT_EQ(built.getRoi(1, 0), green_roi);
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options options;
+    options.cell_width = 2;
+    options.cell_height = 2;
+    options.store_levels = true;
+    PixelBuffer canvas;
+    int rows = 0, cols = 0;
+    ASSERT_TRUE(renderer.render(project_id, options, canvas, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(canvas.data()[2], 255); // left cell blue
+    EXPECT_EQ(canvas.data()[2 * 3 + 1], 255); // right cell green
+
+    // Moving an ROI drops its features until they are backfilled again.
+    ASSERT_TRUE(db.updateImageROI(blue_roi, project_id, 6, 0, 2, 4, error_message)) << error_message;
+    ASSERT_TRUE(db.computeMissingImageFeatures(project_id, computed, error_message)) << error_message;
+    EXPECT_EQ(computed, 1);
+
+    // Moved onto the green half, the same map renders green where the crop was
+    // blue: the renderer's cached crop is not reused.
+    ASSERT_TRUE(db.updateImageROI(blue_roi, project_id, 0, 0, 4, 4, error_message)) << error_message;
+    ASSERT_TRUE(renderer.render(project_id, options, canvas, rows, cols, error_message)) << error_message;
+    EXPECT_EQ(canvas.data()[1], 255);
+    EXPECT_EQ(canvas.data()[2], 0);
+}
+
+TEST_F(MosaifyDatabaseTest, BandedRenderMatchesWholeRender) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("bands@example.com", "Ba", "Nds", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Bands", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    for (int t = 0; t < 3; ++t) {
+        std::vector<unsigned char> data(5 * 7 * 3);
+        for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<unsigned char>(i * (t + 3));
+        tiles.push_back(std::make_unique<ImageData>("tile.png", 5, 7, 3, data));
+    }
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // Five grid rows in bands of two: the last band is short.
+    MosaicMap mosaic_map(4, 5);
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 4; ++col) mosaic_map.setCell(col, row, tile_ids[(row * 4 + col) % 3]);
+    }
+    int map_id = 0;
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, mosaic_map, map_id, error_message)) << error_message;
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options options;
+    options.cell_width = 3;
+    options.cell_height = 2;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    ImageBatch whole;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, whole, error_message)) << error_message;
+
+    options.band_grid_rows = 2;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    int rows = 0, cols = 0, comps = 0, band_rows = 0;
+    ASSERT_TRUE(db.readMosaicImageInfo(project_id, MosaicImageKind::Rendered, rows, cols, comps, band_rows, error_message)) << error_message;
+    EXPECT_EQ(rows, 10);
+    EXPECT_EQ(band_rows, 4);
+
+    ImageBatch banded;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, banded, error_message)) << error_message;
+    ASSERT_EQ(banded.getDataSize(0), whole.getDataSize(0));
+    EXPECT_EQ(0, memcmp(banded.getData(0), whole.getData(0), whole.getDataSize(0)));
+
+    const size_t stride = static_cast<size_t>(cols) * comps;
+    PixelBuffer last;
+    ASSERT_TRUE(db.readMosaicImageBand(project_id, MosaicImageKind::Rendered, 2, last, error_message)) << error_message;
+    ASSERT_EQ(last.size(), 2 * stride);
+    EXPECT_EQ(0, memcmp(last.data(), whole.getData(0) + 8 * stride, last.size()));
+
+    // Patching rewrites only the band holding the cell.
+    mosaic_map.setCell(1, 3, tile_ids[0]);
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, mosaic_map, map_id, error_message)) << error_message;
+    ASSERT_TRUE(renderer.renderCells(project_id, mosaic_map, {3 * 4 + 1}, options, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, banded, error_message)) << error_message;
+
+    options.band_grid_rows = 0;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, whole, error_message)) << error_message;
+    ASSERT_EQ(banded.getDataSize(0), whole.getDataSize(0));
+    EXPECT_EQ(0, memcmp(banded.getData(0), whole.getData(0), whole.getDataSize(0)));
+
+    // Storing the image whole drops the bands.
+    ASSERT_TRUE(db.readMosaicImageInfo(project_id, MosaicImageKind::Rendered, rows, cols, comps, band_rows, error_message)) << error_message;
+    EXPECT_EQ(band_rows, 0);
+    EXPECT_FALSE(db.readMosaicImageBand(project_id, MosaicImageKind::Rendered, 0, last, error_message));
+
+    // A banded target reads back whole through IImageData as well. Writing
+    // bands leaves the version alone until they are finished.
+    std::vector<unsigned char> target(6 * 2 * 3);
+    for (size_t i = 0; i < target.size(); ++i) target[i] = static_cast<unsigned char>(i * 7);
+    int target_id = 0;
+    ASSERT_TRUE(db.createMosaicImageBands(project_id, MosaicImageKind::Target, 6, 2, 3, 4, target_id, error_message)) << error_message;
+    for (int band = 0; band < 2; ++band) {
+        MosaicImageBand encoded;
+        const size_t offset = static_cast<size_t>(band) * 4 * 6;
+        ASSERT_TRUE(MosaifyDatabase::encodeMosaicImageBand(band, target.data() + offset, std::min<size_t>(4 * 6, target.size() - offset), encoded, error_message)) << error_message;
+        ASSERT_TRUE(db.writeMosaicImageBand(project_id, MosaicImageKind::Target, encoded, error_message)) << error_message;
+    }
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readMosaicImage(project_id, img, error_message)) << error_message;
+    EXPECT_EQ(img->getRows(), 6);
+    EXPECT_EQ(img->getData(), target);
+
+    int64_t version = 0;
+    bool modified = false;
+    std::unique_ptr<IImageData> conditional = std::make_unique<ImageData>();
+    ASSERT_TRUE(db.readMosaicImage(project_id, 0, conditional, version, modified, error_message)) << error_message;
+    EXPECT_TRUE(modified);
+    EXPECT_EQ(conditional->getData(), target);
+
+    MosaicImageBand encoded;
+    ASSERT_TRUE(MosaifyDatabase::encodeMosaicImageBand(0, target.data(), 4 * 6, encoded, error_message)) << error_message;
+    ASSERT_TRUE(db.writeMosaicImageBand(project_id, MosaicImageKind::Target, encoded, error_message)) << error_message;
+    const int64_t written_version = version;
+    ASSERT_TRUE(db.readMosaicImage(project_id, written_version, conditional, version, modified, error_message)) << error_message;
+    EXPECT_FALSE(modified);
+    ASSERT_TRUE(db.finishMosaicImageBands(project_id, MosaicImageKind::Target, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicImage(project_id, written_version, conditional, version, modified, error_message)) << error_message;
+    EXPECT_TRUE(modified);
+    EXPECT_GT(version, written_version);
+}
+
+TEST_F(MosaifyDatabaseTest, BandedRenderStoringLevelsIsAtomic) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("atomic@example.com", "At", "Omic", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Atomic", project_id, error_message)) << error_message;
+
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    for (int t = 0; t < 3; ++t) {
+        std::vector<unsigned char> data(5 * 7 * 3);
+        for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<unsigned char>(i * (t + 5));
+        tiles.push_back(std::make_unique<ImageData>("tile.png", 5, 7, 3, data));
+    }
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+    MosaicMap mosaic_map(4, 5);
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 4; ++col) mosaic_map.setCell(col, row, tile_ids[(row * 4 + col) % 3]);
+    }
+    int map_id = 0;
+    ASSERT_TRUE(db.upsertMosaicMap(project_id, mosaic_map, map_id, error_message)) << error_message;
+
+    MosaicRenderer renderer(db);
+    MosaicRenderer::Options options;
+    options.cell_width = 3;
+    options.cell_height = 2;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    ImageBatch before;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, before, error_message)) << error_message;
+
+    // The levels are stored before the second band fails: nothing of the
+    // render may stay behind, and the previous image is still the one read.
+    ASSERT_TRUE(db.executeSQL(R"(
+        CREATE OR REPLACE FUNCTION fail_second_band() RETURNS trigger AS $$
+        BEGIN
+            IF NEW.band = 1 THEN RAISE EXCEPTION 'injected band failure'; END IF;
+            RETURN NEW;
+        END
+        $$ LANGUAGE plpgsql
+    )", error_message)) << error_message;
+    ASSERT_TRUE(db.executeSQL("CREATE TRIGGER fail_second_band BEFORE INSERT ON mosaic_image_bands FOR EACH ROW EXECUTE FUNCTION fail_second_band()", error_message)) << error_message;
+
+    options.band_grid_rows = 2;
+    options.store_levels = true;
+    EXPECT_FALSE(renderer.render(project_id, options, error_message));
+    EXPECT_NE(error_message.find("injected band failure"), std::string::npos) << error_message;
+
+    int rows = 0, cols = 0, comps = 0, band_rows = -1;
+    ASSERT_TRUE(db.readMosaicImageInfo(project_id, MosaicImageKind::Rendered, rows, cols, comps, band_rows, error_message)) << error_message;
+    EXPECT_EQ(band_rows, 0);
+    ImageBatch after;
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, after, error_message)) << error_message;
+    ASSERT_EQ(after.getDataSize(0), before.getDataSize(0));
+    EXPECT_EQ(0, memcmp(after.getData(0), before.getData(0), before.getDataSize(0)));
+
+    // Without the failure the same render commits bands and levels together.
+    ASSERT_TRUE(db.executeSQL("DROP TRIGGER fail_second_band ON mosaic_image_bands", error_message)) << error_message;
+    ASSERT_TRUE(renderer.render(project_id, options, error_message)) << error_message;
+    ASSERT_TRUE(db.readMosaicImageInfo(project_id, MosaicImageKind::Rendered, rows, cols, comps, band_rows, error_message)) << error_message;
+    EXPECT_EQ(band_rows, 4);
+    ASSERT_TRUE(db.readMosaicImage(project_id, MosaicImageKind::Rendered, after, error_message)) << error_message;
+    ASSERT_EQ(after.getDataSize(0), before.getDataSize(0));
+    EXPECT_EQ(0, memcmp(after.getData(0), before.getData(0), before.getDataSize(0)));
+}
+
+TEST(TileIndexTest, KnnMatchesBruteForce) {
+    const size_t count = 5000;
+    const int dims = 8;
+    std::vector<float> vectors(count * dims);
+    std::vector<int> ids(count);
+    uint32_t seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1 << 24);
+    };
+    for (auto &v : vectors) v = next() * 100.0f;
+    for (size_t i = 0; i < count; ++i) ids[i] = static_cast<int>(i) + 1;
+
+    TileIndex index;
+    TileIndex::Options options;
+    options.dimensions = {0, 2, 3, 5, 7};
+    index.build(vectors.data(), count, dims, ids.data(), options);
+    ASSERT_EQ(index.size(), count);
+    ASSERT_EQ(index.getDimensions(), 5);
+
+    const size_t num_queries = 200;
+    const int k = 4;
+    std::vector<float> queries(num_queries * dims);
+    for (auto &v : queries) v = next() * 100.0f;
+
+    std::vector<int> found_ids(num_queries * k);
+    std::vector<float> found_distances(num_queries * k);
+    index.knnBatch(queries.data(), num_queries, k, found_ids.data(), found_distances.data(), 4);
+
+    for (size_t q = 0; q < num_queries; ++q) {
+        std::vector<std::pair<float, int>> expected;
+        for (size_t i = 0; i < count; ++i) {
+            float distance = 0.0f;
+            for (int d : options.dimensions) {
+                const float diff = vectors[i * dims + d] - queries[q * dims + d];
+                distance += diff * diff;
+            }
+            expected.emplace_back(distance, ids[i]);
+        }
+        std::partial_sort(expected.begin(), expected.begin() + k, expected.end());
+        for (int j = 0; j < k; ++j) {
+            EXPECT_EQ(found_ids[q * k + j], expected[j].second) << "query " << q << " rank " << j;
+            EXPECT_FLOAT_EQ(found_distances[q * k + j], expected[j].first);
+        }
+    }
+
+    // Fewer tiles than neighbours asked for.
+    TileIndex small;
+    small.build(vectors.data(), 2, dims, ids.data());
+    int few_ids[3];
+    float few_distances[3];
+    EXPECT_EQ(small.knn(queries.data(), 3, few_ids, few_distances), 2);
+    EXPECT_EQ(few_ids[2], -1);
+}
+
+TEST(TileAssignerTest, HonorsRepeatLimitsDeterministically) {
+    const int grid_cols = 40, grid_rows = 30;
+    const size_t num_cells = static_cast<size_t>(grid_cols) * grid_rows;
+    uint32_t seed = 777;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1 << 24);
+    };
+
+    // A smooth target over few tiles: nearest matching repeats heavily.
+    std::vector<float> cell_features(num_cells * ImageFeatures::DIMENSIONS);
+    for (size_t cell = 0; cell < num_cells; ++cell) {
+        for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) {
+            cell_features[cell * ImageFeatures::DIMENSIONS + d] = static_cast<float>(cell % grid_cols) + 0.1f * d;
+        }
+    }
+    ImageFeatureSet tiles;
+    tiles.resize(60);
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        tiles.setImageId(i, static_cast<int>(i) + 100);
+        for (int d = 0; d < ImageFeatures::DIMENSIONS; ++d) tiles.setValue(i, d, next() * 40.0f);
+    }
+
+    TileAssigner::Options options;
+    EXPECT_FALSE(TileAssigner::isLimited(options));
+    options.max_uses = 25;
+    options.min_repeat_distance = 3;
+    options.candidates = 4;
+    ASSERT_TRUE(TileAssigner::isLimited(options));
+
+    std::vector<int32_t> cells(num_cells), serial(num_cells);
+    TileAssigner assigner(options);
+    assigner.assign(cell_features.data(), grid_cols, grid_rows, tiles, cells.data(), nullptr, 4);
+    EXPECT_EQ(assigner.getLastStats().unconstrained_cells, 0u);
+    EXPECT_GT(assigner.getLastStats().widened_cells, 0u);
+    assigner.assign(cell_features.data(), grid_cols, grid_rows, tiles, serial.data(), nullptr, 1);
+    EXPECT_EQ(cells, serial);
+
+    std::map<int32_t, int> uses;
+    for (size_t cell = 0; cell < num_cells; ++cell) {
+        ASSERT_GE(cells[cell], 100);
+        ++uses[cells[cell]];
+        const int x = static_cast<int>(cell % grid_cols), y = static_cast<int>(cell / grid_cols);
+        for (int dy = -2; dy <= 2; ++dy) {
+            for (int dx = -2; dx <= 2; ++dx) {
+                const int nx = x + dx, ny = y + dy;
+                if ((0 == dx && 0 == dy) || nx < 0 || ny < 0 || nx >= grid_cols || ny >= grid_rows) continue;
+                ASSERT_NE(cells[cell], cells[static_cast<size_t>(ny) * grid_cols + nx]) << "repeat at " << x << "," << y;
+            }
+        }
+    }
+    for (const auto &use : uses) EXPECT_LE(use.second, options.max_uses);
+
+    // Limits no tile set can meet still fill every cell.
+    TileAssigner::Options strict;
+    strict.max_uses = 1;
+    ImageFeatureSet two;
+    two.resize(2);
+    two.setImageId(0, 1);
+    two.setImageId(1, 2);
+    TileAssigner strict_assigner(strict);
+    std::vector<int32_t> small(9);
+    strict_assigner.assign(cell_features.data(), 3, 3, two, small.data());
+    EXPECT_EQ(strict_assigner.getLastStats().unconstrained_cells, 7u);
+    for (int32_t id : small) EXPECT_TRUE(1 == id || 2 == id);
+
+    // Over-subscribed limits on the full grid: the surplus takes its nearest
+    // tile once all uses are spent, without widening past the cap.
+    TileAssigner::Options oversubscribed = options;
+    oversubscribed.max_uses = 10;
+    TileAssigner oversubscribed_assigner(oversubscribed);
+    oversubscribed_assigner.assign(cell_features.data(), grid_cols, grid_rows, tiles, cells.data(), nullptr, 4);
+    const TileAssigner::Stats &stats = oversubscribed_assigner.getLastStats();
+    EXPECT_GE(stats.unconstrained_cells, num_cells - tiles.size() * oversubscribed.max_uses);
+    EXPECT_LE(stats.widened_cells, num_cells);
+    oversubscribed_assigner.assign(cell_features.data(), grid_cols, grid_rows, tiles, serial.data(), nullptr, 1);
+    EXPECT_EQ(cells, serial);
+    for (int32_t id : cells) ASSERT_GE(id, 100);
+}
+
+TEST(TileMatcherTest, KernelsMatchScalar) {
+    const size_t count = 1000;
+    const int dims = 13;
+    std::vector<float> vectors(count * dims);
+    std::vector<int> ids(count);
+    uint32_t seed = 54321;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1 << 24);
+    };
+    for (auto &v : vectors) v = next() * 100.0f;
+    for (size_t i = 0; i < count; ++i) ids[i] = static_cast<int>(i) + 1;
+    // A duplicate tile: ties must resolve to the first one at every level.
+    std::copy(vectors.begin() + 7 * dims, vectors.begin() + 8 * dims, vectors.begin() + 900 * dims);
+
+    const size_t num_queries = 100;
+    std::vector<float> queries(num_queries * dims);
+    for (auto &v : queries) v = next() * 100.0f;
+    std::copy(vectors.begin() + 7 * dims, vectors.begin() + 8 * dims, queries.begin());
+
+    std::vector<int> expected(num_queries);
+    std::vector<float> expected_distances(num_queries);
+    for (size_t q = 0; q < num_queries; ++q) {
+        expected_distances[q] = std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < count; ++i) {
+            float distance = 0.0f;
+            for (int d = 0; d < dims; ++d) {
+                const float diff = vectors[i * dims + d] - queries[q * dims + d];
+                distance += diff * diff;
+            }
+            if (distance < expected_distances[q]) {
+                expected_distances[q] = distance;
+                expected[q] = ids[i];
+            }
+        }
+    }
+    ASSERT_EQ(expected[0], 8);
+
+    BruteForceMatcher::Options options;
+    std::vector<int> found_ids(num_queries);
+    std::vector<float> found_distances(num_queries);
+    for (int level = 0; level <= static_cast<int>(getSupportedSimdLevel()); ++level) {
+        BruteForceMatcher matcher;
+        matcher.build(vectors.data(), count, dims, ids.data(), options);
+        matcher.setSimdLevel(static_cast<SimdLevel>(level));
+        ASSERT_EQ(static_cast<int>(matcher.getSimdLevel()), level);
+
+        matcher.nearestBatch(queries.data(), num_queries, found_ids.data(), found_distances.data(), 2);
+        for (size_t q = 0; q < num_queries; ++q) {
+            EXPECT_EQ(found_ids[q], expected[q]) << getSimdLevelName(matcher.getSimdLevel()) << " query " << q;
+            EXPECT_NEAR(found_distances[q], expected_distances[q], 1e-3f * expected_distances[q] + 1e-3f);
+        }
+    }
+
+    // Quantized kernels agree with each other exactly and with the float search closely.
+    options.quantized = true;
+    std::vector<int> scalar_ids(num_queries);
+    for (int level = 0; level <= static_cast<int>(getSupportedSimdLevel()); ++level) {
+        BruteForceMatcher matcher;
+        matcher.build(vectors.data(), count, dims, ids.data(), options);
+        matcher.setSimdLevel(static_cast<SimdLevel>(level));
+        matcher.nearestBatch(queries.data(), num_queries, found_ids.data(), found_distances.data());
+        if (0 == level) scalar_ids = found_ids;
+        EXPECT_EQ(found_ids, scalar_ids) << getSimdLevelName(matcher.getSimdLevel());
+        EXPECT_EQ(found_ids[0], 8);
+
+        size_t agree = 0;
+        for (size_t q = 0; q < num_queries; ++q) {
+            if (found_ids[q] == expected[q]) ++agree;
+        }
+        EXPECT_GE(agree, num_queries * 9 / 10);
+    }
+
+    BruteForceMatcher empty;
+    float distance = 0.0f;
+    EXPECT_EQ(empty.nearest(queries.data(), distance), -1);
+
+    TileMatcher::Options matcher_options;
+    TileMatcher matcher;
+    matcher.build(vectors.data(), count, dims, ids.data(), matcher_options);
+    EXPECT_NE(matcher.getStrategy(), MatchStrategy::Auto);
+    EXPECT_EQ(matcher.nearest(queries.data() + dims, distance), expected[1]);
+
+    matcher_options.strategy = MatchStrategy::Tree;
+    matcher.build(vectors.data(), count, dims, ids.data(), matcher_options);
+    EXPECT_EQ(matcher.getStrategy(), MatchStrategy::Tree);
+    EXPECT_EQ(matcher.nearest(queries.data() + dims, distance), expected[1]);
+}
+
+TEST(HnswIndexTest, RecallUpdatesAndPersistence) {
+    const size_t count = 5000;
+    const int dims = 8;
+    std::vector<float> vectors(count * dims);
+    std::vector<int64_t> ids(count);
+    uint32_t seed = 24680;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>(seed >> 8) / static_cast<float>(1 << 24);
+    };
+    for (auto &v : vectors) v = next() * 100.0f;
+    for (size_t i = 0; i < count; ++i) ids[i] = (static_cast<int64_t>(i) << 32) | 7;
+
+    HnswIndex index;
+    HnswIndex::Options options;
+    options.dimensions = {0, 2, 3, 5, 7};
+    options.m = 8;
+    index.build(vectors.data(), count, dims, ids.data(), options);
+    ASSERT_EQ(index.size(), count);
+    ASSERT_EQ(index.getDimensions(), 5);
+
+    const size_t num_queries = 200;
+    const int k = 4;
+    std::vector<float> queries(num_queries * dims);
+    for (auto &v : queries) v = next() * 100.0f;
+    auto exact = [&](size_t q) {
+        std::vector<std::pair<float, int64_t>> expected;
+        for (size_t i = 0; i < count; ++i) {
+            if (!index.contains(ids[i])) continue;
+            float distance = 0.0f;
+            for (int d : options.dimensions) {
+                const float diff = vectors[i * dims + d] - queries[q * dims + d];
+                distance += diff * diff;
+            }
+            expected.emplace_back(distance, ids[i]);
+        }
+        std::partial_sort(expected.begin(), expected.begin() + k, expected.end());
+        expected.resize(k);
+        return expected;
+    };
+    auto recall = [&](const HnswIndex &searched) {
+        std::vector<int64_t> found_ids(num_queries * k);
+        std::vector<float> found_distances(num_queries * k);
+        searched.knnBatch(queries.data(), num_queries, k, found_ids.data(), found_distances.data(), 4);
+        size_t hits = 0;
+        for (size_t q = 0; q < num_queries; ++q) {
+            for (const auto &expected : exact(q)) {
+                if (std::find(&found_ids[q * k], &found_ids[q * k] + k, expected.second) != &found_ids[q * k] + k) ++hits;
+            }
+            EXPECT_TRUE(std::is_sorted(&found_distances[q * k], &found_distances[q * k] + k));
+        }
+        return static_cast<double>(hits) / (num_queries * k);
+    };
+
+    // Recall climbs with ef_search and is near exact by 64.
+    index.setEfSearch(4);
+    const double low_recall = recall(index);
+    index.setEfSearch(64);
+    const double high_recall = recall(index);
+    EXPECT_GE(high_recall, 0.98);
+    EXPECT_GE(high_recall, low_recall);
+
+    // Same inserts, same graph.
+    HnswIndex again;
+    again.build(vectors.data(), count, dims, ids.data(), options);
+    std::vector<int64_t> first(k), second(k);
+    std::vector<float> distances(k);
+    for (size_t q = 0; q < 20; ++q) {
+        index.knn(&queries[q * dims], k, first.data(), distances.data());
+        again.knn(&queries[q * dims], k, second.data(), distances.data());
+        EXPECT_EQ(first, second);
+    }
+
+    // Removed and replaced points leave the results; a removed id can come back.
+    ASSERT_TRUE(index.remove(ids[10]));
+    EXPECT_FALSE(index.remove(ids[10]));
+    EXPECT_FALSE(index.contains(ids[10]));
+    std::vector<float> moved(vectors.begin() + 11 * dims, vectors.begin() + 12 * dims);
+    for (auto &v : moved) v += 0.5f;
+    index.insert(moved.data(), ids[11]);
+    EXPECT_EQ(index.size(), count - 1);
+    EXPECT_EQ(index.getTombstoneCount(), 2u);
+    EXPECT_FLOAT_EQ(index.getPoint(ids[11])[0], moved[0]);
+    int64_t nearest = -1;
+    float distance = 0.0f;
+    ASSERT_EQ(index.knn(moved.data(), 1, &nearest, &distance), 1);
+    EXPECT_EQ(nearest, ids[11]);
+    EXPECT_FLOAT_EQ(distance, 0.0f);
+    ASSERT_EQ(index.knn(&vectors[10 * dims], 1, &nearest, &distance), 1);
+    EXPECT_NE(nearest, ids[10]);
+    index.insert(&vectors[10 * dims], ids[10]);
+    ASSERT_EQ(index.knn(&vectors[10 * dims], 1, &nearest, &distance), 1);
+    EXPECT_EQ(nearest, ids[10]);
+    std::copy(moved.begin(), moved.end(), vectors.begin() + 11 * dims);
+
+    // Save and load give back the same index, which keeps growing the same way.
+    std::string path = testing::TempDir() + "hnsw_index_test.bin";
+    std::string error_message;
+    ASSERT_TRUE(index.save(path, error_message)) << error_message;
+    HnswIndex loaded;
+    ASSERT_TRUE(loaded.load(path, error_message)) << error_message;
+    EXPECT_EQ(loaded.size(), index.size());
+    EXPECT_EQ(loaded.getTombstoneCount(), index.getTombstoneCount());
+    EXPECT_EQ(loaded.getDimensionIndices(), index.getDimensionIndices());
+    EXPECT_EQ(loaded.getEfSearch(), 64);
+    EXPECT_DOUBLE_EQ(recall(loaded), recall(index));
+    index.insert(&queries[0], 1);
+    loaded.insert(&queries[0], 1);
+    for (size_t q = 0; q < 20; ++q) {
+        index.knn(&queries[q * dims], k, first.data(), distances.data());
+        loaded.knn(&queries[q * dims], k, second.data(), distances.data());
+        EXPECT_EQ(first, second);
+    }
+
+    // Saves racing on one path write separate files; the survivor is whole.
+    bool raced[2] = {false, false};
+    std::string race_errors[2];
+    std::thread racer([&]() { raced[0] = index.save(path, race_errors[0]); });
+    raced[1] = index.save(path, race_errors[1]);
+    racer.join();
+    ASSERT_TRUE(raced[0]) << race_errors[0];
+    ASSERT_TRUE(raced[1]) << race_errors[1];
+    ASSERT_TRUE(loaded.load(path, error_message)) << error_message;
+    EXPECT_EQ(loaded.size(), index.size());
+
+    // A truncated file is rejected and leaves the index empty.
+    std::vector<char> bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(bytes.data(), bytes.size() / 2);
+    }
+    EXPECT_FALSE(loaded.load(path, error_message));
+    EXPECT_TRUE(loaded.empty());
+    std::remove(path.c_str());
+    EXPECT_FALSE(loaded.load(path, error_message));
+
+    HnswIndex empty;
+    empty.reset(dims, options);
+    EXPECT_EQ(empty.knn(queries.data(), 1, &nearest, &distance), 0);
+    EXPECT_EQ(nearest, -1);
+
+    // The matcher front end resolves approximate matches to the same ids.
+    std::vector<int> int_ids(count);
+    for (size_t i = 0; i < count; ++i) int_ids[i] = static_cast<int>(i) + 1;
+    TileMatcher::Options matcher_options;
+    matcher_options.strategy = MatchStrategy::Approximate;
+    TileMatcher matcher;
+    matcher.build(vectors.data(), count, dims, int_ids.data(), matcher_options);
+    EXPECT_EQ(matcher.getStrategy(), MatchStrategy::Approximate);
+    EXPECT_EQ(matcher.size(), count);
+    EXPECT_EQ(matcher.nearest(&vectors[42 * dims], distance), 43);
+    EXPECT_FLOAT_EQ(distance, 0.0f);
+}
+
+TEST_F(MosaifyDatabaseTest, PersistedTileIndexFollowsNewTiles) {
+    int user_id = 0;
+    int project_id = 0;
+    ASSERT_TRUE(db.createUser("hnsw@example.com", "Hn", "Sw", user_id, error_message)) << error_message;
+    ASSERT_TRUE(db.createProject(user_id, "Approximate", project_id, error_message)) << error_message;
+
+    const unsigned char colors[3][3] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+    auto makeTile = [](const unsigned char* color) {
+        std::vector<unsigned char> data;
+        for (int p = 0; p < 16; ++p) data.insert(data.end(), color, color + 3);
+        return std::make_unique<ImageData>("tile.png", 4, 4, 3, data);
+    };
+    std::vector<std::unique_ptr<IImageData>> tiles;
+    tiles.push_back(makeTile(colors[0]));
+    tiles.push_back(makeTile(colors[1]));
+    std::vector<int> tile_ids;
+    ASSERT_TRUE(db.createImages(project_id, tiles, tile_ids, error_message)) << error_message;
+
+    // 3x1 target: red, green, blue.
+    std::vector<unsigned char> target;
+    for (const auto &color : colors) target.insert(target.end(), color, color + 3);
+    int target_id = 0;
+    std::unique_ptr<IImageData> img = std::make_unique<ImageData>("target.png", 1, 3, 3, target);
+    ASSERT_TRUE(db.upsertMosaicImage(project_id, img, target_id, error_message)) << error_message;
+
+    const std::string path = testing::TempDir() + "engine_tile_index.bin";
+    std::remove(path.c_str());
+    MosaicEngine::Options options;
+    options.matcher.strategy = MatchStrategy::Approximate;
+    EXPECT_FALSE(MosaicEngine(db).syncTileIndex(project_id, options, error_message));
+    options.index_path = path;
+
+    MosaicMap built;
+    {
+        MosaicEngine engine(db);
+        ASSERT_TRUE(engine.buildMap(project_id, 3, 1, options, built, error_message)) << error_message;
+        EXPECT_EQ(engine.getLastStrategy(), MatchStrategy::Approximate);
+        EXPECT_EQ(engine.getTileIndex().size(), 2u);
+        EXPECT_EQ(built.getCell(0, 0), tile_ids[0]);
+        EXPECT_EQ(built.getCell(1, 0), tile_ids[1]);
+    }
+
+    // A new engine picks the file up and only inserts the tile added since.
+    int blue_id = 0;
+    ASSERT_TRUE(db.createImage(project_id, makeTile(colors[2]), blue_id, error_message)) << error_message;
+    MosaicEngine engine(db);
+    ASSERT_TRUE(engine.syncTileIndex(project_id, options, error_message)) << error_message;
+    EXPECT_EQ(engine.getTileIndex().size(), 3u);
+    EXPECT_EQ(engine.getTileIndex().getTombstoneCount(), 0u);
+
+    ASSERT_TRUE(engine.buildMap(project_id, 3, 1, options, built, error_message)) << error_message;
+    EXPECT_EQ(built.getCell(2, 0), blue_id);
+
+    // Deleted tiles leave the index, and their cells are rematched through it.
+    ASSERT_TRUE(db.deleteImage(tile_ids[1], project_id, error_message)) << error_message;
+    MosaicEngine::UpdateResult result;
+    ASSERT_TRUE(engine.updateMap(project_id, options, built, result, error_message)) << error_message;
+    EXPECT_EQ(result.invalid_cells, 1u);
+    EXPECT_NE(built.getCell(1, 0), tile_ids[1]);
+    EXPECT_EQ(engine.getTileIndex().size(), 2u);
+
+    HnswIndex stored;
+    ASSERT_TRUE(stored.load(path, error_message)) << error_message;
+    EXPECT_EQ(stored.size(), 2u);
+    EXPECT_FALSE(stored.contains(static_cast<int64_t>(tile_ids[1]) << 32));
+    std::remove(path.c_str());
+}